@@ -0,0 +1,456 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "akepool.h"
+#include "auth.h"
+#include "userstate.h"
+
+/* Hold back a message received for the given master context while it
+ * has a job in the pool. */
+gcry_error_t otrl_akepool_hold(ConnContext *m_context,
+	const char *accountname, const char *protocol, const char *sender,
+	const char *message,
+	void (*add_appdata)(void *data, ConnContext *context), void *data)
+{
+    OtrlAKEJob *job = m_context->context_priv->ake_job;
+    OtrlAKEHeld *held;
+
+    held = malloc(sizeof(*held));
+    if (!held) return gcry_error(GPG_ERR_ENOMEM);
+    held->next = NULL;
+    held->accountname = strdup(accountname);
+    held->protocol = strdup(protocol);
+    held->sender = strdup(sender);
+    held->message = strdup(message);
+    held->add_appdata = add_appdata;
+    held->data = data;
+    if (!held->accountname || !held->protocol || !held->sender ||
+	    !held->message) {
+	free(held->accountname);
+	free(held->protocol);
+	free(held->sender);
+	free(held->message);
+	free(held);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    *(job->heldtail) = held;
+    job->heldtail = &(held->next);
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Free a job and any messages still held back behind it. */
+void otrl_akepool_job_free(OtrlAKEJob *job)
+{
+    while (job->held) {
+	OtrlAKEHeld *held = job->held;
+	job->held = held->next;
+	free(held->accountname);
+	free(held->protocol);
+	free(held->sender);
+	free(held->message);
+	free(held);
+    }
+    if (job->privkey) {
+	gcry_sexp_release(job->privkey->privkey);
+	free(job->privkey->pubkey_data);
+	free(job->privkey);
+    }
+    free(job->msg);
+    free(job);
+}
+
+/* The given context is about to be freed; if it is a master with a job
+ * in the pool, detach the job from it. */
+void otrl_akepool_forget(ConnContext *context)
+{
+    OtrlAKEJob *job = context->context_priv->ake_job;
+
+    if (!job || context->m_context != context) return;
+
+    otrl_akepool_cancel(context);
+    job->m_context = NULL;
+    context->context_priv->ake_job = NULL;
+}
+
+#ifdef HAVE_PTHREAD_H
+
+struct s_OtrlAKEPool {
+    pthread_mutex_t mutex;
+    pthread_cond_t wanted;       /* Signalled when there are jobs to do,
+				    or the threads should stop */
+    pthread_cond_t idle;         /* Signalled when a thread finishes
+				    working on a job */
+    pthread_t *threads;
+    unsigned int numthreads;
+
+    OtrlAKEJob *pending, **pendingtail;
+    OtrlAKEJob *finished, **finishedtail;
+    int stopping;
+
+    void (*ready)(void *readydata);
+    void *readydata;
+};
+
+/* The auth_succeeded callback used on the pool's threads.  The real
+ * one touches the rest of the context and calls back into the
+ * application, so that's left for otrl_message_ake_poll; just note
+ * what it will need that the auth routines reset afterwards. */
+static gcry_error_t note_success(const OtrlAuthInfo *auth, void *asdata)
+{
+    OtrlAKEJob *job = asdata;
+
+    job->succeeded = 1;
+    job->our_keyid = auth->our_keyid;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+static void run_job(OtrlAKEJob *job)
+{
+    OtrlAuthInfo *auth = &(job->context->auth);
+
+    switch(job->msgtype) {
+	case OTRL_MSGTYPE_DH_KEY:
+	    job->err = otrl_auth_handle_key(auth, job->msg, &(job->havemsg),
+		    job->privkey);
+	    break;
+	case OTRL_MSGTYPE_REVEALSIG:
+	    job->err = otrl_auth_handle_revealsig(auth, job->msg,
+		    &(job->havemsg), job->privkey, note_success, job);
+	    break;
+	case OTRL_MSGTYPE_SIGNATURE:
+	    job->err = otrl_auth_handle_signature(auth, job->msg,
+		    &(job->havemsg), note_success, job);
+	    break;
+	default:
+	    job->err = gcry_error(GPG_ERR_INV_VALUE);
+	    break;
+    }
+}
+
+static void *akepool_thread(void *data)
+{
+    OtrlAKEPool *pool = data;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+	OtrlAKEJob *job;
+
+	while (!pool->stopping && !pool->pending) {
+	    pthread_cond_wait(&pool->wanted, &pool->mutex);
+	}
+	if (pool->stopping) break;
+
+	job = pool->pending;
+	pool->pending = job->next;
+	if (!pool->pending) {
+	    pool->pendingtail = &(pool->pending);
+	}
+	job->next = NULL;
+
+	if (!job->cancelled) {
+	    /* Do the expensive part without holding the lock */
+	    job->running = 1;
+	    pthread_mutex_unlock(&pool->mutex);
+	    run_job(job);
+	    pthread_mutex_lock(&pool->mutex);
+	    job->running = 0;
+	    pthread_cond_broadcast(&pool->idle);
+	}
+
+	*(pool->finishedtail) = job;
+	pool->finishedtail = &(job->next);
+
+	if (pool->ready) {
+	    pthread_mutex_unlock(&pool->mutex);
+	    pool->ready(pool->readydata);
+	    pthread_mutex_lock(&pool->mutex);
+	}
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/* Start handing the expensive parts of AKEs for the given OtrlUserState
+ * to the given number of background threads (at least 1).  If ready is
+ * not NULL, it is called with readydata, from one of those threads,
+ * every time a job is finished; use it to wake up your main loop so it
+ * calls otrl_message_ake_poll.  Returns gcry_error(GPG_ERR_EEXIST) if
+ * the userstate already has a pool, and gcry_error(GPG_ERR_NOT_SUPPORTED)
+ * if libotr was built without thread support. */
+gcry_error_t otrl_akepool_enable(OtrlUserState us, unsigned int threads,
+	void (*ready)(void *readydata), void *readydata)
+{
+    OtrlAKEPool *pool;
+    unsigned int i;
+
+    if (us->akepool) return gcry_error(GPG_ERR_EEXIST);
+
+    if (threads == 0) threads = 1;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool) return gcry_error(GPG_ERR_ENOMEM);
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    if (!pool->threads) {
+	free(pool);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wanted, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->pendingtail = &(pool->pending);
+    pool->finishedtail = &(pool->finished);
+    pool->ready = ready;
+    pool->readydata = readydata;
+    us->akepool = pool;
+
+    for (i = 0; i < threads; ++i) {
+	if (pthread_create(&pool->threads[i], NULL, akepool_thread, pool)) {
+	    break;
+	}
+	pool->numthreads++;
+    }
+    if (pool->numthreads == 0) {
+	otrl_akepool_disable(us);
+	return gcry_error(GPG_ERR_NOT_SUPPORTED);
+    }
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Free the jobs in a list, detaching them from their masters first. */
+static void akepool_drop_jobs(OtrlAKEJob *job)
+{
+    while (job) {
+	OtrlAKEJob *next = job->next;
+	if (job->m_context) {
+	    job->m_context->context_priv->ake_job = NULL;
+	}
+	otrl_akepool_job_free(job);
+	job = next;
+    }
+}
+
+/* Stop the background threads of the given OtrlUserState's pool
+ * (waiting for any job they are in the middle of), and free the pool.
+ * AKE messages not yet handled, and the messages held back behind
+ * them, are dropped, as if they had been lost in transit.  Calling this
+ * on a userstate without a pool is harmless. */
+void otrl_akepool_disable(OtrlUserState us)
+{
+    OtrlAKEPool *pool = us->akepool;
+    unsigned int i;
+
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wanted);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 0; i < pool->numthreads; ++i) {
+	pthread_join(pool->threads[i], NULL);
+    }
+
+    akepool_drop_jobs(pool->pending);
+    akepool_drop_jobs(pool->finished);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->wanted);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+    us->akepool = NULL;
+}
+
+/* Copy the parts of a parsed private key that the auth routines use,
+ * so that the job doesn't depend on the key staying in the
+ * userstate. */
+static gcry_error_t privkey_copy(OtrlPrivKey **copyp,
+	const OtrlPrivKey *privkey)
+{
+    OtrlPrivKey *copy;
+    gcry_error_t err;
+
+    copy = calloc(1, sizeof(*copy));
+    if (!copy) return gcry_error(GPG_ERR_ENOMEM);
+    copy->pubkey_type = privkey->pubkey_type;
+    copy->pubkey_data = malloc(privkey->pubkey_datalen);
+    if (!copy->pubkey_data) {
+	free(copy);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    memmove(copy->pubkey_data, privkey->pubkey_data,
+	    privkey->pubkey_datalen);
+    copy->pubkey_datalen = privkey->pubkey_datalen;
+    err = gcry_sexp_build(&(copy->privkey), NULL, "%S", privkey->privkey);
+    if (err) {
+	free(copy->pubkey_data);
+	free(copy);
+	return err;
+    }
+
+    *copyp = copy;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Hand the given AKE message, received for the given context, to the
+ * given OtrlUserState's pool, using privkey to sign with if needed.
+ * The job works on its own copy of privkey, so the key may be
+ * forgotten meanwhile, but it must already have been parsed, as
+ * otrl_privkey_find does; if it hasn't, this returns
+ * gcry_error(GPG_ERR_UNUSABLE_SECKEY), and the message is best
+ * handled inline.  Until the job is taken back by
+ * otrl_akepool_take_finished, further messages for the context's
+ * master should be passed to otrl_akepool_hold, and nothing on the
+ * main thread may read or write the context's auth: check the
+ * master's ake_job first.  (For a v2 AKE, the context is the master
+ * itself.) */
+gcry_error_t otrl_akepool_submit(OtrlUserState us, ConnContext *context,
+	OtrlMessageType msgtype, const char *msg, OtrlPrivKey *privkey)
+{
+    OtrlAKEPool *pool = us->akepool;
+    OtrlAKEJob *job;
+    gcry_error_t err;
+
+    if (!pool) return gcry_error(GPG_ERR_NOT_SUPPORTED);
+
+    /* Parsing the key writes to it, and the main thread may be looking
+     * it up meanwhile */
+    if (privkey && !privkey->privkey) {
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+
+    job = calloc(1, sizeof(*job));
+    if (!job) return gcry_error(GPG_ERR_ENOMEM);
+    job->msg = strdup(msg);
+    if (!job->msg) {
+	free(job);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    if (privkey) {
+	err = privkey_copy(&(job->privkey), privkey);
+	if (err) {
+	    otrl_akepool_job_free(job);
+	    return err;
+	}
+    }
+    job->context = context;
+    job->m_context = context->m_context;
+    job->msgtype = msgtype;
+    job->heldtail = &(job->held);
+    context->m_context->context_priv->ake_job = job;
+
+    pthread_mutex_lock(&pool->mutex);
+    *(pool->pendingtail) = job;
+    pool->pendingtail = &(job->next);
+    pthread_cond_signal(&pool->wanted);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Take the list of finished jobs from the given OtrlUserState's pool,
+ * oldest first.  The caller must finish each one, release its master
+ * from it, and free it with otrl_akepool_job_free. */
+OtrlAKEJob *otrl_akepool_take_finished(OtrlUserState us)
+{
+    OtrlAKEPool *pool = us->akepool;
+    OtrlAKEJob *jobs;
+
+    if (!pool) return NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    jobs = pool->finished;
+    pool->finished = NULL;
+    pool->finishedtail = &(pool->finished);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return jobs;
+}
+
+/* The given context is being forced to FINISHED or PLAINTEXT; if it has
+ * a job in the pool, wait for any thread working on it, and have its
+ * result discarded. */
+void otrl_akepool_cancel(ConnContext *context)
+{
+    OtrlAKEJob *job = context->m_context->context_priv->ake_job;
+    OtrlAKEPool *pool;
+
+    if (!job || job->context != context) return;
+
+    pool = context->context_priv->us->akepool;
+    if (!pool) return;
+    pthread_mutex_lock(&pool->mutex);
+    while (job->running) {
+	pthread_cond_wait(&pool->idle, &pool->mutex);
+    }
+    job->cancelled = 1;
+    job->context = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+#else  /* HAVE_PTHREAD_H */
+
+/* Without threads, there is never a pool; AKEs are always handled
+ * inline. */
+
+gcry_error_t otrl_akepool_enable(OtrlUserState us, unsigned int threads,
+	void (*ready)(void *readydata), void *readydata)
+{
+    return gcry_error(GPG_ERR_NOT_SUPPORTED);
+}
+
+void otrl_akepool_disable(OtrlUserState us)
+{
+}
+
+gcry_error_t otrl_akepool_submit(OtrlUserState us, ConnContext *context,
+	OtrlMessageType msgtype, const char *msg, OtrlPrivKey *privkey)
+{
+    return gcry_error(GPG_ERR_NOT_SUPPORTED);
+}
+
+OtrlAKEJob *otrl_akepool_take_finished(OtrlUserState us)
+{
+    return NULL;
+}
+
+void otrl_akepool_cancel(ConnContext *context)
+{
+}
+
+#endif  /* HAVE_PTHREAD_H */
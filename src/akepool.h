@@ -0,0 +1,139 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __AKEPOOL_H__
+#define __AKEPOOL_H__
+
+#include <gcrypt.h>
+
+#include "context.h"
+#include "privkey-t.h"
+#include "proto.h"
+
+/* A pool of background threads to do the public-key operations of
+ * AKEs: the D-H computation and DSA signature of handling a D-H Key or
+ * Reveal Signature Message, and the DSA verification of handling a
+ * Reveal Signature or Signature Message.  While one of those messages
+ * is being worked on, any further messages from the same correspondent
+ * are held back, so the AKE state is only ever touched by one thread.
+ * When the work is done, the job is put on a completion queue, which
+ * the application drains on its own thread by calling
+ * otrl_message_ake_poll.  Without a pool, which is the default, all of
+ * this happens inline in otrl_message_receiving. */
+
+/* A message received from a correspondent while one of their AKE
+ * messages was being worked on */
+typedef struct s_OtrlAKEHeld {
+    struct s_OtrlAKEHeld *next;
+    char *accountname;
+    char *protocol;
+    char *sender;
+    char *message;
+    void (*add_appdata)(void *data, ConnContext *context);
+    void *data;
+} OtrlAKEHeld;
+
+/* An AKE message handed to the pool */
+typedef struct s_OtrlAKEJob {
+    struct s_OtrlAKEJob *next;
+
+    ConnContext *context;         /* The context whose auth is being
+				     worked on */
+    ConnContext *m_context;       /* Its master, or NULL once that has
+				     been forgotten */
+    OtrlMessageType msgtype;
+    char *msg;                    /* A copy of the AKE message */
+    OtrlPrivKey *privkey;         /* The job's own copy of the key to
+				     sign with, or NULL */
+
+    int running;                  /* Set while a thread is working on it */
+    int cancelled;                /* Set if its context was forced to
+				     FINISHED or PLAINTEXT meanwhile, so
+				     the result is to be discarded */
+
+    gcry_error_t err;             /* What the otrl_auth_handle_* call */
+    int havemsg;                  /*  returned */
+    int succeeded;                /* Set if the AKE completed */
+    unsigned int our_keyid;       /* The auth's our_keyid at that time */
+
+    OtrlAKEHeld *held;            /* Messages held back meanwhile, in the */
+    OtrlAKEHeld **heldtail;       /*  order they arrived */
+} OtrlAKEJob;
+
+typedef struct s_OtrlAKEPool OtrlAKEPool;
+
+/* Start handing the expensive parts of AKEs for the given OtrlUserState
+ * to the given number of background threads (at least 1).  If ready is
+ * not NULL, it is called with readydata, from one of those threads,
+ * every time a job is finished; use it to wake up your main loop so it
+ * calls otrl_message_ake_poll.  Returns gcry_error(GPG_ERR_EEXIST) if
+ * the userstate already has a pool, and gcry_error(GPG_ERR_NOT_SUPPORTED)
+ * if libotr was built without thread support. */
+gcry_error_t otrl_akepool_enable(OtrlUserState us, unsigned int threads,
+	void (*ready)(void *readydata), void *readydata);
+
+/* Stop the background threads of the given OtrlUserState's pool
+ * (waiting for any job they are in the middle of), and free the pool.
+ * AKE messages not yet handled, and the messages held back behind
+ * them, are dropped, as if they had been lost in transit.  Calling this
+ * on a userstate without a pool is harmless. */
+void otrl_akepool_disable(OtrlUserState us);
+
+/* Hand the given AKE message, received for the given context, to the
+ * given OtrlUserState's pool, using privkey to sign with if needed.
+ * The job works on its own copy of privkey, so the key may be
+ * forgotten meanwhile, but it must already have been parsed, as
+ * otrl_privkey_find does; if it hasn't, this returns
+ * gcry_error(GPG_ERR_UNUSABLE_SECKEY), and the message is best
+ * handled inline.  Until the job is taken back by
+ * otrl_akepool_take_finished, further messages for the context's
+ * master should be passed to otrl_akepool_hold, and nothing on the
+ * main thread may read or write the context's auth: check the
+ * master's ake_job first.  (For a v2 AKE, the context is the master
+ * itself.) */
+gcry_error_t otrl_akepool_submit(OtrlUserState us, ConnContext *context,
+	OtrlMessageType msgtype, const char *msg, OtrlPrivKey *privkey);
+
+/* Hold back a message received for the given master context while it
+ * has a job in the pool. */
+gcry_error_t otrl_akepool_hold(ConnContext *m_context,
+	const char *accountname, const char *protocol, const char *sender,
+	const char *message,
+	void (*add_appdata)(void *data, ConnContext *context), void *data);
+
+/* Take the list of finished jobs from the given OtrlUserState's pool,
+ * oldest first.  The caller must finish each one, release its master
+ * from it, and free it with otrl_akepool_job_free. */
+OtrlAKEJob *otrl_akepool_take_finished(OtrlUserState us);
+
+/* Free a job and any messages still held back behind it. */
+void otrl_akepool_job_free(OtrlAKEJob *job);
+
+/* The given context is being forced to FINISHED or PLAINTEXT; if it has
+ * a job in the pool, wait for any thread working on it, and have its
+ * result discarded. */
+void otrl_akepool_cancel(ConnContext *context);
+
+/* The given context is about to be freed; if it is a master with a job
+ * in the pool, detach the job from it. */
+void otrl_akepool_forget(ConnContext *context);
+
+#endif
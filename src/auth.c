@@ -32,6 +32,7 @@
 #include "proto.h"
 #include "context.h"
 #include "mem.h"
+#include "dhpool.h"
 
 #if OTRL_DEBUGGING
 #include <stdio.h>
@@ -136,6 +137,18 @@ void otrl_auth_clear(OtrlAuthInfo *auth)
     auth->commit_sent_time = 0;
 }
 
+/*
+ * Generate a fresh DH keypair for the AKE, from the pool of our
+ * userstate if it has one.
+ */
+static gcry_error_t auth_gen_keypair(OtrlAuthInfo *auth)
+{
+    OtrlUserState us = auth->context && auth->context->context_priv ?
+	auth->context->context_priv->us : NULL;
+
+    return otrl_dhpool_gen_keypair(us, &(auth->our_dh));
+}
+
 /*
  * Start a fresh AKE (version 2 or 3) using the given OtrlAuthInfo.  Generate
  * a fresh DH keypair to use.  If no error is returned, the message to
@@ -157,7 +170,8 @@ gcry_error_t otrl_auth_start_v23(OtrlAuthInfo *auth, int version)
     auth->protocol_version = version;
     auth->context->protocol_version = version;
 
-    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
+    err = auth_gen_keypair(auth);
+    if (err) goto err;
     auth->our_keyid = 1;
 
     /* Pick an encryption key */
@@ -351,7 +365,8 @@ gcry_error_t otrl_auth_handle_commit(OtrlAuthInfo *auth,
 	    otrl_auth_clear(auth);
 	    auth->protocol_version = version;
 
-	    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
+	    err = auth_gen_keypair(auth);
+	    if (err) goto err;
 
 	    auth->our_keyid = 1;
 	    auth->encgx = encbuf;
@@ -386,7 +401,8 @@ gcry_error_t otrl_auth_handle_commit(OtrlAuthInfo *auth,
 		/* Ours loses.  Use the incoming parameters instead. */
 		otrl_auth_clear(auth);
 		auth->protocol_version = version;
-		otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
+		err = auth_gen_keypair(auth);
+		if (err) goto err;
 		auth->our_keyid = 1;
 		auth->encgx = encbuf;
 		encbuf = NULL;
@@ -1283,7 +1299,8 @@ gcry_error_t otrl_auth_start_v1(OtrlAuthInfo *auth, DH_keypair *our_dh,
 	otrl_dh_keypair_copy(&(auth->our_dh), our_dh);
 	auth->our_keyid = our_keyid;
     } else {
-	otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
+	err = auth_gen_keypair(auth);
+	if (err) return err;
 	auth->our_keyid = 1;
     }
 
@@ -1401,7 +1418,8 @@ gcry_error_t otrl_auth_handle_v1_key_exchange(OtrlAuthInfo *auth,
 	    otrl_dh_keypair_copy(&(auth->our_dh), our_dh);
 	    auth->our_keyid = our_keyid;
 	} else if (auth->our_keyid == 0) {
-	    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
+	    err = auth_gen_keypair(auth);
+	    if (err) goto err;
 	    auth->our_keyid = 1;
 	}
 
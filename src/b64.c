@@ -55,10 +55,22 @@ VERSION HISTORY:
 
 \******************************************************************* */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdio.h>
 #include <string.h>
 
+#if defined(HAVE_X86_SIMD) && (defined(__x86_64__) || defined(__i386__))
+#define OTRL_B64_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define OTRL_B64_NEON
+#include <arm_neon.h>
+#endif
+
 /* libotr headers */
 #include "b64.h"
 
@@ -93,6 +105,410 @@ static void encodeblock( char *out, const unsigned char *in, size_t len )
 		     : '=';
 }
 
+/*
+** Vectorized kernels
+**
+** Each encode kernel converts as many whole groups of input bytes as it
+** safely can and returns the number of input bytes consumed, which is
+** always a multiple of 3; the caller finishes the rest with
+** encodeblock.  Input is always read before the corresponding output
+** is written, so (like encodeblock) the kernels can encode in place
+** into a buffer whose output runs behind the input.
+**
+** Each decode kernel converts whole chunks of characters for as long
+** as every character in the chunk is in the base64 alphabet (so no
+** '=' and nothing to skip), sets *lenp to the number of characters
+** consumed, and returns the number of bytes written.  The caller
+** handles anything else one character at a time, as the scalar code does,
+** so the output is identical either way.
+*/
+typedef size_t (*EncodeKernel)(char *out, const unsigned char *in,
+	size_t len);
+typedef size_t (*DecodeKernel)(unsigned char *out, const char *in,
+	size_t *lenp);
+
+static EncodeKernel encode_kernel = NULL;
+static DecodeKernel decode_kernel = NULL;
+static size_t decode_chunk = 0;   /* Characters per decode_kernel chunk */
+
+#ifdef OTRL_B64_X86
+
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define INLINE __attribute__((always_inline))
+
+/* Spread each group of 3 bytes in the low 12 bytes of in into 4 6-bit
+ * values, one per byte. */
+static inline __m128i TARGET_SSSE3 enc_reshuffle_128(__m128i in)
+{
+    __m128i t0, t1, t2, t3;
+
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+		4, 5, 3, 4, 1, 2, 0, 1));
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+/* Map 6-bit values to characters of cb64. */
+static inline __m128i TARGET_SSSE3 enc_translate_128(__m128i in)
+{
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+	    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	    '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    __m128i r, less;
+
+    r = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    less = _mm_cmpgt_epi8(_mm_set1_epi8(26), in);
+    r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(shift, r), in);
+}
+
+/* Map characters to 6-bit values.  Return 0 if any of them is not in
+ * the base64 alphabet. */
+static inline int TARGET_SSSE3 dec_translate_128(__m128i in, __m128i *outp)
+{
+    __m128i upper, lower, digit, plus, slash, shift, valid;
+
+    upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+	    _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), in));
+    lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+	    _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), in));
+    digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+	    _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+    plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+    slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+
+    valid = _mm_or_si128(_mm_or_si128(upper, lower),
+	    _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+    if (_mm_movemask_epi8(valid) != 0xffff) return 0;
+
+    shift = _mm_or_si128(
+	    _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+		_mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+	    _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+		_mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62 - '+')),
+		    _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+    *outp = _mm_add_epi8(in, shift);
+    return 1;
+}
+
+/* Pack each group of 4 6-bit values into 3 bytes, leaving them in the
+ * low 12 bytes. */
+static inline __m128i TARGET_SSSE3 dec_pack_128(__m128i in)
+{
+    in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(in, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+		14, 13, 12, -1, -1, -1, -1));
+}
+
+/* The 128-bit loops are inlined into the AVX2 kernels to finish off
+ * their input, so that they get the same instruction encoding. */
+static inline size_t TARGET_SSSE3 INLINE encode_128(char *out,
+	const unsigned char *in, size_t len)
+{
+    size_t used = 0;
+
+    /* Each step reads 16 bytes, but only consumes 12 of them */
+    while (len - used >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(in + used));
+	v = enc_translate_128(enc_reshuffle_128(v));
+	_mm_storeu_si128((__m128i *)out, v);
+	out += 16;
+	used += 12;
+    }
+    return used;
+}
+
+static inline size_t TARGET_SSSE3 INLINE decode_128(unsigned char *out,
+	const char *in, size_t *lenp)
+{
+    size_t used = 0, written = 0;
+    __m128i v;
+    int tail;
+
+    while (*lenp - used >= 16) {
+	v = _mm_loadu_si128((const __m128i *)(in + used));
+	if (!dec_translate_128(v, &v)) break;
+	v = dec_pack_128(v);
+	_mm_storel_epi64((__m128i *)(out + written), v);
+	tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	memmove(out + written + 8, &tail, 4);
+	used += 16;
+	written += 12;
+    }
+    *lenp = used;
+    return written;
+}
+
+static size_t TARGET_SSSE3 encode_ssse3(char *out, const unsigned char *in,
+	size_t len)
+{
+    return encode_128(out, in, len);
+}
+
+static size_t TARGET_SSSE3 decode_ssse3(unsigned char *out, const char *in,
+	size_t *lenp)
+{
+    return decode_128(out, in, lenp);
+}
+
+static size_t TARGET_AVX2 encode_avx2(char *out, const unsigned char *in,
+	size_t len)
+{
+    const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+	    7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5, 4,
+	    7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+	    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	    '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+	    'a' - 26, '0' - 52, '0' - 52,
+	    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	    '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t used = 0;
+
+    /* Each step consumes 24 bytes, 12 into each lane, but the load for
+     * the second lane reads 16 */
+    while (len - used >= 28) {
+	__m256i v, t0, t1, t2, t3, r, less;
+
+	v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+		    _mm_loadu_si128((const __m128i *)(in + used))),
+		_mm_loadu_si128((const __m128i *)(in + used + 12)), 1);
+	v = _mm256_shuffle_epi8(v, shuf);
+	t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+	t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+	t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	v = _mm256_or_si256(t1, t3);
+
+	r = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+	less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), v);
+	r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+	v = _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), v);
+
+	_mm256_storeu_si256((__m256i *)out, v);
+	out += 32;
+	used += 24;
+    }
+
+    /* Finish off with narrower steps */
+    return used + encode_128(out, in + used, len - used);
+}
+
+static size_t TARGET_AVX2 decode_avx2(unsigned char *out, const char *in,
+	size_t *lenp)
+{
+    size_t used = 0, written = 0;
+
+    while (*lenp - used >= 32) {
+	__m256i v, upper, lower, digit, plus, slash, shift, valid;
+
+	v = _mm256_loadu_si256((const __m256i *)(in + used));
+	upper = _mm256_and_si256(
+		_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+		_mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+	lower = _mm256_and_si256(
+		_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+		_mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+	digit = _mm256_and_si256(
+		_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+		_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+	plus = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'));
+	slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+
+	valid = _mm256_or_si256(_mm256_or_si256(upper, lower),
+		_mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+	if (_mm256_movemask_epi8(valid) != -1) break;
+
+	shift = _mm256_or_si256(
+		_mm256_or_si256(
+		    _mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+		    _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+		_mm256_or_si256(
+		    _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+		    _mm256_or_si256(
+			_mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')),
+			_mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')))));
+	v = _mm256_add_epi8(v, shift);
+
+	v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+	v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+	v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(2, 1, 0, 6, 5, 4,
+		    10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	/* Bring the 12 bytes from each lane together */
+	v = _mm256_permutevar8x32_epi32(v,
+		_mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+	_mm_storeu_si128((__m128i *)(out + written),
+		_mm256_castsi256_si128(v));
+	_mm_storel_epi64((__m128i *)(out + written + 16),
+		_mm256_extracti128_si256(v, 1));
+	used += 32;
+	written += 24;
+    }
+
+    /* Finish off with narrower steps, unless we stopped at a character
+     * we can't handle */
+    if (*lenp - used < 32) {
+	size_t rest = *lenp - used;
+	written += decode_128(out + written, in + used, &rest);
+	used += rest;
+    }
+    *lenp = used;
+    return written;
+}
+
+#endif  /* OTRL_B64_X86 */
+
+#ifdef OTRL_B64_NEON
+
+static size_t encode_neon(char *out, const unsigned char *in, size_t len)
+{
+    const uint8x16_t mask = vdupq_n_u8(0x3f);
+    uint8x16x4_t table;
+    size_t used = 0;
+
+    table.val[0] = vld1q_u8((const uint8_t *)cb64);
+    table.val[1] = vld1q_u8((const uint8_t *)cb64 + 16);
+    table.val[2] = vld1q_u8((const uint8_t *)cb64 + 32);
+    table.val[3] = vld1q_u8((const uint8_t *)cb64 + 48);
+
+    while (len - used >= 48) {
+	uint8x16x3_t v = vld3q_u8(in + used);
+	uint8x16x4_t r;
+
+	r.val[0] = vshrq_n_u8(v.val[0], 2);
+	r.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[0], 4),
+		    vshrq_n_u8(v.val[1], 4)), mask);
+	r.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[1], 2),
+		    vshrq_n_u8(v.val[2], 6)), mask);
+	r.val[3] = vandq_u8(v.val[2], mask);
+	r.val[0] = vqtbl4q_u8(table, r.val[0]);
+	r.val[1] = vqtbl4q_u8(table, r.val[1]);
+	r.val[2] = vqtbl4q_u8(table, r.val[2]);
+	r.val[3] = vqtbl4q_u8(table, r.val[3]);
+	vst4q_u8((uint8_t *)out, r);
+	out += 64;
+	used += 48;
+    }
+    return used;
+}
+
+/* Map characters to 6-bit values, and AND into *validp a mask of which
+ * of them were in the base64 alphabet. */
+static inline uint8x16_t dec_translate_neon(uint8x16_t in,
+	uint8x16_t *validp)
+{
+    uint8x16_t upper, lower, digit, plus, slash, shift;
+
+    upper = vandq_u8(vcgeq_u8(in, vdupq_n_u8('A')),
+	    vcleq_u8(in, vdupq_n_u8('Z')));
+    lower = vandq_u8(vcgeq_u8(in, vdupq_n_u8('a')),
+	    vcleq_u8(in, vdupq_n_u8('z')));
+    digit = vandq_u8(vcgeq_u8(in, vdupq_n_u8('0')),
+	    vcleq_u8(in, vdupq_n_u8('9')));
+    plus = vceqq_u8(in, vdupq_n_u8('+'));
+    slash = vceqq_u8(in, vdupq_n_u8('/'));
+
+    *validp = vandq_u8(*validp, vorrq_u8(vorrq_u8(upper, lower),
+		vorrq_u8(digit, vorrq_u8(plus, slash))));
+
+    shift = vorrq_u8(
+	    vorrq_u8(vandq_u8(upper, vdupq_n_u8((uint8_t)-'A')),
+		vandq_u8(lower, vdupq_n_u8((uint8_t)(26 - 'a')))),
+	    vorrq_u8(vandq_u8(digit, vdupq_n_u8((uint8_t)(52 - '0'))),
+		vorrq_u8(vandq_u8(plus, vdupq_n_u8((uint8_t)(62 - '+'))),
+		    vandq_u8(slash, vdupq_n_u8((uint8_t)(63 - '/'))))));
+    return vaddq_u8(in, shift);
+}
+
+static size_t decode_neon(unsigned char *out, const char *in, size_t *lenp)
+{
+    size_t used = 0, written = 0;
+
+    while (*lenp - used >= 64) {
+	uint8x16x4_t v = vld4q_u8((const uint8_t *)in + used);
+	uint8x16_t valid = vdupq_n_u8(0xff);
+	uint8x16x3_t r;
+
+	v.val[0] = dec_translate_neon(v.val[0], &valid);
+	v.val[1] = dec_translate_neon(v.val[1], &valid);
+	v.val[2] = dec_translate_neon(v.val[2], &valid);
+	v.val[3] = dec_translate_neon(v.val[3], &valid);
+	if (vminvq_u8(valid) != 0xff) break;
+
+	r.val[0] = vorrq_u8(vshlq_n_u8(v.val[0], 2), vshrq_n_u8(v.val[1], 4));
+	r.val[1] = vorrq_u8(vshlq_n_u8(v.val[1], 4), vshrq_n_u8(v.val[2], 2));
+	r.val[2] = vorrq_u8(vshlq_n_u8(v.val[2], 6), v.val[3]);
+	vst3q_u8(out + written, r);
+	used += 64;
+	written += 48;
+    }
+    *lenp = used;
+    return written;
+}
+
+#endif  /* OTRL_B64_NEON */
+
+/*
+ * Use the given base64 kernels from now on, in place of the ones
+ * otrl_base64_init chose; this is for tests and benchmarks, which want
+ * to compare them.  Return 0, or -1 if this CPU (or this build of
+ * libotr) doesn't have them, in which case nothing changes.
+ */
+int otrl_base64_use_kernels(OtrlBase64Kernels kernels)
+{
+    switch (kernels) {
+	case OTRL_B64_KERNELS_SCALAR:
+	    encode_kernel = NULL;
+	    decode_kernel = NULL;
+	    decode_chunk = 0;
+	    return 0;
+#if defined(OTRL_B64_X86)
+	case OTRL_B64_KERNELS_SSSE3:
+	    __builtin_cpu_init();
+	    if (!__builtin_cpu_supports("ssse3")) return -1;
+	    encode_kernel = encode_ssse3;
+	    decode_kernel = decode_ssse3;
+	    decode_chunk = 16;
+	    return 0;
+	case OTRL_B64_KERNELS_AVX2:
+	    __builtin_cpu_init();
+	    if (!__builtin_cpu_supports("avx2")) return -1;
+	    encode_kernel = encode_avx2;
+	    decode_kernel = decode_avx2;
+	    decode_chunk = 32;
+	    return 0;
+#elif defined(OTRL_B64_NEON)
+	case OTRL_B64_KERNELS_NEON:
+	    /* Advanced SIMD is part of the base AArch64 architecture */
+	    encode_kernel = encode_neon;
+	    decode_kernel = decode_neon;
+	    decode_chunk = 64;
+	    return 0;
+#endif
+	default:
+	    return -1;
+    }
+}
+
+/*
+ * Choose the fastest base64 kernels this CPU supports.  This is called
+ * from otrl_init; until then (or if there are no suitable kernels) the
+ * scalar code is used throughout, with identical results.
+ */
+void otrl_base64_init(void)
+{
+    if (otrl_base64_use_kernels(OTRL_B64_KERNELS_AVX2) &&
+	    otrl_base64_use_kernels(OTRL_B64_KERNELS_SSSE3)) {
+	otrl_base64_use_kernels(OTRL_B64_KERNELS_NEON);
+    }
+}
+
 /*
  * base64 encode data.  Insert no linebreaks or whitespace.
  *
@@ -104,6 +520,14 @@ size_t otrl_base64_encode(char *base64data, const unsigned char *data,
 {
     size_t base64len = 0;
 
+    if (encode_kernel) {
+	size_t used = encode_kernel(base64data, data, datalen);
+	base64data += (used / 3) * 4;
+	base64len += (used / 3) * 4;
+	data += used;
+	datalen -= used;
+    }
+
     while(datalen > 2) {
 	encodeblock(base64data, data, 3);
 	base64data += 4;
@@ -158,10 +582,28 @@ size_t otrl_base64_decode(unsigned char *data, const char *base64data,
     size_t datalen = 0;
     char b64[4];
     size_t b64accum = 0;
+    size_t slowchars = 0;
 
     while(base64len > 0) {
-	char b = *base64data;
+	char b;
 	unsigned char bdecode;
+
+	if (decode_kernel && b64accum == 0 && slowchars == 0) {
+	    /* Decode as much as we can a whole chunk at a time, and then
+	     * take at least one chunk's worth slowly, so that input with
+	     * lots of characters to skip doesn't keep us trying. */
+	    size_t used = base64len;
+	    size_t written = decode_kernel(data, base64data, &used);
+	    data += written;
+	    datalen += written;
+	    base64data += used;
+	    base64len -= used;
+	    slowchars = decode_chunk;
+	    continue;
+	}
+	if (slowchars > 0) --slowchars;
+
+	b = *base64data;
 	++base64data;
 	--base64len;
 	if (b < '+' || b > 'z') continue;  /* Skip non-base64 chars */
@@ -188,6 +630,103 @@ size_t otrl_base64_decode(unsigned char *data, const char *base64data,
     return datalen;
 }
 
+/* Whitespace and line breaks, which some networks add to long
+ * messages, and which the body of an OTR message may contain anywhere */
+#define IS_B64_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || \
+	(c) == '\n')
+
+/* Skip any whitespace from p, stopping at end */
+static const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && IS_B64_SPACE(*p)) ++p;
+    return p;
+}
+
+/*
+ * Base64-decode the body of an OTR message, which starts at base64data
+ * (just after the "?OTR:") and runs for at most base64len characters,
+ * checking that it is well formed as we go.  The body must consist of
+ * base64 characters, correctly padded with '=' if need be, and end with
+ * a '.' (or, if dotoptional is set, possibly at base64len instead).
+ * Whitespace and line breaks anywhere in it are skipped, as the lenient
+ * decoder skips them; anything else is rejected as soon as it is
+ * seen.
+ *
+ * Decode into data, which has room for datasize bytes; at most
+ * OTRL_B64_MAX_DECODED_SIZE(base64len) are ever needed.  Return 0 on
+ * success, putting the number of bytes used into *datalenp, -2 on
+ * invalid input, or -3 if data is too small.
+ */
+int otrl_base64_otr_body_decode(unsigned char *data, size_t datasize,
+	size_t *datalenp, const char *base64data, size_t base64len,
+	int dotoptional)
+{
+    const char *end = base64data + base64len;
+    size_t datalen = 0;
+    char b64[4];
+    size_t b64accum = 0;
+    size_t slowchars = 0;
+    size_t written;
+
+    while (base64data < end) {
+	char b;
+	unsigned char bdecode;
+
+	if (decode_kernel && b64accum == 0 && slowchars == 0) {
+	    /* Take whole chunks quickly, so long as they fit */
+	    size_t used = end - base64data;
+	    size_t room = ((datasize - datalen) / 3) * 4;
+	    if (used > room) used = room;
+	    written = decode_kernel(data + datalen, base64data, &used);
+	    datalen += written;
+	    base64data += used;
+	    slowchars = decode_chunk;
+	    continue;
+	}
+	if (slowchars > 0) --slowchars;
+
+	b = *base64data;
+	if (IS_B64_SPACE(b)) {
+	    ++base64data;
+	    continue;
+	}
+	if (b < '+' || b > 'z') break;
+	bdecode = cd64[b-'+'];
+	if (bdecode == '$') break;
+	++base64data;
+
+	b64[b64accum++] = bdecode-'>';
+	if (b64accum == 4) {
+	    if (datasize - datalen < 3) return -3;
+	    datalen += decode(data + datalen, b64, b64accum);
+	    b64accum = 0;
+	}
+    }
+
+    /* Padding may finish off a short block */
+    if (base64data < end && *base64data == '=' && b64accum >= 2) {
+	base64data = skip_space(base64data + 1, end);
+	if (b64accum == 2) {
+	    if (base64data == end || *base64data != '=') return -2;
+	    base64data = skip_space(base64data + 1, end);
+	}
+	if (datasize - datalen < b64accum - 1) return -3;
+	datalen += decode(data + datalen, b64, b64accum);
+	b64accum = 0;
+    }
+
+    /* Whatever stopped us should be the end of the body */
+    if (b64accum != 0) return -2;
+    if (base64data == end) {
+	if (!dotoptional) return -2;
+    } else if (*base64data != '.') {
+	return -2;
+    }
+
+    *datalenp = datalen;
+    return 0;
+}
+
 /*
  * Base64-encode a block of data, stick "?OTR:" and "." around it, and
  * return the result, or NULL in the event of a memory error.  The
@@ -214,41 +753,41 @@ char *otrl_base64_otr_encode(const unsigned char *buf, size_t buflen)
 
 /*
  * Base64-decode the portion of the given message between "?OTR:" and
- * ".".  Set *bufp to the decoded data, and set *lenp to its length.
+ * ".", which must be well formed, as for otrl_base64_otr_body_decode.
+ * Set *bufp to the decoded data, and set *lenp to its length.
  * The caller must free() the result.  Return 0 on success, -1 on a
  * memory error, or -2 on invalid input.
  */
 int otrl_base64_otr_decode(const char *msg, unsigned char **bufp,
 	size_t *lenp)
 {
-    char *otrtag, *endtag;
+    char *otrtag;
     size_t msglen, rawlen;
     unsigned char *rawmsg;
+    int res;
 
     otrtag = strstr(msg, "?OTR:");
     if (!otrtag) {
 	return -2;
     }
 
-    endtag = strchr(otrtag, '.');
-    if (endtag) {
-	msglen = endtag-otrtag;
-    } else {
-	return -2;
-    }
-
     /* Skip over the "?OTR:" */
     otrtag += 5;
-    msglen -= 5;
+    msglen = strlen(otrtag);
 
-    /* Base64-decode the message */
+    /* Base64-decode the message, checking it as we go */
     rawlen = OTRL_B64_MAX_DECODED_SIZE(msglen);   /* maximum possible */
     rawmsg = malloc(rawlen);
     if (!rawmsg && rawlen > 0) {
 	return -1;
     }
 
-    rawlen = otrl_base64_decode(rawmsg, otrtag, msglen);  /* actual size */
+    res = otrl_base64_otr_body_decode(rawmsg, rawlen, &rawlen, otrtag,
+	    msglen, 0);
+    if (res) {
+	free(rawmsg);
+	return -2;
+    }
 
     *bufp = rawmsg;
     *lenp = rawlen;
@@ -34,6 +34,29 @@
     (((encoded_len + OTRL_B64_ENCODED_LEN - 1) / OTRL_B64_ENCODED_LEN) \
 	* OTRL_B64_DECODED_LEN)
 
+/* The sets of base64 kernels there are */
+typedef enum {
+    OTRL_B64_KERNELS_SCALAR,
+    OTRL_B64_KERNELS_SSSE3,
+    OTRL_B64_KERNELS_AVX2,
+    OTRL_B64_KERNELS_NEON
+} OtrlBase64Kernels;
+
+/*
+ * Choose the fastest base64 kernels this CPU supports.  This is called
+ * from otrl_init; until then (or if there are no suitable kernels) the
+ * scalar code is used throughout, with identical results.
+ */
+void otrl_base64_init(void);
+
+/*
+ * Use the given base64 kernels from now on, in place of the ones
+ * otrl_base64_init chose; this is for tests and benchmarks, which want
+ * to compare them.  Return 0, or -1 if this CPU (or this build of
+ * libotr) doesn't have them, in which case nothing changes.
+ */
+int otrl_base64_use_kernels(OtrlBase64Kernels kernels);
+
 /*
  * base64 encode data.  Insert no linebreaks or whitespace.
  *
@@ -54,6 +77,25 @@ size_t otrl_base64_encode(char *base64data, const unsigned char *data,
 size_t otrl_base64_decode(unsigned char *data, const char *base64data,
 	size_t base64len);
 
+/*
+ * Base64-decode the body of an OTR message, which starts at base64data
+ * (just after the "?OTR:") and runs for at most base64len characters,
+ * checking that it is well formed as we go.  The body must consist of
+ * base64 characters, correctly padded with '=' if need be, and end with
+ * a '.' (or, if dotoptional is set, possibly at base64len instead).
+ * Whitespace and line breaks anywhere in it are skipped, as the lenient
+ * decoder skips them; anything else is rejected as soon as it is
+ * seen.
+ *
+ * Decode into data, which has room for datasize bytes; at most
+ * OTRL_B64_MAX_DECODED_SIZE(base64len) are ever needed.  Return 0 on
+ * success, putting the number of bytes used into *datalenp, -2 on
+ * invalid input, or -3 if data is too small.
+ */
+int otrl_base64_otr_body_decode(unsigned char *data, size_t datasize,
+	size_t *datalenp, const char *base64data, size_t base64len,
+	int dotoptional);
+
 /*
  * Base64-encode a block of data, stick "?OTR:" and "." around it, and
  * return the result, or NULL in the event of a memory error.
@@ -62,7 +104,8 @@ char *otrl_base64_otr_encode(const unsigned char *buf, size_t buflen);
 
 /*
  * Base64-decode the portion of the given message between "?OTR:" and
- * ".".  Set *bufp to the decoded data, and set *lenp to its length.
+ * ".", which must be well formed, as for otrl_base64_otr_body_decode.
+ * Set *bufp to the decoded data, and set *lenp to its length.
  * The caller must free() the result.  Return 0 on success, -1 on a
  * memory error, or -2 on invalid input.
  */
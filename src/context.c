@@ -21,6 +21,7 @@
 
 /* system headers */
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 /* libgcrypt headers */
@@ -29,6 +30,12 @@
 /* libotr headers */
 #include "context.h"
 #include "instag.h"
+#include "hash.h"
+#include "fpstore.h"
+#include "fpjournal.h"
+#include "akepool.h"
+#include "uslock.h"
+#include "deadline.h"
 
 #if OTRL_DEBUGGING
 #include <stdio.h>
@@ -58,7 +65,13 @@ void otrl_context_dump(FILE *f, const ConnContext *context)
 	context->msgstate == OTRL_MSGSTATE_ENCRYPTED ? "ENCRYPTED" :
 	context->msgstate == OTRL_MSGSTATE_FINISHED ? "FINISHED" :
 	"INVALID");
-    otrl_auth_dump(f, &context->auth);
+    if (context->m_context->context_priv->ake_job &&
+	    context->m_context->context_priv->ake_job->context == context) {
+	/* A pool thread may be writing it */
+	fprintf(f, "  Auth info: AKE in the pool\n");
+    } else {
+	otrl_auth_dump(f, &context->auth);
+    }
     fprintf(f, "\n  Fingerprints:\n");
     for (fing = context->fingerprint_root.next; fing; fing = fing->next) {
 	fprintf(f, "    %p ", fing);
@@ -120,6 +133,174 @@ void otrl_context_all_dump(FILE *f, OtrlUserState us)
 }
 #endif
 
+/* A hash index over all the contexts in an OtrlUserState.  Each bucket
+ * is a chain of contexts linked through context_priv->index_next. */
+struct s_OtrlContextIndex {
+    ConnContext **buckets;
+    unsigned int numbuckets;           /* Always a power of 2 */
+    unsigned int numentries;
+    ConnContext *last_added;           /* The context most recently added
+					  by otrl_context_find, as a
+					  starting point for finding
+					  where the next one goes */
+};
+
+#define CONTEXT_INDEX_MIN_BUCKETS 64
+
+/* Compute the index hash of a username/accountname/protocol/instance
+ * tuple. */
+static unsigned int context_hash(const char *user, const char *accountname,
+	const char *protocol, otrl_instag_t their_instance)
+{
+    unsigned int hash = OTRL_HASH_INIT;
+
+    hash = otrl_hash_string(hash, user);
+    hash = otrl_hash_string(hash, accountname);
+    hash = otrl_hash_string(hash, protocol);
+    return otrl_hash_uint(hash, their_instance);
+}
+
+/* Look up the context with exactly the given key in the index.  The
+ * their_instance here must be OTRL_INSTAG_MASTER or a real instance
+ * tag, not a meta-instance. */
+static ConnContext *context_index_lookup(struct s_OtrlContextIndex *index,
+	const char *user, const char *accountname, const char *protocol,
+	otrl_instag_t their_instance)
+{
+    unsigned int hash = context_hash(user, accountname, protocol,
+	    their_instance);
+    ConnContext *c;
+
+    for (c = index->buckets[hash & (index->numbuckets - 1)]; c;
+	    c = c->context_priv->index_next) {
+	if (c->context_priv->index_hash == hash &&
+		c->their_instance == their_instance &&
+		!strcmp(c->username, user) &&
+		!strcmp(c->accountname, accountname) &&
+		!strcmp(c->protocol, protocol)) {
+	    return c;
+	}
+    }
+    return NULL;
+}
+
+/* Double the number of buckets in the index.  On failure, just leave
+ * the index as it is; it's still correct, only slower. */
+static void context_index_grow(struct s_OtrlContextIndex *index)
+{
+    unsigned int newnum = index->numbuckets * 2;
+    ConnContext **newbuckets;
+    unsigned int i;
+
+    if (newnum < index->numbuckets) return;  /* Check for overflow */
+    newbuckets = calloc(newnum, sizeof(ConnContext *));
+    if (!newbuckets) return;
+
+    for (i = 0; i < index->numbuckets; ++i) {
+	ConnContext *c = index->buckets[i];
+	while (c) {
+	    ConnContext *next = c->context_priv->index_next;
+	    unsigned int b = c->context_priv->index_hash & (newnum - 1);
+	    c->context_priv->index_next = newbuckets[b];
+	    newbuckets[b] = c;
+	    c = next;
+	}
+    }
+    free(index->buckets);
+    index->buckets = newbuckets;
+    index->numbuckets = newnum;
+}
+
+/* Add a context to the index. */
+static void context_index_insert(struct s_OtrlContextIndex *index,
+	ConnContext *context)
+{
+    unsigned int b;
+
+    if (index->numentries >= index->numbuckets) {
+	context_index_grow(index);
+    }
+    context->context_priv->index_hash = context_hash(context->username,
+	    context->accountname, context->protocol, context->their_instance);
+    b = context->context_priv->index_hash & (index->numbuckets - 1);
+    context->context_priv->index_next = index->buckets[b];
+    index->buckets[b] = context;
+    index->numentries++;
+}
+
+/* Remove a context from the index. */
+static void context_index_remove(struct s_OtrlContextIndex *index,
+	ConnContext *context)
+{
+    ConnContext **cp;
+    unsigned int b = context->context_priv->index_hash &
+	(index->numbuckets - 1);
+
+    for (cp = &(index->buckets[b]); *cp;
+	    cp = &((*cp)->context_priv->index_next)) {
+	if (*cp == context) {
+	    *cp = context->context_priv->index_next;
+	    context->context_priv->index_next = NULL;
+	    index->numentries--;
+	    if (index->last_added == context) {
+		index->last_added = NULL;
+	    }
+	    return;
+	}
+    }
+}
+
+/* Start maintaining a hash index over the contexts in the given
+ * OtrlUserState, keyed on username, accountname, protocol and instance
+ * tag.  With the index in place, otrl_context_find no longer walks the
+ * whole context list, which matters if you have a very large number of
+ * contexts.  The list at us->context_root is kept exactly as before,
+ * so you can still iterate over it.  Calling this more than once is
+ * harmless. */
+gcry_error_t otrl_context_index_enable(OtrlUserState us)
+{
+    struct s_OtrlContextIndex *index;
+    ConnContext *c;
+
+    if (!us) return gcry_error(GPG_ERR_INV_VALUE);
+    if (us->context_index) return gcry_error(GPG_ERR_NO_ERROR);
+
+    index = malloc(sizeof(*index));
+    if (!index) return gcry_error(GPG_ERR_ENOMEM);
+    index->numbuckets = CONTEXT_INDEX_MIN_BUCKETS;
+    index->numentries = 0;
+    index->last_added = NULL;
+    index->buckets = calloc(index->numbuckets, sizeof(ConnContext *));
+    if (!index->buckets) {
+	free(index);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    /* Index any contexts we already have */
+    for (c = us->context_root; c; c = c->next) {
+	context_index_insert(index, c);
+    }
+    us->context_index = index;
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Stop maintaining the context index for the given OtrlUserState, and
+ * free it.  The contexts themselves are unaffected. */
+void otrl_context_index_disable(OtrlUserState us)
+{
+    ConnContext *c;
+
+    if (!us || !us->context_index) return;
+
+    for (c = us->context_root; c; c = c->next) {
+	c->context_priv->index_next = NULL;
+    }
+    free(us->context_index->buckets);
+    free(us->context_index);
+    us->context_index = NULL;
+}
+
 /* Create a new connection context. */
 static ConnContext * new_context(const char * user, const char * accountname,
 	const char * protocol)
@@ -188,158 +369,480 @@ ConnContext * otrl_context_find_recent_instance(ConnContext * context,
     }
 }
 
+/* Add a child instance to its master's table of children, keeping the
+ * table sorted by instance tag. */
+static void children_add(ConnContext *m_context, ConnContext *child)
+{
+    ConnContextPriv *m_priv = m_context->context_priv;
+    unsigned int i;
+
+    if (m_priv->num_children == m_priv->children_size) {
+	unsigned int newsize = m_priv->children_size ?
+	    2 * m_priv->children_size : 4;
+	ConnContext **newchildren = realloc(m_priv->children,
+		newsize * sizeof(ConnContext *));
+	assert(newchildren != NULL);
+	m_priv->children = newchildren;
+	m_priv->children_size = newsize;
+    }
+
+    for (i = m_priv->num_children; i > 0 &&
+	    m_priv->children[i-1]->their_instance > child->their_instance;
+	    --i) {
+	m_priv->children[i] = m_priv->children[i-1];
+    }
+    m_priv->children[i] = child;
+    m_priv->num_children++;
+    m_priv->best_instance = NULL;
+}
+
+/* Remove a child instance from its master's table of children. */
+static void children_remove(ConnContext *m_context, ConnContext *child)
+{
+    ConnContextPriv *m_priv = m_context->context_priv;
+    unsigned int i;
+
+    for (i = 0; i < m_priv->num_children; ++i) {
+	if (m_priv->children[i] == child) {
+	    memmove(m_priv->children + i, m_priv->children + i + 1,
+		    (m_priv->num_children - i - 1) * sizeof(ConnContext *));
+	    m_priv->num_children--;
+	    break;
+	}
+    }
+    m_priv->best_instance = NULL;
+}
+
+/* Compare curp against cresult, the best instance found so far.  The
+ * trust of each has already been looked up.  Return 1 if curp should
+ * replace cresult. */
+static int secure_instance_improves(ConnContext *cresult,
+	int cresult_trusted, ConnContext *curp, int curp_trusted)
+{
+    int msgstate_improved = 0; /* 0 == same, 1 == improved   */
+    int trust_improved = 0;    /* (will immediately return 0 if worse
+				* than) */
+
+    if (cresult->msgstate == curp->msgstate) {
+	msgstate_improved = 0;
+    } else if (curp->msgstate == OTRL_MSGSTATE_ENCRYPTED ||
+	    (cresult->msgstate == OTRL_MSGSTATE_PLAINTEXT &&
+	    curp->msgstate == OTRL_MSGSTATE_FINISHED)) {
+	msgstate_improved = 1;
+    } else {
+	return 0;
+    }
+
+    if (cresult_trusted == curp_trusted) {
+	trust_improved = 0;
+    } else if (curp_trusted) {
+	trust_improved = 1;
+    } else {
+	return 0;
+    }
+
+    return (msgstate_improved || trust_improved ||
+	    curp->context_priv->lastrecv >= cresult->context_priv->lastrecv);
+}
+
+/* Make the given instance the cached best instance of the master
+ * context m_context, remembering what it was like when it was chosen. */
+static void best_instance_set(ConnContext *m_context, ConnContext *best,
+	int best_trusted)
+{
+    ConnContextPriv *m_priv = m_context->context_priv;
+
+    m_priv->best_instance = best;
+    m_priv->best_msgstate = best->msgstate;
+    m_priv->best_trusted = best_trusted;
+    m_priv->best_lastrecv = best->context_priv->lastrecv;
+}
+
 /* Find the instance of this context that has the best security level,
    and for which we have most recently received a message from. Note that most
    recent in this case is limited to a one-second resolution. */
 ConnContext * otrl_context_find_recent_secure_instance(ConnContext * context)
 {
-    ConnContext *curp; /* for iteration */
     ConnContext *m_context; /* master */
+    ConnContextPriv *m_priv;
     ConnContext *cresult = context;  /* best so far */
+    int cresult_trusted;
+    unsigned int i;
 
     if (!context) {
 	return cresult;
     }
 
     m_context = context->m_context;
+    m_priv = m_context->context_priv;
 
-    for (curp = m_context; curp && curp->m_context == m_context;
-	    curp = curp->next) {
-	int msgstate_improved = 0; /* 0 == same, 1 == improved   */
-	int trust_improved = 0;    /* (will immediately 'continue' if worse
-				    * than) */
-
-	if (cresult->msgstate == curp->msgstate) {
-	    msgstate_improved = 0;
-	} else if (curp->msgstate == OTRL_MSGSTATE_ENCRYPTED ||
-		(cresult->msgstate == OTRL_MSGSTATE_PLAINTEXT &&
-		curp->msgstate == OTRL_MSGSTATE_FINISHED)) {
-	    msgstate_improved = 1;
-	} else {
-	    continue;
+    /* Starting from the master, the answer only changes when one of
+     * the instances does, so we can use the cached one. */
+    if (context == m_context && m_priv->best_instance) {
+	return m_priv->best_instance;
+    }
+
+    cresult_trusted = otrl_context_is_fingerprint_trusted(
+	    cresult->active_fingerprint);
+
+    /* Look at the master and then each of its children, in list order */
+    for (i = 0; i <= m_priv->num_children; ++i) {
+	ConnContext *curp = i ? m_priv->children[i-1] : m_context;
+	int curp_trusted = otrl_context_is_fingerprint_trusted(
+		curp->active_fingerprint);
+
+	if (secure_instance_improves(cresult, cresult_trusted,
+		    curp, curp_trusted)) {
+	    cresult = curp;
+	    cresult_trusted = curp_trusted;
 	}
+    }
 
+    if (context == m_context) {
+	best_instance_set(m_context, cresult, cresult_trusted);
+    }
 
-	if (otrl_context_is_fingerprint_trusted(cresult->active_fingerprint) ==
-		otrl_context_is_fingerprint_trusted(curp->active_fingerprint)) {
+    return cresult;
+}
 
-	    trust_improved = 0;
-	} else if
-		(otrl_context_is_fingerprint_trusted(curp->active_fingerprint)){
+/* Note that something about this instance which affects the choice of
+ * the best instance of its master (its msgstate, the trust of its
+ * active fingerprint, or the time we last received a message) has
+ * changed, so that the cached answer to OTRL_INSTAG_BEST lookups is
+ * kept up to date.  If this is the cached instance, and it is no worse
+ * than it was, it is kept; otherwise all of them are looked at again
+ * on the next lookup.  libotr calls this itself; you only need to call
+ * it if you change those fields directly. */
+void otrl_context_best_instance_changed(ConnContext *context)
+{
+    ConnContext *m_context;
+    ConnContextPriv *m_priv;
+    ConnContext *best;
+    int trusted;
 
-	    trust_improved = 1;
+    if (!context || !context->m_context) return;
+    m_context = context->m_context;
+    m_priv = m_context->context_priv;
+    best = m_priv->best_instance;
+    if (!best) return;
+
+    trusted = otrl_context_is_fingerprint_trusted(
+	    context->active_fingerprint);
+
+    if (context == best) {
+	/* If it's no worse than when it was chosen, it still beats
+	 * everything it did then. */
+	OtrlMessageState was = m_priv->best_msgstate;
+	int msgstate_worse = context->msgstate != was &&
+	    (was == OTRL_MSGSTATE_ENCRYPTED ||
+	     context->msgstate == OTRL_MSGSTATE_PLAINTEXT);
+
+	if (msgstate_worse || trusted < m_priv->best_trusted ||
+		context->context_priv->lastrecv < m_priv->best_lastrecv) {
+	    m_priv->best_instance = NULL;
 	} else {
-	    continue;
+	    best_instance_set(m_context, context, trusted);
 	}
+    } else {
+	/* The choice is a walk over the instances in order, comparing
+	 * each with the best so far, and that comparison is not
+	 * transitive: an instance can lose to the cached one and still
+	 * beat whatever came before it.  So any other instance changing
+	 * means looking at them all again. */
+	m_priv->best_instance = NULL;
+    }
+}
 
-	if (msgstate_improved || trust_improved ||
-		(!msgstate_improved && !trust_improved &&
-		curp->context_priv->lastrecv >=
-		cresult->context_priv->lastrecv)) {
-	    cresult = curp;
+/* Forget the cached best instance of this context's master, for changes
+ * that may affect more than one instance at once. */
+static void best_instance_reset(ConnContext *context)
+{
+    if (context && context->m_context) {
+	context->m_context->context_priv->best_instance = NULL;
+    }
+}
+
+/* Given the context matching a lookup, return the one that was actually
+ * asked for, resolving meta-instances relative to it. */
+static ConnContext * resolve_instance(ConnContext *context,
+	otrl_instag_t their_instance)
+{
+    if (their_instance >= OTRL_MIN_VALID_INSTAG ||
+	    their_instance == OTRL_INSTAG_MASTER) {
+	return context;
+    }
+
+    /* We need to go back and check more values in the context */
+    switch(their_instance) {
+	case OTRL_INSTAG_BEST:
+	    return otrl_context_find_recent_secure_instance(context);
+	case OTRL_INSTAG_RECENT:
+	case OTRL_INSTAG_RECENT_RECEIVED:
+	case OTRL_INSTAG_RECENT_SENT:
+	    return otrl_context_find_recent_instance(context, their_instance);
+	default:
+	    return NULL;
+    }
+}
+
+static ConnContext * context_find(OtrlUserState us, const char *user,
+	const char *accountname, const char *protocol,
+	otrl_instag_t their_instance, int add_if_missing, int *addedp,
+	void (*add_app_data)(void *data, ConnContext *context), void *data);
+
+/* Add a new context at the place in the list given by curp, and fill
+ * it in. */
+static ConnContext * add_context(OtrlUserState us, ConnContext **curp,
+	const char *user, const char *accountname, const char *protocol,
+	otrl_instag_t their_instance,
+	void (*add_app_data)(void *data, ConnContext *context), void *data)
+{
+    ConnContext *newctx;
+    OtrlInsTag *our_instag;
+    OtrlUserState keyus;
+
+    /* A shard's instance tags are its base's */
+    keyus = us->keystate ? us->keystate : us;
+    otrl_uslock_shared_lock(keyus);
+    our_instag = (OtrlInsTag *)otrl_instag_find(keyus, accountname,
+	    protocol);
+    otrl_uslock_shared_unlock(keyus);
+
+    newctx = new_context(user, accountname, protocol);
+    newctx->context_priv->us = us;
+    newctx->next = *curp;
+    if (*curp) {
+	(*curp)->tous = &(newctx->next);
+    }
+    *curp = newctx;
+    newctx->tous = curp;
+    if (add_app_data) {
+	add_app_data(data, *curp);
+    }
+
+    /* Initialize specified instance tags */
+    if (our_instag) {
+	newctx->our_instance = our_instag->instag;
+    }
+
+    if (their_instance >= OTRL_MIN_VALID_INSTAG ||
+	    their_instance == OTRL_INSTAG_MASTER) {
+	newctx->their_instance = their_instance;
+    }
+
+    if (us->context_index) {
+	context_index_insert(us->context_index, newctx);
+    }
+
+    if (their_instance >= OTRL_MIN_VALID_INSTAG) {
+	newctx->m_context = context_find(us, user, accountname,
+	    protocol, OTRL_INSTAG_MASTER, 1, NULL, add_app_data, data);
+	if (newctx->m_context != newctx) {
+	    children_add(newctx->m_context, newctx);
 	}
     }
 
-    return cresult;
+    if (their_instance == OTRL_INSTAG_MASTER) {
+	/* if we're adding a master, there are no children, so the most
+	 * recent context is the one we add. */
+	newctx->recent_child = newctx;
+	newctx->recent_rcvd_child = newctx;
+	newctx->recent_sent_child = newctx;
+
+	/* If its userstate is locked, it needs a lock of its own */
+	if (us->uslock) {
+	    otrl_uslock_context_new(newctx);
+	}
+
+	/* Bring in its fingerprints, if they're waiting in a binary
+	 * store */
+	if (us->fpstore) {
+	    otrl_fpstore_load_context(us->fpstore, newctx);
+	}
+    }
+
+    return newctx;
 }
 
-/* Look up a connection context by name/account/protocol/instag from the given
- * OtrlUserState.  If add_if_missing is true, allocate and return a new
- * context if one does not currently exist.  In that event, call
- * add_app_data(data, context) so that app_data and app_data_free can be
- * filled in by the application, and set *addedp to 1.
- * In the 'their_instance' field note that you can also specify a 'meta-
- * instance' value such as OTRL_INSTAG_MASTER, OTRL_INSTAG_RECENT,
- * OTRL_INSTAG_RECENT_RECEIVED and OTRL_INSTAG_RECENT_SENT. */
-ConnContext * otrl_context_find(OtrlUserState us, const char *user,
+/* Compare the username, accountname and protocol of the given context
+ * with the given ones, in the order of the context list. */
+static int context_key_cmp(const ConnContext *context, const char *user,
+	const char *accountname, const char *protocol)
+{
+    int cmp;
+
+    if ((cmp = strcmp(context->username, user)) != 0) return cmp;
+    if ((cmp = strcmp(context->accountname, accountname)) != 0) return cmp;
+    return strcmp(context->protocol, protocol);
+}
+
+/* The body of otrl_context_find, without the locking. */
+static ConnContext * context_find(OtrlUserState us, const char *user,
 	const char *accountname, const char *protocol,
 	otrl_instag_t their_instance, int add_if_missing, int *addedp,
 	void (*add_app_data)(void *data, ConnContext *context), void *data)
 {
-    ConnContext ** curp;
+    ConnContext ** curp = NULL;
     int usercmp = 1, acctcmp = 1, protocmp = 1;
     if (addedp) *addedp = 0;
     if (!user || !accountname || !protocol) return NULL;
 
-    for (curp = &(us->context_root); *curp; curp = &((*curp)->next)) {
-	if ((usercmp = strcmp((*curp)->username, user)) > 0 ||
-		(usercmp == 0 &&
-		(acctcmp = strcmp((*curp)->accountname, accountname)) > 0) ||
-		(usercmp == 0 && acctcmp == 0 &&
-		(protocmp = strcmp((*curp)->protocol, protocol)) > 0) ||
-		(usercmp == 0 && acctcmp == 0 && protocmp == 0
-		&& (their_instance < OTRL_MIN_VALID_INSTAG ||
-		    ((*curp)->their_instance >= their_instance))))
-	    /* We're at the right place in the list.  We've either found
-	     * it, or gone too far. */
-	    break;
+    if (us->context_index) {
+	/* Meta-instances are resolved relative to the master context */
+	otrl_instag_t keyinstance = their_instance >= OTRL_MIN_VALID_INSTAG ?
+	    their_instance : OTRL_INSTAG_MASTER;
+	ConnContext *found = context_index_lookup(us->context_index, user,
+		accountname, protocol, keyinstance);
+
+	if (found) {
+	    return resolve_instance(found, their_instance);
+	}
+	if (!add_if_missing) return NULL;
+
+	/* If we're adding a child and already have its master, the
+	 * right place in the list is among the master's children, which
+	 * are sorted by instance tag. */
+	if (keyinstance != OTRL_INSTAG_MASTER) {
+	    ConnContext *m_context = context_index_lookup(us->context_index,
+		    user, accountname, protocol, OTRL_INSTAG_MASTER);
+	    if (m_context) {
+		for (curp = &(m_context->next); *curp &&
+			(*curp)->m_context == m_context &&
+			(*curp)->their_instance < their_instance;
+			curp = &((*curp)->next)) {}
+	    }
+	}
     }
 
-    if (usercmp == 0 && acctcmp == 0 && protocmp == 0 && *curp &&
-	    (their_instance < OTRL_MIN_VALID_INSTAG ||
-	    (their_instance == (*curp)->their_instance))) {
-	/* Found one! */
-	if (their_instance >= OTRL_MIN_VALID_INSTAG ||
-		their_instance == OTRL_INSTAG_MASTER) {
-	    return *curp;
+    if (!curp) {
+	/* Otherwise, we have to walk the list to find the right place.
+	 * If the last context we added comes before this one, as it does
+	 * when a sorted store is being read in, start from there. */
+	ConnContext *last = us->context_index ?
+	    us->context_index->last_added : NULL;
+
+	curp = last && context_key_cmp(last, user, accountname,
+		protocol) < 0 ? &(last->next) : &(us->context_root);
+	for (; *curp; curp = &((*curp)->next)) {
+	    if ((usercmp = strcmp((*curp)->username, user)) > 0 ||
+		    (usercmp == 0 &&
+		    (acctcmp = strcmp((*curp)->accountname, accountname)) > 0) ||
+		    (usercmp == 0 && acctcmp == 0 &&
+		    (protocmp = strcmp((*curp)->protocol, protocol)) > 0) ||
+		    (usercmp == 0 && acctcmp == 0 && protocmp == 0
+		    && (their_instance < OTRL_MIN_VALID_INSTAG ||
+			((*curp)->their_instance >= their_instance))))
+		/* We're at the right place in the list.  We've either found
+		 * it, or gone too far. */
+		break;
 	}
 
-	/* We need to go back and check more values in the context */
-	switch(their_instance) {
-	    case OTRL_INSTAG_BEST:
-		return otrl_context_find_recent_secure_instance(*curp);
-	    case OTRL_INSTAG_RECENT:
-	    case OTRL_INSTAG_RECENT_RECEIVED:
-	    case OTRL_INSTAG_RECENT_SENT:
-		return otrl_context_find_recent_instance(*curp, their_instance);
-	    default:
-		return NULL;
+	if (usercmp == 0 && acctcmp == 0 && protocmp == 0 && *curp &&
+		(their_instance < OTRL_MIN_VALID_INSTAG ||
+		(their_instance == (*curp)->their_instance))) {
+	    /* Found one! */
+	    return resolve_instance(*curp, their_instance);
 	}
     }
 
     if (add_if_missing) {
 	ConnContext *newctx;
-	OtrlInsTag *our_instag = (OtrlInsTag *)otrl_instag_find(us, accountname,
-		protocol);
 
 	if (addedp) *addedp = 1;
-	newctx = new_context(user, accountname, protocol);
-	newctx->next = *curp;
-	if (*curp) {
-	    (*curp)->tous = &(newctx->next);
-	}
-	*curp = newctx;
-	newctx->tous = curp;
-	if (add_app_data) {
-	    add_app_data(data, *curp);
+	newctx = add_context(us, curp, user, accountname, protocol,
+		their_instance, add_app_data, data);
+	if (us->context_index) {
+	    us->context_index->last_added = newctx;
 	}
+	return newctx;
+    }
+    return NULL;
+}
 
-	/* Initialize specified instance tags */
-	if (our_instag) {
-	    newctx->our_instance = our_instag->instag;
-	}
+/* Look up a connection context by name/account/protocol/instag from the given
+ * OtrlUserState.  If add_if_missing is true, allocate and return a new
+ * context if one does not currently exist.  In that event, call
+ * add_app_data(data, context) so that app_data and app_data_free can be
+ * filled in by the application, and set *addedp to 1.
+ * In the 'their_instance' field note that you can also specify a 'meta-
+ * instance' value such as OTRL_INSTAG_MASTER, OTRL_INSTAG_RECENT,
+ * OTRL_INSTAG_RECENT_RECEIVED and OTRL_INSTAG_RECENT_SENT.
+ * If the OtrlUserState is locked (see uslock.h), and you are resolving
+ * a meta-instance or adding a child instance, hold the lock of the
+ * master context while you do so. */
+ConnContext * otrl_context_find(OtrlUserState us, const char *user,
+	const char *accountname, const char *protocol,
+	otrl_instag_t their_instance, int add_if_missing, int *addedp,
+	void (*add_app_data)(void *data, ConnContext *context), void *data)
+{
+    ConnContext *context;
 
-	if (their_instance >= OTRL_MIN_VALID_INSTAG ||
-		their_instance == OTRL_INSTAG_MASTER) {
-	    newctx->their_instance = their_instance;
-	}
+    if (!us->uslock) {
+	return context_find(us, user, accountname, protocol,
+		their_instance, add_if_missing, addedp, add_app_data, data);
+    }
 
-	if (their_instance >= OTRL_MIN_VALID_INSTAG) {
-	    newctx->m_context = otrl_context_find(us, user, accountname,
-		protocol, OTRL_INSTAG_MASTER, 1, NULL, add_app_data, data);
-	}
+    /* Most lookups find what they're looking for, so try that first
+     * with only the read lock held */
+    otrl_uslock_contexts_read(us);
+    context = context_find(us, user, accountname, protocol,
+	    their_instance, 0, addedp, NULL, NULL);
+    otrl_uslock_contexts_done(us);
+    if (context || !add_if_missing) return context;
+
+    /* Another thread may have added it in the meantime, so look again
+     * once we have the write lock */
+    otrl_uslock_contexts_write(us);
+    context = context_find(us, user, accountname, protocol,
+	    their_instance, 1, addedp, add_app_data, data);
+    otrl_uslock_contexts_done(us);
+    return context;
+}
 
-	if (their_instance == OTRL_INSTAG_MASTER) {
-	    /* if we're adding a master, there are no children, so the most
-	     * recent context is the one we add. */
-	    newctx->recent_child = newctx;
-	    newctx->recent_rcvd_child = newctx;
-	    newctx->recent_sent_child = newctx;
-	}
+/* Find the master context for the given username, accountname and
+ * protocol, adding it if it is not present.  The search starts at
+ * *cursorp (or at the start of the context list, if *cursorp is NULL),
+ * and *cursorp is left pointing just after the context found, so that a
+ * series of calls made in increasing order of (username, accountname,
+ * protocol) walks the context list only once.  If a context is added,
+ * call add_app_data(data, context) and set *addedp to 1. */
+ConnContext * otrl_context_find_master_sorted(OtrlUserState us,
+	ConnContext ***cursorp, const char *user, const char *accountname,
+	const char *protocol, int *addedp,
+	void (*add_app_data)(void *data, ConnContext *context), void *data)
+{
+    ConnContext **curp;
+    ConnContext *context;
+    int usercmp = 1, acctcmp = 1, protocmp = 1;
+    if (addedp) *addedp = 0;
+    if (!user || !accountname || !protocol) return NULL;
+
+    curp = *cursorp ? *cursorp : &(us->context_root);
+    for (; *curp; curp = &((*curp)->next)) {
+	if ((usercmp = strcmp((*curp)->username, user)) > 0 ||
+		(usercmp == 0 &&
+		(acctcmp = strcmp((*curp)->accountname, accountname)) > 0) ||
+		(usercmp == 0 && acctcmp == 0 &&
+		(protocmp = strcmp((*curp)->protocol, protocol)) >= 0))
+	    break;
+    }
 
-	return *curp;
+    if (usercmp == 0 && acctcmp == 0 && protocmp == 0 && *curp) {
+	context = *curp;
+	if (context->their_instance != OTRL_INSTAG_MASTER) {
+	    /* Not where we expected the master to be; do it the slow
+	     * way. */
+	    context = context_find(us, user, accountname, protocol,
+		    OTRL_INSTAG_MASTER, 1, addedp, add_app_data, data);
+	}
+    } else {
+	if (addedp) *addedp = 1;
+	context = add_context(us, curp, user, accountname, protocol,
+		OTRL_INSTAG_MASTER, add_app_data, data);
     }
-    return NULL;
+
+    *cursorp = &(context->next);
+    return context;
 }
 
 /* Return true iff the given fingerprint is marked as trusted. */
@@ -363,22 +866,117 @@ void otrl_context_update_recent_child(ConnContext *context,
 
 }
 
+/* Once a master context has this many fingerprints, we start keeping a
+ * hash table of them. */
+#define FINGERPRINT_TABLE_THRESHOLD 16
+
+/* The smallest fingerprint table we'll make.  Tables are kept at most
+ * half full. */
+#define FINGERPRINT_TABLE_MIN_SIZE 64
+
+/* The slot in a fingerprint table of the given size at which to start
+ * looking for the given fingerprint. */
+static unsigned int fingerprint_slot(const unsigned char fingerprint[20],
+	unsigned int size)
+{
+    return otrl_hash_data(OTRL_HASH_INIT, fingerprint, 20) & (size - 1);
+}
+
+/* Put a Fingerprint into the fingerprint table, which must have room
+ * for it. */
+static void fingerprint_table_insert(ConnContextPriv *priv, Fingerprint *f)
+{
+    unsigned int mask = priv->fingerprint_table_size - 1;
+    unsigned int i = fingerprint_slot(f->fingerprint,
+	    priv->fingerprint_table_size);
+
+    while (priv->fingerprint_table[i]) {
+	i = (i + 1) & mask;
+    }
+    priv->fingerprint_table[i] = f;
+}
+
+/* Take a Fingerprint out of the fingerprint table, moving back any
+ * entries after it that would otherwise become unreachable. */
+static void fingerprint_table_remove(ConnContextPriv *priv, Fingerprint *f)
+{
+    Fingerprint **table = priv->fingerprint_table;
+    unsigned int mask = priv->fingerprint_table_size - 1;
+    unsigned int i = fingerprint_slot(f->fingerprint,
+	    priv->fingerprint_table_size);
+    unsigned int j;
+
+    while (table[i] && table[i] != f) {
+	i = (i + 1) & mask;
+    }
+    if (!table[i]) return;
+    table[i] = NULL;
+
+    for (j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
+	unsigned int home = fingerprint_slot(table[j]->fingerprint,
+		priv->fingerprint_table_size);
+
+	/* Can table[j] be moved to the hole at i?  Only if its home slot
+	 * is not (cyclically) in (i, j]. */
+	if ((j > i && (home <= i || home > j)) ||
+		(j < i && (home <= i && home > j))) {
+	    table[i] = table[j];
+	    table[j] = NULL;
+	    i = j;
+	}
+    }
+}
+
+/* (Re)build the fingerprint table of the given master context with the
+ * given number of slots (a power of 2).  If we run out of memory, just
+ * drop the table; lookups will fall back to walking the list. */
+static void fingerprint_table_rebuild(ConnContext *context, unsigned int size)
+{
+    ConnContextPriv *priv = context->context_priv;
+    Fingerprint *f;
+
+    free(priv->fingerprint_table);
+    priv->fingerprint_table = calloc(size, sizeof(Fingerprint *));
+    if (!priv->fingerprint_table) {
+	priv->fingerprint_table_size = 0;
+	return;
+    }
+    priv->fingerprint_table_size = size;
+
+    for (f = context->fingerprint_root.next; f; f = f->next) {
+	fingerprint_table_insert(priv, f);
+    }
+}
+
 /* Find a fingerprint in a given context, perhaps adding it if not
  * present. */
 Fingerprint *otrl_context_find_fingerprint(ConnContext *context,
 	unsigned char fingerprint[20], int add_if_missing, int *addedp)
 {
     Fingerprint *f;
+    ConnContextPriv *priv;
     if (addedp) *addedp = 0;
 
     if (!context || !context->m_context) return NULL;
 
     context = context->m_context;
+    priv = context->context_priv;
 
-    f = context->fingerprint_root.next;
-    while(f) {
-	if (!memcmp(f->fingerprint, fingerprint, 20)) return f;
-	f = f->next;
+    if (priv->fingerprint_table) {
+	unsigned int mask = priv->fingerprint_table_size - 1;
+	unsigned int i = fingerprint_slot(fingerprint,
+		priv->fingerprint_table_size);
+
+	while ((f = priv->fingerprint_table[i]) != NULL) {
+	    if (!memcmp(f->fingerprint, fingerprint, 20)) return f;
+	    i = (i + 1) & mask;
+	}
+    } else {
+	f = context->fingerprint_root.next;
+	while(f) {
+	    if (!memcmp(f->fingerprint, fingerprint, 20)) return f;
+	    f = f->next;
+	}
     }
 
     /* Didn't find it. */
@@ -397,6 +995,20 @@ Fingerprint *otrl_context_find_fingerprint(ConnContext *context,
 	}
 	context->fingerprint_root.next = f;
 	f->tous = &(context->fingerprint_root.next);
+	otrl_fpjournal_log(f, OTRL_FPJOURNAL_ADD);
+
+	priv->num_fingerprints++;
+	if (priv->fingerprint_table &&
+		2 * priv->num_fingerprints <= priv->fingerprint_table_size) {
+	    fingerprint_table_insert(priv, f);
+	} else if (priv->fingerprint_table) {
+	    fingerprint_table_rebuild(context,
+		    2 * priv->fingerprint_table_size);
+	} else if (priv->num_fingerprints >= FINGERPRINT_TABLE_THRESHOLD) {
+	    unsigned int size = FINGERPRINT_TABLE_MIN_SIZE;
+	    while (size < 2 * priv->num_fingerprints) size *= 2;
+	    fingerprint_table_rebuild(context, size);
+	}
 	return f;
     }
     return NULL;
@@ -409,11 +1021,15 @@ void otrl_context_set_trust(Fingerprint *fprint, const char *trust)
 
     free(fprint->trust);
     fprint->trust = trust ? strdup(trust) : NULL;
+    otrl_fpjournal_log(fprint, OTRL_FPJOURNAL_TRUST);
+    /* Any of the instances may have this as its active fingerprint */
+    best_instance_reset(fprint->context);
 }
 
 /* Force a context into the OTRL_MSGSTATE_FINISHED state. */
 void otrl_context_force_finished(ConnContext *context)
 {
+    otrl_akepool_cancel(context);
     context->msgstate = OTRL_MSGSTATE_FINISHED;
     otrl_auth_clear(&(context->auth));
     context->active_fingerprint = NULL;
@@ -422,6 +1038,7 @@ void otrl_context_force_finished(ConnContext *context)
     context->protocol_version = 0;
     otrl_sm_state_free(context->smstate);
     otrl_context_priv_force_finished(context->context_priv);
+    otrl_context_best_instance_changed(context);
 }
 
 /* Force a context into the OTRL_MSGSTATE_PLAINTEXT state. */
@@ -432,6 +1049,27 @@ void otrl_context_force_plaintext(ConnContext *context)
 
     /* And just set the state properly */
     context->msgstate = OTRL_MSGSTATE_PLAINTEXT;
+    otrl_context_best_instance_changed(context);
+}
+
+/* Take a fingerprint out of its context and free it, without
+ * journaling anything. */
+static void fingerprint_free(Fingerprint *fprint)
+{
+    ConnContext *context = fprint->context;
+
+    if (context->context_priv->fingerprint_table) {
+	fingerprint_table_remove(context->context_priv, fprint);
+    }
+    context->context_priv->num_fingerprints--;
+    free(fprint->fingerprint);
+    free(fprint->trust);
+    *(fprint->tous) = fprint->next;
+    if (fprint->next) {
+	fprint->next->tous = fprint->tous;
+    }
+    free(fprint);
+    best_instance_reset(context);
 }
 
 /* Forget a fingerprint (so long as it's not the active one.  If it's a
@@ -452,13 +1090,8 @@ void otrl_context_forget_fingerprint(Fingerprint *fprint,
 	if (context->msgstate != OTRL_MSGSTATE_PLAINTEXT ||
 		context->active_fingerprint != fprint) {
 
-	    free(fprint->fingerprint);
-	    free(fprint->trust);
-	    *(fprint->tous) = fprint->next;
-	    if (fprint->next) {
-		fprint->next->tous = fprint->tous;
-	    }
-	    free(fprint);
+	    otrl_fpjournal_log(fprint, OTRL_FPJOURNAL_FORGET);
+	    fingerprint_free(fprint);
 	    if (context->msgstate == OTRL_MSGSTATE_PLAINTEXT &&
 		    context->fingerprint_root.next == NULL &&
 		    and_maybe_context) {
@@ -470,11 +1103,11 @@ void otrl_context_forget_fingerprint(Fingerprint *fprint,
     }
 }
 
-/* Forget a whole context, so long as it's PLAINTEXT. If a context has child
- * instances, don't remove this instance unless children are also all in
- * PLAINTEXT state. In this case, the children will also be removed.
- * Returns 0 on success, 1 on failure. */
-int otrl_context_forget(ConnContext *context)
+/* The body of otrl_context_forget, without the locking.  If
+ * logforget is set, forgetting the context's fingerprints is
+ * journaled; it isn't when the contexts are just being let go of, as
+ * by otrl_context_forget_all. */
+static int context_forget(ConnContext *context, int logforget)
 {
     if (context->msgstate != OTRL_MSGSTATE_PLAINTEXT) return 1;
 
@@ -489,7 +1122,7 @@ int otrl_context_forget(ConnContext *context)
 
 	c_iter = context->next;
 	while (c_iter && c_iter->m_context == context->m_context) {
-	    if (!otrl_context_forget(c_iter)) {
+	    if (!context_forget(c_iter, logforget)) {
 		c_iter = context->next;
 	    } else {
 		return 1;
@@ -504,9 +1137,42 @@ int otrl_context_forget(ConnContext *context)
 
     /* First free all the Fingerprints */
     while(context->fingerprint_root.next) {
-	otrl_context_forget_fingerprint(context->fingerprint_root.next, 0);
+	if (logforget) {
+	    otrl_fpjournal_log(context->fingerprint_root.next,
+		    OTRL_FPJOURNAL_FORGET);
+	}
+	fingerprint_free(context->fingerprint_root.next);
+    }
+    /* Let go of any AKE job it's holding messages for */
+    otrl_akepool_forget(context);
+
+    /* It no longer needs polling */
+    otrl_deadline_cancel(context);
+
+    /* Take it out of the index while we still have its key */
+    if (context->context_priv->us &&
+	    context->context_priv->us->context_index) {
+	context_index_remove(context->context_priv->us->context_index,
+		context);
+    }
+    /* Take it out of its master's table of children, or if it is the
+     * master, free the (now empty) table */
+    if (context->m_context != context) {
+	children_remove(context->m_context, context);
+    } else {
+	free(context->context_priv->children);
+	context->context_priv->children = NULL;
+	context->context_priv->num_children = 0;
+	context->context_priv->children_size = 0;
+	free(context->context_priv->fingerprint_table);
+	context->context_priv->fingerprint_table = NULL;
+	context->context_priv->fingerprint_table_size = 0;
+	otrl_uslock_context_free(context);
     }
+
     /* Now free all the dynamic info here */
+    free(context->context_priv->recv_scratch);
+    context->context_priv->recv_scratch = NULL;
     free(context->username);
     free(context->accountname);
     free(context->protocol);
@@ -532,7 +1198,33 @@ int otrl_context_forget(ConnContext *context)
     return 0;
 }
 
-/* Forget all the contexts in a given OtrlUserState. */
+/* context_forget, holding the userstate's lock on its contexts if it
+ * has one */
+static int context_forget_locked(ConnContext *context, int logforget)
+{
+    OtrlUserState us = context->context_priv->us;
+    int res;
+
+    if (!us || !us->uslock) return context_forget(context, logforget);
+
+    otrl_uslock_contexts_write(us);
+    res = context_forget(context, logforget);
+    otrl_uslock_contexts_done(us);
+    return res;
+}
+
+/* Forget a whole context, so long as it's PLAINTEXT. If a context has child
+ * instances, don't remove this instance unless children are also all in
+ * PLAINTEXT state. In this case, the children will also be removed.
+ * Returns 0 on success, 1 on failure. */
+int otrl_context_forget(ConnContext *context)
+{
+    return context_forget_locked(context, 1);
+}
+
+/* Forget all the contexts in a given OtrlUserState.  This only lets go
+ * of them in memory: their fingerprints are not journaled as
+ * forgotten. */
 void otrl_context_forget_all(OtrlUserState us)
 {
     ConnContext *c_iter;
@@ -542,6 +1234,6 @@ void otrl_context_forget_all(OtrlUserState us)
     }
 
     while (us->context_root) {
-	otrl_context_forget(us->context_root);
+	context_forget_locked(us->context_root, 0);
     }
 }
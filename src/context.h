@@ -142,6 +142,18 @@ ConnContext * otrl_context_find(OtrlUserState us, const char *user,
 	otrl_instag_t their_instance, int add_if_missing, int *addedp,
 	void (*add_app_data)(void *data, ConnContext *context), void *data);
 
+/* Find the master context for the given username, accountname and
+ * protocol, adding it if it is not present.  The search starts at
+ * *cursorp (or at the start of the context list, if *cursorp is NULL),
+ * and *cursorp is left pointing just after the context found, so that a
+ * series of calls made in increasing order of (username, accountname,
+ * protocol) walks the context list only once.  If a context is added,
+ * call add_app_data(data, context) and set *addedp to 1. */
+ConnContext * otrl_context_find_master_sorted(OtrlUserState us,
+	ConnContext ***cursorp, const char *user, const char *accountname,
+	const char *protocol, int *addedp,
+	void (*add_app_data)(void *data, ConnContext *context), void *data);
+
 /* Return true iff the given fingerprint is marked as trusted. */
 int otrl_context_is_fingerprint_trusted(Fingerprint *fprint);
 
@@ -178,7 +190,9 @@ void otrl_context_forget_fingerprint(Fingerprint *fprint,
  * Returns 0 on success, 1 on failure. */
 int otrl_context_forget(ConnContext *context);
 
-/* Forget all the contexts in a given OtrlUserState. */
+/* Forget all the contexts in a given OtrlUserState.  This only lets go
+ * of them in memory: their fingerprints are not journaled as
+ * forgotten. */
 void otrl_context_forget_all(OtrlUserState us);
 
 /* Find requested recent instance */
@@ -190,4 +204,31 @@ ConnContext * otrl_context_find_recent_instance(ConnContext * context,
  * in this case is limited to a one-second resolution. */
 ConnContext * otrl_context_find_recent_secure_instance(ConnContext * context);
 
+/* Note that something about this instance which affects the choice of
+ * the best instance of its master (its msgstate, the trust of its
+ * active fingerprint, or the time we last received a message) has
+ * changed, so that the cached answer to OTRL_INSTAG_BEST lookups is
+ * kept up to date.  The cached answer survives only if this is it,
+ * and it has not got worse; otherwise all of the instances are looked
+ * at again on the next lookup.  libotr calls this itself; you only need to call it if you
+ * change those fields directly.  (To change the trust of a fingerprint,
+ * which any of the instances may be using, use otrl_context_set_trust.) */
+void otrl_context_best_instance_changed(ConnContext *context);
+
+/* Start maintaining a hash index over the contexts in the given
+ * OtrlUserState, keyed on username, accountname, protocol and instance
+ * tag.  With the index in place, otrl_context_find no longer walks the
+ * whole context list to look up a context, which matters if you have a
+ * very large number of contexts.  The list at us->context_root is kept
+ * exactly as before, so you can still iterate over it.  Adding a new
+ * context still has to find its place in that sorted list: that is
+ * quick when contexts are added in sorted order (as when reading back a
+ * store libotr wrote), but otherwise can mean walking much of the list.
+ * Calling this more than once is harmless. */
+gcry_error_t otrl_context_index_enable(OtrlUserState us);
+
+/* Stop maintaining the context index for the given OtrlUserState, and
+ * free it.  The contexts themselves are unaffected. */
+void otrl_context_index_disable(OtrlUserState us);
+
 #endif
@@ -27,6 +27,7 @@
 
 /* libotr headers */
 #include "context_priv.h"
+#include "fragment.h"
 
 /* Create a new private connection context */
 ConnContextPriv *otrl_context_priv_new()
@@ -35,10 +36,25 @@ ConnContextPriv *otrl_context_priv_new()
 	context_priv = malloc(sizeof(*context_priv));
 	assert(context_priv != NULL);
 
-	context_priv->fragment = NULL;
-	context_priv->fragment_len = 0;
-	context_priv->fragment_n = 0;
-	context_priv->fragment_k = 0;
+	context_priv->us = NULL;
+	context_priv->index_next = NULL;
+	context_priv->index_hash = 0;
+	context_priv->children = NULL;
+	context_priv->num_children = 0;
+	context_priv->children_size = 0;
+	context_priv->best_instance = NULL;
+	context_priv->best_msgstate = OTRL_MSGSTATE_PLAINTEXT;
+	context_priv->best_trusted = 0;
+	context_priv->best_lastrecv = 0;
+	context_priv->num_fingerprints = 0;
+	context_priv->fingerprint_table = NULL;
+	context_priv->fingerprint_table_size = 0;
+	context_priv->fragment_slots = NULL;
+	context_priv->num_fragment_slots = 0;
+	context_priv->fragment_bytes = 0;
+	context_priv->ake_job = NULL;
+	context_priv->lock = NULL;
+	context_priv->deadline_slot = 0;
 	context_priv->numsavedkeys = 0;
 	context_priv->saved_mac_keys = NULL;
 	context_priv->generation = 0;
@@ -46,6 +62,7 @@ ConnContextPriv *otrl_context_priv_new()
 	context_priv->lastmessage = NULL;
 	context_priv->lastrecv = 0;
 	context_priv->may_retransmit = 0;
+	context_priv->recv_scratch = NULL;
 	context_priv->their_keyid = 0;
 	context_priv->their_y = NULL;
 	context_priv->their_old_y = NULL;
@@ -56,6 +73,9 @@ ConnContextPriv *otrl_context_priv_new()
 	context_priv->our_old_dh_key.groupid = 0;
 	context_priv->our_old_dh_key.priv = NULL;
 	context_priv->our_old_dh_key.pub = NULL;
+	context_priv->our_dh_pub_serialized_from = NULL;
+	context_priv->our_dh_pub_serialized = NULL;
+	context_priv->our_dh_pub_serialized_len = 0;
 	otrl_dh_session_blank(&(context_priv->sesskeys[0][0]));
 	otrl_dh_session_blank(&(context_priv->sesskeys[0][1]));
 	otrl_dh_session_blank(&(context_priv->sesskeys[1][0]));
@@ -69,11 +89,7 @@ ConnContextPriv *otrl_context_priv_new()
  */
 void otrl_context_priv_force_finished(ConnContextPriv *context_priv)
 {
-	free(context_priv->fragment);
-	context_priv->fragment = NULL;
-	context_priv->fragment_len = 0;
-	context_priv->fragment_n = 0;
-	context_priv->fragment_k = 0;
+	otrl_fragment_forget_all(context_priv);
 	context_priv->numsavedkeys = 0;
 	free(context_priv->saved_mac_keys);
 	context_priv->saved_mac_keys = NULL;
@@ -88,6 +104,11 @@ void otrl_context_priv_force_finished(ConnContextPriv *context_priv)
 	context_priv->our_keyid = 0;
 	otrl_dh_keypair_free(&(context_priv->our_dh_key));
 	otrl_dh_keypair_free(&(context_priv->our_old_dh_key));
+	gcry_mpi_release(context_priv->our_dh_pub_serialized_from);
+	context_priv->our_dh_pub_serialized_from = NULL;
+	gcry_free(context_priv->our_dh_pub_serialized);
+	context_priv->our_dh_pub_serialized = NULL;
+	context_priv->our_dh_pub_serialized_len = 0;
 	otrl_dh_session_free(&(context_priv->sesskeys[0][0]));
 	otrl_dh_session_free(&(context_priv->sesskeys[0][1]));
 	otrl_dh_session_free(&(context_priv->sesskeys[1][0]));
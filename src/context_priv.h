@@ -27,18 +27,71 @@
 #include "auth.h"
 #include "sm.h"
 
-typedef struct context_priv {
-	/* The part of the fragmented message we've seen so far */
-	char *fragment;
-
-	/* The length of fragment */
-	size_t fragment_len;
-
-	/* The total number of fragments in this message */
-	unsigned short fragment_n;
+struct context;
+struct s_fingerprint;
+struct s_OtrlUserState;
+
+/* The size of each context's buffer for decrypting received Data
+ * Messages.  Larger messages are decrypted in a buffer of their own.
+ * The buffer is allocated when the context receives its first Data
+ * Message and kept until the context is forgotten, so each context
+ * that has been in a conversation costs this much more memory.  What
+ * it saves is the buffers for the decoded message and its plaintext;
+ * a plaintext that is shown to the user is still copied out of it. */
+#define OTRL_RECV_SCRATCH_BYTES 4096
 
-	/* The highest fragment number we've seen so far for this message */
-	unsigned short fragment_k;
+typedef struct context_priv {
+	/* The OtrlUserState this context belongs to */
+	struct s_OtrlUserState *us;
+
+	/* The next context in the same bucket of the userstate's context
+	 * index (if it has one), and our hash value in that index */
+	struct context *index_next;
+	unsigned int index_hash;
+
+	/* For a master context, its child instances, sorted by instance
+	 * tag (the same order they appear in the context list) */
+	struct context **children;
+	unsigned int num_children;
+	unsigned int children_size;
+
+	/* For a master context, the cached answer to an OTRL_INSTAG_BEST
+	 * lookup, or NULL if it needs to be recomputed, and the msgstate,
+	 * trust and time of last received message it had when it was
+	 * chosen */
+	struct context *best_instance;
+	int best_msgstate;
+	int best_trusted;
+	time_t best_lastrecv;
+
+	/* For a master context, the number of Fingerprints in its
+	 * fingerprint list, and once there are enough of them to make it
+	 * worthwhile, an open-addressing table of them keyed on the
+	 * fingerprint itself (NULL until then) */
+	unsigned int num_fingerprints;
+	struct s_fingerprint **fingerprint_table;
+	unsigned int fingerprint_table_size;
+
+	/* The messages we've seen some but not all of the fragments of,
+	 * most recently heard from first */
+	struct s_OtrlFragmentSlot *fragment_slots;
+	unsigned int num_fragment_slots;
+
+	/* The memory held by those messages */
+	size_t fragment_bytes;
+
+	/* For a master context, the job in the userstate's AKE pool
+	 * working on an AKE message for it or one of its children, or
+	 * NULL if there isn't one */
+	struct s_OtrlAKEJob *ake_job;
+
+	/* For a master context, the lock over it and its children, or
+	 * NULL if its userstate isn't locked */
+	struct s_OtrlUSLockContext *lock;
+
+	/* One more than our position in the userstate's heap of
+	 * deadlines (see deadline.h), or 0 if we're not in it */
+	unsigned int deadline_slot;
 
 	/* current keyid used by other side; this is set to 0 if we get
 	 * a OTRL_TLV_DISCONNECTED message from them. */
@@ -59,6 +112,13 @@ typedef struct context_priv {
 	/* DH key[our_keyid-1] */
 	DH_keypair our_old_dh_key;
 
+	/* The public half of our_dh_key as it appears in a Data Message,
+	 * and a copy of the key it was made from, so that it is only
+	 * serialized again when the key changes */
+	gcry_mpi_t our_dh_pub_serialized_from;
+	unsigned char *our_dh_pub_serialized;
+	size_t our_dh_pub_serialized_len;
+
 	/* sesskeys[i][j] are the session keys derived from DH
 	 * key[our_keyid-i] and mpi Y[their_keyid-j] */
 	DH_sesskeys sesskeys[2][2];
@@ -83,6 +143,10 @@ typedef struct context_priv {
 	/* Is the last message eligible for retransmission? */
 	int may_retransmit;
 
+	/* Where Data Messages of up to OTRL_RECV_SCRATCH_BYTES (decoded)
+	 * are decrypted as they are received, or NULL until the first */
+	unsigned char *recv_scratch;
+
 } ConnContextPriv;
 
 /* Create a new private connection context. */
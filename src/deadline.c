@@ -0,0 +1,213 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdlib.h>
+
+/* libotr headers */
+#include "deadline.h"
+#include "context_priv.h"
+#include "uslock.h"
+
+#define DEADLINES_MIN_SIZE 16
+
+typedef struct {
+    time_t when;
+    ConnContext *context;
+} DeadlineEntry;
+
+struct s_OtrlDeadlines {
+    DeadlineEntry *heap;         /* heap[0] is due first */
+    unsigned int num;
+    unsigned int size;
+};
+
+/* Put entry e at position i of the heap, and note where it is in its
+ * context. */
+static void heap_set(OtrlDeadlines *d, unsigned int i, DeadlineEntry e)
+{
+    d->heap[i] = e;
+    e.context->context_priv->deadline_slot = i + 1;
+}
+
+/* Move the entry at position i towards the top of the heap until it
+ * is no earlier than its parent. */
+static void heap_up(OtrlDeadlines *d, unsigned int i)
+{
+    DeadlineEntry e = d->heap[i];
+
+    while (i > 0) {
+	unsigned int parent = (i - 1) / 2;
+	if (d->heap[parent].when <= e.when) break;
+	heap_set(d, i, d->heap[parent]);
+	i = parent;
+    }
+    heap_set(d, i, e);
+}
+
+/* Move the entry at position i towards the bottom of the heap until it
+ * is no later than its children. */
+static void heap_down(OtrlDeadlines *d, unsigned int i)
+{
+    DeadlineEntry e = d->heap[i];
+
+    for (;;) {
+	unsigned int child = 2 * i + 1;
+	if (child >= d->num) break;
+	if (child + 1 < d->num &&
+		d->heap[child + 1].when < d->heap[child].when) {
+	    child++;
+	}
+	if (e.when <= d->heap[child].when) break;
+	heap_set(d, i, d->heap[child]);
+	i = child;
+    }
+    heap_set(d, i, e);
+}
+
+/* Take the entry at position i out of the heap. */
+static void heap_remove(OtrlDeadlines *d, unsigned int i)
+{
+    d->heap[i].context->context_priv->deadline_slot = 0;
+    if (--d->num == i) return;
+
+    heap_set(d, i, d->heap[d->num]);
+    if (i > 0 && d->heap[i].when < d->heap[(i - 1) / 2].when) {
+	heap_up(d, i);
+    } else {
+	heap_down(d, i);
+    }
+}
+
+/* Make sure the given context is looked at by otrl_message_poll no
+ * later than when.  If it is already due at or before then, nothing
+ * changes. */
+void otrl_deadline_schedule(ConnContext *context, time_t when)
+{
+    OtrlUserState us = context->context_priv->us;
+    OtrlDeadlines *d;
+    unsigned int slot;
+
+    if (!us) return;
+
+    otrl_uslock_shared_lock(us);
+    d = us->deadlines;
+    if (!d) {
+	d = calloc(1, sizeof(*d));
+	if (!d) goto done;
+	us->deadlines = d;
+    }
+
+    slot = context->context_priv->deadline_slot;
+    if (slot) {
+	/* Already in the heap; only ever make it earlier */
+	if (d->heap[slot - 1].when > when) {
+	    d->heap[slot - 1].when = when;
+	    heap_up(d, slot - 1);
+	}
+	goto done;
+    }
+
+    if (d->num == d->size) {
+	unsigned int newsize = d->size ? 2 * d->size : DEADLINES_MIN_SIZE;
+	DeadlineEntry *newheap = realloc(d->heap,
+		newsize * sizeof(DeadlineEntry));
+	/* If we can't grow it, the context just won't be polled until
+	 * something else schedules it */
+	if (!newheap) goto done;
+	d->heap = newheap;
+	d->size = newsize;
+    }
+    d->heap[d->num].when = when;
+    d->heap[d->num].context = context;
+    heap_up(d, d->num++);
+
+done:
+    otrl_uslock_shared_unlock(us);
+}
+
+/* Remove the given context's entry, if it has one, as when it is about
+ * to be freed. */
+void otrl_deadline_cancel(ConnContext *context)
+{
+    OtrlUserState us = context->context_priv->us;
+    unsigned int slot;
+
+    if (!us) return;
+
+    otrl_uslock_shared_lock(us);
+    slot = context->context_priv->deadline_slot;
+    if (slot) {
+	heap_remove(us->deadlines, slot - 1);
+    }
+    otrl_uslock_shared_unlock(us);
+}
+
+/* Remove and return a context of the given OtrlUserState that is due
+ * at or before now, or return NULL if there isn't one. */
+ConnContext *otrl_deadline_take(OtrlUserState us, time_t now)
+{
+    OtrlDeadlines *d;
+    ConnContext *context = NULL;
+
+    otrl_uslock_shared_lock(us);
+    d = us->deadlines;
+    if (d && d->num > 0 && d->heap[0].when <= now) {
+	context = d->heap[0].context;
+	heap_remove(d, 0);
+    }
+    otrl_uslock_shared_unlock(us);
+
+    return context;
+}
+
+/* Return the earliest time any context of the given OtrlUserState is
+ * due, or 0 if none is. */
+time_t otrl_deadline_next(OtrlUserState us)
+{
+    OtrlDeadlines *d;
+    time_t when = 0;
+
+    otrl_uslock_shared_lock(us);
+    d = us->deadlines;
+    if (d && d->num > 0) {
+	when = d->heap[0].when;
+    }
+    otrl_uslock_shared_unlock(us);
+
+    return when;
+}
+
+/* Free the heap of the given OtrlUserState. */
+void otrl_deadline_free(OtrlUserState us)
+{
+    OtrlDeadlines *d = us->deadlines;
+    unsigned int i;
+
+    if (!d) return;
+
+    for (i = 0; i < d->num; ++i) {
+	d->heap[i].context->context_priv->deadline_slot = 0;
+    }
+    free(d->heap);
+    free(d);
+    us->deadlines = NULL;
+}
@@ -0,0 +1,62 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include <time.h>
+
+#include "context.h"
+#include "userstate.h"
+
+/* The times at which otrl_message_poll next has something to do for a
+ * context: a DH Commit that may go unanswered for too long, or a partly
+ * received fragmented message that may be given up on.  They are kept
+ * in a min-heap in the OtrlUserState, with at most one entry for each
+ * context, so that polling only looks at the contexts whose time has
+ * come, however many contexts there are.
+ *
+ * An entry may come due earlier than it needs to; the poll then just
+ * schedules the context again for whatever it is still waiting for. */
+
+typedef struct s_OtrlDeadlines OtrlDeadlines;
+
+/* Make sure the given context is looked at by otrl_message_poll no
+ * later than when.  If it is already due at or before then, nothing
+ * changes. */
+void otrl_deadline_schedule(ConnContext *context, time_t when);
+
+/* Remove the given context's entry, if it has one, as when it is about
+ * to be freed. */
+void otrl_deadline_cancel(ConnContext *context);
+
+/* Remove and return a context of the given OtrlUserState that is due
+ * at or before now, or return NULL if there isn't one. */
+ConnContext *otrl_deadline_take(OtrlUserState us, time_t now);
+
+/* Return the earliest time any context of the given OtrlUserState is
+ * due, or 0 if none is. */
+time_t otrl_deadline_next(OtrlUserState us);
+
+/* Free the heap of the given OtrlUserState. */
+void otrl_deadline_free(OtrlUserState us);
+
+#endif
@@ -19,8 +19,16 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /* libgcrypt headers */
 #include <gcrypt.h>
@@ -117,12 +125,242 @@ gcry_error_t otrl_dh_gen_keypair(unsigned int groupid, DH_keypair *kp)
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* A pool of AES-CTR cipher handles and HMAC-SHA1 handles taken from
+ * session keys that have been freed, to be rekeyed by new ones */
+struct s_OtrlDHHandlePool {
+    gcry_cipher_hd_t *ciphers;
+    unsigned int numciphers, maxciphers;
+    gcry_md_hd_t *macs;
+    unsigned int nummacs, maxmacs;
+    OtrlDHHandleStats stats;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t mutex;       /* Session keys may be made and freed
+				    in several threads at once (see
+				    uslock.h) */
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+#define pool_lock(pool) pthread_mutex_lock(&(pool)->mutex)
+#define pool_unlock(pool) pthread_mutex_unlock(&(pool)->mutex)
+#else
+#define pool_lock(pool)
+#define pool_unlock(pool)
+#endif
+
+/* Scrub keys out of handles before they sit in the pool */
+static const unsigned char zerokey[20];
+
+/*
+ * Create a new, empty handle pool, which keeps no handles until its
+ * caps are set with otrl_dh_handlepool_set_caps.
+ */
+OtrlDHHandlePool *otrl_dh_handlepool_new(void)
+{
+    OtrlDHHandlePool *pool = calloc(1, sizeof(*pool));
+#ifdef HAVE_PTHREAD_H
+    if (pool) pthread_mutex_init(&pool->mutex, NULL);
+#endif
+    return pool;
+}
+
+/*
+ * Set the most cipher and MAC handles a pool will keep, closing any
+ * handles it has over those caps.
+ */
+gcry_error_t otrl_dh_handlepool_set_caps(OtrlDHHandlePool *pool,
+	unsigned int maxciphers, unsigned int maxmacs)
+{
+    gcry_cipher_hd_t *newciphers;
+    gcry_md_hd_t *newmacs;
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    pool_lock(pool);
+    while (pool->numciphers > maxciphers) {
+	gcry_cipher_close(pool->ciphers[--pool->numciphers]);
+    }
+    while (pool->nummacs > maxmacs) {
+	gcry_md_close(pool->macs[--pool->nummacs]);
+    }
+
+    newciphers = realloc(pool->ciphers, maxciphers * sizeof(*newciphers));
+    if (!newciphers && maxciphers > 0) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+	goto done;
+    }
+    pool->ciphers = newciphers;
+    pool->maxciphers = maxciphers;
+
+    newmacs = realloc(pool->macs, maxmacs * sizeof(*newmacs));
+    if (!newmacs && maxmacs > 0) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+	goto done;
+    }
+    pool->macs = newmacs;
+    pool->maxmacs = maxmacs;
+
+done:
+    pool_unlock(pool);
+    return err;
+}
+
+/*
+ * Fill in *stats for the given handle pool.
+ */
+void otrl_dh_handlepool_stats(const OtrlDHHandlePool *pool,
+	OtrlDHHandleStats *stats)
+{
+    OtrlDHHandlePool *p = (OtrlDHHandlePool *)pool;
+
+    pool_lock(p);
+    *stats = pool->stats;
+    stats->ciphers_pooled = pool->numciphers;
+    stats->macs_pooled = pool->nummacs;
+    pool_unlock(p);
+}
+
+/*
+ * Close all the handles in a handle pool, and free it.
+ */
+void otrl_dh_handlepool_free(OtrlDHHandlePool *pool)
+{
+    if (!pool) return;
+    otrl_dh_handlepool_set_caps(pool, 0, 0);
+    free(pool->ciphers);
+    free(pool->macs);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&pool->mutex);
+#endif
+    free(pool);
+}
+
+/* Get an AES-CTR handle, from the pool if possible, and key it */
+static gcry_error_t cipher_get(OtrlDHHandlePool *pool,
+	gcry_cipher_hd_t *hdp, const unsigned char *key)
+{
+    gcry_error_t err;
+
+    *hdp = NULL;
+    if (pool) {
+	pool_lock(pool);
+	if (pool->numciphers > 0) {
+	    *hdp = pool->ciphers[--pool->numciphers];
+	    pool->stats.cipher_reuses++;
+	} else {
+	    pool->stats.cipher_opens++;
+	}
+	pool_unlock(pool);
+    }
+    if (!*hdp) {
+	err = gcry_cipher_open(hdp, GCRY_CIPHER_AES, GCRY_CIPHER_MODE_CTR,
+		GCRY_CIPHER_SECURE);
+	if (err) return err;
+    }
+    return gcry_cipher_setkey(*hdp, key, 16);
+}
+
+/* Return an AES-CTR handle to the pool, or close it if the pool is
+ * full */
+static void cipher_put(OtrlDHHandlePool *pool, gcry_cipher_hd_t hd)
+{
+    if (!hd) return;
+    if (pool && gcry_cipher_setkey(hd, zerokey, 16) == 0) {
+	pool_lock(pool);
+	if (pool->numciphers < pool->maxciphers) {
+	    pool->ciphers[pool->numciphers++] = hd;
+	    hd = NULL;
+	}
+	pool_unlock(pool);
+    }
+    if (hd) {
+	gcry_cipher_close(hd);
+    }
+}
+
+/* Get an HMAC-SHA1 handle, from the pool if possible, and key it */
+static gcry_error_t mac_get(OtrlDHHandlePool *pool, gcry_md_hd_t *hdp,
+	const unsigned char *key)
+{
+    gcry_error_t err;
+
+    *hdp = NULL;
+    if (pool) {
+	pool_lock(pool);
+	if (pool->nummacs > 0) {
+	    *hdp = pool->macs[--pool->nummacs];
+	    pool->stats.mac_reuses++;
+	} else {
+	    pool->stats.mac_opens++;
+	}
+	pool_unlock(pool);
+    }
+    if (!*hdp) {
+	err = gcry_md_open(hdp, GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
+	if (err) return err;
+    }
+    return gcry_md_setkey(*hdp, key, 20);
+}
+
+/* Return an HMAC-SHA1 handle to the pool, or close it if the pool is
+ * full */
+static void mac_put(OtrlDHHandlePool *pool, gcry_md_hd_t hd)
+{
+    if (!hd) return;
+    gcry_md_reset(hd);
+    if (pool && gcry_md_setkey(hd, zerokey, 20) == 0) {
+	pool_lock(pool);
+	if (pool->nummacs < pool->maxmacs) {
+	    pool->macs[pool->nummacs++] = hd;
+	    hd = NULL;
+	}
+	pool_unlock(pool);
+    }
+    if (hd) {
+	gcry_md_close(hd);
+    }
+}
+
 /*
  * Construct session keys from a DH keypair and someone else's public
- * key.
+ * key.  This only records what is needed to do so; the shared secret
+ * and the keys themselves are computed by otrl_dh_session_derive, the
+ * first time the session keys are used.
  */
 gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
 	gcry_mpi_t y)
+{
+    otrl_dh_session_blank(sess);
+
+    if (kp->groupid != DH1536_GROUP_ID) {
+	/* Invalid group id */
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    /* Are we the "high" or "low" end of the connection? */
+    if ( gcry_mpi_cmp(kp->pub, y) > 0 ) {
+	sess->sendbyte = 0x01;
+    } else {
+	sess->sendbyte = 0x02;
+    }
+
+    sess->pending_priv = gcry_mpi_copy(kp->priv);
+    sess->pending_y = gcry_mpi_copy(y);
+    if (!sess->pending_priv || !sess->pending_y) {
+	otrl_dh_session_free(sess);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/*
+ * Compute the shared secret and derive the keys of a DH_sesskeys set
+ * up by otrl_dh_session, if that hasn't been done yet.  The cipher and
+ * MAC handles are taken from the given pool (which may be NULL) if it
+ * has any, and are returned to it when the DH_sesskeys is freed.
+ */
+gcry_error_t otrl_dh_session_derive(DH_sesskeys *sess,
+	OtrlDHHandlePool *pool)
 {
     gcry_mpi_t gab;
     size_t gablen;
@@ -131,16 +369,14 @@ gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
     unsigned char sendbyte, rcvbyte;
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
 
-    otrl_dh_session_blank(sess);
-
-    if (kp->groupid != DH1536_GROUP_ID) {
-	/* Invalid group id */
-	return gcry_error(GPG_ERR_INV_VALUE);
+    if (!sess->pending_priv) {
+	/* Already derived (or never set up) */
+	return gcry_error(GPG_ERR_NO_ERROR);
     }
 
     /* Calculate the shared secret MPI */
     gab = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
-    gcry_mpi_powm(gab, y, kp->priv, DH1536_MODULUS);
+    gcry_mpi_powm(gab, sess->pending_y, sess->pending_priv, DH1536_MODULUS);
 
     /* Output it in the right format */
     gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &gablen, gab);
@@ -162,46 +398,30 @@ gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
 	return gcry_error(GPG_ERR_ENOMEM);
     }
 
-    /* Are we the "high" or "low" end of the connection? */
-    if ( gcry_mpi_cmp(kp->pub, y) > 0 ) {
-	sendbyte = 0x01;
-	rcvbyte = 0x02;
-    } else {
-	sendbyte = 0x02;
-	rcvbyte = 0x01;
-    }
+    sendbyte = sess->sendbyte;
+    rcvbyte = sendbyte == 0x01 ? 0x02 : 0x01;
 
     /* Calculate the sending encryption key */
     gabdata[0] = sendbyte;
     gcry_md_hash_buffer(GCRY_MD_SHA1, hashdata, gabdata, gablen+5);
-    err = gcry_cipher_open(&(sess->sendenc), GCRY_CIPHER_AES,
-	    GCRY_CIPHER_MODE_CTR, GCRY_CIPHER_SECURE);
-    if (err) goto err;
-    err = gcry_cipher_setkey(sess->sendenc, hashdata, 16);
+    err = cipher_get(pool, &(sess->sendenc), hashdata);
     if (err) goto err;
 
     /* Calculate the sending MAC key */
     gcry_md_hash_buffer(GCRY_MD_SHA1, sess->sendmackey, hashdata, 16);
-    err = gcry_md_open(&(sess->sendmac), GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
-    if (err) goto err;
-    err = gcry_md_setkey(sess->sendmac, sess->sendmackey, 20);
+    err = mac_get(pool, &(sess->sendmac), sess->sendmackey);
     if (err) goto err;
 
     /* Calculate the receiving encryption key */
     gabdata[0] = rcvbyte;
     gcry_md_hash_buffer(GCRY_MD_SHA1, hashdata, gabdata, gablen+5);
-    err = gcry_cipher_open(&(sess->rcvenc), GCRY_CIPHER_AES,
-	    GCRY_CIPHER_MODE_CTR, GCRY_CIPHER_SECURE);
-    if (err) goto err;
-    err = gcry_cipher_setkey(sess->rcvenc, hashdata, 16);
+    err = cipher_get(pool, &(sess->rcvenc), hashdata);
     if (err) goto err;
 
     /* Calculate the receiving MAC key (and save it in the DH_sesskeys
      * struct, so we can reveal it later) */
     gcry_md_hash_buffer(GCRY_MD_SHA1, sess->rcvmackey, hashdata, 16);
-    err = gcry_md_open(&(sess->rcvmac), GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
-    if (err) goto err;
-    err = gcry_md_setkey(sess->rcvmac, sess->rcvmackey, 20);
+    err = mac_get(pool, &(sess->rcvmac), sess->rcvmackey);
     if (err) goto err;
 
     /* Calculate the extra key (used if applications wish to extract a
@@ -211,9 +431,25 @@ gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
 
     gcry_free(gabdata);
     gcry_free(hashdata);
+
+    /* We don't need these any more */
+    gcry_mpi_release(sess->pending_priv);
+    gcry_mpi_release(sess->pending_y);
+    sess->pending_priv = NULL;
+    sess->pending_y = NULL;
+    sess->handlepool = pool;
+
     return gcry_error(GPG_ERR_NO_ERROR);
 err:
-    otrl_dh_session_free(sess);
+    /* Leave the DH_sesskeys as it was, so we can try again */
+    cipher_put(pool, sess->sendenc);
+    cipher_put(pool, sess->rcvenc);
+    mac_put(pool, sess->sendmac);
+    mac_put(pool, sess->rcvmac);
+    sess->sendenc = NULL;
+    sess->rcvenc = NULL;
+    sess->sendmac = NULL;
+    sess->rcvmac = NULL;
     gcry_free(gabdata);
     gcry_free(hashdata);
     return err;
@@ -424,14 +660,17 @@ gcry_error_t otrl_dh_compute_v1_session_id(const DH_keypair *our_dh,
 
 /*
  * Deallocate the contents of a DH_sesskeys (but not the DH_sesskeys
- * itself)
+ * itself), returning its handles to the pool they came from
  */
 void otrl_dh_session_free(DH_sesskeys *sess)
 {
-    gcry_cipher_close(sess->sendenc);
-    gcry_cipher_close(sess->rcvenc);
-    gcry_md_close(sess->sendmac);
-    gcry_md_close(sess->rcvmac);
+    /* Hand our handles back to the pool they came from, if any */
+    cipher_put(sess->handlepool, sess->sendenc);
+    cipher_put(sess->handlepool, sess->rcvenc);
+    mac_put(sess->handlepool, sess->sendmac);
+    mac_put(sess->handlepool, sess->rcvmac);
+    gcry_mpi_release(sess->pending_priv);
+    gcry_mpi_release(sess->pending_y);
 
     otrl_dh_session_blank(sess);
 }
@@ -452,6 +691,10 @@ void otrl_dh_session_blank(DH_sesskeys *sess)
     sess->sendmacused = 0;
     sess->rcvmacused = 0;
     memset(sess->extrakey, 0, OTRL_EXTRAKEY_BYTES);
+    sess->pending_priv = NULL;
+    sess->pending_y = NULL;
+    sess->sendbyte = 0;
+    sess->handlepool = NULL;
 }
 
 /* Increment the top half of a counter block */
@@ -36,6 +36,20 @@ typedef enum {
 
 #define OTRL_EXTRAKEY_BYTES 32
 
+/* A pool of cipher and MAC handles for reuse by session keys */
+typedef struct s_OtrlDHHandlePool OtrlDHHandlePool;
+
+typedef struct {
+    unsigned long cipher_opens;        /* Cipher handles newly opened */
+    unsigned long cipher_reuses;       /* Cipher handles taken from the
+					  pool */
+    unsigned long mac_opens;           /* MAC handles newly opened */
+    unsigned long mac_reuses;          /* MAC handles taken from the
+					  pool */
+    unsigned int ciphers_pooled;       /* Cipher handles in the pool now */
+    unsigned int macs_pooled;          /* MAC handles in the pool now */
+} OtrlDHHandleStats;
+
 typedef struct {
     unsigned char sendctr[16];
     unsigned char rcvctr[16];
@@ -48,6 +62,17 @@ typedef struct {
     unsigned char rcvmackey[20];
     int rcvmacused;
     unsigned char extrakey[OTRL_EXTRAKEY_BYTES];
+
+    /* Until otrl_dh_session_derive has been called, the keys above are
+     * not set, and these hold our private key and their public key */
+    gcry_mpi_t pending_priv;
+    gcry_mpi_t pending_y;
+    unsigned char sendbyte;            /* 0x01 if we're the "high" end
+					  of the connection, else 0x02 */
+
+    OtrlDHHandlePool *handlepool;      /* Where to return the handles
+					  above when we're freed, or
+					  NULL */
 } DH_sesskeys;
 
 /*
@@ -79,11 +104,46 @@ gcry_error_t otrl_dh_gen_keypair(unsigned int groupid, DH_keypair *kp);
 
 /*
  * Construct session keys from a DH keypair and someone else's public
- * key.
+ * key.  This only records what is needed to do so; the shared secret
+ * and the keys themselves are computed by otrl_dh_session_derive, the
+ * first time the session keys are used.
  */
 gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
 	gcry_mpi_t y);
 
+/*
+ * Compute the shared secret and derive the keys of a DH_sesskeys set
+ * up by otrl_dh_session, if that hasn't been done yet.  The cipher and
+ * MAC handles are taken from the given pool (which may be NULL) if it
+ * has any, and are returned to it when the DH_sesskeys is freed.
+ */
+gcry_error_t otrl_dh_session_derive(DH_sesskeys *sess,
+	OtrlDHHandlePool *pool);
+
+/*
+ * Create a new, empty handle pool, which keeps no handles until its
+ * caps are set with otrl_dh_handlepool_set_caps.
+ */
+OtrlDHHandlePool *otrl_dh_handlepool_new(void);
+
+/*
+ * Set the most cipher and MAC handles a pool will keep, closing any
+ * handles it has over those caps.
+ */
+gcry_error_t otrl_dh_handlepool_set_caps(OtrlDHHandlePool *pool,
+	unsigned int maxciphers, unsigned int maxmacs);
+
+/*
+ * Fill in *stats for the given handle pool.
+ */
+void otrl_dh_handlepool_stats(const OtrlDHHandlePool *pool,
+	OtrlDHHandleStats *stats);
+
+/*
+ * Close all the handles in a handle pool, and free it.
+ */
+void otrl_dh_handlepool_free(OtrlDHHandlePool *pool);
+
 /*
  * Compute the secure session id, two encryption keys, and four MAC keys
  * given our DH key and their DH public key.
@@ -104,7 +164,7 @@ gcry_error_t otrl_dh_compute_v1_session_id(const DH_keypair *our_dh,
 
 /*
  * Deallocate the contents of a DH_sesskeys (but not the DH_sesskeys
- * itself)
+ * itself), returning its handles to the pool they came from
  */
 void otrl_dh_session_free(DH_sesskeys *sess);
 
@@ -0,0 +1,270 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "dhpool.h"
+
+#ifdef HAVE_PTHREAD_H
+
+struct s_OtrlDHPool {
+    pthread_mutex_t mutex;
+    pthread_cond_t wanted;       /* Signalled when the threads should
+				    generate more keypairs, or stop */
+    pthread_t *threads;
+    unsigned int numthreads;
+
+    DH_keypair *keys;            /* The ready keypairs; room for high */
+    unsigned int count;
+    unsigned int inflight;       /* Keypairs being generated right now */
+    unsigned int low, high;
+    int refilling;               /* Set when count reaches low, and
+				    cleared when it reaches high */
+    int stopping;
+
+    unsigned long hits, misses;
+};
+
+static void *dhpool_thread(void *data)
+{
+    OtrlDHPool *pool = data;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+	DH_keypair kp;
+
+	while (!pool->stopping && !(pool->refilling &&
+		    pool->count + pool->inflight < pool->high)) {
+	    pthread_cond_wait(&pool->wanted, &pool->mutex);
+	}
+	if (pool->stopping) break;
+
+	/* Do the expensive part without holding the lock */
+	pool->inflight++;
+	pthread_mutex_unlock(&pool->mutex);
+	otrl_dh_keypair_init(&kp);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &kp);
+	pthread_mutex_lock(&pool->mutex);
+	pool->inflight--;
+
+	pool->keys[pool->count++] = kp;
+	if (pool->count >= pool->high) {
+	    pool->refilling = 0;
+	}
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/* Start keeping a pool of pre-generated DH keypairs for the given
+ * OtrlUserState, refilled by the given number of background threads
+ * (at least 1).  Returns gcry_error(GPG_ERR_EEXIST) if the userstate
+ * already has a pool, and gcry_error(GPG_ERR_NOT_SUPPORTED) if libotr
+ * was built without thread support. */
+gcry_error_t otrl_dhpool_enable(OtrlUserState us, unsigned int low,
+	unsigned int high, unsigned int threads)
+{
+    OtrlDHPool *pool;
+    unsigned int i;
+
+    if (us->dhpool) return gcry_error(GPG_ERR_EEXIST);
+
+    if (high == 0) {
+	low = OTRL_DHPOOL_DEFAULT_LOW;
+	high = OTRL_DHPOOL_DEFAULT_HIGH;
+    }
+    if (low >= high) low = high - 1;
+    if (threads == 0) threads = 1;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool) return gcry_error(GPG_ERR_ENOMEM);
+    pool->keys = malloc(high * sizeof(DH_keypair));
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    if (!pool->keys || !pool->threads) {
+	free(pool->keys);
+	free(pool->threads);
+	free(pool);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wanted, NULL);
+    pool->low = low;
+    pool->high = high;
+    pool->refilling = 1;
+    us->dhpool = pool;
+
+    for (i = 0; i < threads; ++i) {
+	if (pthread_create(&pool->threads[i], NULL, dhpool_thread, pool)) {
+	    break;
+	}
+	pool->numthreads++;
+    }
+    if (pool->numthreads == 0) {
+	otrl_dhpool_disable(us);
+	return gcry_error(GPG_ERR_NOT_SUPPORTED);
+    }
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Stop the background threads of the given OtrlUserState's pool
+ * (waiting for any keypair they are in the middle of generating), and
+ * free the pool.  Calling this on a userstate without a pool is
+ * harmless. */
+void otrl_dhpool_disable(OtrlUserState us)
+{
+    OtrlDHPool *pool = us->dhpool;
+    unsigned int i;
+
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wanted);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 0; i < pool->numthreads; ++i) {
+	pthread_join(pool->threads[i], NULL);
+    }
+
+    for (i = 0; i < pool->count; ++i) {
+	otrl_dh_keypair_free(&pool->keys[i]);
+    }
+    pthread_cond_destroy(&pool->wanted);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->keys);
+    free(pool->threads);
+    free(pool);
+    us->dhpool = NULL;
+}
+
+/* Generate a DH1536 keypair into *kp, taking a ready one from the given
+ * OtrlUserState's pool if there is one.  us may be NULL. */
+gcry_error_t otrl_dhpool_gen_keypair(OtrlUserState us, DH_keypair *kp)
+{
+    OtrlDHPool *pool = us ? us->dhpool : NULL;
+    int hit = 0;
+
+    if (pool) {
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->count > 0) {
+	    *kp = pool->keys[--pool->count];
+	    pool->hits++;
+	    hit = 1;
+	} else {
+	    pool->misses++;
+	}
+	if (pool->count <= pool->low && !pool->refilling) {
+	    pool->refilling = 1;
+	    pthread_cond_broadcast(&pool->wanted);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	if (hit) return gcry_error(GPG_ERR_NO_ERROR);
+    }
+
+    return otrl_dh_gen_keypair(DH1536_GROUP_ID, kp);
+}
+
+/* Fill in *stats for the given OtrlUserState's pool.  All of the
+ * counts are 0 if it doesn't have one. */
+void otrl_dhpool_stats(OtrlUserState us, OtrlDHPoolStats *stats)
+{
+    OtrlDHPool *pool = us->dhpool;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    stats->hits = pool->hits;
+    stats->misses = pool->misses;
+    stats->available = pool->count;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+#else  /* HAVE_PTHREAD_H */
+
+/* Without threads, there is never a pool; keypairs are always
+ * generated inline. */
+
+gcry_error_t otrl_dhpool_enable(OtrlUserState us, unsigned int low,
+	unsigned int high, unsigned int threads)
+{
+    return gcry_error(GPG_ERR_NOT_SUPPORTED);
+}
+
+void otrl_dhpool_disable(OtrlUserState us)
+{
+}
+
+gcry_error_t otrl_dhpool_gen_keypair(OtrlUserState us, DH_keypair *kp)
+{
+    return otrl_dh_gen_keypair(DH1536_GROUP_ID, kp);
+}
+
+void otrl_dhpool_stats(OtrlUserState us, OtrlDHPoolStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif  /* HAVE_PTHREAD_H */
+
+/* Keep up to the given numbers of AES-CTR and HMAC-SHA1 handles from
+ * freed session keys in the given OtrlUserState, to be rekeyed by new
+ * session keys instead of opening new handles.  Caps of 0 stop
+ * keeping handles, which is the default. */
+gcry_error_t otrl_dhpool_set_handle_caps(OtrlUserState us,
+	unsigned int maxciphers, unsigned int maxmacs)
+{
+    /* Once created, the handle pool lives as long as the userstate,
+     * since session keys hold on to it */
+    if (!us->dhhandles) {
+	if (maxciphers == 0 && maxmacs == 0) {
+	    return gcry_error(GPG_ERR_NO_ERROR);
+	}
+	us->dhhandles = otrl_dh_handlepool_new();
+	if (!us->dhhandles) return gcry_error(GPG_ERR_ENOMEM);
+    }
+    return otrl_dh_handlepool_set_caps(us->dhhandles, maxciphers, maxmacs);
+}
+
+/* Fill in *stats for the given OtrlUserState's pool of cipher and MAC
+ * handles.  All of the counts are 0 if it doesn't have one. */
+void otrl_dhpool_handle_stats(OtrlUserState us, OtrlDHHandleStats *stats)
+{
+    if (us->dhhandles) {
+	otrl_dh_handlepool_stats(us->dhhandles, stats);
+    } else {
+	memset(stats, 0, sizeof(*stats));
+    }
+}
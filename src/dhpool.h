@@ -0,0 +1,84 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __DHPOOL_H__
+#define __DHPOOL_H__
+
+#include <gcrypt.h>
+
+#include "dh.h"
+#include "userstate.h"
+
+/* A pool of DH1536 keypairs, generated ahead of time by background
+ * threads, so that rotating our DH key while handling a message, or
+ * starting an AKE, doesn't have to wait for a modular exponentiation.
+ * Once the number of keypairs in the pool drops to the low watermark,
+ * the threads refill it up to the high watermark.  If the pool is
+ * empty when a keypair is wanted, one is generated inline as usual. */
+
+/* The watermarks used if a high watermark of 0 is passed to
+ * otrl_dhpool_enable */
+#define OTRL_DHPOOL_DEFAULT_LOW  4
+#define OTRL_DHPOOL_DEFAULT_HIGH 16
+
+typedef struct s_OtrlDHPool OtrlDHPool;
+
+typedef struct {
+    unsigned long hits;          /* Keypairs taken from the pool */
+    unsigned long misses;        /* Keypairs generated inline because
+				    the pool was empty */
+    unsigned int available;      /* Keypairs in the pool right now */
+} OtrlDHPoolStats;
+
+/* Start keeping a pool of pre-generated DH keypairs for the given
+ * OtrlUserState, refilled by the given number of background threads
+ * (at least 1).  Returns gcry_error(GPG_ERR_EEXIST) if the userstate
+ * already has a pool, and gcry_error(GPG_ERR_NOT_SUPPORTED) if libotr
+ * was built without thread support. */
+gcry_error_t otrl_dhpool_enable(OtrlUserState us, unsigned int low,
+	unsigned int high, unsigned int threads);
+
+/* Stop the background threads of the given OtrlUserState's pool
+ * (waiting for any keypair they are in the middle of generating), and
+ * free the pool.  Calling this on a userstate without a pool is
+ * harmless. */
+void otrl_dhpool_disable(OtrlUserState us);
+
+/* Generate a DH1536 keypair into *kp, taking a ready one from the given
+ * OtrlUserState's pool if there is one.  us may be NULL. */
+gcry_error_t otrl_dhpool_gen_keypair(OtrlUserState us, DH_keypair *kp);
+
+/* Fill in *stats for the given OtrlUserState's pool.  All of the
+ * counts are 0 if it doesn't have one. */
+void otrl_dhpool_stats(OtrlUserState us, OtrlDHPoolStats *stats);
+
+/* Keep up to the given numbers of AES-CTR and HMAC-SHA1 handles from
+ * freed session keys in the given OtrlUserState, to be rekeyed by new
+ * session keys instead of opening new handles.  Caps of 0 stop
+ * keeping handles, which is the default. */
+gcry_error_t otrl_dhpool_set_handle_caps(OtrlUserState us,
+	unsigned int maxciphers, unsigned int maxmacs);
+
+/* Fill in *stats for the given OtrlUserState's pool of cipher and MAC
+ * handles.  All of the counts are 0 if it doesn't have one. */
+void otrl_dhpool_handle_stats(OtrlUserState us, OtrlDHHandleStats *stats);
+
+#endif
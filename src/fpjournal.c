@@ -0,0 +1,764 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "fpjournal.h"
+#include "fpstore.h"
+#include "privkey.h"
+#include "context_priv.h"
+
+struct s_OtrlFPJournal {
+    OtrlUserState us;
+    char *filename;		/* The store itself */
+    char *journalname;		/* The journal being appended to */
+    char *oldname;		/* The journal being compacted away */
+    FILE *journalf;
+    size_t journal_len;		/* Bytes in the current journal */
+    size_t threshold;
+    size_t auto_threshold;	/* The journal size at which to start
+				   compacting it ourselves */
+    int compacting;
+    gcry_error_t write_err;	/* The first error appending to the
+				   journal, if any */
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t mutex;	/* Guards everything above, and the
+				   files, against an automatic
+				   compaction */
+    pthread_t auto_thread;	/* The thread doing our own compaction */
+    int auto_thread_valid;	/* ...and whether it is yet to be joined */
+#endif
+};
+
+/* A compaction in progress */
+typedef struct {
+    char *buf;			/* The whole new store, or NULL to build
+				   it from the files below */
+    size_t len;
+    const char *filename;	/* The store as it was on disk... */
+    const char *oldname;	/* ...and the journal to replay over it */
+    FILE *f;			/* The temporary file it is written to... */
+    char *tmpname;		/* ...and its name */
+    int automatic;		/* Started by otrl_fpjournal_log */
+    gcry_error_t err;
+} FPCompaction;
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/* Lock and unlock the given journal.  These do nothing without
+ * threads. */
+static void journal_lock(OtrlFPJournal *journal)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&journal->mutex);
+#endif
+}
+
+static void journal_unlock(OtrlFPJournal *journal)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&journal->mutex);
+#endif
+}
+
+/* Return a newly allocated copy of s with suffix on the end */
+static char *append_suffix(const char *s, const char *suffix)
+{
+    char *r = malloc(strlen(s) + strlen(suffix) + 1);
+    if (r) {
+	strcpy(r, s);
+	strcat(r, suffix);
+    }
+    return r;
+}
+
+/* Read the whole of the given file into a newly allocated buffer.  A
+ * missing file reads as empty. */
+static gcry_error_t read_whole_file(const char *filename, char **bufp,
+	size_t *lenp)
+{
+    FILE *f;
+    char *buf = NULL;
+    size_t len = 0, size = 0;
+
+    *bufp = NULL;
+    *lenp = 0;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+	if (errno == ENOENT) return gcry_error(GPG_ERR_NO_ERROR);
+	return gcry_error_from_errno(errno);
+    }
+    do {
+	if (size - len < 4096) {
+	    char *newbuf;
+	    size = size ? 2 * size : 65536;
+	    newbuf = realloc(buf, size);
+	    if (!newbuf) {
+		free(buf);
+		fclose(f);
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	    buf = newbuf;
+	}
+	len += fread(buf + len, 1, size - len, f);
+    } while (!feof(f) && !ferror(f));
+    if (ferror(f)) {
+	gcry_error_t err = gcry_error_from_errno(errno);
+	free(buf);
+	fclose(f);
+	return err;
+    }
+    fclose(f);
+
+    *bufp = buf;
+    *lenp = len;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Apply one journal line, which runs from line up to the newline at
+ * eol, to the OtrlUserState.  Malformed lines are ignored. */
+static void replay_line(OtrlUserState us, char *line, char *eol,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void  *data)
+{
+    char *field[6];
+    char *end;
+    int numfields = 1;
+    unsigned char fingerprint[20];
+    ConnContext *context;
+    Fingerprint *fng;
+
+    field[0] = line;
+    while (numfields < 6) {
+	char *tab = memchr(field[numfields-1], '\t',
+		eol - field[numfields-1]);
+	if (!tab) break;
+	*tab = '\0';
+	field[numfields++] = tab + 1;
+    }
+    if (numfields < 5 || strlen(field[0]) != 1) return;
+
+    end = memchr(field[numfields-1], '\r', eol - field[numfields-1]);
+    if (!end) end = eol;
+    *end = '\0';
+
+    if (strlen(field[4]) != 40) return;
+    otrl_privkey_hex_to_hash(fingerprint, field[4]);
+
+    switch(field[0][0]) {
+	case OTRL_FPJOURNAL_ADD:
+	case OTRL_FPJOURNAL_TRUST:
+	    context = otrl_context_find(us, field[1], field[2], field[3],
+		    OTRL_INSTAG_MASTER, 1, NULL, add_app_data, data);
+	    fng = otrl_context_find_fingerprint(context, fingerprint, 1,
+		    NULL);
+	    if (field[0][0] == OTRL_FPJOURNAL_TRUST) {
+		otrl_context_set_trust(fng, numfields == 6 ? field[5] : NULL);
+	    }
+	    break;
+	case OTRL_FPJOURNAL_FORGET:
+	    context = otrl_context_find(us, field[1], field[2], field[3],
+		    OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+	    fng = otrl_context_find_fingerprint(context, fingerprint, 0,
+		    NULL);
+	    if (fng) {
+		otrl_context_forget_fingerprint(fng, 0);
+	    }
+	    break;
+	default:
+	    break;
+    }
+}
+
+/* Replay the journal in the given file over the OtrlUserState.  A
+ * partial last line (from a crash part way through appending it) is
+ * ignored. */
+static gcry_error_t replay_journal(OtrlUserState us, const char *filename,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void  *data)
+{
+    gcry_error_t err;
+    char *buf, *line, *eol;
+    size_t len;
+
+    err = read_whole_file(filename, &buf, &len);
+    if (err || !buf) return err;
+
+    for (line = buf; line < buf + len &&
+	    (eol = memchr(line, '\n', buf + len - line)) != NULL;
+	    line = eol + 1) {
+	replay_line(us, line, eol, add_app_data, data);
+    }
+
+    free(buf);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Append the contents of the file src to the file dst, and remove
+ * src. */
+static gcry_error_t append_file(const char *src, const char *dst)
+{
+    gcry_error_t err;
+    char *buf;
+    size_t len;
+    FILE *f;
+
+    err = read_whole_file(src, &buf, &len);
+    if (err) return err;
+    if (len) {
+	f = fopen(dst, "ab");
+	if (!f) {
+	    err = gcry_error_from_errno(errno);
+	} else {
+	    if (fwrite(buf, len, 1, f) != 1) {
+		err = gcry_error_from_errno(errno);
+	    }
+	    if (fclose(f) && !err) {
+		err = gcry_error_from_errno(errno);
+	    }
+	}
+    }
+    free(buf);
+    if (!err) remove(src);
+    return err;
+}
+
+/* Open the journal file for appending, and note its current size */
+static gcry_error_t open_journal(OtrlFPJournal *journal)
+{
+    long pos;
+
+    journal->journalf = fopen(journal->journalname, "ab");
+    if (!journal->journalf) {
+	return gcry_error_from_errno(errno);
+    }
+    fseek(journal->journalf, 0, SEEK_END);
+    pos = ftell(journal->journalf);
+    journal->journal_len = pos > 0 ? pos : 0;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Free a journal structure */
+static void journal_free(OtrlFPJournal *journal)
+{
+    free(journal->filename);
+    free(journal->journalname);
+    free(journal->oldname);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&journal->mutex);
+#endif
+    free(journal);
+}
+
+/* Read the fingerprint store in the given file, and its journal, into
+ * the given OtrlUserState, and then start journaling changes to its
+ * fingerprints.  Use add_app_data to add application data to each
+ * ConnContext so created.  If threshold is 0, use
+ * OTRL_FPJOURNAL_DEFAULT_THRESHOLD.  On success, *journalp is set to
+ * the new journal, which must be closed with otrl_fpjournal_close
+ * before the OtrlUserState is freed. */
+gcry_error_t otrl_fpjournal_open(OtrlFPJournal **journalp,
+	OtrlUserState us, const char *filename, size_t threshold,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void  *data)
+{
+    gcry_error_t err;
+    OtrlFPJournal *journal;
+    FILE *oldf;
+
+    *journalp = NULL;
+    if (us->fpjournal) return gcry_error(GPG_ERR_EEXIST);
+
+    journal = calloc(1, sizeof(OtrlFPJournal));
+    if (!journal) return gcry_error(GPG_ERR_ENOMEM);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&journal->mutex, NULL);
+#endif
+    journal->us = us;
+    journal->threshold = threshold ? threshold :
+	OTRL_FPJOURNAL_DEFAULT_THRESHOLD;
+    journal->auto_threshold = journal->threshold;
+    journal->filename = strdup(filename);
+    journal->journalname = append_suffix(filename, ".journal");
+    journal->oldname = append_suffix(filename, ".journal.old");
+    if (!journal->filename || !journal->journalname || !journal->oldname) {
+	journal_free(journal);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    /* The store itself */
+    err = otrl_privkey_read_fingerprints_bulk(us, filename, add_app_data,
+	    data, NULL);
+    if (err && gcry_err_code(err) != GPG_ERR_ENOENT) {
+	journal_free(journal);
+	return err;
+    }
+
+    /* If we crashed during a compaction, there will be an old journal
+     * as well; its changes come first.  Merge the two into one. */
+    oldf = fopen(journal->oldname, "rb");
+    if (oldf) {
+	fclose(oldf);
+	err = append_file(journal->journalname, journal->oldname);
+	if (!err && rename(journal->oldname, journal->journalname)) {
+	    err = gcry_error_from_errno(errno);
+	}
+	if (err) {
+	    journal_free(journal);
+	    return err;
+	}
+    }
+
+    err = replay_journal(us, journal->journalname, add_app_data, data);
+    if (!err) {
+	err = open_journal(journal);
+    }
+    if (err) {
+	journal_free(journal);
+	return err;
+    }
+
+    us->fpjournal = journal;
+    *journalp = journal;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Stop journaling, and close the journal file.  Any compaction started
+ * with otrl_fpjournal_compact_start must have been finished first; an
+ * automatic one is waited for. */
+void otrl_fpjournal_close(OtrlFPJournal *journal)
+{
+    if (!journal) return;
+
+    /* Stop any more records being written, then wait for an automatic
+     * compaction to finish; it needs the lock to do so. */
+    if (journal->us->fpjournal == journal) {
+	journal->us->fpjournal = NULL;
+    }
+#ifdef HAVE_PTHREAD_H
+    journal_lock(journal);
+    if (journal->auto_thread_valid) {
+	pthread_t thread = journal->auto_thread;
+
+	journal->auto_thread_valid = 0;
+	journal_unlock(journal);
+	pthread_join(thread, NULL);
+    } else {
+	journal_unlock(journal);
+    }
+#endif
+
+    if (journal->journalf) {
+	fclose(journal->journalf);
+    }
+    journal_free(journal);
+}
+
+/* Make sure everything written to the journal so far is on disk. */
+gcry_error_t otrl_fpjournal_sync(OtrlFPJournal *journal)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    journal_lock(journal);
+    if (journal->write_err) {
+	err = journal->write_err;
+    } else if (journal->journalf && fflush(journal->journalf)) {
+	err = gcry_error_from_errno(errno);
+    }
+#ifdef HAVE_FSYNC
+    else if (journal->journalf && fsync(fileno(journal->journalf))) {
+	err = gcry_error_from_errno(errno);
+    }
+#endif
+    journal_unlock(journal);
+    return err;
+}
+
+static void compact_auto(OtrlFPJournal *journal);
+
+/* Append a record of the given type for the given Fingerprint to the
+ * journal of the OtrlUserState it belongs to, if it has one.  The
+ * context functions that change fingerprints call this themselves.
+ * If this takes the journal past its threshold, compaction is started
+ * in the background. */
+void otrl_fpjournal_log(Fingerprint *fprint, char type)
+{
+    ConnContext *context = fprint ? fprint->context : NULL;
+    OtrlFPJournal *journal;
+    const char *trust = NULL;
+    char *line, *p;
+    size_t len;
+    int i;
+
+    if (!context || !context->context_priv->us) return;
+    journal = context->context_priv->us->fpjournal;
+    if (!journal) return;
+
+    if (type == OTRL_FPJOURNAL_TRUST) {
+	trust = fprint->trust;
+    }
+
+    len = 2 + strlen(context->username) + 1 + strlen(context->accountname)
+	+ 1 + strlen(context->protocol) + 1 + 40 +
+	(trust ? 1 + strlen(trust) : 0) + 1;
+    line = malloc(len + 1);
+    if (!line) {
+	journal_lock(journal);
+	if (!journal->write_err) journal->write_err =
+	    gcry_error(GPG_ERR_ENOMEM);
+	journal_unlock(journal);
+	return;
+    }
+
+    p = line;
+    p += sprintf(p, "%c\t%s\t%s\t%s\t", type, context->username,
+	    context->accountname, context->protocol);
+    for (i = 0; i < 20; ++i) {
+	*(p++) = hexdigits[fprint->fingerprint[i] >> 4];
+	*(p++) = hexdigits[fprint->fingerprint[i] & 0x0f];
+    }
+    if (trust) {
+	p += sprintf(p, "\t%s", trust);
+    }
+    *(p++) = '\n';
+
+    /* Write out the whole line at once, so that a crash leaves at most
+     * one partial line at the end, which replay ignores. */
+    journal_lock(journal);
+    if (!journal->journalf) {
+	/* A failed compaction couldn't reopen it */
+	journal_unlock(journal);
+	free(line);
+	return;
+    }
+    if ((fwrite(line, len, 1, journal->journalf) != 1 ||
+		fflush(journal->journalf)) && !journal->write_err) {
+	journal->write_err = gcry_error_from_errno(errno);
+    }
+    journal->journal_len += len;
+    if (!journal->write_err && !journal->compacting &&
+	    journal->journal_len >= journal->auto_threshold) {
+	compact_auto(journal);
+    }
+    journal_unlock(journal);
+    free(line);
+}
+
+/* Return true if the journal has grown past its threshold, and no
+ * compaction is already in progress. */
+int otrl_fpjournal_compact_needed(OtrlFPJournal *journal)
+{
+    int needed;
+
+    if (!journal) return 0;
+    journal_lock(journal);
+    needed = !journal->compacting &&
+	journal->journal_len >= journal->threshold;
+    journal_unlock(journal);
+    return needed;
+}
+
+/* Free a compaction */
+static void compact_free(FPCompaction *c)
+{
+    free(c->buf);
+    free(c->tmpname);
+    free(c);
+}
+
+/* Set aside the current journal to be compacted into the store, and
+ * start a fresh one.  If snapshot is set, the new store is taken from
+ * the OtrlUserState now; otherwise it is rebuilt later from the store
+ * and the set-aside journal on disk, which is what reading them back
+ * would give.  The caller holds the journal's lock. */
+static gcry_error_t compact_begin(OtrlFPJournal *journal, int snapshot,
+	FPCompaction **compactp)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    FPCompaction *compact;
+
+    *compactp = NULL;
+    if (journal->compacting) return gcry_error(GPG_ERR_EEXIST);
+
+    compact = calloc(1, sizeof(FPCompaction));
+    if (!compact) return gcry_error(GPG_ERR_ENOMEM);
+    compact->filename = journal->filename;
+    compact->oldname = journal->oldname;
+
+    /* Take a snapshot of the store as it is now... */
+    if (snapshot) {
+	err = otrl_privkey_snapshot_fingerprints(journal->us, &compact->buf,
+		&compact->len);
+	if (err) {
+	    compact_free(compact);
+	    return err;
+	}
+    }
+
+    /* ...and start a fresh journal for the changes after it */
+    fclose(journal->journalf);
+    journal->journalf = NULL;
+    if (rename(journal->journalname, journal->oldname) &&
+	    errno != ENOENT) {
+	err = gcry_error_from_errno(errno);
+    }
+    if (!err) {
+	journal->journalf = fopen(journal->journalname, "wb");
+	if (!journal->journalf) {
+	    err = gcry_error_from_errno(errno);
+	    rename(journal->oldname, journal->journalname);
+	}
+	journal->journal_len = 0;
+    }
+    if (err) {
+	open_journal(journal);
+	compact_free(compact);
+	return err;
+    }
+
+    journal->compacting = 1;
+    *compactp = compact;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Build the new store from the old one and the set-aside journal, in
+ * an OtrlUserState of our own. */
+static gcry_error_t compact_rebuild(FPCompaction *c)
+{
+    gcry_error_t err;
+    OtrlUserState us = otrl_userstate_create();
+
+    if (!us) return gcry_error(GPG_ERR_ENOMEM);
+    err = otrl_privkey_read_fingerprints_bulk(us, c->filename, NULL, NULL,
+	    NULL);
+    if (gcry_err_code(err) == GPG_ERR_ENOENT) {
+	err = gcry_error(GPG_ERR_NO_ERROR);
+    }
+    if (!err) {
+	err = replay_journal(us, c->oldname, NULL, NULL);
+    }
+    if (!err) {
+	err = otrl_privkey_snapshot_fingerprints(us, &c->buf, &c->len);
+    }
+    otrl_userstate_free(us);
+    return err;
+}
+
+/* Put the compacted store in place and discard the set-aside journal,
+ * or if the compaction failed, put the journal back the way it was.
+ * The caller holds the journal's lock. */
+static gcry_error_t compact_end(OtrlFPJournal *journal, FPCompaction *c)
+{
+    gcry_error_t err = c->err;
+
+    if (c->f) {
+	err = otrl_fpstore_replace_end(journal->filename, c->f, c->tmpname,
+		err);
+	c->f = NULL;
+	c->tmpname = NULL;
+    } else if (!err) {
+	/* otrl_fpjournal_compact_calculate was never called */
+	err = gcry_error(GPG_ERR_ENOENT);
+    }
+
+    if (!err) {
+	remove(journal->oldname);
+    } else {
+	/* Put the journal back the way it was: the old journal, then
+	 * whatever has been appended since. */
+	fclose(journal->journalf);
+	journal->journalf = NULL;
+	if (!append_file(journal->journalname, journal->oldname)) {
+	    rename(journal->oldname, journal->journalname);
+	}
+	open_journal(journal);
+    }
+
+    /* If we started it ourselves and it failed, don't try again until
+     * the journal has grown by as much again. */
+    if (c->automatic) {
+	journal->auto_threshold = err ?
+	    journal->journal_len + journal->threshold : journal->threshold;
+    }
+
+    journal->compacting = 0;
+    compact_free(c);
+    return err;
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/* The state handed to an automatic compaction thread */
+typedef struct {
+    OtrlFPJournal *journal;
+    FPCompaction *compact;
+} FPAutoCompaction;
+
+static void *compact_auto_thread(void *arg)
+{
+    FPAutoCompaction *ac = arg;
+
+    otrl_fpjournal_compact_calculate(ac->compact);
+
+    journal_lock(ac->journal);
+    compact_end(ac->journal, ac->compact);
+    journal_unlock(ac->journal);
+    free(ac);
+    return NULL;
+}
+
+#endif
+
+/* Start compacting the journal ourselves, because it has grown past
+ * its threshold.  Only setting the journal aside happens here; the
+ * store is rebuilt and written in a background thread (or right away,
+ * if threads are not available).  The caller holds the journal's lock. */
+static void compact_auto(OtrlFPJournal *journal)
+{
+    FPCompaction *c;
+
+#ifdef HAVE_PTHREAD_H
+    FPAutoCompaction *ac;
+
+    /* The last one has finished, since we're not compacting; just make
+     * sure its thread is gone. */
+    if (journal->auto_thread_valid) {
+	pthread_join(journal->auto_thread, NULL);
+	journal->auto_thread_valid = 0;
+    }
+#endif
+
+    if (compact_begin(journal, 0, &c)) {
+	journal->auto_threshold = journal->journal_len + journal->threshold;
+	return;
+    }
+    c->automatic = 1;
+
+#ifdef HAVE_PTHREAD_H
+    ac = malloc(sizeof(FPAutoCompaction));
+    if (ac) {
+	ac->journal = journal;
+	ac->compact = c;
+	if (!pthread_create(&journal->auto_thread, NULL,
+		    compact_auto_thread, ac)) {
+	    journal->auto_thread_valid = 1;
+	    return;
+	}
+	free(ac);
+    }
+#endif
+
+    /* We already hold the journal's lock here. */
+    otrl_fpjournal_compact_calculate(c);
+    compact_end(journal, c);
+}
+
+/* Begin compacting the journal.  This routine must be called from the
+ * main thread.  It will set *compactp, which you can pass to
+ * otrl_fpjournal_compact_calculate in a background thread.  If it
+ * returns gcry_error(GPG_ERR_EEXIST), then a compaction (perhaps an
+ * automatic one) is already in progress, and *compactp will be set to
+ * NULL. */
+gcry_error_t otrl_fpjournal_compact_start(OtrlFPJournal *journal,
+	void **compactp)
+{
+    gcry_error_t err;
+    FPCompaction *compact;
+
+    journal_lock(journal);
+    err = compact_begin(journal, 1, &compact);
+    journal_unlock(journal);
+
+    *compactp = compact;
+    return err;
+}
+
+/* Write out the compacted store.  You may call this from a background
+ * thread.  When it completes, call otrl_fpjournal_compact_finish from
+ * the _main_ thread. */
+gcry_error_t otrl_fpjournal_compact_calculate(void *compact)
+{
+    FPCompaction *c = compact;
+
+    if (!c->buf && (c->err = compact_rebuild(c)) != 0) {
+	return c->err;
+    }
+
+    c->err = otrl_fpstore_replace_begin(c->filename, &c->f, &c->tmpname);
+    if (c->err) return c->err;
+    if ((c->len && fwrite(c->buf, c->len, 1, c->f) != 1) || fflush(c->f)) {
+	c->err = gcry_error_from_errno(errno);
+    }
+#ifdef HAVE_FSYNC
+    /* Sync it here, so that putting it in place under the journal's
+     * lock doesn't wait for the disk */
+    if (!c->err && fsync(fileno(c->f))) {
+	c->err = gcry_error_from_errno(errno);
+    }
+#endif
+    return c->err;
+}
+
+/* Call this from the main thread only, to put the compacted store in
+ * place and discard the old journal.  If the compaction failed, the
+ * old journal is kept, and its error is returned.  The compact object
+ * is deallocated, and must not be used further. */
+gcry_error_t otrl_fpjournal_compact_finish(OtrlFPJournal *journal,
+	void *compact)
+{
+    gcry_error_t err;
+
+    journal_lock(journal);
+    err = compact_end(journal, compact);
+    journal_unlock(journal);
+    return err;
+}
+
+/* Compact the journal synchronously. */
+gcry_error_t otrl_fpjournal_compact(OtrlFPJournal *journal)
+{
+    gcry_error_t err;
+    void *compact;
+
+    err = otrl_fpjournal_compact_start(journal, &compact);
+    if (err) return err;
+    otrl_fpjournal_compact_calculate(compact);
+    return otrl_fpjournal_compact_finish(journal, compact);
+}
@@ -0,0 +1,121 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __FPJOURNAL_H__
+#define __FPJOURNAL_H__
+
+#include <gcrypt.h>
+
+#include "context.h"
+#include "userstate.h"
+
+/* A journaled fingerprint store.  The store itself is an ordinary
+ * tab-separated fingerprint store file, as written by
+ * otrl_privkey_write_fingerprints.  While a journal is open on an
+ * OtrlUserState, each change to its fingerprints (adding one, setting
+ * its trust, or forgetting it) is appended as a single line to the
+ * journal file (the store's filename with ".journal" appended), so the
+ * cost of saving a change doesn't depend on the size of the store.
+ * Reading the store replays the journal over it.
+ *
+ * Once the journal grows past a given size, it should be compacted:
+ * the whole store is rewritten and the journal emptied.  Like private
+ * key generation, compaction is split into three parts, so that the
+ * slow part can be done in a background thread:
+ * otrl_fpjournal_compact_start and otrl_fpjournal_compact_finish must
+ * be called from the main thread, and otrl_fpjournal_compact_calculate
+ * may be called from any thread.  Changes made in the meantime go to a
+ * fresh journal.
+ *
+ * Journal lines look like store lines with a record type in front:
+ *    A\tusername\taccountname\tprotocol\tfingerprint\n
+ *    T\tusername\taccountname\tprotocol\tfingerprint[\ttrust]\n
+ *    F\tusername\taccountname\tprotocol\tfingerprint\n
+ * for adding a fingerprint, setting its trust, and forgetting it. */
+
+#define OTRL_FPJOURNAL_ADD    'A'
+#define OTRL_FPJOURNAL_TRUST  'T'
+#define OTRL_FPJOURNAL_FORGET 'F'
+
+/* The default journal size, in bytes, past which
+ * otrl_fpjournal_compact_needed returns true */
+#define OTRL_FPJOURNAL_DEFAULT_THRESHOLD (1024*1024)
+
+typedef struct s_OtrlFPJournal OtrlFPJournal;
+
+/* Read the fingerprint store in the given file, and its journal, into
+ * the given OtrlUserState, and then start journaling changes to its
+ * fingerprints.  Use add_app_data to add application data to each
+ * ConnContext so created.  If threshold is 0, use
+ * OTRL_FPJOURNAL_DEFAULT_THRESHOLD.  On success, *journalp is set to
+ * the new journal, which must be closed with otrl_fpjournal_close
+ * before the OtrlUserState is freed. */
+gcry_error_t otrl_fpjournal_open(OtrlFPJournal **journalp,
+	OtrlUserState us, const char *filename, size_t threshold,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void  *data);
+
+/* Stop journaling, and close the journal file.  Any compaction started
+ * with otrl_fpjournal_compact_start must have been finished first; an
+ * automatic one is waited for. */
+void otrl_fpjournal_close(OtrlFPJournal *journal);
+
+/* Make sure everything written to the journal so far is on disk. */
+gcry_error_t otrl_fpjournal_sync(OtrlFPJournal *journal);
+
+/* Append a record of the given type for the given Fingerprint to the
+ * journal of the OtrlUserState it belongs to, if it has one.  The
+ * context functions that change fingerprints call this themselves;
+ * fingerprints are logged as forgotten by
+ * otrl_context_forget_fingerprint and otrl_context_forget, but not by
+ * otrl_context_forget_all, which only lets go of them.  If this takes the journal past its threshold, compaction is started
+ * in the background. */
+void otrl_fpjournal_log(Fingerprint *fprint, char type);
+
+/* Return true if the journal has grown past its threshold, and no
+ * compaction is already in progress. */
+int otrl_fpjournal_compact_needed(OtrlFPJournal *journal);
+
+/* Begin compacting the journal.  This routine must be called from the
+ * main thread.  It will set *compactp, which you can pass to
+ * otrl_fpjournal_compact_calculate in a background thread.  If it
+ * returns gcry_error(GPG_ERR_EEXIST), then a compaction (perhaps an
+ * automatic one) is already in progress, and *compactp will be set to
+ * NULL. */
+gcry_error_t otrl_fpjournal_compact_start(OtrlFPJournal *journal,
+	void **compactp);
+
+/* Write out the compacted store.  You may call this from a background
+ * thread.  When it completes, call otrl_fpjournal_compact_finish from
+ * the _main_ thread. */
+gcry_error_t otrl_fpjournal_compact_calculate(void *compact);
+
+/* Call this from the main thread only, to put the compacted store in
+ * place and discard the old journal.  If the compaction failed, the
+ * old journal is kept, and its error is returned.  The compact object
+ * is deallocated, and must not be used further. */
+gcry_error_t otrl_fpjournal_compact_finish(OtrlFPJournal *journal,
+	void *compact);
+
+/* Compact the journal synchronously. */
+gcry_error_t otrl_fpjournal_compact(OtrlFPJournal *journal);
+
+#endif
@@ -0,0 +1,882 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "fpstore.h"
+#include "privkey.h"
+#include "hash.h"
+
+struct s_OtrlFPStore {
+    unsigned char *data;	    /* The whole file */
+    size_t len;
+    int mapped;			    /* Is data mmap'd (or malloc'd)? */
+    unsigned int num_contexts;
+    const unsigned char *contexts;
+    unsigned int num_fingerprints;
+    const unsigned char *fingerprints;
+    const char *strings;
+    unsigned int strings_len;
+    unsigned char *loaded;	    /* Which contexts have been copied
+				       into an OtrlUserState */
+};
+
+/* Read a 4-byte big-endian integer */
+static unsigned int get_int(const unsigned char *p)
+{
+    return (((unsigned int)p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Write a 4-byte big-endian integer */
+static void put_int(unsigned char *p, unsigned int v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+/* Return the string at the given offset of the string table, or "" if
+ * the offset is bad. */
+static const char *store_string(const OtrlFPStore *store, unsigned int off)
+{
+    if (off >= store->strings_len) return "";
+    return store->strings + off;
+}
+
+/* Compare the key of the idx'th context record to the given one, in
+ * context list order. */
+static int context_cmp(const OtrlFPStore *store, unsigned int idx,
+	const char *username, const char *accountname, const char *protocol)
+{
+    const unsigned char *rec = store->contexts +
+	idx * OTRL_FPSTORE_CONTEXT_LEN;
+    int cmp;
+
+    if ((cmp = strcmp(store_string(store, get_int(rec)), username)) != 0)
+	return cmp;
+    if ((cmp = strcmp(store_string(store, get_int(rec+4)),
+		    accountname)) != 0)
+	return cmp;
+    return strcmp(store_string(store, get_int(rec+8)), protocol);
+}
+
+/* Find the index of the context record for the given key, or return -1
+ * if there isn't one. */
+static long find_context(const OtrlFPStore *store, const char *username,
+	const char *accountname, const char *protocol)
+{
+    unsigned int lo = 0, hi = store->num_contexts;
+
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+	int cmp = context_cmp(store, mid, username, accountname, protocol);
+	if (cmp == 0) return mid;
+	if (cmp < 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return -1;
+}
+
+/* Find the range of fingerprint records belonging to the idx'th context
+ * record.  Return 0 if the record is bad. */
+static int context_fingerprints(const OtrlFPStore *store, unsigned int idx,
+	unsigned int *firstp, unsigned int *nump)
+{
+    const unsigned char *rec = store->contexts +
+	idx * OTRL_FPSTORE_CONTEXT_LEN;
+    unsigned int first = get_int(rec+12);
+    unsigned int num = get_int(rec+16);
+
+    if (first > store->num_fingerprints ||
+	    num > store->num_fingerprints - first) {
+	return 0;
+    }
+    *firstp = first;
+    *nump = num;
+    return 1;
+}
+
+/* Return the trust string of the given fingerprint record (or NULL). */
+static const char *fingerprint_trust(const OtrlFPStore *store,
+	const unsigned char *rec)
+{
+    unsigned int off = get_int(rec+20);
+
+    if (off == OTRL_FPSTORE_NO_TRUST) return NULL;
+    return store_string(store, off);
+}
+
+/* Open the binary fingerprint store in the given file, mapping it into
+ * memory where possible.  On success, *storep is set to the new store,
+ * which should be closed with otrl_fpstore_close. */
+gcry_error_t otrl_fpstore_open(OtrlFPStore **storep, const char *filename)
+{
+    OtrlFPStore *store;
+    struct stat st;
+    const unsigned char *hdr;
+    unsigned int contexts_off, fingerprints_off, strings_off;
+    size_t got;
+    int fd;
+
+    *storep = NULL;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+	return gcry_error_from_errno(errno);
+    }
+    if (fstat(fd, &st)) {
+	gcry_error_t err = gcry_error_from_errno(errno);
+	close(fd);
+	return err;
+    }
+    if (st.st_size < OTRL_FPSTORE_HEADER_LEN) {
+	close(fd);
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    store = calloc(1, sizeof(OtrlFPStore));
+    if (!store) {
+	close(fd);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    store->len = st.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+    store->data = mmap(NULL, store->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (store->data == MAP_FAILED) {
+	store->data = NULL;
+    } else {
+	store->mapped = 1;
+    }
+#endif
+    if (!store->data) {
+	/* Just read the whole thing in */
+	store->data = malloc(store->len);
+	if (!store->data) {
+	    free(store);
+	    close(fd);
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	for (got = 0; got < store->len; ) {
+	    ssize_t r = read(fd, store->data + got, store->len - got);
+	    if (r <= 0) {
+		gcry_error_t err = r < 0 ? gcry_error_from_errno(errno) :
+		    gcry_error(GPG_ERR_INV_VALUE);
+		free(store->data);
+		free(store);
+		close(fd);
+		return err;
+	    }
+	    got += r;
+	}
+    }
+    close(fd);
+
+    /* Check that the header is sane and that everything it points to
+     * is within the file.  The individual records are checked as we
+     * use them. */
+    hdr = store->data;
+    store->num_contexts = get_int(hdr+8);
+    contexts_off = get_int(hdr+12);
+    store->num_fingerprints = get_int(hdr+16);
+    fingerprints_off = get_int(hdr+20);
+    strings_off = get_int(hdr+24);
+    store->strings_len = get_int(hdr+28);
+
+    if (memcmp(hdr, OTRL_FPSTORE_MAGIC, OTRL_FPSTORE_MAGIC_LEN) ||
+	    contexts_off > store->len ||
+	    store->num_contexts > (store->len - contexts_off) /
+		OTRL_FPSTORE_CONTEXT_LEN ||
+	    fingerprints_off > store->len ||
+	    store->num_fingerprints > (store->len - fingerprints_off) /
+		OTRL_FPSTORE_FINGERPRINT_LEN ||
+	    strings_off > store->len ||
+	    store->strings_len > store->len - strings_off ||
+	    (store->strings_len > 0 &&
+	     store->data[strings_off + store->strings_len - 1] != '\0')) {
+	otrl_fpstore_close(store);
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+    store->contexts = store->data + contexts_off;
+    store->fingerprints = store->data + fingerprints_off;
+    store->strings = (const char *)store->data + strings_off;
+
+    store->loaded = calloc(store->num_contexts + 1, 1);
+    if (!store->loaded) {
+	otrl_fpstore_close(store);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    *storep = store;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Close a binary fingerprint store.  It must not be attached to any
+ * OtrlUserState at this point. */
+void otrl_fpstore_close(OtrlFPStore *store)
+{
+    if (!store) return;
+
+#ifdef HAVE_SYS_MMAN_H
+    if (store->mapped) {
+	munmap(store->data, store->len);
+    } else
+#endif
+    {
+	free(store->data);
+    }
+    free(store->loaded);
+    free(store);
+}
+
+/* Look up a fingerprint for the given user directly in the binary
+ * store, without touching any OtrlUserState.  Return 1 if it's there,
+ * and set *trustp (if trustp is not NULL) to its trust string (which
+ * may be NULL, and which points into the store), or 0 if not. */
+int otrl_fpstore_lookup(OtrlFPStore *store, const char *username,
+	const char *accountname, const char *protocol,
+	const unsigned char fingerprint[20], const char **trustp)
+{
+    long idx;
+    unsigned int lo, hi;
+
+    if (!store || !username || !accountname || !protocol) return 0;
+
+    idx = find_context(store, username, accountname, protocol);
+    if (idx < 0 || !context_fingerprints(store, idx, &lo, &hi)) return 0;
+    hi += lo;
+
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+	const unsigned char *rec = store->fingerprints +
+	    mid * OTRL_FPSTORE_FINGERPRINT_LEN;
+	int cmp = memcmp(rec, fingerprint, 20);
+	if (cmp == 0) {
+	    if (trustp) *trustp = fingerprint_trust(store, rec);
+	    return 1;
+	}
+	if (cmp < 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return 0;
+}
+
+/* Copy the fingerprints for the given master context out of the store,
+ * if they haven't been already.  otrl_context_find calls this for you
+ * when it adds a master context to an OtrlUserState with an attached
+ * store. */
+void otrl_fpstore_load_context(OtrlFPStore *store, ConnContext *context)
+{
+    long idx;
+    unsigned int first, num, i;
+
+    if (!store || !context) return;
+    context = context->m_context;
+
+    idx = find_context(store, context->username, context->accountname,
+	    context->protocol);
+    if (idx < 0 || store->loaded[idx]) return;
+    store->loaded[idx] = 1;
+    if (!context_fingerprints(store, idx, &first, &num)) return;
+
+    for (i = first; i < first + num; ++i) {
+	const unsigned char *rec = store->fingerprints +
+	    i * OTRL_FPSTORE_FINGERPRINT_LEN;
+	Fingerprint *fng = otrl_context_find_fingerprint(context,
+		(unsigned char *)rec, 1, NULL);
+	otrl_context_set_trust(fng, fingerprint_trust(store, rec));
+    }
+}
+
+/* Attach a binary fingerprint store to the given OtrlUserState, or
+ * detach it if store is NULL.  While a store is attached, the
+ * fingerprints for a context are copied out of the store into the
+ * OtrlUserState when its master context is first created (and
+ * immediately, for master contexts which already exist), so contexts
+ * which are never used are never built. */
+void otrl_fpstore_attach(OtrlUserState us, OtrlFPStore *store)
+{
+    ConnContext *context;
+
+    us->fpstore = store;
+    if (!store) return;
+
+    for (context = us->context_root; context; context = context->next) {
+	if (context->their_instance == OTRL_INSTAG_MASTER) {
+	    otrl_fpstore_load_context(store, context);
+	}
+    }
+}
+
+/* A binary fingerprint store being built in memory */
+typedef struct {
+    unsigned char *contexts;
+    size_t contexts_len, contexts_size;
+    unsigned char *fingerprints;
+    size_t fingerprints_len, fingerprints_size;
+    char *strings;
+    size_t strings_len, strings_size;
+    unsigned int *string_slots;	    /* Offset+1 of each interned string,
+				       or 0 for an empty slot */
+    unsigned int num_string_slots, num_strings;
+} StoreBuilder;
+
+/* Make sure there's room for len more bytes in *bufp. */
+static int builder_reserve(unsigned char **bufp, size_t *sizep,
+	size_t used, size_t len)
+{
+    if (used + len > *sizep) {
+	size_t newsize = *sizep ? *sizep : 1024;
+	unsigned char *newbuf;
+	while (newsize < used + len) newsize *= 2;
+	newbuf = realloc(*bufp, newsize);
+	if (!newbuf) return 0;
+	*bufp = newbuf;
+	*sizep = newsize;
+    }
+    return 1;
+}
+
+/* Add a string to the builder's string table, if it's not already
+ * there, and set *offp to its offset.  Return 0 if we run out of
+ * memory. */
+static int builder_intern(StoreBuilder *b, const char *s, unsigned int *offp)
+{
+    size_t len = strlen(s) + 1;
+    unsigned int mask, i, hash = otrl_hash_string(OTRL_HASH_INIT, s);
+
+    /* Keep the table at most half full */
+    if (2 * (b->num_strings + 1) > b->num_string_slots) {
+	unsigned int newnum = b->num_string_slots ?
+	    2 * b->num_string_slots : 256;
+	unsigned int *newslots = calloc(newnum, sizeof(unsigned int));
+	if (!newslots) return 0;
+	for (i = 0; i < b->num_string_slots; ++i) {
+	    if (b->string_slots[i]) {
+		unsigned int j = otrl_hash_string(OTRL_HASH_INIT,
+			b->strings + b->string_slots[i] - 1) & (newnum - 1);
+		while (newslots[j]) j = (j + 1) & (newnum - 1);
+		newslots[j] = b->string_slots[i];
+	    }
+	}
+	free(b->string_slots);
+	b->string_slots = newslots;
+	b->num_string_slots = newnum;
+    }
+
+    mask = b->num_string_slots - 1;
+    for (i = hash & mask; b->string_slots[i]; i = (i + 1) & mask) {
+	if (!strcmp(b->strings + b->string_slots[i] - 1, s)) {
+	    *offp = b->string_slots[i] - 1;
+	    return 1;
+	}
+    }
+
+    if (b->strings_len + len >= OTRL_FPSTORE_NO_TRUST ||
+	    !builder_reserve((unsigned char **)&b->strings,
+		&b->strings_size, b->strings_len, len)) {
+	return 0;
+    }
+    memmove(b->strings + b->strings_len, s, len);
+    *offp = b->strings_len;
+    b->string_slots[i] = b->strings_len + 1;
+    b->strings_len += len;
+    b->num_strings++;
+    return 1;
+}
+
+/* Order 24-byte fingerprint records by fingerprint */
+static int fingerprint_record_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, 20);
+}
+
+/* Add a context record to the builder, with the given fingerprints
+ * (from the given context, or the idx'th record of the given store, or
+ * both).  Contexts must be added in context list order. */
+static int builder_add_context(StoreBuilder *b, ConnContext *context,
+	const OtrlFPStore *store, long idx)
+{
+    unsigned int first = b->fingerprints_len / OTRL_FPSTORE_FINGERPRINT_LEN;
+    unsigned int off[3], trustoff, num, sfirst = 0, snum = 0, i;
+    unsigned char *rec;
+    Fingerprint *fprint;
+
+    if (store && idx >= 0 &&
+	    !context_fingerprints(store, idx, &sfirst, &snum)) {
+	snum = 0;
+    }
+
+    if (context) {
+	for (fprint = context->fingerprint_root.next; fprint;
+		fprint = fprint->next) {
+	    if (!builder_reserve(&b->fingerprints, &b->fingerprints_size,
+			b->fingerprints_len, OTRL_FPSTORE_FINGERPRINT_LEN))
+		return 0;
+	    trustoff = OTRL_FPSTORE_NO_TRUST;
+	    if (fprint->trust &&
+		    !builder_intern(b, fprint->trust, &trustoff)) return 0;
+	    rec = b->fingerprints + b->fingerprints_len;
+	    memmove(rec, fprint->fingerprint, 20);
+	    put_int(rec+20, trustoff);
+	    b->fingerprints_len += OTRL_FPSTORE_FINGERPRINT_LEN;
+	}
+    }
+    for (i = sfirst; i < sfirst + snum; ++i) {
+	const unsigned char *srec = store->fingerprints +
+	    i * OTRL_FPSTORE_FINGERPRINT_LEN;
+	const char *trust = fingerprint_trust(store, srec);
+
+	/* The context's own copy wins */
+	if (context && otrl_context_find_fingerprint(context,
+		    (unsigned char *)srec, 0, NULL)) continue;
+
+	if (!builder_reserve(&b->fingerprints, &b->fingerprints_size,
+		    b->fingerprints_len, OTRL_FPSTORE_FINGERPRINT_LEN))
+	    return 0;
+	trustoff = OTRL_FPSTORE_NO_TRUST;
+	if (trust && !builder_intern(b, trust, &trustoff)) return 0;
+	rec = b->fingerprints + b->fingerprints_len;
+	memmove(rec, srec, 20);
+	put_int(rec+20, trustoff);
+	b->fingerprints_len += OTRL_FPSTORE_FINGERPRINT_LEN;
+    }
+
+    num = b->fingerprints_len / OTRL_FPSTORE_FINGERPRINT_LEN - first;
+    if (num == 0) return 1;
+    qsort(b->fingerprints + first * OTRL_FPSTORE_FINGERPRINT_LEN, num,
+	    OTRL_FPSTORE_FINGERPRINT_LEN, fingerprint_record_cmp);
+
+    if (context) {
+	if (!builder_intern(b, context->username, &off[0]) ||
+		!builder_intern(b, context->accountname, &off[1]) ||
+		!builder_intern(b, context->protocol, &off[2])) return 0;
+    } else {
+	const unsigned char *srec = store->contexts +
+	    idx * OTRL_FPSTORE_CONTEXT_LEN;
+	for (i = 0; i < 3; ++i) {
+	    if (!builder_intern(b, store_string(store, get_int(srec + 4*i)),
+			&off[i])) return 0;
+	}
+    }
+
+    if (!builder_reserve(&b->contexts, &b->contexts_size, b->contexts_len,
+		OTRL_FPSTORE_CONTEXT_LEN))
+	return 0;
+    rec = b->contexts + b->contexts_len;
+    put_int(rec, off[0]);
+    put_int(rec+4, off[1]);
+    put_int(rec+8, off[2]);
+    put_int(rec+12, first);
+    put_int(rec+16, num);
+    b->contexts_len += OTRL_FPSTORE_CONTEXT_LEN;
+    return 1;
+}
+
+/* Walk the (sorted) master contexts of the given OtrlUserState and the
+ * (sorted) contexts of its attached store which haven't been loaded
+ * together, in context list order, calling cb(data, context, store,
+ * idx) for each, with whichever of context (or NULL) and idx (or -1)
+ * it came from.  Stop as soon as cb returns nonzero, and return that
+ * value. */
+static int merge_contexts(OtrlUserState us,
+	int (*cb)(void *data, ConnContext *context, const OtrlFPStore *store,
+	    long idx), void *data)
+{
+    OtrlFPStore *store = us->fpstore;
+    ConnContext *context = us->context_root;
+    unsigned int idx = 0;
+
+    while (context || (store && idx < store->num_contexts)) {
+	int cmp;
+	int ret;
+
+	if (context && context->their_instance != OTRL_INSTAG_MASTER) {
+	    context = context->next;
+	    continue;
+	}
+	if (store && idx < store->num_contexts && store->loaded[idx]) {
+	    ++idx;
+	    continue;
+	}
+
+	if (!context) {
+	    cmp = 1;
+	} else if (!store || idx >= store->num_contexts) {
+	    cmp = -1;
+	} else {
+	    cmp = -context_cmp(store, idx, context->username,
+		    context->accountname, context->protocol);
+	}
+
+	if (cmp < 0) {
+	    ret = cb(data, context, NULL, -1);
+	    context = context->next;
+	} else if (cmp > 0) {
+	    ret = cb(data, NULL, store, idx);
+	    ++idx;
+	} else {
+	    ret = cb(data, context, store, idx);
+	    context = context->next;
+	    ++idx;
+	}
+	if (ret) return ret;
+    }
+    return 0;
+}
+
+/* merge_contexts callback for otrl_fpstore_write */
+static int write_context_cb(void *data, ConnContext *context,
+	const OtrlFPStore *store, long idx)
+{
+    return !builder_add_context(data, context, store, idx);
+}
+
+/* The state of an otrl_fpstore_foreach_fingerprint walk */
+typedef struct {
+    int (*cb)(void *data, const char *username, const char *accountname,
+	    const char *protocol, const unsigned char fingerprint[20],
+	    const char *trust);
+    void *data;
+} ForeachFingerprint;
+
+/* merge_contexts callback for otrl_fpstore_foreach_fingerprint */
+static int foreach_context_cb(void *data, ConnContext *context,
+	const OtrlFPStore *store, long idx)
+{
+    ForeachFingerprint *ff = data;
+    unsigned int first = 0, num = 0, i;
+    const unsigned char *crec = NULL;
+    Fingerprint *fprint;
+    int ret;
+
+    if (context) {
+	for (fprint = context->fingerprint_root.next; fprint;
+		fprint = fprint->next) {
+	    ret = ff->cb(ff->data, context->username, context->accountname,
+		    context->protocol, fprint->fingerprint, fprint->trust);
+	    if (ret) return ret;
+	}
+    }
+    if (!store || idx < 0 || !context_fingerprints(store, idx, &first, &num))
+	return 0;
+
+    crec = store->contexts + idx * OTRL_FPSTORE_CONTEXT_LEN;
+    for (i = first; i < first + num; ++i) {
+	const unsigned char *rec = store->fingerprints +
+	    i * OTRL_FPSTORE_FINGERPRINT_LEN;
+
+	/* The context's own copy wins */
+	if (context && otrl_context_find_fingerprint(context,
+		    (unsigned char *)rec, 0, NULL)) continue;
+
+	ret = ff->cb(ff->data, store_string(store, get_int(crec)),
+		store_string(store, get_int(crec+4)),
+		store_string(store, get_int(crec+8)), rec,
+		fingerprint_trust(store, rec));
+	if (ret) return ret;
+    }
+    return 0;
+}
+
+/* Call cb(data, username, accountname, protocol, fingerprint, trust)
+ * for each fingerprint in the given OtrlUserState, and for each one in
+ * its attached store (if any) which hasn't been loaded, in context list
+ * order.  The strings may point into the store, so they are only good
+ * until cb returns.  Stop as soon as cb returns nonzero, and return
+ * that value; otherwise return 0. */
+int otrl_fpstore_foreach_fingerprint(OtrlUserState us,
+	int (*cb)(void *data, const char *username, const char *accountname,
+	    const char *protocol, const unsigned char fingerprint[20],
+	    const char *trust), void *data)
+{
+    ForeachFingerprint ff;
+
+    ff.cb = cb;
+    ff.data = data;
+    return merge_contexts(us, foreach_context_cb, &ff);
+}
+
+#ifdef HAVE_FSYNC
+/* Sync the directory containing the given file to disk, so that a
+ * rename into it survives a crash.  Filesystems which can't sync a
+ * directory are not treated as an error. */
+static gcry_error_t sync_directory(const char *filename)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    const char *slash = strrchr(filename, '/');
+    char *dirname;
+    int fd;
+
+    if (!slash) {
+	dirname = strdup(".");
+    } else {
+	size_t len = slash == filename ? 1 : slash - filename;
+	dirname = malloc(len + 1);
+	if (dirname) {
+	    memmove(dirname, filename, len);
+	    dirname[len] = '\0';
+	}
+    }
+    if (!dirname) return gcry_error(GPG_ERR_ENOMEM);
+
+    fd = open(dirname, O_RDONLY);
+    free(dirname);
+    if (fd < 0) return gcry_error_from_errno(errno);
+    if (fsync(fd) && errno != EINVAL && errno != EBADF) {
+	err = gcry_error_from_errno(errno);
+    }
+    close(fd);
+    return err;
+}
+#endif
+
+/* Open a temporary file in which to write a replacement for the given
+ * file, for otrl_fpstore_replace_end to put in its place.  The file is
+ * returned in *fp, and its name in *tmpnamep.  Its name is made unique
+ * with mkstemp where possible, so that two writers replacing the same
+ * file never write into each other's temporary file. */
+gcry_error_t otrl_fpstore_replace_begin(const char *filename, FILE **fp,
+	char **tmpnamep)
+{
+    gcry_error_t err;
+    char *tmpname;
+#ifdef HAVE_MKSTEMP
+    int fd;
+
+    tmpname = malloc(strlen(filename) + 8);
+    if (!tmpname) return gcry_error(GPG_ERR_ENOMEM);
+    sprintf(tmpname, "%s.XXXXXX", filename);
+
+    fd = mkstemp(tmpname);
+    if (fd < 0) {
+	err = gcry_error_from_errno(errno);
+	free(tmpname);
+	return err;
+    }
+    *fp = fdopen(fd, "wb");
+    if (!*fp) {
+	err = gcry_error_from_errno(errno);
+	close(fd);
+	remove(tmpname);
+	free(tmpname);
+	return err;
+    }
+#else
+    tmpname = malloc(strlen(filename) + 5);
+    if (!tmpname) return gcry_error(GPG_ERR_ENOMEM);
+    sprintf(tmpname, "%s.tmp", filename);
+
+    *fp = fopen(tmpname, "wb");
+    if (!*fp) {
+	err = gcry_error_from_errno(errno);
+	free(tmpname);
+	return err;
+    }
+#endif
+
+    *tmpnamep = tmpname;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Finish a replacement begun with otrl_fpstore_replace_begin: sync the
+ * temporary file f to disk, close it, rename it over filename, and
+ * sync the directory, so that a crash leaves either the old file or
+ * the whole of the new one.  Pass in err any error writing f.  If
+ * that or any of these steps fails, the temporary file is removed
+ * instead, and the old file left alone.  tmpname is freed either
+ * way. */
+gcry_error_t otrl_fpstore_replace_end(const char *filename, FILE *f,
+	char *tmpname, gcry_error_t err)
+{
+    if (!err && (fflush(f) || ferror(f))) {
+	err = gcry_error_from_errno(errno);
+    }
+#ifdef HAVE_FSYNC
+    if (!err && fsync(fileno(f))) {
+	err = gcry_error_from_errno(errno);
+    }
+#endif
+    if (fclose(f) && !err) {
+	err = gcry_error_from_errno(errno);
+    }
+    if (!err && rename(tmpname, filename)) {
+	err = gcry_error_from_errno(errno);
+    }
+    if (err) {
+	remove(tmpname);
+    }
+    free(tmpname);
+#ifdef HAVE_FSYNC
+    if (!err) err = sync_directory(filename);
+#endif
+    return err;
+}
+
+/* Write the fingerprints in the given OtrlUserState, together with
+ * those in its attached store (if any) which haven't been loaded, to
+ * the given file as a binary fingerprint store.  The file is written
+ * under a temporary name, synced to disk, and then renamed into place,
+ * so this is safe even if it is the file the attached store was opened
+ * from, and a crash never leaves a partly-written store. */
+gcry_error_t otrl_fpstore_write(OtrlUserState us, const char *filename)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    StoreBuilder b;
+    unsigned char hdr[OTRL_FPSTORE_HEADER_LEN];
+    size_t total;
+    char *tmpname;
+    FILE *f;
+
+    memset(&b, 0, sizeof(b));
+
+    if (merge_contexts(us, write_context_cb, &b)) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+	goto done;
+    }
+
+    total = OTRL_FPSTORE_HEADER_LEN + b.contexts_len + b.fingerprints_len +
+	b.strings_len;
+    if (total >= OTRL_FPSTORE_NO_TRUST) {
+	err = gcry_error(GPG_ERR_TOO_LARGE);
+	goto done;
+    }
+
+    memmove(hdr, OTRL_FPSTORE_MAGIC, OTRL_FPSTORE_MAGIC_LEN);
+    put_int(hdr+8, b.contexts_len / OTRL_FPSTORE_CONTEXT_LEN);
+    put_int(hdr+12, OTRL_FPSTORE_HEADER_LEN);
+    put_int(hdr+16, b.fingerprints_len / OTRL_FPSTORE_FINGERPRINT_LEN);
+    put_int(hdr+20, OTRL_FPSTORE_HEADER_LEN + b.contexts_len);
+    put_int(hdr+24, OTRL_FPSTORE_HEADER_LEN + b.contexts_len +
+	    b.fingerprints_len);
+    put_int(hdr+28, b.strings_len);
+
+    err = otrl_fpstore_replace_begin(filename, &f, &tmpname);
+    if (err) goto done;
+    if (fwrite(hdr, OTRL_FPSTORE_HEADER_LEN, 1, f) != 1 ||
+	    (b.contexts_len &&
+	     fwrite(b.contexts, b.contexts_len, 1, f) != 1) ||
+	    (b.fingerprints_len &&
+	     fwrite(b.fingerprints, b.fingerprints_len, 1, f) != 1) ||
+	    (b.strings_len &&
+	     fwrite(b.strings, b.strings_len, 1, f) != 1)) {
+	err = gcry_error_from_errno(errno);
+    }
+    err = otrl_fpstore_replace_end(filename, f, tmpname, err);
+
+done:
+    free(b.contexts);
+    free(b.fingerprints);
+    free(b.strings);
+    free(b.string_slots);
+    return err;
+}
+
+/* Convert a fingerprint store in the tab-separated format to a binary
+ * one. */
+gcry_error_t otrl_fpstore_convert_from_text(const char *textfile,
+	const char *binfile)
+{
+    gcry_error_t err;
+    OtrlUserState us = otrl_userstate_create();
+
+    err = otrl_privkey_read_fingerprints_bulk(us, textfile, NULL, NULL,
+	    NULL);
+    if (!err) {
+	err = otrl_fpstore_write(us, binfile);
+    }
+
+    otrl_userstate_free(us);
+    return err;
+}
+
+/* Convert a binary fingerprint store to the tab-separated format. */
+gcry_error_t otrl_fpstore_convert_to_text(const char *binfile,
+	const char *textfile)
+{
+    gcry_error_t err;
+    OtrlFPStore *store;
+    unsigned int idx;
+    FILE *storef;
+
+    err = otrl_fpstore_open(&store, binfile);
+    if (err) return err;
+
+    storef = fopen(textfile, "wb");
+    if (!storef) {
+	err = gcry_error_from_errno(errno);
+	otrl_fpstore_close(store);
+	return err;
+    }
+
+    for (idx = 0; idx < store->num_contexts; ++idx) {
+	const unsigned char *crec = store->contexts +
+	    idx * OTRL_FPSTORE_CONTEXT_LEN;
+	unsigned int first, num, i;
+
+	if (!context_fingerprints(store, idx, &first, &num)) continue;
+	for (i = first; i < first + num; ++i) {
+	    const unsigned char *rec = store->fingerprints +
+		i * OTRL_FPSTORE_FINGERPRINT_LEN;
+	    const char *trust = fingerprint_trust(store, rec);
+	    int j;
+
+	    fprintf(storef, "%s\t%s\t%s\t", store_string(store, get_int(crec)),
+		    store_string(store, get_int(crec+4)),
+		    store_string(store, get_int(crec+8)));
+	    for(j=0;j<20;++j) {
+		fprintf(storef, "%02x", rec[j]);
+	    }
+	    fprintf(storef, "\t%s\n", trust ? trust : "");
+	}
+    }
+
+    if (fclose(storef)) {
+	err = gcry_error_from_errno(errno);
+    }
+    otrl_fpstore_close(store);
+    return err;
+}
@@ -0,0 +1,147 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __FPSTORE_H__
+#define __FPSTORE_H__
+
+#include <stdio.h>
+
+#include <gcrypt.h>
+
+#include "context.h"
+#include "userstate.h"
+
+/* A binary fingerprint store, which holds the same information as the
+ * tab-separated one written by otrl_privkey_write_fingerprints, but in
+ * a form that can be mapped into memory and searched directly.  All
+ * integers are 4 bytes, big-endian.  The file is laid out as:
+ *
+ *    Header:
+ *	"OTRFPST1"		magic number (8 bytes)
+ *	num_contexts		number of context records
+ *	contexts_offset		file offset of the context records
+ *	num_fingerprints	number of fingerprint records
+ *	fingerprints_offset	file offset of the fingerprint records
+ *	strings_offset		file offset of the string table
+ *	strings_len		length of the string table
+ *    Context records (20 bytes each), sorted in the same order as the
+ *    context list (by username, then accountname, then protocol):
+ *	username		offset of username in the string table
+ *	accountname		offset of accountname in the string table
+ *	protocol		offset of protocol in the string table
+ *	first_fingerprint	index of the context's first fingerprint
+ *	num_fingerprints	number of fingerprints for this context
+ *    Fingerprint records (24 bytes each), grouped by context, and
+ *    sorted by fingerprint within each context:
+ *	fingerprint		the 20-byte fingerprint
+ *	trust			offset of the trust string in the string
+ *				table, or OTRL_FPSTORE_NO_TRUST
+ *    String table:
+ *	NUL-terminated strings, each distinct string appearing once
+ */
+
+#define OTRL_FPSTORE_MAGIC "OTRFPST1"
+#define OTRL_FPSTORE_MAGIC_LEN 8
+#define OTRL_FPSTORE_HEADER_LEN 32
+#define OTRL_FPSTORE_CONTEXT_LEN 20
+#define OTRL_FPSTORE_FINGERPRINT_LEN 24
+#define OTRL_FPSTORE_NO_TRUST 0xffffffff
+
+typedef struct s_OtrlFPStore OtrlFPStore;
+
+/* Open the binary fingerprint store in the given file, mapping it into
+ * memory where possible.  On success, *storep is set to the new store,
+ * which should be closed with otrl_fpstore_close. */
+gcry_error_t otrl_fpstore_open(OtrlFPStore **storep, const char *filename);
+
+/* Close a binary fingerprint store.  It must not be attached to any
+ * OtrlUserState at this point. */
+void otrl_fpstore_close(OtrlFPStore *store);
+
+/* Look up a fingerprint for the given user directly in the binary
+ * store, without touching any OtrlUserState.  Return 1 if it's there,
+ * and set *trustp (if trustp is not NULL) to its trust string (which
+ * may be NULL, and which points into the store), or 0 if not. */
+int otrl_fpstore_lookup(OtrlFPStore *store, const char *username,
+	const char *accountname, const char *protocol,
+	const unsigned char fingerprint[20], const char **trustp);
+
+/* Attach a binary fingerprint store to the given OtrlUserState, or
+ * detach it if store is NULL.  While a store is attached, the
+ * fingerprints for a context are copied out of the store into the
+ * OtrlUserState when its master context is first created (and
+ * immediately, for master contexts which already exist), so contexts
+ * which are never used are never built. */
+void otrl_fpstore_attach(OtrlUserState us, OtrlFPStore *store);
+
+/* Copy the fingerprints for the given master context out of the store,
+ * if they haven't been already.  otrl_context_find calls this for you
+ * when it adds a master context to an OtrlUserState with an attached
+ * store. */
+void otrl_fpstore_load_context(OtrlFPStore *store, ConnContext *context);
+
+/* Call cb(data, username, accountname, protocol, fingerprint, trust)
+ * for each fingerprint in the given OtrlUserState, and for each one in
+ * its attached store (if any) which hasn't been loaded, in context list
+ * order.  The strings may point into the store, so they are only good
+ * until cb returns.  Stop as soon as cb returns nonzero, and return
+ * that value; otherwise return 0. */
+int otrl_fpstore_foreach_fingerprint(OtrlUserState us,
+	int (*cb)(void *data, const char *username, const char *accountname,
+	    const char *protocol, const unsigned char fingerprint[20],
+	    const char *trust), void *data);
+
+/* Write the fingerprints in the given OtrlUserState, together with
+ * those in its attached store (if any) which haven't been loaded, to
+ * the given file as a binary fingerprint store.  The file is written
+ * under a temporary name, synced to disk, and then renamed into place,
+ * so this is safe even if it is the file the attached store was opened
+ * from, and a crash never leaves a partly-written store. */
+gcry_error_t otrl_fpstore_write(OtrlUserState us, const char *filename);
+
+/* Open a temporary file in which to write a replacement for the given
+ * file, for otrl_fpstore_replace_end to put in its place.  The file is
+ * returned in *fp, and its name in *tmpnamep.  Its name is made unique
+ * with mkstemp where possible, so that two writers replacing the same
+ * file never write into each other's temporary file. */
+gcry_error_t otrl_fpstore_replace_begin(const char *filename, FILE **fp,
+	char **tmpnamep);
+
+/* Finish a replacement begun with otrl_fpstore_replace_begin: sync the
+ * temporary file f to disk, close it, rename it over filename, and
+ * sync the directory, so that a crash leaves either the old file or
+ * the whole of the new one.  Pass in err any error writing f.  If
+ * that or any of these steps fails, the temporary file is removed
+ * instead, and the old file left alone.  tmpname is freed either
+ * way. */
+gcry_error_t otrl_fpstore_replace_end(const char *filename, FILE *f,
+	char *tmpname, gcry_error_t err);
+
+/* Convert a fingerprint store in the tab-separated format to a binary
+ * one. */
+gcry_error_t otrl_fpstore_convert_from_text(const char *textfile,
+	const char *binfile);
+
+/* Convert a binary fingerprint store to the tab-separated format. */
+gcry_error_t otrl_fpstore_convert_to_text(const char *binfile,
+	const char *textfile);
+
+#endif
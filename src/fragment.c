@@ -0,0 +1,334 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdlib.h>
+#include <string.h>
+
+/* libotr headers */
+#include "fragment.h"
+#include "userstate.h"
+#include "uslock.h"
+
+/* Where one fragment's piece of the message sits in the slot's data */
+typedef struct {
+    size_t offset;
+    size_t len;
+} FragmentPiece;
+
+struct s_OtrlFragmentSlot {
+    struct s_OtrlFragmentSlot *next;
+    struct s_OtrlFragmentSlot **tous;
+    unsigned int sender;         /* The sender's instance tag, or 0 */
+    unsigned short n;            /* The number of fragments */
+    unsigned short have;         /* The number of them we have */
+    int inorder;                 /* Have they all arrived in order? */
+    time_t lastrcvd;             /* When we last got one of them */
+    size_t bytes;                /* What we count against the
+				    userstate's limit */
+    char *data;                  /* The pieces, in order of arrival */
+    size_t datalen;
+    size_t datasize;             /* The space allocated for data */
+    FragmentPiece *pieces;       /* Where piece k is in data is in
+				    pieces[k-1] */
+    unsigned char *bitmap;       /* Bit k-1 is set if we have piece k */
+};
+
+/* Account for more bytes held by slot, unless that would take the
+ * context or the userstate over its limit, in which case return 0. */
+static int slot_account(ConnContextPriv *context_priv,
+	OtrlFragmentSlot *slot, size_t more)
+{
+    OtrlUserState us = context_priv->us;
+    size_t context_limit = us ? us->fragment_context_limit :
+	OTRL_FRAGMENT_MAX_CONTEXT_BYTES;
+
+    /* Lowering the limits can leave either already over them */
+    if (context_priv->fragment_bytes >= context_limit ||
+	    more > context_limit - context_priv->fragment_bytes) return 0;
+    if (us) {
+	otrl_uslock_shared_lock(us);
+	if (us->fragment_bytes >= us->fragment_limit ||
+		more > us->fragment_limit - us->fragment_bytes) {
+	    otrl_uslock_shared_unlock(us);
+	    return 0;
+	}
+	us->fragment_bytes += more;
+	otrl_uslock_shared_unlock(us);
+    }
+    context_priv->fragment_bytes += more;
+    slot->bytes += more;
+    return 1;
+}
+
+/* Make sure slot's data has room for at least needed bytes.  If it
+ * has to grow, try to make room for want bytes, so that we don't have
+ * to grow it again for every piece, but settle for needed if want
+ * would go over the limits.  Return 0 if we can't. */
+static int slot_reserve(ConnContextPriv *context_priv,
+	OtrlFragmentSlot *slot, size_t needed, size_t want)
+{
+    char *newdata;
+
+    if (needed <= slot->datasize) return 1;
+
+    if (want < needed || !slot_account(context_priv, slot,
+		want - slot->datasize)) {
+	want = needed;
+	if (!slot_account(context_priv, slot, want - slot->datasize)) {
+	    return 0;
+	}
+    }
+    newdata = realloc(slot->data, want);
+    if (!newdata) return 0;
+    slot->data = newdata;
+    slot->datasize = want;
+    return 1;
+}
+
+static void slot_free(ConnContextPriv *context_priv, OtrlFragmentSlot *slot)
+{
+    *(slot->tous) = slot->next;
+    if (slot->next) {
+	slot->next->tous = slot->tous;
+    }
+    --context_priv->num_fragment_slots;
+    context_priv->fragment_bytes -= slot->bytes;
+    if (context_priv->us) {
+	otrl_uslock_shared_lock(context_priv->us);
+	context_priv->us->fragment_bytes -= slot->bytes;
+	otrl_uslock_shared_unlock(context_priv->us);
+    }
+    free(slot->data);
+    free(slot);
+}
+
+/* Put slot at the front of the context's list, which is kept in order
+ * of when we last heard from each slot. */
+static void slot_to_front(ConnContextPriv *context_priv,
+	OtrlFragmentSlot *slot)
+{
+    if (context_priv->fragment_slots == slot) return;
+
+    *(slot->tous) = slot->next;
+    if (slot->next) {
+	slot->next->tous = slot->tous;
+    }
+    slot->next = context_priv->fragment_slots;
+    slot->tous = &(context_priv->fragment_slots);
+    if (slot->next) {
+	slot->next->tous = &(slot->next);
+    }
+    context_priv->fragment_slots = slot;
+}
+
+/* Make a new, empty slot for a message of n fragments from the given
+ * sender, discarding the least recently heard from slot if there are
+ * already too many. */
+static OtrlFragmentSlot *slot_new(ConnContextPriv *context_priv,
+	unsigned int sender, unsigned short n)
+{
+    OtrlFragmentSlot *slot;
+    size_t size = sizeof(OtrlFragmentSlot) + n * sizeof(FragmentPiece) +
+	(n + 7) / 8;
+
+    if (context_priv->num_fragment_slots >= OTRL_FRAGMENT_MAX_SLOTS) {
+	OtrlFragmentSlot *oldest = context_priv->fragment_slots;
+	while (oldest->next) oldest = oldest->next;
+	slot_free(context_priv, oldest);
+    }
+
+    slot = calloc(1, size);
+    if (!slot) return NULL;
+    slot->sender = sender;
+    slot->n = n;
+    slot->inorder = 1;
+    slot->pieces = (FragmentPiece *)(slot + 1);
+    slot->bitmap = (unsigned char *)(slot->pieces + n);
+
+    slot->next = context_priv->fragment_slots;
+    slot->tous = &(context_priv->fragment_slots);
+    if (slot->next) {
+	slot->next->tous = &(slot->next);
+    }
+    context_priv->fragment_slots = slot;
+    ++context_priv->num_fragment_slots;
+
+    if (!slot_account(context_priv, slot, size)) {
+	slot_free(context_priv, slot);
+	return NULL;
+    }
+    return slot;
+}
+
+/* Put the pieces of the complete message in slot together, and free
+ * the slot.  Return the message, or NULL on a memory error. */
+static char *slot_finish(ConnContextPriv *context_priv,
+	OtrlFragmentSlot *slot)
+{
+    char *message;
+    unsigned int i;
+
+    if (slot->inorder) {
+	/* The data is already the message; there's room left for the
+	 * NUL.  Give back any space we reserved but didn't need. */
+	message = slot->data;
+	slot->data = NULL;
+	if (slot->datasize > slot->datalen + 1) {
+	    char *shrunk = realloc(message, slot->datalen + 1);
+	    if (shrunk) message = shrunk;
+	}
+    } else {
+	char *p;
+	message = malloc(slot->datalen + 1);
+	if (message) {
+	    p = message;
+	    for (i = 0; i < slot->n; ++i) {
+		memmove(p, slot->data + slot->pieces[i].offset,
+			slot->pieces[i].len);
+		p += slot->pieces[i].len;
+	    }
+	}
+    }
+    if (message) {
+	message[slot->datalen] = '\0';
+    }
+    slot_free(context_priv, slot);
+    return message;
+}
+
+/* Add fragment k of n, whose piece of the message is the piecelen
+ * bytes at piece, from the given sender instance (0 for protocol
+ * version 2) to the context's slots.  If that completes the message,
+ * put it (newly allocated and NUL-terminated) into *messagep and
+ * return OTRL_FRAGMENT_COMPLETE; otherwise return
+ * OTRL_FRAGMENT_INCOMPLETE.  A repeat of a fragment we already have
+ * starts the message over. */
+OtrlFragmentResult otrl_fragment_add(ConnContextPriv *context_priv,
+	unsigned int sender, unsigned short k, unsigned short n,
+	const char *piece, size_t piecelen, time_t now, char **messagep)
+{
+    OtrlFragmentSlot *slot;
+    unsigned char bit = 1 << ((k-1) % 8);
+    size_t needed, want;
+
+    for (slot = context_priv->fragment_slots; slot; slot = slot->next) {
+	if (slot->n == n && slot->sender == sender) break;
+    }
+    if (slot && (slot->bitmap[(k-1) / 8] & bit)) {
+	/* We've had this one already, so this must be a new message */
+	slot_free(context_priv, slot);
+	slot = NULL;
+    }
+    if (!slot) {
+	slot = slot_new(context_priv, sender, n);
+	if (!slot) return OTRL_FRAGMENT_INCOMPLETE;
+    } else {
+	slot_to_front(context_priv, slot);
+    }
+
+    /* Append the piece, leaving room for a NUL after it.  The first
+     * time, reserve enough for n pieces of this size, since all but the
+     * last are normally the same size; after that, grow geometrically. */
+    needed = slot->datalen + piecelen + 1;
+    if (needed <= slot->datalen) {
+	/* Overflow */
+	slot_free(context_priv, slot);
+	return OTRL_FRAGMENT_INCOMPLETE;
+    }
+    if (slot->datasize == 0) {
+	want = piecelen < ((size_t)-1 - 1) / n ? n * piecelen + 1 : needed;
+    } else {
+	want = slot->datasize < (size_t)-1 / 2 ? slot->datasize * 2 : needed;
+    }
+    if (!slot_reserve(context_priv, slot, needed, want)) {
+	slot_free(context_priv, slot);
+	return OTRL_FRAGMENT_INCOMPLETE;
+    }
+    memmove(slot->data + slot->datalen, piece, piecelen);
+    slot->pieces[k-1].offset = slot->datalen;
+    slot->pieces[k-1].len = piecelen;
+    slot->datalen += piecelen;
+    slot->bitmap[(k-1) / 8] |= bit;
+    if (k != slot->have + 1) {
+	slot->inorder = 0;
+    }
+    ++slot->have;
+    slot->lastrcvd = now;
+
+    if (slot->have < slot->n) {
+	return OTRL_FRAGMENT_INCOMPLETE;
+    }
+
+    /* We've got a complete message */
+    *messagep = slot_finish(context_priv, slot);
+    return *messagep ? OTRL_FRAGMENT_COMPLETE : OTRL_FRAGMENT_INCOMPLETE;
+}
+
+/* Discard the context's partly received messages that no fragment has
+ * arrived for since before expire_before. */
+void otrl_fragment_expire(ConnContextPriv *context_priv,
+	time_t expire_before)
+{
+    OtrlFragmentSlot *slot = context_priv->fragment_slots;
+
+    while (slot) {
+	OtrlFragmentSlot *next = slot->next;
+	if (slot->lastrcvd < expire_before) {
+	    slot_free(context_priv, slot);
+	}
+	slot = next;
+    }
+}
+
+/* Return the time a fragment last arrived for the context's partly
+ * received message least recently heard from, or 0 if it has none. */
+time_t otrl_fragment_oldest(ConnContextPriv *context_priv)
+{
+    OtrlFragmentSlot *slot = context_priv->fragment_slots;
+
+    /* The slots are kept most recently heard from first */
+    if (!slot) return 0;
+    while (slot->next) {
+	slot = slot->next;
+    }
+    return slot->lastrcvd;
+}
+
+/* Discard all of the context's partly received messages. */
+void otrl_fragment_forget_all(ConnContextPriv *context_priv)
+{
+    while (context_priv->fragment_slots) {
+	slot_free(context_priv, context_priv->fragment_slots);
+    }
+}
+
+/* Set the most memory that partly received messages may take up in
+ * each context of the given OtrlUserState, and in the OtrlUserState
+ * as a whole.  Pass 0 for either to use the default.  Messages already
+ * held are kept, even if they go over the new limits. */
+void otrl_fragment_set_limits(OtrlUserState us, size_t context_bytes,
+	size_t total_bytes)
+{
+    us->fragment_context_limit = context_bytes ? context_bytes :
+	OTRL_FRAGMENT_MAX_CONTEXT_BYTES;
+    us->fragment_limit = total_bytes ? total_bytes : OTRL_FRAGMENT_MAX_BYTES;
+}
@@ -0,0 +1,86 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __FRAGMENT_H__
+#define __FRAGMENT_H__
+
+#include <time.h>
+
+#include "context_priv.h"
+#include "proto.h"
+
+/* Reassembly of fragmented messages.  Each context keeps a slot for
+ * every message it has received some but not all of the fragments of,
+ * keyed by the number of fragments and the sender's instance tag, with
+ * a bitmap of which fragments have arrived.  Fragments may arrive in
+ * any order, and interleaved with fragments of other messages or with
+ * unfragmented messages. */
+
+/* A partly received message is discarded once none of its fragments
+ * has arrived for this many seconds. */
+#define OTRL_FRAGMENT_EXPIRY 300
+
+/* At most this many partly received messages are kept for each
+ * context.  To make room for another, the one least recently heard
+ * from is discarded. */
+#define OTRL_FRAGMENT_MAX_SLOTS 4
+
+/* By default, at most this many bytes of partly received messages,
+ * including their bookkeeping, are kept for each context, and for each
+ * OtrlUserState as a whole.  A fragment that would go over either
+ * limit is discarded, along with the rest of its message.  Use
+ * otrl_fragment_set_limits to change them. */
+#define OTRL_FRAGMENT_MAX_CONTEXT_BYTES (2 * 1024 * 1024)
+#define OTRL_FRAGMENT_MAX_BYTES (8 * 1024 * 1024)
+
+typedef struct s_OtrlFragmentSlot OtrlFragmentSlot;
+
+/* Add fragment k of n, whose piece of the message is the piecelen
+ * bytes at piece, from the given sender instance (0 for protocol
+ * version 2) to the context's slots.  If that completes the message,
+ * put it (newly allocated and NUL-terminated) into *messagep and
+ * return OTRL_FRAGMENT_COMPLETE; otherwise return
+ * OTRL_FRAGMENT_INCOMPLETE.  A repeat of a fragment we already have
+ * starts the message over. */
+OtrlFragmentResult otrl_fragment_add(ConnContextPriv *context_priv,
+	unsigned int sender, unsigned short k, unsigned short n,
+	const char *piece, size_t piecelen, time_t now, char **messagep);
+
+/* Discard the context's partly received messages that no fragment has
+ * arrived for since before expire_before. */
+void otrl_fragment_expire(ConnContextPriv *context_priv,
+	time_t expire_before);
+
+/* Return the time a fragment last arrived for the context's partly
+ * received message least recently heard from, or 0 if it has none. */
+time_t otrl_fragment_oldest(ConnContextPriv *context_priv);
+
+/* Discard all of the context's partly received messages. */
+void otrl_fragment_forget_all(ConnContextPriv *context_priv);
+
+/* Set the most memory that partly received messages may take up in
+ * each context of the given OtrlUserState, and in the OtrlUserState
+ * as a whole.  Pass 0 for either to use the default.  Messages already
+ * held are kept, even if they go over the new limits. */
+void otrl_fragment_set_limits(OtrlUserState us, size_t context_bytes,
+	size_t total_bytes);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdlib.h>
+
+/* libotr headers */
+#include "hash.h"
+
+#define OTRL_HASH_PRIME 16777619U
+
+/* Fold a block of data into a running (FNV-1a) hash value, and return
+ * the new hash value.  These hashes are used only for in-memory lookup
+ * tables, and are not cryptographic. */
+unsigned int otrl_hash_data(unsigned int hash, const unsigned char *data,
+	size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+	hash ^= data[i];
+	hash *= OTRL_HASH_PRIME;
+    }
+    return hash;
+}
+
+/* Fold a NUL-terminated string (including its NUL, so that
+ * consecutive strings can't run into each other) into a running hash
+ * value, and return the new hash value. */
+unsigned int otrl_hash_string(unsigned int hash, const char *s)
+{
+    const unsigned char *p = (const unsigned char *)s;
+
+    do {
+	hash ^= *p;
+	hash *= OTRL_HASH_PRIME;
+    } while (*(p++));
+    return hash;
+}
+
+/* Fold a 32-bit unsigned value into a running hash value, and return
+ * the new hash value. */
+unsigned int otrl_hash_uint(unsigned int hash, unsigned int v)
+{
+    unsigned char buf[4];
+
+    buf[0] = (v >> 24) & 0xff;
+    buf[1] = (v >> 16) & 0xff;
+    buf[2] = (v >> 8) & 0xff;
+    buf[3] = v & 0xff;
+    return otrl_hash_data(hash, buf, 4);
+}
@@ -21,6 +21,7 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* libgcrypt headers */
 #include <gcrypt.h>
@@ -28,6 +29,105 @@
 /* libotr headers */
 #include "instag.h"
 #include "userstate.h"
+#include "hash.h"
+#include "uslock.h"
+
+/* The hash index over a userstate's instags.  Each bucket lists its
+ * instags most recently added first, just as instag_root does, so that
+ * a lookup finds the same instag a walk of instag_root would. */
+struct s_OtrlInsTagIndex {
+    OtrlInsTag **buckets;
+    unsigned int mask;                 /* The number of buckets, less 1 */
+    size_t count;
+};
+
+static unsigned int instag_hash(const char *accountname,
+	const char *protocol)
+{
+    return otrl_hash_string(otrl_hash_string(OTRL_HASH_INIT, accountname),
+	    protocol);
+}
+
+/* Double the number of buckets in the index, keeping the order of the
+ * instags within each bucket. */
+static void instag_index_grow(struct s_OtrlInsTagIndex *index)
+{
+    unsigned int oldsize = index->mask + 1;
+    unsigned int newmask = 2 * oldsize - 1;
+    OtrlInsTag **newbuckets;
+    unsigned int i;
+
+    newbuckets = calloc(2 * oldsize, sizeof(OtrlInsTag *));
+    if (!newbuckets) return;  /* Just carry on with longer chains */
+
+    for (i = 0; i < oldsize; ++i) {
+	OtrlInsTag *p = index->buckets[i];
+	OtrlInsTag **tails[2];
+
+	tails[0] = &(newbuckets[i]);
+	tails[1] = &(newbuckets[i + oldsize]);
+	while (p) {
+	    OtrlInsTag *next = p->hash_next;
+	    OtrlInsTag ***tailp = &tails[(p->hash & newmask) >= oldsize];
+
+	    p->hash_next = NULL;
+	    p->hash_tous = *tailp;
+	    **tailp = p;
+	    *tailp = &(p->hash_next);
+	    p = next;
+	}
+    }
+    free(index->buckets);
+    index->buckets = newbuckets;
+    index->mask = newmask;
+}
+
+/* Link a new instag into the front of the given OtrlUserState's list,
+ * and into its index. */
+static void instag_link(OtrlUserState us, OtrlInsTag *p)
+{
+    struct s_OtrlInsTagIndex *index = us->instag_index;
+    OtrlInsTag **bucket;
+
+    p->us = us;
+    p->next = us->instag_root;
+    if (p->next) {
+	p->next->tous = &(p->next);
+    }
+    p->tous = &(us->instag_root);
+    us->instag_root = p;
+
+    p->hash = instag_hash(p->accountname, p->protocol);
+    p->hash_next = NULL;
+    p->hash_tous = NULL;
+
+    if (!index) {
+	/* Start the index with the first instag.  If we couldn't, any
+	 * instags added since then aren't indexed, so just carry on
+	 * without one. */
+	if (p->next) return;
+	index = malloc(sizeof(*index));
+	if (!index) return;
+	index->buckets = calloc(16, sizeof(OtrlInsTag *));
+	if (!index->buckets) {
+	    free(index);
+	    return;
+	}
+	index->mask = 15;
+	index->count = 0;
+	us->instag_index = index;
+    }
+
+    bucket = &(index->buckets[p->hash & index->mask]);
+    p->hash_next = *bucket;
+    if (p->hash_next) {
+	p->hash_next->hash_tous = &(p->hash_next);
+    }
+    p->hash_tous = bucket;
+    *bucket = p;
+    ++index->count;
+    if (index->count > index->mask + 1) instag_index_grow(index);
+}
 
 /* Forget the given instag. */
 void otrl_instag_forget(OtrlInsTag* instag) {
@@ -42,6 +142,15 @@ void otrl_instag_forget(OtrlInsTag* instag) {
 	instag->next->tous = instag->tous;
     }
 
+    /* And the index bucket */
+    if (instag->hash_tous) {
+	*(instag->hash_tous) = instag->hash_next;
+	if (instag->hash_next) {
+	    instag->hash_next->hash_tous = instag->hash_tous;
+	}
+	instag->us->instag_index->count--;
+    }
+
     free(instag);
 }
 
@@ -50,6 +159,11 @@ void otrl_instag_forget_all(OtrlUserState us) {
     while(us->instag_root) {
 	otrl_instag_forget(us->instag_root);
     }
+    if (us->instag_index) {
+	free(us->instag_index->buckets);
+	free(us->instag_index);
+	us->instag_index = NULL;
+    }
 }
 
 /* Fetch the instance tag from the given OtrlUserState associated with
@@ -59,6 +173,22 @@ OtrlInsTag * otrl_instag_find(OtrlUserState us, const char *accountname,
 {
     OtrlInsTag *p;
 
+    /* A shard looks in the userstate it shares instance tags with */
+    if (us->keystate) us = us->keystate;
+
+    if (us->instag_index) {
+	unsigned int hash = instag_hash(accountname, protocol);
+
+	p = us->instag_index->buckets[hash & us->instag_index->mask];
+	for(; p; p=p->hash_next) {
+	    if (p->hash == hash && !strcmp(p->accountname, accountname) &&
+		    !strcmp(p->protocol, protocol)) {
+		return p;
+	    }
+	}
+	return NULL;
+    }
+
     for(p=us->instag_root; p; p=p->next) {
 	if (!strcmp(p->accountname, accountname) &&
 		!strcmp(p->protocol, protocol)) {
@@ -87,81 +217,95 @@ gcry_error_t otrl_instag_read(OtrlUserState us, const char *filename)
 }
 
 /* Read our instance tag from a file on disk into the given
- * OtrlUserState. The FILE* must be open for reading. */
+ * OtrlUserState. The FILE* must be open for reading.  The whole file is
+ * read in at once, and parsed in a single pass. */
 gcry_error_t otrl_instag_read_FILEp(OtrlUserState us, FILE *instf)
 {
+    char *buf = NULL, *line, *end;
+    size_t buflen = 0, bufsize = 0;
+
     if (!instf) return gcry_error(GPG_ERR_NO_ERROR);
 
-    OtrlInsTag *p;
-    char storeline[1000];
-    size_t maxsize = sizeof(storeline);
+    /* Slurp in the file */
+    while (1) {
+	size_t got;
+
+	if (bufsize - buflen < 4096) {
+	    size_t newsize = bufsize ? 2 * bufsize : 16384;
+	    char *newbuf = realloc(buf, newsize + 1);
+	    if (!newbuf) {
+		free(buf);
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	    buf = newbuf;
+	    bufsize = newsize;
+	}
+	got = fread(buf + buflen, 1, bufsize - buflen, instf);
+	buflen += got;
+	if (got == 0) break;
+    }
+    if (!buf) return gcry_error(GPG_ERR_NO_ERROR);
+    buf[buflen] = '\0';
 
-    while(fgets(storeline, maxsize, instf)) {
-	char *prevpos;
-	char *pos;
+    for (line = buf, end = buf + buflen; line < end; ) {
+	char *nextline = memchr(line, '\n', end - line);
+	char *acctend, *protoend, *instagend;
 	unsigned int instag = 0;
-
-	p = malloc(sizeof(*p));
-	if (!p) {
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
+	OtrlInsTag *p;
 
 	/* Parse the line, which should be of the form:
 	 * accountname\tprotocol\t40_hex_nybbles\n          */
-	prevpos = storeline;
-	pos = strchr(prevpos, '\t');
-	if (!pos) {
-	    free(p);
-	    continue;
-	}
-	*pos = '\0';
-	pos++;
-	p->accountname = malloc(pos - prevpos);
-	memmove(p->accountname, prevpos, pos - prevpos);
-
-	prevpos = pos;
-	pos = strchr(prevpos, '\t');
-	if (!pos) {
-	    free(p);
+	if (!nextline) break;  /* Unterminated last line */
+	*nextline = '\0';
+
+	acctend = strchr(line, '\t');
+	protoend = acctend ? strchr(acctend + 1, '\t') : NULL;
+	if (!protoend) {
+	    line = nextline + 1;
 	    continue;
 	}
-	*pos = '\0';
-	pos++;
-	p->protocol = malloc(pos - prevpos);
-	memmove(p->protocol, prevpos, pos - prevpos);
-
-	prevpos = pos;
-	pos = strchr(prevpos, '\r');
-	if (!pos) pos = strchr(prevpos, '\n');
-	if (!pos) {
-	    free(p);
+	instagend = strchr(protoend + 1, '\r');
+	if (!instagend) instagend = nextline;
+	*instagend = '\0';
+
+	/* hex str of length 8 */
+	if (instagend - (protoend + 1) != 8) {
+	    line = nextline + 1;
 	    continue;
 	}
-	*pos = '\0';
-	pos++;
-	/* hex str of length 8 */
-	if (strlen(prevpos) != 8) {
-	    free(p);
+	sscanf(protoend + 1, "%08x", &instag);
+	if (instag < OTRL_MIN_VALID_INSTAG) {
+	    line = nextline + 1;
 	    continue;
 	}
 
-	sscanf(prevpos, "%08x", &instag);
-
-	if (instag < OTRL_MIN_VALID_INSTAG) {
+	p = malloc(sizeof(*p));
+	if (!p) {
+	    free(buf);
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	p->accountname = malloc(acctend - line + 1);
+	p->protocol = malloc(protoend - acctend);
+	if (!p->accountname || !p->protocol) {
+	    free(p->accountname);
+	    free(p->protocol);
 	    free(p);
-	    continue;
+	    free(buf);
+	    return gcry_error(GPG_ERR_ENOMEM);
 	}
+	memmove(p->accountname, line, acctend - line);
+	p->accountname[acctend - line] = '\0';
+	memmove(p->protocol, acctend + 1, protoend - acctend - 1);
+	p->protocol[protoend - acctend - 1] = '\0';
 	p->instag = instag;
 
 	/* Link it up */
-	p->next = us->instag_root;
-	if (p->next) {
-	    p->next->tous = &(p->next);
-	}
-	p->tous = &(us->instag_root);
-	us->instag_root = p;
+	instag_link(us, p);
+
+	line = nextline + 1;
     }
 
+    free(buf);
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
@@ -213,14 +357,11 @@ gcry_error_t otrl_instag_generate_FILEp(OtrlUserState us, FILE *instf,
     p->instag = otrl_instag_get_new();
 
     /* Add to our list in OtrlUserState */
-    p->next = us->instag_root;
-    if (p->next) {
-	p->next->tous = &(p->next);
-    }
-    p->tous = &(us->instag_root);
-    us->instag_root = p;
+    otrl_uslock_shared_lock(us);
+    instag_link(us, p);
 
     otrl_instag_write_FILEp(us, instf);
+    otrl_uslock_shared_unlock(us);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
@@ -243,19 +384,39 @@ gcry_error_t otrl_instag_write(OtrlUserState us, const char *filename)
 }
 
 /* Write our instance tags to a file on disk.
- * The FILE* must be open for writing. */
+ * The FILE* must be open for writing.  The whole file is formatted in
+ * memory, and written with a single call. */
 gcry_error_t otrl_instag_write_FILEp(OtrlUserState us, FILE *instf)
 {
-    OtrlInsTag *p;
     /* This line should be ignored when read back in, since there are no
     tabs. */
-    fprintf(instf, "# WARNING! You shouldn't copy this file to another"
-    " computer. It is unnecessary and can cause problems.\n");
+    static const char warning[] = "# WARNING! You shouldn't copy this "
+	"file to another computer. It is unnecessary and can cause "
+	"problems.\n";
+    OtrlInsTag *p;
+    char *buf, *bufp;
+    size_t buflen = sizeof(warning) - 1;
+
+    for(p=us->instag_root; p; p=p->next) {
+	buflen += strlen(p->accountname) + strlen(p->protocol) + 11;
+    }
+    buf = malloc(buflen + 1);
+    if (!buf) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    memmove(buf, warning, sizeof(warning) - 1);
+    bufp = buf + sizeof(warning) - 1;
     for(p=us->instag_root; p; p=p->next) {
-	fprintf(instf, "%s\t%s\t%08x\n", p->accountname, p->protocol,
-		p->instag);
+	bufp += sprintf(bufp, "%s\t%s\t%08x\n", p->accountname,
+		p->protocol, p->instag);
     }
 
+    if (fwrite(buf, bufp - buf, 1, instf) != 1 && bufp > buf) {
+	free(buf);
+	return gcry_error_from_errno(errno);
+    }
+    free(buf);
+
     return gcry_error(GPG_ERR_NO_ERROR);
 }
-
@@ -44,6 +44,14 @@ typedef struct s_OtrlInsTag {
     char *accountname;
     char *protocol;
     otrl_instag_t instag;
+
+    struct s_OtrlUserState *us;        /* The userstate we belong to */
+    unsigned int hash;                 /* Hash of accountname and
+					  protocol */
+    struct s_OtrlInsTag *hash_next;    /* The next instag in our bucket
+					  of the userstate's index */
+    struct s_OtrlInsTag **hash_tous;   /* A pointer to the pointer to us
+					  in that bucket, or NULL */
 } OtrlInsTag;
 
 #include "userstate.h"
@@ -64,7 +72,8 @@ OtrlInsTag * otrl_instag_find(OtrlUserState us, const char *accountname,
 gcry_error_t otrl_instag_read(OtrlUserState us, const char *filename);
 
 /* Read our instance tag from a file on disk into the given
- * OtrlUserState. The FILE* must be open for reading. */
+ * OtrlUserState. The FILE* must be open for reading.  The whole file is
+ * read in at once, and parsed in a single pass. */
 gcry_error_t otrl_instag_read_FILEp(OtrlUserState us, FILE *instf);
 
 /* Return a new valid instance tag */
@@ -83,7 +92,8 @@ gcry_error_t otrl_instag_generate_FILEp(OtrlUserState us, FILE *instf,
 gcry_error_t otrl_instag_write(OtrlUserState us, const char *filename);
 
 /* Write our instance tags to a file on disk.
- * The FILE* must be open for writing. */
+ * The FILE* must be open for writing.  The whole file is formatted in
+ * memory, and written with a single call. */
 gcry_error_t otrl_instag_write_FILEp(OtrlUserState us, FILE *instf);
 
 #endif
@@ -35,6 +35,11 @@
 #include "message.h"
 #include "sm.h"
 #include "instag.h"
+#include "dhpool.h"
+#include "fragment.h"
+#include "akepool.h"
+#include "uslock.h"
+#include "deadline.h"
 
 #if OTRL_DEBUGGING
 #include <stdio.h>
@@ -85,43 +90,45 @@ static gcry_error_t fragment_and_send(const OtrlMessageAppOps *ops,
 
 	/* Don't incur overhead of fragmentation unless necessary */
 	if(mms != 0 && msglen > mms) {
-	    char **fragments;
+	    OtrlFragment *fragments;
 	    gcry_error_t err;
-	    int i;
+	    int i, first, last;
 	    int headerlen = context->protocol_version == 3 ? 37 : 19;
 	    /* Like ceil(msglen/(mms - headerlen)) */
 	    int fragment_count = ((msglen - 1) / (mms - headerlen)) + 1;
 
-	    err = otrl_proto_fragment_create(mms, fragment_count, &fragments,
-		    context, message);
+	    err = otrl_proto_fragment_create_contiguous(mms, fragment_count,
+		    &fragments, context, message);
 	    if (err) {
 		return err;
 	    }
 
 	    /* Determine which fragments to send and which to return
-	     * based on given Fragment Policy.  If the first fragment
-	     * should be returned instead of sent, store it. */
+	     * based on given Fragment Policy.  If the first or last
+	     * fragment should be returned instead of sent, store it. */
+	    first = 0;
+	    last = fragment_count - 1;
 	    if (fragPolicy == OTRL_FRAGMENT_SEND_ALL_BUT_FIRST) {
-		*returnFragment = strdup(fragments[0]);
-	    } else {
-		ops->inject_message(opdata, context->accountname,
-			context->protocol, context->username, fragments[0]);
+		*returnFragment = strdup(fragments[first++].text);
+	    } else if (fragPolicy == OTRL_FRAGMENT_SEND_ALL_BUT_LAST) {
+		*returnFragment = strdup(fragments[last--].text);
 	    }
-	    for (i=1; i<fragment_count-1; i++) {
-		ops->inject_message(opdata, context->accountname,
-			context->protocol, context->username, fragments[i]);
-	    }
-	    /* If the last fragment should be stored instead of sent,
-	     * store it */
-	    if (fragPolicy == OTRL_FRAGMENT_SEND_ALL_BUT_LAST) {
-		*returnFragment = strdup(fragments[fragment_count-1]);
-	    } else {
-		ops->inject_message(opdata, context->accountname,
+
+	    if (first > last) {
+		/* Nothing left to send */
+	    } else if (ops->inject_fragments) {
+		ops->inject_fragments(opdata, context->accountname,
 			context->protocol, context->username,
-			fragments[fragment_count-1]);
+			fragments + first, last - first + 1);
+	    } else {
+		for (i=first; i<=last; i++) {
+		    ops->inject_message(opdata, context->accountname,
+			    context->protocol, context->username,
+			    fragments[i].text);
+		}
 	    }
 	    /* Now free all fragment memory */
-	    otrl_proto_fragment_free(&fragments, fragment_count);
+	    free(fragments);
 
 	} else {
 	    /* No fragmentation necessary */
@@ -142,119 +149,103 @@ static void populate_context_instag(OtrlUserState us, const OtrlMessageAppOps
 	*ops, void *opdata, const char *accountname, const char *protocol,
 	ConnContext *context) {
     OtrlInsTag *p_instag;
+    otrl_instag_t instag = 0;
+    int shard = (us->keystate != NULL);
+
+    /* A shard's instance tags are its base's */
+    if (shard) us = us->keystate;
 
+    otrl_uslock_shared_lock(us);
     p_instag = otrl_instag_find(us, accountname, protocol);
-    if ((!p_instag) && ops->create_instag) {
+    if (p_instag) instag = p_instag->instag;
+    otrl_uslock_shared_unlock(us);
+
+    /* Don't hold the lock while the application makes one; it may take
+     * a while, or call into another userstate.  A shard can't have one
+     * made, since other shards may be reading the base meanwhile. */
+    if ((!p_instag) && ops->create_instag && !shard) {
 	ops->create_instag(opdata, accountname, protocol);
+	otrl_uslock_shared_lock(us);
 	p_instag = otrl_instag_find(us, accountname, protocol);
+	if (p_instag) instag = p_instag->instag;
+	otrl_uslock_shared_unlock(us);
     }
 
-    if (p_instag && p_instag->instag >= OTRL_MIN_VALID_INSTAG) {
-	context->our_instance = p_instag->instag;
+    if (instag >= OTRL_MIN_VALID_INSTAG) {
+	context->our_instance = instag;
     } else {
 	context->our_instance = otrl_instag_get_new();
     }
 }
 
+/* Find our private key for the account of the given context, asking
+ * the application to create one if we've got none.  Returns NULL if
+ * there still isn't one. */
+static OtrlPrivKey *find_privkey(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, ConnContext *context)
+{
+    OtrlPrivKey *privkey;
+
+    if (us->keystate) {
+	/* A shard's keys are its base's, and it can't have one made,
+	 * since other shards may be reading the base meanwhile */
+	otrl_uslock_shared_lock(us->keystate);
+	privkey = otrl_privkey_find(us->keystate, context->accountname,
+		context->protocol);
+	otrl_uslock_shared_unlock(us->keystate);
+	if (privkey == NULL && ops->handle_msg_event) {
+	    ops->handle_msg_event(opdata, OTRL_MSGEVENT_SETUP_ERROR,
+		    context, NULL, gcry_error(GPG_ERR_NO_SECKEY));
+	}
+	return privkey;
+    }
+
+    otrl_uslock_shared_lock(us);
+    privkey = otrl_privkey_find(us, context->accountname,
+	    context->protocol);
+    otrl_uslock_shared_unlock(us);
+    if (privkey == NULL) {
+	/* We've got no private key!  Don't hold the lock while the
+	 * application makes one; that takes a while, and it may call
+	 * into another userstate. */
+	if (ops->create_privkey) {
+	    ops->create_privkey(opdata, context->accountname,
+		    context->protocol);
+	    otrl_uslock_shared_lock(us);
+	    privkey = otrl_privkey_find(us, context->accountname,
+		    context->protocol);
+	    otrl_uslock_shared_unlock(us);
+	}
+    }
+
+    return privkey;
+}
+
 /* Deallocate a message allocated by other otrl_message_* routines. */
 void otrl_message_free(char *message)
 {
     free(message);
 }
 
-/* Handle a message about to be sent to the network.  It is safe to pass
- * all messages about to be sent to this routine.  add_appdata is a
- * function that will be called in the event that a new ConnContext is
- * created.  It will be passed the data that you supplied, as well as a
- * pointer to the new ConnContext.  You can use this to add
- * application-specific information to the ConnContext using the
- * "context->app" field, for example.  If you don't need to do this, you
- * can pass NULL for the last two arguments of otrl_message_sending.
- *
- * tlvs is a chain of OtrlTLVs to append to the private message.  It is
- * usually correct to just pass NULL here.
- *
- * If non-NULL, ops->convert_msg will be called just before encrypting a
- * message.
- *
- * "instag" specifies the instance tag of the buddy (protocol version 3 only).
- * Meta-instances may also be specified (e.g., OTRL_INSTAG_MOST_SECURE).
- * If "contextp" is not NULL, it will be set to the ConnContext used for
- * sending the message.
- *
- * If no fragmentation or msg injection is wanted, use OTRL_FRAGMENT_SEND_SKIP
- * as the OtrlFragmentPolicy. In this case, this function will assign *messagep
- * with the encrypted msg. If the routine returns non-zero, then the library
- * tried to encrypt the message, but for some reason failed. DO NOT send the
- * message in the clear in that case. If *messagep gets set by the call to
- * something non-NULL, then you should replace your message with the contents
- * of *messagep, and send that instead.
- *
- * Other fragmentation policies are OTRL_FRAGMENT_SEND_ALL,
- * OTRL_FRAGMENT_SEND_ALL_BUT_LAST, or OTRL_FRAGMENT_SEND_ALL_BUT_FIRST. In
- * these cases, the appropriate fragments will be automatically sent. For the
- * last two policies, the remaining fragment will be passed in *original_msg.
- *
- * Call otrl_message_free(*messagep) if you don't need *messagep or when you're
- * done with it. */
-gcry_error_t otrl_message_sending(OtrlUserState us,
-	const OtrlMessageAppOps *ops,
-	void *opdata, const char *accountname, const char *protocol,
-	const char *recipient, otrl_instag_t their_instag,
+/* Handle a message about to be sent to the network once the context
+ * for it has been found and the policy for it looked up.  The arguments
+ * and return value are as for otrl_message_sending. */
+static gcry_error_t send_message(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
 	const char *original_msg, OtrlTLV *tlvs, char **messagep,
-	OtrlFragmentPolicy fragPolicy, ConnContext **contextp,
-	void (*add_appdata)(void *data, ConnContext *context),
-	void *data)
+	OtrlFragmentPolicy fragPolicy, ConnContext *context,
+	OtrlPolicy policy)
 {
-    ConnContext * context = NULL;
     char * msgtosend;
     const char * err_msg;
     gcry_error_t err_code, err;
-    OtrlPolicy policy = OTRL_POLICY_DEFAULT;
-    int context_added = 0;
     int convert_called = 0;
     char *converted_msg = NULL;
 
-    if (messagep) {
-	*messagep = NULL;
-    }
+    *messagep = NULL;
 
     err = gcry_error(GPG_ERR_NO_ERROR);	/* Default to no error */
 
-    if (contextp) {
-	*contextp = NULL;
-    }
-
-    if (!accountname || !protocol || !recipient ||
-		!original_msg || !messagep) {
-	err = gcry_error(GPG_ERR_INV_VALUE);
-	goto fragment;
-    }
-
-    /* See if we have a fingerprint for this user */
-    context = otrl_context_find(us, recipient, accountname, protocol,
-	    their_instag, 1, &context_added, add_appdata, data);
-
-    /* Update the context list if we added one */
-    if (context_added && ops->update_context_list) {
-	ops->update_context_list(opdata);
-    }
-
-    /* Find or generate the instance tag if needed */
-    if (!context->our_instance) {
-	populate_context_instag(us, ops, opdata, accountname, protocol,
-	    context);
-    }
-
-    if (contextp) {
-	*contextp = context;
-    }
-
-    /* Check the policy */
-    if (ops->policy) {
-	policy = ops->policy(opdata, context);
-    }
-
     /* Should we go on at all? */
     if ((policy & OTRL_POLICY_VERSION_MASK) == 0) {
 	err =  gcry_error(GPG_ERR_NO_ERROR);
@@ -457,6 +448,294 @@ fragment:
     }
 }
 
+/* Handle a message about to be sent to the network.  It is safe to pass
+ * all messages about to be sent to this routine.  add_appdata is a
+ * function that will be called in the event that a new ConnContext is
+ * created.  It will be passed the data that you supplied, as well as a
+ * pointer to the new ConnContext.  You can use this to add
+ * application-specific information to the ConnContext using the
+ * "context->app" field, for example.  If you don't need to do this, you
+ * can pass NULL for the last two arguments of otrl_message_sending.
+ *
+ * tlvs is a chain of OtrlTLVs to append to the private message.  It is
+ * usually correct to just pass NULL here.
+ *
+ * If non-NULL, ops->convert_msg will be called just before encrypting a
+ * message.
+ *
+ * "instag" specifies the instance tag of the buddy (protocol version 3 only).
+ * Meta-instances may also be specified (e.g., OTRL_INSTAG_MOST_SECURE).
+ * If "contextp" is not NULL, it will be set to the ConnContext used for
+ * sending the message.
+ *
+ * If no fragmentation or msg injection is wanted, use OTRL_FRAGMENT_SEND_SKIP
+ * as the OtrlFragmentPolicy. In this case, this function will assign *messagep
+ * with the encrypted msg. If the routine returns non-zero, then the library
+ * tried to encrypt the message, but for some reason failed. DO NOT send the
+ * message in the clear in that case. If *messagep gets set by the call to
+ * something non-NULL, then you should replace your message with the contents
+ * of *messagep, and send that instead.
+ *
+ * Other fragmentation policies are OTRL_FRAGMENT_SEND_ALL,
+ * OTRL_FRAGMENT_SEND_ALL_BUT_LAST, or OTRL_FRAGMENT_SEND_ALL_BUT_FIRST. In
+ * these cases, the appropriate fragments will be automatically sent. For the
+ * last two policies, the remaining fragment will be passed in *original_msg.
+ *
+ * Call otrl_message_free(*messagep) if you don't need *messagep or when you're
+ * done with it. */
+gcry_error_t otrl_message_sending(OtrlUserState us,
+	const OtrlMessageAppOps *ops,
+	void *opdata, const char *accountname, const char *protocol,
+	const char *recipient, otrl_instag_t their_instag,
+	const char *original_msg, OtrlTLV *tlvs, char **messagep,
+	OtrlFragmentPolicy fragPolicy, ConnContext **contextp,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    ConnContext * context = NULL;
+    ConnContext *m_context = NULL;
+    OtrlPolicy policy = OTRL_POLICY_DEFAULT;
+    int context_added = 0, instance_added = 0;
+    gcry_error_t err;
+
+    if (messagep) {
+	*messagep = NULL;
+    }
+
+    if (contextp) {
+	*contextp = NULL;
+    }
+
+    if (!accountname || !protocol || !recipient ||
+		!original_msg || !messagep) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    /* If other threads may be using this userstate, lock the master
+     * context before looking among its instances */
+    if (us->uslock) {
+	m_context = otrl_context_find(us, recipient, accountname, protocol,
+		OTRL_INSTAG_MASTER, 1, &context_added, add_appdata, data);
+	otrl_uslock_context_lock(m_context);
+    }
+
+    /* See if we have a fingerprint for this user */
+    context = otrl_context_find(us, recipient, accountname, protocol,
+	    their_instag, 1, &instance_added, add_appdata, data);
+    context_added |= instance_added;
+
+    /* Update the context list if we added one */
+    if (context_added && ops->update_context_list) {
+	ops->update_context_list(opdata);
+    }
+
+    /* Find or generate the instance tag if needed */
+    if (!context->our_instance) {
+	populate_context_instag(us, ops, opdata, accountname, protocol,
+	    context);
+    }
+
+    if (contextp) {
+	*contextp = context;
+    }
+
+    /* Check the policy */
+    if (ops->policy) {
+	policy = ops->policy(opdata, context);
+    }
+
+    err = send_message(us, ops, opdata, accountname, original_msg, tlvs,
+	    messagep, fragPolicy, context, policy);
+
+    if (m_context) {
+	otrl_uslock_context_unlock(m_context);
+    }
+    return err;
+}
+
+/* Handle a batch of messages about to be sent to the network, such as
+ * one announcement going to many correspondents, or several messages
+ * going to one.  This is the same as calling otrl_message_sending on
+ * each of items[0..count-1] in turn, with the accountname, protocol,
+ * recipient, instag, message and tlvs fields and the given fragPolicy as
+ * the arguments, and the results put in the newmessage, context and err
+ * fields.  ops->update_context_list is called at most once, and when
+ * consecutive entries go to the same instance (or to the same master
+ * context), its lookup and policy query are done only once.  Each
+ * message is encrypted with the session keys of its own context.
+ *
+ * With OTRL_FRAGMENT_SEND_SKIP, nothing is injected and every
+ * ciphertext is left in its entry's newmessage, so that the
+ * application can write them all out in one go.  Otherwise each message
+ * is fragmented and injected as otrl_message_sending would, using
+ * ops->inject_fragments if it is set.  Call otrl_message_free on each
+ * non-NULL newmessage when you're done with it. */
+void otrl_message_sending_batch(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata,
+	OtrlMessageToSend *items, size_t count,
+	OtrlFragmentPolicy fragPolicy,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    size_t i;
+    int any_added = 0;
+    ConnContext *context = NULL, *last_context = NULL;
+    const OtrlMessageToSend *last = NULL;
+    OtrlPolicy policy = OTRL_POLICY_DEFAULT;
+
+    if (!items) return;
+
+    /* Find the context for each message first, so that the context list
+     * only needs updating once. */
+    for (i = 0; i < count; ++i) {
+	OtrlMessageToSend *item = &items[i];
+	int context_added = 0;
+
+	item->newmessage = NULL;
+	item->context = NULL;
+	item->err = gcry_error(GPG_ERR_NO_ERROR);
+
+	if (!item->accountname || !item->protocol || !item->recipient ||
+		!item->message) {
+	    item->err = gcry_error(GPG_ERR_INV_VALUE);
+	    continue;
+	}
+
+	/* Meta-instances such as OTRL_INSTAG_BEST may resolve differently
+	 * as earlier messages are sent, so look those up each time */
+	if (last && (item->instag == OTRL_INSTAG_MASTER ||
+		    item->instag >= OTRL_MIN_VALID_INSTAG) &&
+		item->instag == last->instag &&
+		!strcmp(item->recipient, last->recipient) &&
+		!strcmp(item->accountname, last->accountname) &&
+		!strcmp(item->protocol, last->protocol)) {
+	    item->context = last->context;
+	} else {
+	    /* Meta-instances are resolved in the second pass, so find just
+	     * the master for those here.  If other threads may be using
+	     * this userstate, lock the master before looking among (or
+	     * adding to) its instances, as otrl_message_sending does. */
+	    ConnContext *m_context = otrl_context_find(us, item->recipient,
+		    item->accountname, item->protocol, OTRL_INSTAG_MASTER, 1,
+		    &context_added, add_appdata, data);
+	    any_added |= context_added;
+	    item->context = m_context;
+	    if (item->instag >= OTRL_MIN_VALID_INSTAG) {
+		otrl_uslock_context_lock(m_context);
+		item->context = otrl_context_find(us, item->recipient,
+			item->accountname, item->protocol, item->instag, 1,
+			&context_added, add_appdata, data);
+		otrl_uslock_context_unlock(m_context);
+		any_added |= context_added;
+	    }
+	}
+	last = item;
+    }
+
+    if (any_added && ops->update_context_list) {
+	ops->update_context_list(opdata);
+    }
+
+    for (i = 0; i < count; ++i) {
+	OtrlMessageToSend *item = &items[i];
+
+	if (item->err) continue;
+
+	otrl_uslock_context_lock(item->context);
+	if (item->instag < OTRL_MIN_VALID_INSTAG &&
+		item->instag != OTRL_INSTAG_MASTER) {
+	    context = otrl_context_find(us, item->recipient,
+		    item->accountname, item->protocol, item->instag, 0,
+		    NULL, NULL, NULL);
+	    if (context) {
+		item->context = context;
+	    }
+	}
+	context = item->context;
+
+	if (context != last_context) {
+	    /* Find or generate the instance tag if needed */
+	    if (!context->our_instance) {
+		populate_context_instag(us, ops, opdata, item->accountname,
+			item->protocol, context);
+	    }
+
+	    /* Check the policy */
+	    policy = OTRL_POLICY_DEFAULT;
+	    if (ops->policy) {
+		policy = ops->policy(opdata, context);
+	    }
+	    last_context = context;
+	}
+
+	item->err = send_message(us, ops, opdata, item->accountname,
+		item->message, item->tlvs, &item->newmessage, fragPolicy,
+		context, policy);
+	otrl_uslock_context_unlock(context);
+    }
+}
+
+/* Schedule the given context to be looked at again by
+ * otrl_message_poll when its DH Commit (if it is a master waiting for a
+ * v3 DHKEY message) or its oldest partly received message will have
+ * waited too long.  While the master has an AKE in the pool, a pool
+ * thread may be writing its auth, so its DH Commit is left alone;
+ * otrl_message_ake_poll schedules it again once that's done. */
+static void schedule_poll(ConnContext *context)
+{
+    time_t when = otrl_fragment_oldest(context->context_priv);
+
+    if (when) {
+	when += OTRL_FRAGMENT_EXPIRY + 1;
+    }
+    if (context->m_context == context &&
+	    !context->context_priv->ake_job &&
+	    context->auth.authstate == OTRL_AUTHSTATE_AWAITING_DHKEY &&
+	    context->auth.protocol_version == 3 &&
+	    context->auth.commit_sent_time > 0) {
+	time_t commit_expiry = context->auth.commit_sent_time +
+	    MAX_AKE_WAIT_TIME + 1;
+	if (!when || commit_expiry < when) {
+	    when = commit_expiry;
+	}
+    }
+    if (when) {
+	otrl_deadline_schedule(context, when);
+    }
+}
+
+/* Start the application's timer if there is something for
+ * otrl_message_poll to wait for, or stop it if there isn't, calling
+ * ops->timer_control without holding any lock.  Only one thread calls
+ * it at a time; if the deadlines change meanwhile, that thread looks
+ * again once it returns. */
+static void update_timer(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata)
+{
+    if (!ops || !ops->timer_control) return;
+
+    otrl_uslock_shared_lock(us);
+    if (us->timer_busy) {
+	us->timer_recheck = 1;
+	otrl_uslock_shared_unlock(us);
+	return;
+    }
+    us->timer_busy = 1;
+    do {
+	int want = (otrl_deadline_next(us) != 0);
+
+	us->timer_recheck = 0;
+	if (want != us->timer_running) {
+	    us->timer_running = want;
+	    otrl_uslock_shared_unlock(us);
+	    ops->timer_control(opdata, want ? POLL_DEFAULT_INTERVAL : 0);
+	    otrl_uslock_shared_lock(us);
+	}
+    } while (us->timer_recheck);
+    us->timer_busy = 0;
+    otrl_uslock_shared_unlock(us);
+}
+
 /* If err == 0, send the last auth message for the given context to the
  * appropriate user.  Otherwise, display an appripriate error dialog.
  * Return the value of err that was passed. */
@@ -486,12 +765,10 @@ static gcry_error_t send_or_error_auth(const OtrlMessageAppOps *ops,
 		    context->auth.authstate == OTRL_AUTHSTATE_AWAITING_DHKEY &&
 		    context->auth.protocol_version == 3) {
 		context->auth.commit_sent_time = now;
+		otrl_deadline_schedule(context, now + MAX_AKE_WAIT_TIME + 1);
 		/* If there's not already a timer running to clean up
 		 * this private key, try to start one. */
-		if (us->timer_running == 0 && ops && ops->timer_control) {
-		    ops->timer_control(opdata, POLL_DEFAULT_INTERVAL);
-		    us->timer_running = 1;
-		}
+		update_timer(us, ops, opdata);
 	    }
 	}
     } else {
@@ -604,9 +881,9 @@ static gcry_error_t go_encrypted(const OtrlAuthInfo *auth, void *asdata)
 	otrl_dh_keypair_free(&(edata->context->context_priv->our_old_dh_key));
 	otrl_dh_keypair_copy(&(edata->context->context_priv->our_old_dh_key),
 		&(edata->context->auth.our_dh));
-	otrl_dh_gen_keypair(
-		edata->context->context_priv->our_old_dh_key.groupid,
+	err = otrl_dhpool_gen_keypair(edata->us,
 		&(edata->context->context_priv->our_dh_key));
+	if (err) return err;
 	edata->context->context_priv->our_keyid = edata->context->auth.our_keyid
 		+ 1;
     }
@@ -626,6 +903,7 @@ static gcry_error_t go_encrypted(const OtrlAuthInfo *auth, void *asdata)
     edata->context->context_priv->generation++;
     edata->context->active_fingerprint = found_print;
     edata->context->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+    otrl_context_best_instance_changed(edata->context);
 
     if (edata->ops->update_context_list) {
 	edata->ops->update_context_list(edata->opdata);
@@ -867,6 +1145,51 @@ void otrl_message_abort_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
     otrl_tlv_free(sendtlv);
 }
 
+/* Don't leave a received plaintext lying around in the scratch buffer */
+static void wipe_scratch(ConnContext *context)
+{
+    memset(context->context_priv->recv_scratch, 0, OTRL_RECV_SCRATCH_BYTES);
+}
+
+/* Accept a Data Message for the given context, as
+ * otrl_proto_accept_data does, but decrypt it in the context's scratch
+ * buffer if it fits, and set *scratchedp to say whether it did.  If so,
+ * *plaintextp points into that buffer, which must be wiped with
+ * wipe_scratch once the plaintext has been copied out of it.  On error,
+ * the buffer has already been wiped. */
+static gcry_error_t accept_data(char **plaintextp, int *scratchedp,
+	OtrlTLV **tlvsp, ConnContext *context, const char *message,
+	unsigned char *flagsp, unsigned char *extrakey)
+{
+    ConnContextPriv *priv = context->context_priv;
+    gcry_error_t err;
+
+    *scratchedp = 0;
+    if (!priv->recv_scratch) {
+	priv->recv_scratch = malloc(OTRL_RECV_SCRATCH_BYTES);
+    }
+    if (priv->recv_scratch) {
+	err = otrl_proto_accept_data_scratch(plaintextp, tlvsp, context,
+		message, flagsp, extrakey, priv->recv_scratch,
+		OTRL_RECV_SCRATCH_BYTES);
+	if (!err) {
+	    *scratchedp = 1;
+	    return err;
+	}
+
+	/* It may have got as far as decrypting before it failed (if
+	 * rotating the keys did, say) */
+	wipe_scratch(context);
+	if (gpg_err_code(err) != GPG_ERR_BUFFER_TOO_SHORT) {
+	    return err;
+	}
+    }
+
+    /* Too big for the scratch buffer; decrypt it in one of its own */
+    return otrl_proto_accept_data(plaintextp, tlvsp, context, message,
+	    flagsp, extrakey);
+}
+
 static void message_malformed(const OtrlMessageAppOps *ops,
 	void *opdata, ConnContext *context) {
     if (ops->handle_msg_event) {
@@ -878,75 +1201,107 @@ static void message_malformed(const OtrlMessageAppOps *ops,
 	const char *err_msg = ops->otr_error_message(opdata, context,
 		OTRL_ERRCODE_MSG_MALFORMED);
 
-	if (err_msg) {
-	    char *buf = malloc(strlen(OTR_ERROR_PREFIX) + strlen(err_msg) + 1);
+	if (err_msg) {
+	    char *buf = malloc(strlen(OTR_ERROR_PREFIX) + strlen(err_msg) + 1);
+
+	    if (buf) {
+		strcpy(buf, OTR_ERROR_PREFIX);
+		strcat(buf, err_msg);
+		ops->inject_message(opdata, context->accountname,
+			context->protocol, context->username, buf);
+		free(buf);
+	    }
+
+	    if (ops->otr_error_message_free) {
+		ops->otr_error_message_free(opdata, err_msg);
+	    }
+	}
+    }
+}
+
+
+/* If handling the given AKE message for the given context would need
+ * public-key operations, and the userstate has an AKE pool, hand it to
+ * the pool.  privkey, if any, came from otrl_privkey_find, so it has
+ * been parsed on this thread already.  Return 1 if the pool took it,
+ * in which case otrl_message_ake_poll will finish handling it. */
+static int offload_ake(OtrlUserState us, ConnContext *context,
+	OtrlMessageType msgtype, const char *otrtag, OtrlPrivKey *privkey)
+{
+    OtrlAuthState wanted;
+
+    if (!us->akepool) return 0;
+
+    switch(msgtype) {
+	case OTRL_MSGTYPE_DH_KEY:
+	    wanted = OTRL_AUTHSTATE_AWAITING_DHKEY;
+	    break;
+	case OTRL_MSGTYPE_REVEALSIG:
+	    wanted = OTRL_AUTHSTATE_AWAITING_REVEALSIG;
+	    break;
+	case OTRL_MSGTYPE_SIGNATURE:
+	    wanted = OTRL_AUTHSTATE_AWAITING_SIG;
+	    break;
+	default:
+	    return 0;
+    }
+    if (context->auth.authstate != wanted) return 0;
+
+    return !otrl_akepool_submit(us, context, msgtype, otrtag, privkey);
+}
 
-	    if (buf) {
-		strcpy(buf, OTR_ERROR_PREFIX);
-		strcat(buf, err_msg);
-		ops->inject_message(opdata, context->accountname,
-			context->protocol, context->username, buf);
-		free(buf);
-	    }
+/* Finish handling an AKE message whose public-key operations the AKE
+ * pool has done, as receive_message would have done inline. */
+static void finish_ake(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, OtrlAKEJob *job)
+{
+    ConnContext *context = job->context;
+    EncrData edata;
+    gcry_error_t err = job->err;
 
-	    if (ops->otr_error_message_free) {
-		ops->otr_error_message_free(opdata, err_msg);
-	    }
+    edata.gone_encrypted = 0;
+    edata.us = us;
+    edata.context = context;
+    edata.ops = ops;
+    edata.opdata = opdata;
+    edata.ignore_message = -1;
+    edata.messagep = NULL;
+
+    if (!err && job->succeeded) {
+	/* The auth routines have reset our_keyid since the pool's
+	 * auth_succeeded callback ran, but go_encrypted needs it */
+	context->auth.our_keyid = job->our_keyid;
+	err = go_encrypted(&(context->auth), &edata);
+	context->auth.our_keyid = 0;
+    }
+
+    if (err || job->havemsg) {
+	send_or_error_auth(ops, opdata, err, context, us);
+	if (job->msgtype != OTRL_MSGTYPE_DH_KEY) {
+	    maybe_resend(&edata);
 	}
     }
 }
 
-
-/* Handle a message just received from the network.  It is safe to pass
- * all received messages to this routine.  add_appdata is a function
- * that will be called in the event that a new ConnContext is created.
- * It will be passed the data that you supplied, as well as
- * a pointer to the new ConnContext.  You can use this to add
- * application-specific information to the ConnContext using the
- * "context->app" field, for example.  If you don't need to do this, you
- * can pass NULL for the last two arguments of otrl_message_receiving.
- *
- * If non-NULL, ops->convert_msg will be called after a data message is
- * decrypted.
- *
- * If "contextp" is not NULL, it will be set to the ConnContext used for
- * receiving the message.
- *
- * If otrl_message_receiving returns 1, then the message you received
- * was an internal protocol message, and no message should be delivered
- * to the user.
- *
- * If it returns 0, then check if *messagep was set to non-NULL.  If
- * so, replace the received message with the contents of *messagep, and
- * deliver that to the user instead.  You must call
- * otrl_message_free(*messagep) when you're done with it.  If tlvsp is
- * non-NULL, *tlvsp will be set to a chain of any TLVs that were
- * transmitted along with this message.  You must call
- * otrl_tlv_free(*tlvsp) when you're done with those.
- *
- * If otrl_message_receiving returns 0 and *messagep is NULL, then this
- * was an ordinary, non-OTR message, which should just be delivered to
- * the user without modification. */
-int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
+/* Handle a received message once its master context has been found
+ * and the policy for it looked up.  The arguments and return value are
+ * as for otrl_message_receiving. */
+static int receive_message(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata, const char *accountname, const char *protocol,
 	const char *sender, const char *message, char **newmessagep,
 	OtrlTLV **tlvsp, ConnContext **contextp,
 	void (*add_appdata)(void *data, ConnContext *context),
-	void *data)
+	void *data, ConnContext *m_context, OtrlPolicy policy)
 {
-    ConnContext *context, *m_context, *best_context;
+    ConnContext *context, *best_context;
     OtrlMessageType msgtype;
     int context_added = 0;
-    OtrlPolicy policy = OTRL_POLICY_DEFAULT;
     char *unfragmessage = NULL, *otrtag = NULL;
     EncrData edata;
     otrl_instag_t our_instance = 0, their_instance = 0;
     int version;
     gcry_error_t err;
 
-    if (!accountname || !protocol || !sender || !message || !newmessagep)
-	return 0;
-
     *newmessagep = NULL;
     if (tlvsp) *tlvsp = NULL;
 
@@ -954,36 +1309,28 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	*contextp = NULL;
     }
 
-    /* Find the master context and state with this correspondent */
-    m_context = otrl_context_find(us, sender, accountname,
-	    protocol, OTRL_INSTAG_MASTER, 1, &context_added, add_appdata, data);
     context = m_context;
-
-    /* Update the context list if we added one */
-    if (context_added && ops->update_context_list) {
-	ops->update_context_list(opdata);
-    }
-
-    best_context = otrl_context_find(us, sender, accountname,
-	    protocol, OTRL_INSTAG_BEST, 0, NULL, add_appdata, data);
-
-    /* Find or generate the instance tag if needed */
-    if (!context->our_instance) {
-	populate_context_instag(us, ops, opdata, accountname, protocol,
-		context);
-    }
-
-
-    /* Check the policy */
-    if (ops->policy) {
-	policy = ops->policy(opdata, context);
-    }
+    best_context = otrl_context_find_recent_secure_instance(m_context);
 
     /* Should we go on at all? */
     if ((policy & OTRL_POLICY_VERSION_MASK) == 0) {
 	return 0;
     }
 
+    /* If one of their AKE messages is still in the AKE pool, hold this
+     * one back until otrl_message_ake_poll, so that they're handled in
+     * the order they arrived.  Handling it now instead would race with
+     * the pool, so if there's no memory to hold it, say so. */
+    if (m_context->context_priv->ake_job) {
+	err = otrl_akepool_hold(m_context, accountname, protocol, sender,
+		message, add_appdata, data);
+	if (err && ops->handle_msg_event) {
+	    ops->handle_msg_event(opdata, OTRL_MSGEVENT_RCVDMSG_UNREADABLE,
+		    m_context, NULL, err);
+	}
+	return 1;
+    }
+
     otrtag = strstr(message, "?OTR");
     if (otrtag) {
 	/* See if we have a V3 fragment */
@@ -1017,7 +1364,10 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		break;
 	    case OTRL_FRAGMENT_INCOMPLETE:
 		/* We've accumulated this fragment, but we don't have a
-		 * complete message yet */
+		 * complete message yet.  Make sure otrl_message_poll gets
+		 * around to giving up on it. */
+		schedule_poll(context);
+		update_timer(us, ops, opdata);
 		return 1;
 	    case OTRL_FRAGMENT_COMPLETE:
 		/* We've got a new complete message, in unfragmessage. */
@@ -1089,6 +1439,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    context->auth.protocol_version = 3;
 	    context->protocol_version = 3;
 	    context->msgstate = m_context->msgstate;
+	    otrl_context_best_instance_changed(context);
 
 	    if (m_context->context_priv->may_retransmit) {
 		gcry_free(context->context_priv->lastmessage);
@@ -1116,6 +1467,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    !(context->auth.authstate ==
 		    OTRL_AUTHSTATE_AWAITING_DHKEY)) {
 		context->msgstate = m_context->msgstate;
+		otrl_context_best_instance_changed(context);
 		context->auth.protocol_version = 3;
 		context->protocol_version = 3;
 		otrl_auth_copy_on_key(&(m_context->auth), &(context->auth));
@@ -1129,6 +1481,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 
     /* update time of last received message */
     context->context_priv->lastrecv = time(NULL);
+    otrl_context_best_instance_changed(context);
     otrl_context_update_recent_child(context, 0);
 
     edata.gone_encrypted = 0;
@@ -1170,17 +1523,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    break;
 		case 1:
 		    /* Get our private key */
-		    privkey = otrl_privkey_find(us, context->accountname,
-			    context->protocol);
-		    if (privkey == NULL) {
-			/* We've got no private key! */
-			if (ops->create_privkey) {
-			    ops->create_privkey(opdata, context->accountname,
-				    context->protocol);
-			    privkey = otrl_privkey_find(us,
-				    context->accountname, context->protocol);
-			}
-		    }
+		    privkey = find_privkey(us, ops, opdata, context);
 		    if (privkey) {
 			err = otrl_auth_start_v1(&(context->auth), our_dh,
 				our_keyid, privkey);
@@ -1204,18 +1547,9 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 
 	case OTRL_MSGTYPE_DH_KEY:
 	    /* Get our private key */
-	    privkey = otrl_privkey_find(us, context->accountname,
-		    context->protocol);
-	    if (privkey == NULL) {
-		/* We've got no private key! */
-		if (ops->create_privkey) {
-		    ops->create_privkey(opdata, context->accountname,
-			    context->protocol);
-		    privkey = otrl_privkey_find(us,
-			    context->accountname, context->protocol);
-		}
-	    }
-	    if (privkey) {
+	    privkey = find_privkey(us, ops, opdata, context);
+	    if (privkey && !offload_ake(us, context, msgtype, otrtag,
+			privkey)) {
 		err = otrl_auth_handle_key(&(context->auth), otrtag,
 			&haveauthmsg, privkey);
 		if (err || haveauthmsg) {
@@ -1228,18 +1562,9 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 
 	case OTRL_MSGTYPE_REVEALSIG:
 	    /* Get our private key */
-	    privkey = otrl_privkey_find(us, context->accountname,
-		    context->protocol);
-	    if (privkey == NULL) {
-		/* We've got no private key! */
-		if (ops->create_privkey) {
-		    ops->create_privkey(opdata, context->accountname,
-			    context->protocol);
-		    privkey = otrl_privkey_find(us,
-			    context->accountname, context->protocol);
-		}
-	    }
-	    if (privkey) {
+	    privkey = find_privkey(us, ops, opdata, context);
+	    if (privkey && !offload_ake(us, context, msgtype, otrtag,
+			privkey)) {
 		err = otrl_auth_handle_revealsig(&(context->auth),
 			otrtag, &haveauthmsg, privkey, go_encrypted,
 			&edata);
@@ -1253,6 +1578,10 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    break;
 
 	case OTRL_MSGTYPE_SIGNATURE:
+	    if (offload_ake(us, context, msgtype, otrtag, NULL)) {
+		if (edata.ignore_message == -1) edata.ignore_message = 1;
+		break;
+	    }
 	    err = otrl_auth_handle_signature(&(context->auth),
 		    otrtag, &haveauthmsg, go_encrypted, &edata);
 	    if (err || haveauthmsg) {
@@ -1275,17 +1604,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    }
 
 	    /* Get our private key */
-	    privkey = otrl_privkey_find(us, context->accountname,
-		    context->protocol);
-	    if (privkey == NULL) {
-		/* We've got no private key! */
-		if (ops->create_privkey) {
-		    ops->create_privkey(opdata, context->accountname,
-			    context->protocol);
-		    privkey = otrl_privkey_find(us, context->accountname,
-			    context->protocol);
-		}
-	    }
+	    privkey = find_privkey(us, ops, opdata, context);
 	    if (privkey) {
 		err = otrl_auth_handle_v1_key_exchange(&(context->auth),
 			message, &haveauthmsg, privkey, our_dh, our_keyid,
@@ -1308,6 +1627,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		const char *err_msg;
 		unsigned char *extrakey;
 		unsigned char flags;
+		int scratched;
 		NextExpectedSMP nextMsg;
 
 		case OTRL_MSGSTATE_PLAINTEXT:
@@ -1344,7 +1664,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 
 		case OTRL_MSGSTATE_ENCRYPTED:
 		    extrakey = gcry_malloc_secure(OTRL_EXTRAKEY_BYTES);
-		    err = otrl_proto_accept_data(&plaintext, &tlvs, context,
+		    err = accept_data(&plaintext, &scratched, &tlvs, context,
 				    message, &flags, extrakey);
 		    if (err) {
 			int is_conflict =
@@ -1724,18 +2044,29 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    if (edata.ignore_message != 1) {
 			char *converted_msg = NULL;
 
-			*newmessagep = plaintext;
+			/* The caller frees what we return, so it can't
+			 * be the scratch buffer */
+			*newmessagep = scratched ? strdup(plaintext) :
+			    plaintext;
 			edata.ignore_message = 0;
 
-			/* convert the plaintext message if necessary */
-			if (ops->convert_msg) {
+			if (!*newmessagep) {
+			    /* We can't show it */
+			    edata.ignore_message = 1;
+			    if (ops->handle_msg_event) {
+				ops->handle_msg_event(opdata,
+					OTRL_MSGEVENT_RCVDMSG_UNREADABLE,
+					context, NULL,
+					gcry_error(GPG_ERR_ENOMEM));
+			    }
+			} else if (ops->convert_msg) {
+			    /* convert the plaintext message if necessary */
 			    ops->convert_msg(opdata, context,
 				    OTRL_CONVERT_RECEIVING, &converted_msg,
 				    plaintext);
 
 			    if (converted_msg) {
-				free(plaintext);
-				plaintext = NULL;
+				free(*newmessagep);
 				*newmessagep = strdup(converted_msg);
 
 				if (ops->convert_free) {
@@ -1744,9 +2075,12 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 				}
 			    }
 			}
-		    } else {
+		    } else if (!scratched) {
 			free(plaintext);
 		    }
+		    if (scratched) {
+			wipe_scratch(context);
+		    }
 		    break;
 	    }
 	    break;
@@ -1819,19 +2153,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			break;
 		    case 1:
 			/* Get our private key */
-			privkey = otrl_privkey_find(us, context->accountname,
-				context->protocol);
-			if (privkey == NULL) {
-			    /* We've got no private key! */
-			    if (ops->create_privkey) {
-				ops->create_privkey(opdata,
-					context->accountname,
-					context->protocol);
-				privkey = otrl_privkey_find(us,
-					context->accountname,
-					context->protocol);
-			    }
-			}
+			privkey = find_privkey(us, ops, opdata, context);
 			if (privkey) {
 			    err = otrl_auth_start_v1(&(context->auth), NULL, 0,
 				    privkey);
@@ -1882,6 +2204,339 @@ end:
     return edata.ignore_message;
 }
 
+/* Handle a message just received from the network.  It is safe to pass
+ * all received messages to this routine.  add_appdata is a function
+ * that will be called in the event that a new ConnContext is created.
+ * It will be passed the data that you supplied, as well as
+ * a pointer to the new ConnContext.  You can use this to add
+ * application-specific information to the ConnContext using the
+ * "context->app" field, for example.  If you don't need to do this, you
+ * can pass NULL for the last two arguments of otrl_message_receiving.
+ *
+ * If non-NULL, ops->convert_msg will be called after a data message is
+ * decrypted.
+ *
+ * If "contextp" is not NULL, it will be set to the ConnContext used for
+ * receiving the message.
+ *
+ * If otrl_message_receiving returns 1, then the message you received
+ * was an internal protocol message, and no message should be delivered
+ * to the user.
+ *
+ * If it returns 0, then check if *messagep was set to non-NULL.  If
+ * so, replace the received message with the contents of *messagep, and
+ * deliver that to the user instead.  You must call
+ * otrl_message_free(*messagep) when you're done with it.  If tlvsp is
+ * non-NULL, *tlvsp will be set to a chain of any TLVs that were
+ * transmitted along with this message.  You must call
+ * otrl_tlv_free(*tlvsp) when you're done with those.
+ *
+ * If otrl_message_receiving returns 0 and *messagep is NULL, then this
+ * was an ordinary, non-OTR message, which should just be delivered to
+ * the user without modification. */
+int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, const char *accountname, const char *protocol,
+	const char *sender, const char *message, char **newmessagep,
+	OtrlTLV **tlvsp, ConnContext **contextp,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    ConnContext *m_context;
+    int context_added = 0;
+    OtrlPolicy policy = OTRL_POLICY_DEFAULT;
+    int ignore;
+
+    if (!accountname || !protocol || !sender || !message || !newmessagep)
+	return 0;
+
+    /* Find the master context and state with this correspondent */
+    m_context = otrl_context_find(us, sender, accountname,
+	    protocol, OTRL_INSTAG_MASTER, 1, &context_added, add_appdata, data);
+    otrl_uslock_context_lock(m_context);
+
+    /* Update the context list if we added one */
+    if (context_added && ops->update_context_list) {
+	ops->update_context_list(opdata);
+    }
+
+    /* Find or generate the instance tag if needed */
+    if (!m_context->our_instance) {
+	populate_context_instag(us, ops, opdata, accountname, protocol,
+		m_context);
+    }
+
+    /* Check the policy */
+    if (ops->policy) {
+	policy = ops->policy(opdata, m_context);
+    }
+
+    ignore = receive_message(us, ops, opdata, accountname, protocol, sender,
+	    message, newmessagep, tlvsp, contextp, add_appdata, data,
+	    m_context, policy);
+
+    otrl_uslock_context_unlock(m_context);
+    return ignore;
+}
+
+/* One entry of the sort done by otrl_message_receiving_batch: the
+ * message's position in the batch, its master context, and the
+ * position of the first message in the batch for that context. */
+typedef struct {
+    size_t index;
+    size_t first;
+    ConnContext *m_context;
+} BatchOrder;
+
+static int batch_order_by_context(const void *a, const void *b)
+{
+    const BatchOrder *oa = a, *ob = b;
+
+    if (oa->m_context != ob->m_context) {
+	return oa->m_context < ob->m_context ? -1 : 1;
+    }
+    return oa->index < ob->index ? -1 : (oa->index > ob->index);
+}
+
+static int batch_order_by_first(const void *a, const void *b)
+{
+    const BatchOrder *oa = a, *ob = b;
+
+    if (oa->first != ob->first) {
+	return oa->first < ob->first ? -1 : 1;
+    }
+    return oa->index < ob->index ? -1 : (oa->index > ob->index);
+}
+
+/* Are these two batch entries from the same correspondent? */
+static int batch_same_peer(const OtrlMessageReceived *a,
+	const OtrlMessageReceived *b)
+{
+    return !strcmp(a->sender, b->sender) &&
+	!strcmp(a->accountname, b->accountname) &&
+	!strcmp(a->protocol, b->protocol);
+}
+
+/* Handle a batch of messages just received from the network, such as
+ * those read from the socket in one go.  This is the same as calling
+ * otrl_message_receiving on each of items[0..count-1], with the
+ * accountname, protocol, sender and message fields as the arguments,
+ * and the results put in the newmessage, tlvs, context and ignore
+ * fields (ignore being what otrl_message_receiving would have
+ * returned).  The messages are grouped by the correspondent who sent
+ * them, so each master context is looked up, and the policy for it
+ * queried, only once per batch, and ops->update_context_list is called
+ * at most once.  Messages from the same correspondent are handled in
+ * the order they appear in items; groups are handled in the order their
+ * first message appears.  You are responsible for freeing each non-NULL
+ * newmessage and tlvs, as for otrl_message_receiving. */
+void otrl_message_receiving_batch(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata,
+	OtrlMessageReceived *items, size_t count,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    BatchOrder *order;
+    size_t i, j, n = 0;
+    int any_added = 0;
+    ConnContext *m_context = NULL;
+    OtrlPolicy policy = OTRL_POLICY_DEFAULT;
+
+    if (!items || count == 0) return;
+
+    order = malloc(count * sizeof(BatchOrder));
+    if (!order) {
+	/* Just handle them one at a time */
+	for (i = 0; i < count; ++i) {
+	    OtrlMessageReceived *item = &items[i];
+	    item->newmessage = NULL;
+	    item->tlvs = NULL;
+	    item->context = NULL;
+	    item->ignore = otrl_message_receiving(us, ops, opdata,
+		    item->accountname, item->protocol, item->sender,
+		    item->message, &item->newmessage, &item->tlvs,
+		    &item->context, add_appdata, data);
+	}
+	return;
+    }
+
+    /* Find the master context for each message, reusing the previous
+     * one when consecutive messages come from the same correspondent. */
+    for (i = 0; i < count; ++i) {
+	OtrlMessageReceived *item = &items[i];
+	int context_added = 0;
+
+	item->newmessage = NULL;
+	item->tlvs = NULL;
+	item->context = NULL;
+	item->ignore = 0;
+
+	if (!item->accountname || !item->protocol || !item->sender ||
+		!item->message) {
+	    continue;
+	}
+
+	if (n == 0 || !batch_same_peer(&items[order[n-1].index], item)) {
+	    m_context = otrl_context_find(us, item->sender,
+		    item->accountname, item->protocol, OTRL_INSTAG_MASTER, 1,
+		    &context_added, add_appdata, data);
+	    any_added |= context_added;
+	}
+	order[n].index = i;
+	order[n].m_context = m_context;
+	++n;
+    }
+
+    if (any_added && ops->update_context_list) {
+	ops->update_context_list(opdata);
+    }
+
+    /* Group the messages by master context, keeping each group in the
+     * order it arrived, and then put the groups in order of their first
+     * message. */
+    qsort(order, n, sizeof(BatchOrder), batch_order_by_context);
+    for (i = 0; i < n; ++i) {
+	order[i].first = (i > 0 && order[i].m_context ==
+		order[i-1].m_context) ? order[i-1].first : order[i].index;
+    }
+    qsort(order, n, sizeof(BatchOrder), batch_order_by_first);
+
+    for (i = 0; i < n; i = j) {
+	m_context = order[i].m_context;
+	otrl_uslock_context_lock(m_context);
+
+	/* Find or generate the instance tag if needed */
+	if (!m_context->our_instance) {
+	    populate_context_instag(us, ops, opdata,
+		    m_context->accountname, m_context->protocol, m_context);
+	}
+
+	/* Check the policy once for the whole group */
+	policy = OTRL_POLICY_DEFAULT;
+	if (ops->policy) {
+	    policy = ops->policy(opdata, m_context);
+	}
+
+	for (j = i; j < n && order[j].m_context == m_context; ++j) {
+	    OtrlMessageReceived *item = &items[order[j].index];
+	    item->ignore = receive_message(us, ops, opdata,
+		    item->accountname, item->protocol, item->sender,
+		    item->message, &item->newmessage, &item->tlvs,
+		    &item->context, add_appdata, data, m_context, policy);
+	}
+	otrl_uslock_context_unlock(m_context);
+    }
+
+    free(order);
+}
+
+/* Finish handling the AKE messages whose public-key operations the
+ * given OtrlUserState's AKE pool (see akepool.h) has done since the
+ * last call, sending replies and calling ops callbacks as
+ * otrl_message_receiving would have.  Call this from your main thread,
+ * whenever the pool's ready callback tells you to, or just every so
+ * often.  Messages that arrived from a correspondent while one of their
+ * AKE messages was in the pool were held back (otrl_message_receiving
+ * returned 1 for them); they are handled now, and *heldp is set to an
+ * array of *numheldp entries with their results, to be treated as if
+ * they came from otrl_message_receiving_batch.  Call
+ * otrl_message_ake_held_free(*heldp, *numheldp) when you're done with
+ * them. */
+void otrl_message_ake_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, OtrlMessageReceived **heldp, size_t *numheldp)
+{
+    OtrlAKEJob *job, *next;
+    OtrlMessageReceived *results = NULL;
+    size_t num = 0;
+
+    *heldp = NULL;
+    *numheldp = 0;
+
+    for (job = otrl_akepool_take_finished(us); job; job = next) {
+	ConnContext *m_context = job->m_context;
+	OtrlAKEHeld *held;
+	size_t count = 0;
+
+	next = job->next;
+
+	if (!m_context) {
+	    /* The correspondent has been forgotten */
+	    otrl_akepool_job_free(job);
+	    continue;
+	}
+	otrl_uslock_context_lock(m_context);
+
+	if (job->context && !job->cancelled) {
+	    finish_ake(us, ops, opdata, job);
+	}
+	m_context->context_priv->ake_job = NULL;
+	schedule_poll(m_context);
+
+	/* Make room for the results of the held messages */
+	for (held = job->held; held; held = held->next) {
+	    count++;
+	}
+	if (count > 0) {
+	    OtrlMessageReceived *newresults = realloc(results,
+		    (num + count) * sizeof(OtrlMessageReceived));
+	    if (!newresults) {
+		/* Drop them, as if they'd been lost in transit */
+		otrl_uslock_context_unlock(m_context);
+		otrl_akepool_job_free(job);
+		continue;
+	    }
+	    results = newresults;
+	}
+
+	/* Handle them in order, until one of them is handed to the pool
+	 * in turn */
+	while (job->held && !m_context->context_priv->ake_job) {
+	    OtrlMessageReceived *item = &results[num++];
+
+	    held = job->held;
+	    job->held = held->next;
+
+	    item->accountname = held->accountname;
+	    item->protocol = held->protocol;
+	    item->sender = held->sender;
+	    item->message = held->message;
+	    item->ignore = otrl_message_receiving(us, ops, opdata,
+		    held->accountname, held->protocol, held->sender,
+		    held->message, &item->newmessage, &item->tlvs,
+		    &item->context, held->add_appdata, held->data);
+	    free(held);
+	}
+
+	/* If one was, the rest keep waiting behind the new job */
+	if (job->held) {
+	    OtrlAKEJob *newjob = m_context->context_priv->ake_job;
+	    newjob->held = job->held;
+	    newjob->heldtail = job->heldtail;
+	    job->held = NULL;
+	}
+	otrl_uslock_context_unlock(m_context);
+	otrl_akepool_job_free(job);
+    }
+
+    *heldp = results;
+    *numheldp = num;
+}
+
+/* Free the results returned by otrl_message_ake_poll. */
+void otrl_message_ake_held_free(OtrlMessageReceived *held, size_t numheld)
+{
+    size_t i;
+
+    for (i = 0; i < numheld; ++i) {
+	free((char *)held[i].accountname);
+	free((char *)held[i].protocol);
+	free((char *)held[i].sender);
+	free((char *)held[i].message);
+	otrl_message_free(held[i].newmessage);
+	otrl_tlv_free(held[i].tlvs);
+    }
+    free(held);
+}
+
 /* Put a connection into the PLAINTEXT state, first sending the
  * other side a notice that we're doing so if we're currently ENCRYPTED,
  * and we think he's logged in. Affects only the specified context. */
@@ -1930,7 +2585,9 @@ void otrl_message_disconnect(OtrlUserState us, const OtrlMessageAppOps *ops,
 
     if (!context) return;
 
+    otrl_uslock_context_lock(context);
     disconnect_context(us, ops, opdata, context);
+    otrl_uslock_context_unlock(context);
 }
 
 /* Put a connection into the PLAINTEXT state, first sending the
@@ -1940,8 +2597,8 @@ void otrl_message_disconnect_all_instances(OtrlUserState us,
 	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
 	const char *protocol, const char *username)
 {
-    ConnContext * c_iter;
     ConnContext *context;
+    unsigned int i;
 
     if (!username || !accountname || !protocol) return;
 
@@ -1950,10 +2607,15 @@ void otrl_message_disconnect_all_instances(OtrlUserState us,
 
     if (!context) return;
 
-    for (c_iter = context; c_iter && c_iter->m_context == context->m_context;
-	c_iter = c_iter->next) {
-	disconnect_context(us, ops, opdata, c_iter);
+    /* Go through the master's own table of its instances, rather than
+     * the context list, which other threads may be adding to */
+    otrl_uslock_context_lock(context);
+    disconnect_context(us, ops, opdata, context);
+    for (i = 0; i < context->context_priv->num_children; ++i) {
+	disconnect_context(us, ops, opdata,
+		context->context_priv->children[i]);
     }
+    otrl_uslock_context_unlock(context);
 }
 
 /* Get the current extra symmetric key (of size OTRL_EXTRAKEY_BYTES
@@ -2015,41 +2677,66 @@ unsigned int otrl_message_poll_get_default_interval(OtrlUserState us)
 /* Call this function every so often, either as directed by the
  * timer_control callback, or every definterval =
  * otrl_message_poll_get_default_interval(userstate) seconds if you have
- * no timer_control callback.  This function must be called from the
- * main libotr thread.*/
+ * no timer_control callback, or at the time returned by
+ * otrl_message_poll_next_deadline.  Only the contexts with a deadline
+ * that has passed are looked at.  This function must be called from
+ * the main libotr thread, unless the userstate is locked (see
+ * uslock.h).  In that case, correspondents whose contexts are busy in
+ * other threads are left for the next call. */
 void otrl_message_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata)
 {
+    time_t now = time(NULL);
+
     /* Wipe private keys last sent before this time */
-    time_t expire_before = time(NULL) - MAX_AKE_WAIT_TIME;
+    time_t expire_before = now - MAX_AKE_WAIT_TIME;
 
     ConnContext *contextp;
 
-    /* Is there a context still waiting for a DHKEY message, even after
-     * we wipe the stale ones? */
-    int still_waiting = 0;
-
     if (us == NULL) return;
 
-    for (contextp = us->context_root; contextp; contextp = contextp->next) {
+    otrl_uslock_contexts_read(us);
+    while ((contextp = otrl_deadline_take(us, now)) != NULL) {
+	/* Don't wait for other threads; just come back next time */
+	if (!otrl_uslock_context_trylock(contextp)) {
+	    otrl_deadline_schedule(contextp, now + 1);
+	    continue;
+	}
+
+	/* Discard any partly received messages we've given up on */
+	otrl_fragment_expire(contextp->context_priv,
+		now - OTRL_FRAGMENT_EXPIRY);
+
 	/* If this is a master context, and it's still waiting for a
-	 * v3 DHKEY message, see if it's waited long enough. */
+	 * v3 DHKEY message, see if it's waited long enough.  If its AKE
+	 * is in the pool, a pool thread may be writing its auth, so
+	 * leave it; otrl_message_ake_poll will schedule it again once
+	 * that's done. */
 	if (contextp->m_context == contextp &&
+		!contextp->context_priv->ake_job &&
 		contextp->auth.authstate == OTRL_AUTHSTATE_AWAITING_DHKEY &&
 		contextp->auth.protocol_version == 3 &&
-		contextp->auth.commit_sent_time > 0) {
-	    if (contextp->auth.commit_sent_time < expire_before) {
-		otrl_auth_clear(&contextp->auth);
-	    } else {
-		/* Not yet expired */
-		still_waiting = 1;
-	    }
+		contextp->auth.commit_sent_time > 0 &&
+		contextp->auth.commit_sent_time < expire_before) {
+	    otrl_auth_clear(&contextp->auth);
 	}
+
+	schedule_poll(contextp);
+	otrl_uslock_context_unlock(contextp);
     }
+    otrl_uslock_contexts_done(us);
 
     /* If there's nothing more to wait for, stop the timer, if possible. */
-    if (still_waiting == 0 && ops && ops->timer_control) {
-	ops->timer_control(opdata, 0);
-	us->timer_running = 0;
-    }
+    update_timer(us, ops, opdata);
+}
+
+/* Return the time at which otrl_message_poll next has something to do
+ * for the given OtrlUserState, or 0 if there is nothing it is waiting
+ * for.  Applications that would rather set a timer for exactly when it
+ * is needed than be called back through timer_control can use this
+ * after each call to otrl_message_poll, otrl_message_sending or
+ * otrl_message_receiving. */
+time_t otrl_message_poll_next_deadline(OtrlUserState us)
+{
+    return otrl_deadline_next(us);
 }
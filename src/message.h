@@ -220,7 +220,8 @@ typedef struct s_OtrlMessageAppOps {
      *      Received an encrypted message but cannot read
      *      it because no private connection is established yet.
      * - OTRL_MSGEVENT_RCVDMSG_UNREADABLE
-     *      Cannot read the received message.
+     *      Cannot read the received message.  A gcry_error_t is passed
+     *      if that was for want of memory (see otrl_message_ake_poll).
      * - OTRL_MSGEVENT_RCVDMSG_MALFORMED
      *      The message received contains malformed data.
      * - OTRL_MSGEVENT_LOG_HEARTBEAT_RCVD
@@ -293,6 +294,14 @@ typedef struct s_OtrlMessageAppOps {
      */
     void (*timer_control)(void *opdata, unsigned int interval);
 
+    /* Send all the given fragments of a message to the given recipient
+     * from the given accountname/protocol, in order, in a single call.
+     * If this is NULL, inject_message is called once per fragment
+     * instead.  The fragments are only valid until you return. */
+    void (*inject_fragments)(void *opdata, const char *accountname,
+	    const char *protocol, const char *recipient,
+	    const OtrlFragment *fragments, unsigned int fragment_count);
+
 } OtrlMessageAppOps;
 
 /* Deallocate a message allocated by other otrl_message_* routines. */
@@ -342,6 +351,45 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
 	void (*add_appdata)(void *data, ConnContext *context),
 	void *data);
 
+/* One message in a batch passed to otrl_message_sending_batch.  You
+ * fill in the first six fields; the library fills in the rest. */
+typedef struct s_OtrlMessageToSend {
+    const char *accountname;
+    const char *protocol;
+    const char *recipient;
+    otrl_instag_t instag;
+    const char *message;
+    OtrlTLV *tlvs;
+
+    char *newmessage;         /* As *messagep from otrl_message_sending */
+    ConnContext *context;     /* As *contextp from otrl_message_sending */
+    gcry_error_t err;         /* What otrl_message_sending returned */
+} OtrlMessageToSend;
+
+/* Handle a batch of messages about to be sent to the network, such as
+ * one announcement going to many correspondents, or several messages
+ * going to one.  This is the same as calling otrl_message_sending on
+ * each of items[0..count-1] in turn, with the accountname, protocol,
+ * recipient, instag, message and tlvs fields and the given fragPolicy as
+ * the arguments, and the results put in the newmessage, context and err
+ * fields.  ops->update_context_list is called at most once, and when
+ * consecutive entries go to the same instance (or to the same master
+ * context), its lookup and policy query are done only once.  Each
+ * message is encrypted with the session keys of its own context.
+ *
+ * With OTRL_FRAGMENT_SEND_SKIP, nothing is injected and every
+ * ciphertext is left in its entry's newmessage, so that the
+ * application can write them all out in one go.  Otherwise each message
+ * is fragmented and injected as otrl_message_sending would, using
+ * ops->inject_fragments if it is set.  Call otrl_message_free on each
+ * non-NULL newmessage when you're done with it. */
+void otrl_message_sending_batch(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata,
+	OtrlMessageToSend *items, size_t count,
+	OtrlFragmentPolicy fragPolicy,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data);
+
 /* Handle a message just received from the network.  It is safe to pass
  * all received messages to this routine.  add_appdata is a function
  * that will be called in the event that a new ConnContext is created.
@@ -379,6 +427,59 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void (*add_appdata)(void *data, ConnContext *context),
 	void *data);
 
+/* One message in a batch passed to otrl_message_receiving_batch.  You
+ * fill in the first four fields; the library fills in the rest. */
+typedef struct s_OtrlMessageReceived {
+    const char *accountname;
+    const char *protocol;
+    const char *sender;
+    const char *message;
+
+    char *newmessage;         /* As *messagep from otrl_message_receiving */
+    OtrlTLV *tlvs;            /* As *tlvsp from otrl_message_receiving */
+    ConnContext *context;     /* As *contextp from otrl_message_receiving */
+    int ignore;               /* What otrl_message_receiving returned */
+} OtrlMessageReceived;
+
+/* Handle a batch of messages just received from the network, such as
+ * those read from the socket in one go.  This is the same as calling
+ * otrl_message_receiving on each of items[0..count-1], with the
+ * accountname, protocol, sender and message fields as the arguments,
+ * and the results put in the newmessage, tlvs, context and ignore
+ * fields (ignore being what otrl_message_receiving would have
+ * returned).  The messages are grouped by the correspondent who sent
+ * them, so each master context is looked up, and the policy for it
+ * queried, only once per batch, and ops->update_context_list is called
+ * at most once.  Messages from the same correspondent are handled in
+ * the order they appear in items; groups are handled in the order their
+ * first message appears.  You are responsible for freeing each non-NULL
+ * newmessage and tlvs, as for otrl_message_receiving. */
+void otrl_message_receiving_batch(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata,
+	OtrlMessageReceived *items, size_t count,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data);
+
+/* Finish handling the AKE messages whose public-key operations the
+ * given OtrlUserState's AKE pool (see akepool.h) has done since the
+ * last call, sending replies and calling ops callbacks as
+ * otrl_message_receiving would have.  Call this from your main thread,
+ * whenever the pool's ready callback tells you to, or just every so
+ * often.  Messages that arrived from a correspondent while one of their
+ * AKE messages was in the pool were held back (otrl_message_receiving
+ * returned 1 for them); they are handled now, and *heldp is set to an
+ * array of *numheldp entries with their results, to be treated as if
+ * they came from otrl_message_receiving_batch.  Call
+ * otrl_message_ake_held_free(*heldp, *numheldp) when you're done with
+ * them.  A message that couldn't be held back for lack of memory is
+ * dropped, and reported to ops->handle_msg_event as
+ * OTRL_MSGEVENT_RCVDMSG_UNREADABLE with GPG_ERR_ENOMEM. */
+void otrl_message_ake_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, OtrlMessageReceived **heldp, size_t *numheldp);
+
+/* Free the results returned by otrl_message_ake_poll. */
+void otrl_message_ake_held_free(OtrlMessageReceived *held, size_t numheld);
+
 /* Put a connection into the PLAINTEXT state, first sending the
  * other side a notice that we're doing so if we're currently ENCRYPTED,
  * and we think he's logged in. Affects only the specified instance. */
@@ -432,9 +533,21 @@ unsigned int otrl_message_poll_get_default_interval(OtrlUserState us);
 /* Call this function every so often, either as directed by the
  * timer_control callback, or every definterval =
  * otrl_message_poll_get_default_interval(userstate) seconds if you have
- * no timer_control callback.  This function must be called from the
- * main libotr thread.*/
+ * no timer_control callback, or at the time returned by
+ * otrl_message_poll_next_deadline.  Only the contexts with a deadline
+ * that has passed are looked at.  This function must be called from
+ * the main libotr thread, unless the userstate is locked (see
+ * uslock.h).  In that case, correspondents whose contexts are busy in
+ * other threads are left for the next call. */
 void otrl_message_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata);
 
+/* Return the time at which otrl_message_poll next has something to do
+ * for the given OtrlUserState, or 0 if there is nothing it is waiting
+ * for.  Applications that would rather set a timer for exactly when it
+ * is needed than be called back through timer_control can use this
+ * after each call to otrl_message_poll, otrl_message_sending or
+ * otrl_message_receiving. */
+time_t otrl_message_poll_next_deadline(OtrlUserState us);
+
 #endif
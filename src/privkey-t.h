@@ -33,6 +33,21 @@ typedef struct s_OtrlPrivKey {
     gcry_sexp_t privkey;
     unsigned char *pubkey_data;
     size_t pubkey_datalen;
+
+    /* Keys read lazily (see otrl_privkey_lazy_enable) are only parsed
+     * the first time they are looked up with otrl_privkey_find (or
+     * used with otrl_privkey_sign).  Until then, privkey and
+     * pubkey_data are NULL, and sexp is a copy of the unparsed
+     * "account" S-expression; afterwards, sexp is NULL. */
+    char *sexp;
+    size_t sexplen;
+
+    unsigned int hash;                 /* Hash of accountname and
+					  protocol */
+    struct s_OtrlPrivKey *hash_next;   /* The next key in our bucket of
+					  the userstate's privkey index */
+    struct s_OtrlPrivKey **hash_tous;  /* A pointer to the pointer to us
+					  in that bucket, or NULL */
 } OtrlPrivKey;
 
 #define OTRL_PUBKEY_TYPE_DSA 0x0000
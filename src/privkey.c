@@ -18,11 +18,23 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /* libgcrypt headers */
 #include <gcrypt.h>
@@ -30,6 +42,28 @@
 /* libotr headers */
 #include "privkey.h"
 #include "serial.h"
+#include "fpstore.h"
+#include "hash.h"
+#include "uslock.h"
+
+/* Convert a hex character to a value */
+static unsigned int ctoh(char c)
+{
+    if (c >= '0' && c <= '9') return c-'0';
+    if (c >= 'a' && c <= 'f') return c-'a'+10;
+    if (c >= 'A' && c <= 'F') return c-'A'+10;
+    return 0;  /* Unknown hex char */
+}
+
+/* Convert the 40 hex digits at hex to a 20-byte hash value */
+void otrl_privkey_hex_to_hash(unsigned char hash[20], const char *hex)
+{
+    int i;
+
+    for(i=0; i<20; ++i) {
+	hash[i] = (ctoh(hex[2*i]) << 4) + (ctoh(hex[2*i+1]));
+    }
+}
 
 /* Convert a 20-byte hash value to a 45-byte human-readable value */
 void otrl_privkey_hash_to_human(
@@ -197,18 +231,390 @@ gcry_error_t otrl_privkey_read(OtrlUserState us, const char *filename)
     return err;
 }
 
+/* The hash index over a userstate's private keys */
+struct s_OtrlPrivKeyIndex {
+    OtrlPrivKey **buckets;
+    unsigned int mask;                 /* The number of buckets, less 1 */
+};
+
+/* Where the pieces of one "account" S-exp are in the privkey file */
+typedef struct {
+    size_t off, len;                   /* The whole "account" S-exp */
+    size_t nameoff, namelen;           /* Its "name" S-exp */
+    size_t protooff, protolen;         /* Its "protocol" S-exp */
+} PrivKeyExtent;
+
+static unsigned int privkey_hash(const char *accountname,
+	const char *protocol)
+{
+    return otrl_hash_string(otrl_hash_string(OTRL_HASH_INIT, accountname),
+	    protocol);
+}
+
+static void privkey_index_free(OtrlUserState us)
+{
+    struct s_OtrlPrivKeyIndex *index = us->privkey_index;
+
+    if (!index) return;
+
+    free(index->buckets);
+    free(index);
+    us->privkey_index = NULL;
+}
+
+static int sexp_isspace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+	c == '\f' || c == '\v';
+}
+
+static size_t sexp_skip_space(const char *buf, size_t len, size_t pos)
+{
+    while (pos < len && sexp_isspace(buf[pos])) ++pos;
+    return pos;
+}
+
+/* Skip over the atom (token, quoted string, hex or base64 string, or
+ * length-prefixed verbatim string) starting at *posp.  Return 0 on
+ * success, or -1 if there's no well-formed atom there. */
+static int sexp_skip_atom(const char *buf, size_t len, size_t *posp)
+{
+    size_t pos = *posp;
+    size_t n;
+    char c;
+
+    if (pos >= len) return -1;
+    c = buf[pos];
+
+    if (c >= '0' && c <= '9') {
+	/* A length prefix */
+	n = 0;
+	while (pos < len && buf[pos] >= '0' && buf[pos] <= '9') {
+	    if (n > len) return -1;
+	    n = n * 10 + (buf[pos] - '0');
+	    ++pos;
+	}
+	if (pos >= len) return -1;
+	if (buf[pos] == ':') {
+	    if (n > len - pos - 1) return -1;
+	    *posp = pos + 1 + n;
+	    return 0;
+	}
+	c = buf[pos];
+	if (c != '"' && c != '#' && c != '|') return -1;
+    }
+
+    switch(c) {
+	case '"':
+	    for (++pos; pos < len && buf[pos] != '"'; ++pos) {
+		if (buf[pos] == '\\') ++pos;
+	    }
+	    break;
+	case '#':
+	case '|':
+	    for (++pos; pos < len && buf[pos] != c; ++pos);
+	    break;
+	case '(':
+	case ')':
+	case '[':
+	case ']':
+	case '{':
+	case '}':
+	    return -1;
+	default:
+	    while (pos < len && !sexp_isspace(buf[pos]) &&
+		    !strchr("()[]{}\"#|", buf[pos])) {
+		++pos;
+	    }
+	    *posp = pos;
+	    return 0;
+    }
+    if (pos >= len) return -1;
+    *posp = pos + 1;
+    return 0;
+}
+
+/* Skip over the list starting at *posp, which must point to a '('.
+ * Return 0 on success, or -1 if the list is not well-formed. */
+static int sexp_skip_list(const char *buf, size_t len, size_t *posp)
+{
+    size_t pos = *posp;
+    unsigned int depth = 0;
+
+    while (1) {
+	pos = sexp_skip_space(buf, len, pos);
+	if (pos >= len) return -1;
+	if (buf[pos] == '(') {
+	    ++depth;
+	    ++pos;
+	} else if (buf[pos] == ')') {
+	    ++pos;
+	    if (--depth == 0) break;
+	} else if (sexp_skip_atom(buf, len, &pos)) {
+	    return -1;
+	}
+    }
+    *posp = pos;
+    return 0;
+}
+
+/* Is the atom from start to end the given token, written either
+ * plainly or as a verbatim string? */
+static int sexp_atom_is(const char *buf, size_t start, size_t end,
+	const char *token)
+{
+    size_t toklen = strlen(token);
+    char prefix[24];
+    size_t prefixlen;
+
+    if (end - start == toklen && !memcmp(buf + start, token, toklen)) {
+	return 1;
+    }
+    sprintf(prefix, "%lu:", (unsigned long)toklen);
+    prefixlen = strlen(prefix);
+    return end - start == prefixlen + toklen &&
+	!memcmp(buf + start, prefix, prefixlen) &&
+	!memcmp(buf + start + prefixlen, token, toklen);
+}
+
+/* Find the "name" and "protocol" S-exps in the "account" S-exp of the
+ * given extent, and check that it has a "private-key". */
+static gcry_error_t account_scan(const char *buf, PrivKeyExtent *ext)
+{
+    size_t end = ext->off + ext->len - 1;  /* The closing ')' */
+    size_t pos, atom, sub;
+    int seen_privkey = 0;
+
+    pos = sexp_skip_space(buf, end, ext->off + 1);
+    atom = pos;
+    if (sexp_skip_atom(buf, end, &pos) ||
+	    !sexp_atom_is(buf, atom, pos, "account")) {
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+
+    ext->namelen = 0;
+    ext->protolen = 0;
+    while ((pos = sexp_skip_space(buf, end, pos)) < end) {
+	size_t subend = pos;
+
+	if (buf[pos] != '(') {
+	    if (sexp_skip_atom(buf, end, &pos)) {
+		return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+	    }
+	    continue;
+	}
+	if (sexp_skip_list(buf, end, &subend)) {
+	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+	}
+
+	/* Look at the first atom of this sub-S-exp */
+	sub = pos;
+	atom = sexp_skip_space(buf, subend, pos + 1);
+	pos = atom;
+	if (atom < subend && buf[atom] != '(' &&
+		sexp_skip_atom(buf, subend, &pos) == 0) {
+	    if (!ext->namelen && sexp_atom_is(buf, atom, pos, "name")) {
+		ext->nameoff = sub;
+		ext->namelen = subend - sub;
+	    } else if (!ext->protolen &&
+		    sexp_atom_is(buf, atom, pos, "protocol")) {
+		ext->protooff = sub;
+		ext->protolen = subend - sub;
+	    } else if (sexp_atom_is(buf, atom, pos, "private-key")) {
+		seen_privkey = 1;
+	    }
+	}
+	pos = subend;
+    }
+
+    if (!ext->namelen || !ext->protolen || !seen_privkey) {
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Find the extent of each "account" S-exp in the text of a privkeys
+ * file.  Return gcry_error(GPG_ERR_INV_SEXP) if the text is not
+ * something this simple scanner understands. */
+static gcry_error_t privkey_scan(const char *buf, size_t len,
+	PrivKeyExtent **extentsp, size_t *numextentsp)
+{
+    PrivKeyExtent *extents = NULL;
+    size_t numextents = 0, extentssize = 0;
+    size_t pos, atom, end;
+    gcry_error_t err;
+
+    *extentsp = NULL;
+    *numextentsp = 0;
+
+    /* Check that the list as a whole is well-formed */
+    pos = sexp_skip_space(buf, len, 0);
+    end = pos;
+    if (end >= len || buf[end] != '(' || sexp_skip_list(buf, len, &end)) {
+	return gcry_error(GPG_ERR_INV_SEXP);
+    }
+    --end;  /* The closing ')' */
+
+    pos = sexp_skip_space(buf, end, pos + 1);
+    atom = pos;
+    if (sexp_skip_atom(buf, end, &pos)) {
+	return gcry_error(GPG_ERR_INV_SEXP);
+    }
+    if (!sexp_atom_is(buf, atom, pos, "privkeys")) {
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+
+    /* Get each account */
+    while ((pos = sexp_skip_space(buf, end, pos)) < end) {
+	PrivKeyExtent *ext;
+
+	/* It's really an "account" S-exp? */
+	if (buf[pos] != '(') {
+	    free(extents);
+	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+	}
+	if (numextents == extentssize) {
+	    size_t newsize = extentssize ? 2 * extentssize : 16;
+	    PrivKeyExtent *newextents = realloc(extents,
+		    newsize * sizeof(*extents));
+	    if (!newextents) {
+		free(extents);
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	    extents = newextents;
+	    extentssize = newsize;
+	}
+	ext = &extents[numextents];
+	ext->off = pos;
+	sexp_skip_list(buf, end, &pos);
+	ext->len = pos - ext->off;
+
+	err = account_scan(buf, ext);
+	if (err) {
+	    free(extents);
+	    return err;
+	}
+	++numextents;
+    }
+
+    *extentsp = extents;
+    *numextentsp = numextents;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Parse the given (name ...) or (protocol ...) S-exp, and return a
+ * newly allocated copy of its value in *strp. */
+static gcry_error_t sexp_nth_string(const char *text, size_t len,
+	char **strp)
+{
+    gcry_sexp_t sexp;
+    const char *token;
+    size_t tokenlen;
+    gcry_error_t err;
+
+    *strp = NULL;
+    err = gcry_sexp_sscan(&sexp, NULL, text, len);
+    if (err) {
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    token = gcry_sexp_nth_data(sexp, 1, &tokenlen);
+    if (!token) {
+	gcry_sexp_release(sexp);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    *strp = malloc(tokenlen + 1);
+    if (!*strp) {
+	gcry_sexp_release(sexp);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    memmove(*strp, token, tokenlen);
+    (*strp)[tokenlen] = '\0';
+    gcry_sexp_release(sexp);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Parse the given "account" S-expression into the privkey and
+ * pubkey_data of p. */
+static gcry_error_t privkey_parse(OtrlPrivKey *p, const char *text,
+	size_t len)
+{
+    gcry_sexp_t accounts, privs;
+    gcry_error_t err;
+
+    err = gcry_sexp_sscan(&accounts, NULL, text, len);
+    if (err) {
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    privs = gcry_sexp_find_token(accounts, "private-key", 0);
+    gcry_sexp_release(accounts);
+    if (!privs) {
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    err = make_pubkey(&(p->pubkey_data), &(p->pubkey_datalen), privs);
+    if (err) {
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    p->privkey = privs;
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Held while parsing a key read lazily, which may be looked up or
+ * used from several threads at once */
+static pthread_mutex_t privkey_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Parse a key that was read lazily, if that hasn't been done yet, and
+ * let go of its text. */
+static gcry_error_t privkey_load(OtrlPrivKey *p)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&privkey_load_mutex);
+#endif
+    if (!p->privkey && p->sexp) {
+	err = privkey_parse(p, p->sexp, p->sexplen);
+	if (!err) {
+	    /* The text contains private key material */
+	    memset(p->sexp, 0, p->sexplen);
+	    free(p->sexp);
+	    p->sexp = NULL;
+	    p->sexplen = 0;
+	}
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&privkey_load_mutex);
+#endif
+
+    return err;
+}
+
+/* Parse keys read from files into the given OtrlUserState only when
+ * they are first needed. */
+void otrl_privkey_lazy_enable(OtrlUserState us)
+{
+    us->privkey_lazy = 1;
+}
+
 /* Read a sets of private DSA keys from a FILE* into the given
- * OtrlUserState.  The FILE* must be open for reading. */
+ * OtrlUserState.  The FILE* must be open for reading.  If
+ * otrl_privkey_lazy_enable has been called, the file is only scanned
+ * for the accountname and protocol of each key here, and each key is
+ * parsed the first time it is needed. */
 gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf)
 {
     int privfd;
     struct stat st;
     char *buf;
-    const char *token;
-    size_t tokenlen;
+    size_t buflen;
     gcry_error_t err;
-    gcry_sexp_t allkeys;
-    int i;
+    PrivKeyExtent *extents;
+    size_t numextents, i;
+    struct s_OtrlPrivKeyIndex *index;
+    unsigned int numbuckets;
 
     if (!privf) return gcry_error(GPG_ERR_NO_ERROR);
 
@@ -230,120 +636,128 @@ gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf)
 	free(buf);
 	return err;
     }
+    buflen = st.st_size;
 
-    err = gcry_sexp_new(&allkeys, buf, st.st_size, 0);
-    free(buf);
+    err = privkey_scan(buf, buflen, &extents, &numextents);
+    if (gcry_err_code(err) == GPG_ERR_INV_SEXP) {
+	/* Not in the form we write ourselves.  Have libgcrypt parse it
+	 * and print it back out in that form, and try again. */
+	gcry_sexp_t allkeys;
+	char *newbuf;
+
+	err = gcry_sexp_new(&allkeys, buf, buflen, 0);
+	memset(buf, 0, buflen);
+	free(buf);
+	if (err) {
+	    return err;
+	}
+	buflen = gcry_sexp_sprint(allkeys, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+	newbuf = malloc(buflen);
+	if (!newbuf) {
+	    gcry_sexp_release(allkeys);
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	gcry_sexp_sprint(allkeys, GCRYSEXP_FMT_ADVANCED, newbuf, buflen);
+	gcry_sexp_release(allkeys);
+	buf = newbuf;
+
+	err = privkey_scan(buf, buflen, &extents, &numextents);
+	if (gcry_err_code(err) == GPG_ERR_INV_SEXP) {
+	    err = gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+	}
+    }
     if (err) {
+	memset(buf, 0, buflen);
+	free(buf);
 	return err;
     }
 
-    token = gcry_sexp_nth_data(allkeys, 0, &tokenlen);
-    if (tokenlen != 8 || strncmp(token, "privkeys", 8)) {
-	gcry_sexp_release(allkeys);
-	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    /* Set up the index */
+    index = malloc(sizeof(*index));
+    for (numbuckets = 16; numbuckets < numextents; numbuckets *= 2);
+    if (index) {
+	index->buckets = calloc(numbuckets, sizeof(OtrlPrivKey *));
+    }
+    if (!index || !index->buckets) {
+	free(index);
+	err = gcry_error(GPG_ERR_ENOMEM);
+	goto done;
     }
+    index->mask = numbuckets - 1;
+    us->privkey_index = index;
 
-    /* Get each account */
-    for(i=1; i<gcry_sexp_length(allkeys); ++i) {
-	gcry_sexp_t names, protos, privs;
+    for (i = 0; i < numextents; ++i) {
 	char *name, *proto;
-	gcry_sexp_t accounts;
-	OtrlPrivKey *p;
-
-	/* Get the ith "account" S-exp */
-	accounts = gcry_sexp_nth(allkeys, i);
+	OtrlPrivKey *p, **bucket;
 
-	/* It's really an "account" S-exp? */
-	token = gcry_sexp_nth_data(accounts, 0, &tokenlen);
-	if (tokenlen != 7 || strncmp(token, "account", 7)) {
-	    gcry_sexp_release(accounts);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
-	/* Extract the name, protocol, and privkey S-exps */
-	names = gcry_sexp_find_token(accounts, "name", 0);
-	protos = gcry_sexp_find_token(accounts, "protocol", 0);
-	privs = gcry_sexp_find_token(accounts, "private-key", 0);
-	gcry_sexp_release(accounts);
-	if (!names || !protos || !privs) {
-	    gcry_sexp_release(names);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
 	/* Extract the actual name and protocol */
-	token = gcry_sexp_nth_data(names, 1, &tokenlen);
-	if (!token) {
-	    gcry_sexp_release(names);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
-	name = malloc(tokenlen + 1);
-	if (!name) {
-	    gcry_sexp_release(names);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
-	memmove(name, token, tokenlen);
-	name[tokenlen] = '\0';
-	gcry_sexp_release(names);
-
-	token = gcry_sexp_nth_data(protos, 1, &tokenlen);
-	if (!token) {
-	    free(name);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
-	proto = malloc(tokenlen + 1);
-	if (!proto) {
+	err = sexp_nth_string(buf + extents[i].nameoff, extents[i].namelen,
+		&name);
+	if (err) goto done;
+	err = sexp_nth_string(buf + extents[i].protooff,
+		extents[i].protolen, &proto);
+	if (err) {
 	    free(name);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_ENOMEM);
+	    goto done;
 	}
-	memmove(proto, token, tokenlen);
-	proto[tokenlen] = '\0';
-	gcry_sexp_release(protos);
 
 	/* Make a new OtrlPrivKey entry */
 	p = malloc(sizeof(*p));
 	if (!p) {
 	    free(name);
 	    free(proto);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_ENOMEM);
+	    err = gcry_error(GPG_ERR_ENOMEM);
+	    goto done;
 	}
-
-	/* Fill it in and link it up */
 	p->accountname = name;
 	p->protocol = proto;
 	p->pubkey_type = OTRL_PUBKEY_TYPE_DSA;
-	p->privkey = privs;
+	p->privkey = NULL;
+	p->pubkey_data = NULL;
+	p->pubkey_datalen = 0;
+	p->sexp = NULL;
+	p->sexplen = 0;
+
+	/* Parse it now, or keep a copy of its text to parse later */
+	if (!us->privkey_lazy) {
+	    err = privkey_parse(p, buf + extents[i].off, extents[i].len);
+	} else if ((p->sexp = malloc(extents[i].len)) == NULL) {
+	    err = gcry_error(GPG_ERR_ENOMEM);
+	} else {
+	    memmove(p->sexp, buf + extents[i].off, extents[i].len);
+	    p->sexplen = extents[i].len;
+	}
+	if (err) {
+	    free(name);
+	    free(proto);
+	    free(p);
+	    goto done;
+	}
+
+	/* Link it up */
 	p->next = us->privkey_root;
 	if (p->next) {
 	    p->next->tous = &(p->next);
 	}
 	p->tous = &(us->privkey_root);
 	us->privkey_root = p;
-	err = make_pubkey(&(p->pubkey_data), &(p->pubkey_datalen), p->privkey);
-	if (err) {
-	    gcry_sexp_release(allkeys);
-	    otrl_privkey_forget(p);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+
+	p->hash = privkey_hash(name, proto);
+	bucket = &(index->buckets[p->hash & index->mask]);
+	p->hash_next = *bucket;
+	if (p->hash_next) {
+	    p->hash_next->hash_tous = &(p->hash_next);
 	}
+	p->hash_tous = bucket;
+	*bucket = p;
     }
-    gcry_sexp_release(allkeys);
 
-    return gcry_error(GPG_ERR_NO_ERROR);
+done:
+    free(extents);
+    /* The text contains private key material */
+    memset(buf, 0, buflen);
+    free(buf);
+    return err;
 }
 
 static OtrlPendingPrivKey *pending_find(OtrlUserState us,
@@ -475,16 +889,22 @@ struct s_pending_privkey_calc {
 gcry_error_t otrl_privkey_generate_start(OtrlUserState us,
 	const char *accountname, const char *protocol, void **newkeyp)
 {
-    OtrlPendingPrivKey *found = pending_find(us, accountname, protocol);
+    OtrlPendingPrivKey *found;
     struct s_pending_privkey_calc *ppc;
 
+    /* With the userstate locked, ops->create_privkey may be called for
+     * the same account from several threads at once */
+    otrl_uslock_shared_lock(us);
+    found = pending_find(us, accountname, protocol);
     if (found) {
+	otrl_uslock_shared_unlock(us);
 	if (newkeyp) *newkeyp = NULL;
 	return gcry_error(GPG_ERR_EEXIST);
     }
 
     /* We're not already creating this key.  Mark it as in progress. */
     pending_insert(us, accountname, protocol);
+    otrl_uslock_shared_unlock(us);
 
     /* Allocate the working structure */
     ppc = malloc(sizeof(*ppc));
@@ -555,7 +975,9 @@ void otrl_privkey_generate_cancelled(OtrlUserState us, void *newkey)
 	    (struct s_pending_privkey_calc *)newkey;
 
     if (us) {
+	otrl_uslock_shared_lock(us);
 	pending_forget(pending_find(us, ppc->accountname, ppc->protocol));
+	otrl_uslock_shared_unlock(us);
     }
 
     /* Deallocate ppc */
@@ -595,6 +1017,8 @@ gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
     if (ppc && us && privf) {
 	OtrlPrivKey *p;
 
+	otrl_uslock_shared_lock(us);
+
 	/* Output the other keys we know */
 	fprintf(privf, "(privkeys\n");
 
@@ -605,7 +1029,15 @@ gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
 		continue;
 	    }
 
-	    account_write(privf, p->accountname, p->protocol, p->privkey);
+	    if (p->privkey) {
+		account_write(privf, p->accountname, p->protocol,
+			p->privkey);
+	    } else if (p->sexp) {
+		/* We never parsed this one; copy it out as we read it */
+		fprintf(privf, " ");
+		fwrite(p->sexp, p->sexplen, 1, privf);
+		fprintf(privf, "\n");
+	    }
 	}
 	account_write(privf, ppc->accountname, ppc->protocol, ppc->privkey);
 	fprintf(privf, ")\n");
@@ -613,6 +1045,7 @@ gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
 	fseek(privf, 0, SEEK_SET);
 
 	ret = otrl_privkey_read_FILEp(us, privf);
+	otrl_uslock_shared_unlock(us);
     }
 
     otrl_privkey_generate_cancelled(us, newkey);
@@ -657,15 +1090,6 @@ gcry_error_t otrl_privkey_generate_FILEp(OtrlUserState us, FILE *privf,
     return err;
 }
 
-/* Convert a hex character to a value */
-static unsigned int ctoh(char c)
-{
-    if (c >= '0' && c <= '9') return c-'0';
-    if (c >= 'a' && c <= 'f') return c-'a'+10;
-    if (c >= 'A' && c <= 'F') return c-'A'+10;
-    return 0;  /* Unknown hex char */
-}
-
 /* Read the fingerprint store from a file on disk into the given
  * OtrlUserState.  Use add_app_data to add application data to each
  * ConnContext so created. */
@@ -713,7 +1137,6 @@ gcry_error_t otrl_privkey_read_fingerprints_FILEp(OtrlUserState us,
 	char *tab;
 	char *eol;
 	Fingerprint *fng;
-	int i, j;
 	/* Parse the line, which should be of the form:
 	 *    username\taccountname\tprotocol\t40_hex_nybbles\n          */
 	username = storeline;
@@ -749,9 +1172,7 @@ gcry_error_t otrl_privkey_read_fingerprints_FILEp(OtrlUserState us,
 	}
 
 	if (strlen(hex) != 40) continue;
-	for(j=0, i=0; i<40; i+=2) {
-	    fingerprint[j++] = (ctoh(hex[i]) << 4) + (ctoh(hex[i+1]));
-	}
+	otrl_privkey_hex_to_hash(fingerprint, hex);
 	/* Get the context for this user, adding if not yet present */
 	context = otrl_context_find(us, username, accountname, protocol,
 		OTRL_INSTAG_MASTER, 1, NULL, add_app_data, data);
@@ -763,6 +1184,205 @@ gcry_error_t otrl_privkey_read_fingerprints_FILEp(OtrlUserState us,
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* One parsed line of a fingerprint store, for bulk loading */
+typedef struct {
+    const char *username;
+    const char *accountname;
+    const char *protocol;
+    const char *trust;
+    unsigned char fingerprint[20];
+    size_t seq;
+} FingerprintStoreEntry;
+
+/* Order fingerprint store entries the same way as the context list, and
+ * within a context, by their position in the store. */
+static int fingerprint_entry_cmp(const void *a, const void *b)
+{
+    const FingerprintStoreEntry *ea = a;
+    const FingerprintStoreEntry *eb = b;
+    int cmp;
+
+    if ((cmp = strcmp(ea->username, eb->username)) != 0) return cmp;
+    if ((cmp = strcmp(ea->accountname, eb->accountname)) != 0) return cmp;
+    if ((cmp = strcmp(ea->protocol, eb->protocol)) != 0) return cmp;
+    return (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+/* Parse one line of a fingerprint store, which runs from line up to
+ * (and including) the newline at eol.  The line is modified in place.
+ * Return 1 and fill in *entry if it's well-formed, or 0 otherwise. */
+static int parse_fingerprint_line(char *line, char *eol,
+	FingerprintStoreEntry *entry)
+{
+    char *field[5];
+    char *end;
+    int numfields = 1;
+
+    /* The line should be of the form:
+     *    username\taccountname\tprotocol\t40_hex_nybbles[\ttrust]\n   */
+    field[0] = line;
+    while (numfields < 5) {
+	char *tab = memchr(field[numfields-1], '\t',
+		eol - field[numfields-1]);
+	if (!tab) break;
+	*tab = '\0';
+	field[numfields++] = tab + 1;
+    }
+    if (numfields < 4) return 0;
+
+    end = memchr(field[numfields-1], '\r', eol - field[numfields-1]);
+    if (!end) end = eol;
+    *end = '\0';
+
+    if (strlen(field[3]) != 40) return 0;
+    otrl_privkey_hex_to_hash(entry->fingerprint, field[3]);
+    entry->username = field[0];
+    entry->accountname = field[1];
+    entry->protocol = field[2];
+    entry->trust = numfields == 5 ? field[4] : NULL;
+    return 1;
+}
+
+/* The number of microseconds since *start, which is then reset to now */
+static unsigned long usecs_since(struct timeval *start)
+{
+    struct timeval now;
+    unsigned long usecs;
+
+    gettimeofday(&now, NULL);
+    usecs = (now.tv_sec - start->tv_sec) * 1000000UL +
+	(now.tv_usec - start->tv_usec);
+    *start = now;
+    return usecs;
+}
+
+/* Read the fingerprint store from a file on disk into the given
+ * OtrlUserState, in the same way as otrl_privkey_read_fingerprints,
+ * but suited to very large stores: the whole file is read in one go,
+ * its entries are sorted, and the contexts are then built in a single
+ * pass over the context list.  If stats is not NULL, fill it in. */
+gcry_error_t otrl_privkey_read_fingerprints_bulk(OtrlUserState us,
+	const char *filename,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void  *data, OtrlFingerprintLoadStats *stats)
+{
+    gcry_error_t err;
+    FILE *storef;
+
+    storef = fopen(filename, "rb");
+    if (!storef) {
+	err = gcry_error_from_errno(errno);
+	return err;
+    }
+
+    err = otrl_privkey_read_fingerprints_bulk_FILEp(us, storef,
+	    add_app_data, data, stats);
+
+    fclose(storef);
+    return err;
+}
+
+/* Read the fingerprint store from a FILE* into the given OtrlUserState,
+ * as otrl_privkey_read_fingerprints_bulk does.  The FILE* must be open
+ * for reading. */
+gcry_error_t otrl_privkey_read_fingerprints_bulk_FILEp(OtrlUserState us,
+	FILE *storef,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void  *data, OtrlFingerprintLoadStats *stats)
+{
+    OtrlFingerprintLoadStats st;
+    struct timeval timer;
+    char *buf = NULL, *line, *eol, *bufend;
+    size_t buflen = 0, bufsize = 0;
+    FingerprintStoreEntry *entries = NULL;
+    size_t numentries = 0, entriessize = 0, i;
+    ConnContext **cursor = NULL;
+    ConnContext *context = NULL;
+
+    memset(&st, 0, sizeof(st));
+    if (stats) *stats = st;
+    if (!storef) return gcry_error(GPG_ERR_NO_ERROR);
+
+    gettimeofday(&timer, NULL);
+
+    /* Slurp in the whole store */
+    do {
+	if (bufsize - buflen < 65536) {
+	    char *newbuf;
+	    bufsize = bufsize ? 2 * bufsize : 65536;
+	    newbuf = realloc(buf, bufsize);
+	    if (!newbuf) {
+		free(buf);
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	    buf = newbuf;
+	}
+	buflen += fread(buf + buflen, 1, bufsize - buflen, storef);
+    } while (!feof(storef) && !ferror(storef));
+    if (ferror(storef)) {
+	free(buf);
+	return gcry_error_from_errno(errno);
+    }
+    st.read_usecs = usecs_since(&timer);
+
+    /* Parse each complete line */
+    bufend = buf + buflen;
+    for (line = buf; line < bufend &&
+	    (eol = memchr(line, '\n', bufend - line)) != NULL;
+	    line = eol + 1) {
+	st.lines++;
+	if (numentries == entriessize) {
+	    FingerprintStoreEntry *newentries;
+	    entriessize = entriessize ? 2 * entriessize : 1024;
+	    newentries = realloc(entries,
+		    entriessize * sizeof(FingerprintStoreEntry));
+	    if (!newentries) {
+		free(entries);
+		free(buf);
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	    entries = newentries;
+	}
+	if (parse_fingerprint_line(line, eol, &entries[numentries])) {
+	    entries[numentries].seq = numentries;
+	    numentries++;
+	}
+    }
+    st.fingerprints = numentries;
+
+    qsort(entries, numentries, sizeof(FingerprintStoreEntry),
+	    fingerprint_entry_cmp);
+    st.sort_usecs = usecs_since(&timer);
+
+    /* The entries are now in context list order, so we can find or add
+     * each master context with one walk along the list. */
+    for (i = 0; i < numentries; ++i) {
+	FingerprintStoreEntry *e = &entries[i];
+	Fingerprint *fng;
+
+	if (i == 0 || strcmp((e-1)->username, e->username) ||
+		strcmp((e-1)->accountname, e->accountname) ||
+		strcmp((e-1)->protocol, e->protocol)) {
+	    int added;
+	    context = otrl_context_find_master_sorted(us, &cursor,
+		    e->username, e->accountname, e->protocol, &added,
+		    add_app_data, data);
+	    if (added) st.contexts_added++;
+	}
+
+	/* Add the fingerprint if not already there */
+	fng = otrl_context_find_fingerprint(context, e->fingerprint, 1, NULL);
+	otrl_context_set_trust(fng, e->trust);
+    }
+    st.build_usecs = usecs_since(&timer);
+
+    free(entries);
+    free(buf);
+
+    if (stats) *stats = st;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
 /* Write the fingerprint store from a given OtrlUserState to a file on disk. */
 gcry_error_t otrl_privkey_write_fingerprints(OtrlUserState us,
 	const char *filename)
@@ -782,51 +1402,443 @@ gcry_error_t otrl_privkey_write_fingerprints(OtrlUserState us,
     return err;
 }
 
+/* otrl_fpstore_foreach_fingerprint callback for
+ * otrl_privkey_write_fingerprints_FILEp */
+static int write_fingerprint_cb(void *data, const char *username,
+	const char *accountname, const char *protocol,
+	const unsigned char fingerprint[20], const char *trust)
+{
+    FILE *storef = data;
+    int i;
+
+    fprintf(storef, "%s\t%s\t%s\t", username, accountname, protocol);
+    for(i=0;i<20;++i) {
+	fprintf(storef, "%02x", fingerprint[i]);
+    }
+    fprintf(storef, "\t%s\n", trust ? trust : "");
+    return 0;
+}
+
 /* Write the fingerprint store from a given OtrlUserState to a FILE*.
- * The FILE* must be open for writing. */
+ * The FILE* must be open for writing.  If a binary fingerprint store
+ * is attached, the fingerprints in it which haven't been loaded yet are
+ * written too. */
 gcry_error_t otrl_privkey_write_fingerprints_FILEp(OtrlUserState us,
 	FILE *storef)
 {
-    ConnContext *context;
-    Fingerprint *fprint;
-
     if (!storef) return gcry_error(GPG_ERR_NO_ERROR);
 
-    for(context = us->context_root; context; context = context->next) {
-	/* Fingerprints are only stored in the master contexts */
-	if (context->their_instance != OTRL_INSTAG_MASTER) continue;
-
-	/* Don't bother with the first (fingerprintless) entry. */
-	for (fprint = context->fingerprint_root.next; fprint;
-		fprint = fprint->next) {
-	    int i;
-	    fprintf(storef, "%s\t%s\t%s\t", context->username,
-		    context->accountname, context->protocol);
-	    for(i=0;i<20;++i) {
-		fprintf(storef, "%02x", fprint->fingerprint[i]);
-	    }
-	    fprintf(storef, "\t%s\n", fprint->trust ? fprint->trust : "");
+    otrl_fpstore_foreach_fingerprint(us, write_fingerprint_cb, storef);
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* A fingerprint store snapshot being built */
+typedef struct {
+    char *buf;		    /* NULL while we're just counting */
+    size_t len;
+} FingerprintSnapshot;
+
+/* otrl_fpstore_foreach_fingerprint callback for
+ * otrl_privkey_snapshot_fingerprints */
+static int snapshot_fingerprint_cb(void *data, const char *username,
+	const char *accountname, const char *protocol,
+	const unsigned char fingerprint[20], const char *trust)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    FingerprintSnapshot *snap = data;
+    char *p;
+    int i;
+
+    if (!snap->buf) {
+	snap->len += strlen(username) + strlen(accountname) +
+	    strlen(protocol) + 3 + 40 + 1 + (trust ? strlen(trust) : 0) + 1;
+	return 0;
+    }
+
+    p = snap->buf + snap->len;
+    p += sprintf(p, "%s\t%s\t%s\t", username, accountname, protocol);
+    for (i = 0; i < 20; ++i) {
+	*(p++) = hexdigits[fingerprint[i] >> 4];
+	*(p++) = hexdigits[fingerprint[i] & 0x0f];
+    }
+    p += sprintf(p, "\t%s\n", trust ? trust : "");
+    snap->len = p - snap->buf;
+    return 0;
+}
+
+/* Write the fingerprints in the given OtrlUserState, in the same
+ * tab-separated format as otrl_privkey_write_fingerprints, into a newly
+ * allocated buffer, which the caller must free().  Set *bufp and
+ * *lenp to the buffer and its length.  As with
+ * otrl_privkey_write_fingerprints, the fingerprints in an attached
+ * binary fingerprint store which haven't been loaded are included. */
+gcry_error_t otrl_privkey_snapshot_fingerprints(OtrlUserState us,
+	char **bufp, size_t *lenp)
+{
+    FingerprintSnapshot snap;
+    size_t len;
+
+    /* First work out how big it will be */
+    snap.buf = NULL;
+    snap.len = 0;
+    otrl_fpstore_foreach_fingerprint(us, snapshot_fingerprint_cb, &snap);
+    len = snap.len;
+
+    snap.buf = malloc(len + 1);
+    if (!snap.buf) return gcry_error(GPG_ERR_ENOMEM);
+    snap.len = 0;
+    otrl_fpstore_foreach_fingerprint(us, snapshot_fingerprint_cb, &snap);
+
+    *bufp = snap.buf;
+    *lenp = snap.len;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* The size of each write(2) when writing out a fingerprint store */
+#define FINGERPRINT_WRITE_CHUNK (1024*1024)
+
+/* Marks a FingerprintRecord with no trust */
+#define FINGERPRINT_NO_TRUST ((size_t)-1)
+
+/* One fingerprint in a raw snapshot of a fingerprint store.  The
+ * strings are offsets into the snapshot's string buffer. */
+typedef struct {
+    size_t username, accountname, protocol;
+    size_t trust;		/* or FINGERPRINT_NO_TRUST */
+    unsigned char fingerprint[20];
+} FingerprintRecord;
+
+/* A fingerprint store write waiting for the background thread */
+typedef struct s_FingerprintWrite {
+    struct s_FingerprintWrite *next;
+    char *filename;
+    FingerprintRecord *records;
+    size_t numrecords, recordsize;
+    char *strings;
+    size_t stringslen, stringssize;
+    void (*done)(void *data, gcry_error_t err);
+    void *data;
+} FingerprintWrite;
+
+/* Copy the given string onto the end of the write's string buffer, and
+ * set *offp to where it went.  Return 0 on success, or 1 if we ran out
+ * of memory. */
+static int fingerprint_write_string(FingerprintWrite *w, const char *str,
+	size_t *offp)
+{
+    size_t len = strlen(str) + 1;
+
+    if (w->stringslen + len > w->stringssize) {
+	size_t newsize = w->stringssize ? 2 * w->stringssize : 4096;
+	char *newstrings;
+
+	while (newsize < w->stringslen + len) newsize *= 2;
+	newstrings = realloc(w->strings, newsize);
+	if (!newstrings) return 1;
+	w->strings = newstrings;
+	w->stringssize = newsize;
+    }
+    memmove(w->strings + w->stringslen, str, len);
+    *offp = w->stringslen;
+    w->stringslen += len;
+    return 0;
+}
+
+/* otrl_fpstore_foreach_fingerprint callback for
+ * otrl_privkey_write_fingerprints_async: just copy out the fields.  A
+ * context's fingerprints come one after another, so its names are only
+ * copied once.  Return 1 if we ran out of memory. */
+static int copy_fingerprint_cb(void *data, const char *username,
+	const char *accountname, const char *protocol,
+	const unsigned char fingerprint[20], const char *trust)
+{
+    FingerprintWrite *w = data;
+    FingerprintRecord *r, *prev;
+
+    if (w->numrecords == w->recordsize) {
+	size_t newsize = w->recordsize ? 2 * w->recordsize : 256;
+	FingerprintRecord *newrecords = realloc(w->records,
+		newsize * sizeof(FingerprintRecord));
+	if (!newrecords) return 1;
+	w->records = newrecords;
+	w->recordsize = newsize;
+    }
+    r = &(w->records[w->numrecords]);
+    prev = w->numrecords ? r - 1 : NULL;
+
+    if (prev && !strcmp(w->strings + prev->username, username) &&
+	    !strcmp(w->strings + prev->accountname, accountname) &&
+	    !strcmp(w->strings + prev->protocol, protocol)) {
+	r->username = prev->username;
+	r->accountname = prev->accountname;
+	r->protocol = prev->protocol;
+    } else if (fingerprint_write_string(w, username, &r->username) ||
+	    fingerprint_write_string(w, accountname, &r->accountname) ||
+	    fingerprint_write_string(w, protocol, &r->protocol)) {
+	return 1;
+    }
+    r->trust = FINGERPRINT_NO_TRUST;
+    if (trust && fingerprint_write_string(w, trust, &r->trust)) {
+	return 1;
+    }
+    memmove(r->fingerprint, fingerprint, 20);
+    w->numrecords++;
+    return 0;
+}
+
+/* Format the snapshot in the given write into a temporary file next to
+ * the file it is for, sync it to disk, and rename it over that file. */
+static gcry_error_t fingerprint_write_file(FingerprintWrite *w)
+{
+    gcry_error_t err;
+    char *tmpname;
+    size_t i;
+    FILE *f;
+
+    err = otrl_fpstore_replace_begin(w->filename, &f, &tmpname);
+    if (err) return err;
+    setvbuf(f, NULL, _IOFBF, FINGERPRINT_WRITE_CHUNK);
+
+    for (i = 0; i < w->numrecords; ++i) {
+	FingerprintRecord *r = &(w->records[i]);
+
+	write_fingerprint_cb(f, w->strings + r->username,
+		w->strings + r->accountname, w->strings + r->protocol,
+		r->fingerprint, r->trust == FINGERPRINT_NO_TRUST ? NULL :
+		w->strings + r->trust);
+    }
+    return otrl_fpstore_replace_end(w->filename, f, tmpname, err);
+}
+
+/* Free a queued write */
+static void fingerprint_write_free(FingerprintWrite *w)
+{
+    free(w->filename);
+    free(w->records);
+    free(w->strings);
+    free(w);
+}
+
+/* Do a queued write, and free it */
+static void fingerprint_write_run(FingerprintWrite *w)
+{
+    gcry_error_t err = fingerprint_write_file(w);
+
+    if (w->done) {
+	w->done(w->data, err);
+    }
+    fingerprint_write_free(w);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/* A userstate's queue of writes for its background thread.  The thread
+ * runs only while there's something in the queue. */
+typedef struct s_OtrlFPWriter OtrlFPWriter;
+
+struct s_OtrlFPWriter {
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;
+    FingerprintWrite *head;
+    FingerprintWrite **tail;
+    int running;		/* The thread is working on the queue */
+    pthread_t thread;
+    int thread_valid;		/* ...or has, and is yet to be joined */
+};
+
+static void *fingerprint_write_thread(void *arg)
+{
+    OtrlFPWriter *fw = arg;
+
+    pthread_mutex_lock(&fw->mutex);
+    while (fw->head) {
+	FingerprintWrite *w = fw->head;
+	fw->head = w->next;
+	if (!fw->head) fw->tail = &fw->head;
+	pthread_mutex_unlock(&fw->mutex);
+
+	fingerprint_write_run(w);
+
+	pthread_mutex_lock(&fw->mutex);
+    }
+    fw->running = 0;
+    pthread_cond_broadcast(&fw->idle);
+    pthread_mutex_unlock(&fw->mutex);
+    return NULL;
+}
+
+/* Return the given userstate's write queue, making it if need be, or
+ * NULL if we ran out of memory */
+static OtrlFPWriter *fingerprint_writer(OtrlUserState us)
+{
+    OtrlFPWriter *fw;
+
+    otrl_uslock_shared_lock(us);
+    fw = us->fpwriter;
+    if (!fw) {
+	fw = calloc(1, sizeof(OtrlFPWriter));
+	if (fw) {
+	    pthread_mutex_init(&fw->mutex, NULL);
+	    pthread_cond_init(&fw->idle, NULL);
+	    fw->tail = &fw->head;
+	    us->fpwriter = fw;
 	}
     }
+    otrl_uslock_shared_unlock(us);
+    return fw;
+}
+
+#endif
+
+/* Write the fingerprint store from a given OtrlUserState to a file on
+ * disk, without making the caller wait for the disk.  A snapshot of
+ * the fingerprints is taken before this returns, so the OtrlUserState
+ * may be changed straight away; it is just a copy of their fields, and
+ * formatting it and writing it out happen in a background thread of
+ * the OtrlUserState's own.  It is written to a temporary file, synced
+ * to disk, and renamed over the given file, so a crash never leaves a
+ * partly-written store.  Writes are done one at a time, in the order
+ * they were requested.  When the write is done, done(data, err) is
+ * called, from the background thread; err is 0 on success.  If this
+ * function itself returns an error, done will not be called.  If
+ * threads are not available, the write is done (and done is called)
+ * before this returns. */
+gcry_error_t otrl_privkey_write_fingerprints_async(OtrlUserState us,
+	const char *filename, void (*done)(void *data, gcry_error_t err),
+	void *data)
+{
+    FingerprintWrite *w;
+#ifdef HAVE_PTHREAD_H
+    OtrlFPWriter *fw = fingerprint_writer(us);
+
+    if (!fw) return gcry_error(GPG_ERR_ENOMEM);
+#endif
+
+    w = calloc(1, sizeof(FingerprintWrite));
+    if (!w) return gcry_error(GPG_ERR_ENOMEM);
+    w->filename = strdup(filename);
+    if (!w->filename) {
+	free(w);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    w->done = done;
+    w->data = data;
+
+    if (otrl_fpstore_foreach_fingerprint(us, copy_fingerprint_cb, w)) {
+	fingerprint_write_free(w);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&fw->mutex);
+    *fw->tail = w;
+    fw->tail = &(w->next);
+    if (!fw->running) {
+	/* The last thread has finished with the queue; make sure it's
+	 * gone before starting another */
+	if (fw->thread_valid) {
+	    pthread_join(fw->thread, NULL);
+	    fw->thread_valid = 0;
+	}
+	if (pthread_create(&fw->thread, NULL, fingerprint_write_thread,
+		    fw)) {
+	    /* No thread, so take it back off the queue (it's the only
+	     * thing there) and just do it now */
+	    fw->head = NULL;
+	    fw->tail = &fw->head;
+	    pthread_mutex_unlock(&fw->mutex);
+	    fingerprint_write_run(w);
+	    return gcry_error(GPG_ERR_NO_ERROR);
+	}
+	fw->thread_valid = 1;
+	fw->running = 1;
+    }
+    pthread_mutex_unlock(&fw->mutex);
+#else
+    fingerprint_write_run(w);
+#endif
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* Wait for all writes requested by
+ * otrl_privkey_write_fingerprints_async for the given OtrlUserState to
+ * complete.  Don't call this from a done callback. */
+void otrl_privkey_write_fingerprints_wait(OtrlUserState us)
+{
+#ifdef HAVE_PTHREAD_H
+    OtrlFPWriter *fw;
+
+    otrl_uslock_shared_lock(us);
+    fw = us->fpwriter;
+    otrl_uslock_shared_unlock(us);
+    if (!fw) return;
+
+    pthread_mutex_lock(&fw->mutex);
+    while (fw->running) {
+	pthread_cond_wait(&fw->idle, &fw->mutex);
+    }
+    if (fw->thread_valid) {
+	pthread_join(fw->thread, NULL);
+	fw->thread_valid = 0;
+    }
+    pthread_mutex_unlock(&fw->mutex);
+#endif
+}
+
+/* Wait for the given OtrlUserState's writes to complete, and free its
+ * write queue.  otrl_userstate_free calls this. */
+void otrl_privkey_write_fingerprints_free(OtrlUserState us)
+{
+#ifdef HAVE_PTHREAD_H
+    OtrlFPWriter *fw = us->fpwriter;
+
+    if (!fw) return;
+    otrl_privkey_write_fingerprints_wait(us);
+    pthread_cond_destroy(&fw->idle);
+    pthread_mutex_destroy(&fw->mutex);
+    free(fw);
+    us->fpwriter = NULL;
+#endif
+}
+
 /* Fetch the private key from the given OtrlUserState associated with
- * the given account */
+ * the given account.  A key read from a file is parsed the first time
+ * it is fetched; NULL is returned if that fails. */
 OtrlPrivKey *otrl_privkey_find(OtrlUserState us, const char *accountname,
 	const char *protocol)
 {
     OtrlPrivKey *p;
     if (!accountname || !protocol) return NULL;
 
-    for(p=us->privkey_root; p; p=p->next) {
-	if (!strcmp(p->accountname, accountname) &&
-		!strcmp(p->protocol, protocol)) {
-	    return p;
+    /* A shard looks in the userstate it shares keys with */
+    if (us->keystate) us = us->keystate;
+
+    if (us->privkey_index) {
+	unsigned int hash = privkey_hash(accountname, protocol);
+
+	p = us->privkey_index->buckets[hash & us->privkey_index->mask];
+	for(; p; p=p->hash_next) {
+	    if (p->hash == hash && !strcmp(p->accountname, accountname) &&
+		    !strcmp(p->protocol, protocol)) {
+		break;
+	    }
+	}
+    } else {
+	for(p=us->privkey_root; p; p=p->next) {
+	    if (!strcmp(p->accountname, accountname) &&
+		    !strcmp(p->protocol, protocol)) {
+		break;
+	    }
 	}
     }
-    return NULL;
+
+    /* Parse the key if this is its first use */
+    if (p && privkey_load(p)) {
+	return NULL;
+    }
+    return p;
 }
 
 /* Forget a private key */
@@ -836,6 +1848,10 @@ void otrl_privkey_forget(OtrlPrivKey *privkey)
     free(privkey->protocol);
     gcry_sexp_release(privkey->privkey);
     free(privkey->pubkey_data);
+    if (privkey->sexp) {
+	memset(privkey->sexp, 0, privkey->sexplen);
+	free(privkey->sexp);
+    }
 
     /* Re-link the list */
     *(privkey->tous) = privkey->next;
@@ -843,6 +1859,14 @@ void otrl_privkey_forget(OtrlPrivKey *privkey)
 	privkey->next->tous = privkey->tous;
     }
 
+    /* And the index bucket */
+    if (privkey->hash_tous) {
+	*(privkey->hash_tous) = privkey->hash_next;
+	if (privkey->hash_next) {
+	    privkey->hash_next->hash_tous = privkey->hash_tous;
+	}
+    }
+
     /* Free the privkey struct */
     free(privkey);
 }
@@ -853,6 +1877,7 @@ void otrl_privkey_forget_all(OtrlUserState us)
     while (us->privkey_root) {
 	otrl_privkey_forget(us->privkey_root);
     }
+    privkey_index_free(us);
 }
 
 /* Sign data using a private key.  The data must be small enough to be
@@ -866,10 +1891,14 @@ gcry_error_t otrl_privkey_sign(unsigned char **sigp, size_t *siglenp,
     gcry_sexp_t dsas, rs, ss, sigs, datas;
     size_t nr, ns;
     const enum gcry_mpi_format format = GCRYMPI_FMT_USG;
+    gcry_error_t err;
 
     if (privkey->pubkey_type != OTRL_PUBKEY_TYPE_DSA)
 	return gcry_error(GPG_ERR_INV_VALUE);
 
+    err = privkey_load(privkey);
+    if (err) return err;
+
     *sigp = malloc(40);
     if (*sigp == NULL) return gcry_error(GPG_ERR_ENOMEM);
     *siglenp = 40;
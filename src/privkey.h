@@ -34,6 +34,9 @@ void otrl_privkey_hash_to_human(
 	char human[OTRL_PRIVKEY_FPRINT_HUMAN_LEN],
 	const unsigned char hash[20]);
 
+/* Convert the 40 hex digits at hex to a 20-byte hash value */
+void otrl_privkey_hex_to_hash(unsigned char hash[20], const char *hex);
+
 /* Calculate a human-readable hash of our DSA public key.  Return it in
  * the passed fingerprint buffer.  Return NULL on error, or a pointer to
  * the given buffer on success. */
@@ -52,7 +55,10 @@ unsigned char *otrl_privkey_fingerprint_raw(OtrlUserState us,
 gcry_error_t otrl_privkey_read(OtrlUserState us, const char *filename);
 
 /* Read a sets of private DSA keys from a FILE* into the given
- * OtrlUserState.  The FILE* must be open for reading. */
+ * OtrlUserState.  The FILE* must be open for reading.  If
+ * otrl_privkey_lazy_enable has been called, the file is only scanned
+ * for the accountname and protocol of each key here, and each key is
+ * parsed the first time it is needed. */
 gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf);
 
 /* Free the memory associated with the pending privkey list */
@@ -118,17 +124,93 @@ gcry_error_t otrl_privkey_read_fingerprints_FILEp(OtrlUserState us,
 	void (*add_app_data)(void *data, ConnContext *context),
 	void  *data);
 
+/* Statistics about a bulk fingerprint store load.  Times are in
+ * microseconds. */
+typedef struct s_OtrlFingerprintLoadStats {
+    unsigned long lines;          /* Lines in the store */
+    unsigned long fingerprints;   /* Well-formed fingerprint lines */
+    unsigned long contexts_added; /* New master contexts created */
+    unsigned long read_usecs;     /* Time spent reading the store */
+    unsigned long sort_usecs;     /* Time spent parsing and sorting it */
+    unsigned long build_usecs;    /* Time spent building the contexts */
+} OtrlFingerprintLoadStats;
+
+/* Read the fingerprint store from a file on disk into the given
+ * OtrlUserState, in the same way as otrl_privkey_read_fingerprints,
+ * but suited to very large stores: the whole file is read in one go,
+ * its entries are sorted, and the contexts are then built in a single
+ * pass over the context list.  If stats is not NULL, fill it in. */
+gcry_error_t otrl_privkey_read_fingerprints_bulk(OtrlUserState us,
+	const char *filename,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void  *data, OtrlFingerprintLoadStats *stats);
+
+/* Read the fingerprint store from a FILE* into the given OtrlUserState,
+ * as otrl_privkey_read_fingerprints_bulk does.  The FILE* must be open
+ * for reading. */
+gcry_error_t otrl_privkey_read_fingerprints_bulk_FILEp(OtrlUserState us,
+	FILE *storef,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void  *data, OtrlFingerprintLoadStats *stats);
+
 /* Write the fingerprint store from a given OtrlUserState to a file on disk. */
 gcry_error_t otrl_privkey_write_fingerprints(OtrlUserState us,
 	const char *filename);
 
 /* Write the fingerprint store from a given OtrlUserState to a FILE*.
- * The FILE* must be open for writing. */
+ * The FILE* must be open for writing.  If a binary fingerprint store
+ * is attached, the fingerprints in it which haven't been loaded yet are
+ * written too. */
 gcry_error_t otrl_privkey_write_fingerprints_FILEp(OtrlUserState us,
 	FILE *storef);
 
+/* Write the fingerprints in the given OtrlUserState, in the same
+ * tab-separated format as otrl_privkey_write_fingerprints, into a newly
+ * allocated buffer, which the caller must free().  Set *bufp and
+ * *lenp to the buffer and its length.  As with
+ * otrl_privkey_write_fingerprints, the fingerprints in an attached
+ * binary fingerprint store which haven't been loaded are included. */
+gcry_error_t otrl_privkey_snapshot_fingerprints(OtrlUserState us,
+	char **bufp, size_t *lenp);
+
+/* Write the fingerprint store from a given OtrlUserState to a file on
+ * disk, without making the caller wait for the disk.  A snapshot of
+ * the fingerprints is taken before this returns, so the OtrlUserState
+ * may be changed straight away; it is just a copy of their fields, and
+ * formatting it and writing it out happen in a background thread of
+ * the OtrlUserState's own.  It is written to a temporary file, synced
+ * to disk, and renamed over the given file, so a crash never leaves a
+ * partly-written store.  Writes are done one at a time, in the order
+ * they were requested.  When the write is done, done(data, err) is
+ * called, from the background thread; err is 0 on success.  If this
+ * function itself returns an error, done will not be called.  If
+ * threads are not available, the write is done (and done is called)
+ * before this returns.  otrl_userstate_free waits for any writes still
+ * to be done. */
+gcry_error_t otrl_privkey_write_fingerprints_async(OtrlUserState us,
+	const char *filename, void (*done)(void *data, gcry_error_t err),
+	void *data);
+
+/* Wait for all writes requested by
+ * otrl_privkey_write_fingerprints_async for the given OtrlUserState to
+ * complete.  Don't call this from a done callback. */
+void otrl_privkey_write_fingerprints_wait(OtrlUserState us);
+
+/* Wait for the given OtrlUserState's writes to complete, and free its
+ * write queue.  otrl_userstate_free calls this. */
+void otrl_privkey_write_fingerprints_free(OtrlUserState us);
+
+/* Have later reads of private keys into the given OtrlUserState only
+ * scan the file for each key's accountname and protocol, and parse
+ * each key the first time it is fetched with otrl_privkey_find or used
+ * with otrl_privkey_sign.  With many keys, of which only a few are
+ * used, this makes reading them much quicker.  Until it is parsed,
+ * each key keeps a copy of its text from the file. */
+void otrl_privkey_lazy_enable(OtrlUserState us);
+
 /* Fetch the private key from the given OtrlUserState associated with
- * the given account */
+ * the given account.  A key read lazily is parsed the first time it is
+ * fetched; NULL is returned if that fails. */
 OtrlPrivKey *otrl_privkey_find(OtrlUserState us, const char *accountname,
 	const char *protocol);
 
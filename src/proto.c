@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 
 /* libgcrypt headers */
 #include <gcrypt.h>
@@ -38,6 +39,8 @@
 #include "version.h"
 #include "tlv.h"
 #include "serial.h"
+#include "dhpool.h"
+#include "fragment.h"
 
 #if OTRL_DEBUGGING
 extern const char *OTRL_DEBUGGING_DEBUGSTR;
@@ -80,6 +83,9 @@ gcry_error_t otrl_init(unsigned int ver_major, unsigned int ver_minor,
     /* Initialize the SM module */
     otrl_sm_init();
 
+    /* Initialize the base64 module */
+    otrl_base64_init();
+
 #if OTRL_DEBUGGING
     /* Inform the user that debugging is available */
     fprintf(stderr, "\nlibotr debugging is available.  Type %s in a message\n"
@@ -144,6 +150,13 @@ static gcry_error_t reveal_macs(ConnContext *context,
 static gcry_error_t rotate_dh_keys(ConnContext *context)
 {
     gcry_error_t err;
+    DH_keypair newkey;
+
+    /* Create a new DH key first, so that if that fails, nothing has
+     * been rotated */
+    otrl_dh_keypair_init(&newkey);
+    err = otrl_dhpool_gen_keypair(context->context_priv->us, &newkey);
+    if (err) return err;
 
     /* Rotate the keypair */
     otrl_dh_keypair_free(&(context->context_priv->our_old_dh_key));
@@ -154,7 +167,10 @@ static gcry_error_t rotate_dh_keys(ConnContext *context)
     /* Rotate the session keys */
     err = reveal_macs(context, &(context->context_priv->sesskeys[1][0]),
 	    &(context->context_priv->sesskeys[1][1]));
-    if (err) return err;
+    if (err) {
+	otrl_dh_keypair_free(&newkey);
+	return err;
+    }
     otrl_dh_session_free(&(context->context_priv->sesskeys[1][0]));
     otrl_dh_session_free(&(context->context_priv->sesskeys[1][1]));
     memmove(&(context->context_priv->sesskeys[1][0]),
@@ -164,8 +180,8 @@ static gcry_error_t rotate_dh_keys(ConnContext *context)
 	    &(context->context_priv->sesskeys[0][1]),
 	    sizeof(DH_sesskeys));
 
-    /* Create a new DH key */
-    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(context->context_priv->our_dh_key));
+    /* Put the new DH key in place */
+    context->context_priv->our_dh_key = newkey;
     context->context_priv->our_keyid++;
 
     /* Make the session keys */
@@ -472,6 +488,34 @@ invval:
     return err;
 }
 
+/* Return in *pubp and *publenp our current DH public key, serialized
+ * as it goes in a Data Message.  This is kept in the context, and is
+ * only made again once the key is different from the one it was made
+ * from; comparing the two does not allocate, as serializing does. */
+static gcry_error_t our_dh_pub_serialized(ConnContextPriv *priv,
+	const unsigned char **pubp, size_t *publenp)
+{
+    gcry_error_t err;
+    unsigned char *pub;
+    size_t publen;
+
+    if (priv->our_dh_pub_serialized_from == NULL ||
+	    gcry_mpi_cmp(priv->our_dh_pub_serialized_from,
+		priv->our_dh_key.pub)) {
+	err = gcry_mpi_aprint(GCRYMPI_FMT_USG, &pub, &publen,
+		priv->our_dh_key.pub);
+	if (err) return err;
+	gcry_mpi_release(priv->our_dh_pub_serialized_from);
+	gcry_free(priv->our_dh_pub_serialized);
+	priv->our_dh_pub_serialized_from = gcry_mpi_copy(priv->our_dh_key.pub);
+	priv->our_dh_pub_serialized = pub;
+	priv->our_dh_pub_serialized_len = publen;
+    }
+    *pubp = priv->our_dh_pub_serialized;
+    *publenp = priv->our_dh_pub_serialized_len;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
 /* Create an OTR Data message.  Pass the plaintext as msg, and an
  * optional chain of TLVs.  A newly-allocated string will be returned in
  * *encmessagep. Put the current extra symmetric key into extrakey
@@ -483,18 +527,17 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     size_t justmsglen = strlen(msg);
     size_t msglen = justmsglen + 1 + otrl_tlv_seriallen(tlvs);
     size_t buflen;
+    const unsigned char *pubkey;
     size_t pubkeylen;
-    unsigned char *buf = NULL;
+    unsigned char *buf;
     unsigned char *bufp;
     size_t lenp;
     DH_sesskeys *sess = &(context->context_priv->sesskeys[1][0]);
     gcry_error_t err;
     size_t reveallen = 20 * context->context_priv->numsavedkeys;
     size_t base64len;
+    size_t outlen;
     char *base64buf = NULL;
-    unsigned char *msgbuf = NULL;
-    enum gcry_mpi_format format = GCRYMPI_FMT_USG;
-    char *msgdup;
     int version = context->protocol_version;
 
     /* Make sure we're actually supposed to be able to encrypt */
@@ -503,13 +546,12 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
 	return gcry_error(GPG_ERR_CONFLICT);
     }
 
-    /* We need to copy the incoming msg, since it might be an alias for
-     * context->lastmessage, which we'll be freeing soon. */
-    msgdup = gcry_malloc_secure(justmsglen + 1);
-    if (msgdup == NULL) {
-	return gcry_error(GPG_ERR_ENOMEM);
-    }
-    strcpy(msgdup, msg);
+    /* Derive the sending keys, if this is their first use */
+    err = otrl_dh_session_derive(sess, context->context_priv->us ?
+	    context->context_priv->us->dhhandles : NULL);
+    if (err) return err;
+    err = our_dh_pub_serialized(context->context_priv, &pubkey, &pubkeylen);
+    if (err) return err;
 
     *encmessagep = NULL;
 
@@ -518,20 +560,22 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     buflen = OTRL_HEADER_LEN + (version == 3 ? 8 : 0)
 	+ (version == 2 || version == 3 ? 1 : 0) + 4 + 4
 	+ 8 + 4 + msglen + 4 + reveallen + 20;
-    gcry_mpi_print(format, NULL, 0, &pubkeylen,
-	    context->context_priv->our_dh_key.pub);
     buflen += pubkeylen + 4;
-    buf = malloc(buflen);
-    msgbuf = gcry_malloc_secure(msglen);
-    if (buf == NULL || msgbuf == NULL) {
-	free(buf);
-	gcry_free(msgbuf);
-	gcry_free(msgdup);
+
+    /* Everything is built in the one buffer we return.  The binary
+     * message goes at its very end; once it is complete, it is
+     * base64-encoded in place towards the front.  Each 3-byte block is
+     * read before its 4 encoded bytes are written, and the encoding
+     * starts far enough ahead of the binary message (by "?OTR:", "."
+     * and the NUL, plus a byte for each block already encoded) that it
+     * never overwrites a block not yet read. */
+    base64len = ((buflen + 2) / 3) * 4;
+    outlen = 5 + base64len + 1 + 1;
+    base64buf = malloc(outlen);
+    if (base64buf == NULL) {
 	return gcry_error(GPG_ERR_ENOMEM);
     }
-    memmove(msgbuf, msgdup, justmsglen);
-    msgbuf[justmsglen] = '\0';
-    otrl_tlv_serialize(msgbuf + justmsglen + 1, tlvs);
+    buf = (unsigned char *)base64buf + outlen - buflen;
     bufp = buf;
     lenp = buflen;
     if (version == 1) {
@@ -563,7 +607,10 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     write_int(context->context_priv->their_keyid); /* recipient keyid */
     debug_int("Recipient keyid", bufp-4);
 
-    write_mpi(context->context_priv->our_dh_key.pub, pubkeylen, "Y");  /* Y */
+    write_int(pubkeylen);                                        /* Y */
+    memmove(bufp, pubkey, pubkeylen);
+    debug_data("Y", bufp, pubkeylen);
+    bufp += pubkeylen; lenp -= pubkeylen;
 
     otrl_dh_incctr(sess->sendctr);
     memmove(bufp, sess->sendctr, 8);      /* Counter (top 8 bytes only) */
@@ -577,7 +624,12 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     if (err) goto err;
     err = gcry_cipher_setctr(sess->sendenc, sess->sendctr, 16);
     if (err) goto err;
-    err = gcry_cipher_encrypt(sess->sendenc, bufp, msglen, msgbuf, msglen);
+    /* Lay out the plaintext where the ciphertext goes, and encrypt it
+     * in place */
+    memmove(bufp, msg, justmsglen);
+    bufp[justmsglen] = '\0';
+    otrl_tlv_serialize(bufp + justmsglen + 1, tlvs);
+    err = gcry_cipher_encrypt(sess->sendenc, bufp, msglen, NULL, 0);
     if (err) goto err;                              /* encrypted data */
     debug_data("Enc data", bufp, msglen);
     bufp += msglen;
@@ -604,31 +656,30 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
 
     assert(lenp == 0);
 
-    /* Make the base64-encoding. */
-    base64len = ((buflen + 2) / 3) * 4;
-    base64buf = malloc(5 + base64len + 1 + 1);
-    if (base64buf == NULL) {
-	err = gcry_error(GPG_ERR_ENOMEM);
-	goto err;
-    }
+    /* Make the base64-encoding, in place. */
     memmove(base64buf, "?OTR:", 5);
     otrl_base64_encode(base64buf+5, buf, buflen);
     base64buf[5 + base64len] = '.';
     base64buf[5 + base64len + 1] = '\0';
 
-    free(buf);
-    gcry_free(msgbuf);
     *encmessagep = base64buf;
-    gcry_free(context->context_priv->lastmessage);
-    context->context_priv->lastmessage = NULL;
     context->context_priv->may_retransmit = 0;
-    if (msglen > 0) {
-	context->context_priv->lastmessage = gcry_malloc_secure(justmsglen + 1);
-	if (context->context_priv->lastmessage) {
-	    strcpy(context->context_priv->lastmessage, msgdup);
+
+    /* Remember the message, in case we need to retransmit it.  If msg
+     * is context->lastmessage itself (as it is when we're
+     * retransmitting), it's already there.  Otherwise reuse the old
+     * buffer if the new message fits in it. */
+    if (msg != context->context_priv->lastmessage) {
+	char *last = context->context_priv->lastmessage;
+	if (!last || strlen(last) < justmsglen) {
+	    gcry_free(last);
+	    last = gcry_malloc_secure(justmsglen + 1);
+	    context->context_priv->lastmessage = last;
+	}
+	if (last) {
+	    memmove(last, msg, justmsglen + 1);
 	}
     }
-    gcry_free(msgdup);
 
     /* Save a copy of the current extra key */
     if (extrakey) {
@@ -637,38 +688,62 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
 
     return gcry_error(GPG_ERR_NO_ERROR);
 err:
-    free(buf);
-    gcry_free(msgbuf);
-    gcry_free(msgdup);
+    free(base64buf);
     *encmessagep = NULL;
     return err;
 }
 
+/* Find the base64 body of the OTR Data Message in datamsg.  Put a
+ * pointer to it into *bodyp and the length of the rest of the message
+ * into *bodylenp; the body ends at the '.' (if any) within that. */
+static gcry_error_t data_body(const char *datamsg, const char **bodyp,
+	size_t *bodylenp)
+{
+    const char *otrtag;
+
+    otrtag = strstr(datamsg, "?OTR:");
+    if (!otrtag) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    /* Skip over the "?OTR:" */
+    *bodyp = otrtag + 5;
+    *bodylenp = strlen(*bodyp);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Base64-decode the body at otrtag, found by data_body, into rawmsg,
+ * which has room for rawsize bytes, putting the decoded length into
+ * *rawlenp.  Malformed bodies are rejected before any of the message
+ * is looked at. */
+static gcry_error_t data_decode(unsigned char *rawmsg, size_t rawsize,
+	size_t *rawlenp, const char *otrtag, size_t msglen)
+{
+    switch (otrl_base64_otr_body_decode(rawmsg, rawsize, rawlenp, otrtag,
+		msglen, 1)) {
+	case 0:
+	    return gcry_error(GPG_ERR_NO_ERROR);
+	case -3:
+	    return gcry_error(GPG_ERR_BUFFER_TOO_SHORT);
+	default:
+	    return gcry_error(GPG_ERR_INV_VALUE);
+    }
+}
+
 /* Extract the flags from an otherwise unreadable Data Message. */
 gcry_error_t otrl_proto_data_read_flags(const char *datamsg,
 	unsigned char *flagsp)
 {
-    char *otrtag, *endtag;
+    const char *otrtag;
     unsigned char *rawmsg = NULL;
     unsigned char *bufp;
     size_t msglen, rawlen, lenp;
     unsigned char version;
 
     if (flagsp) *flagsp = 0;
-    otrtag = strstr(datamsg, "?OTR:");
-    if (!otrtag) {
+    if (data_body(datamsg, &otrtag, &msglen)) {
 	goto invval;
     }
-    endtag = strchr(otrtag, '.');
-    if (endtag) {
-	msglen = endtag-otrtag;
-    } else {
-	msglen = strlen(otrtag);
-    }
-
-    /* Skip over the "?OTR:" */
-    otrtag += 5;
-    msglen -= 5;
 
     /* Base64-decode the message */
     rawlen = OTRL_B64_MAX_DECODED_SIZE(msglen);   /* maximum possible */
@@ -676,7 +751,9 @@ gcry_error_t otrl_proto_data_read_flags(const char *datamsg,
     if (!rawmsg && rawlen > 0) {
 	return gcry_error(GPG_ERR_ENOMEM);
     }
-    rawlen = otrl_base64_decode(rawmsg, otrtag, msglen);  /* actual size */
+    if (data_decode(rawmsg, rawlen, &rawlen, otrtag, msglen)) {
+	goto invval;
+    }
 
     bufp = rawmsg;
     lenp = rawlen;
@@ -704,18 +781,16 @@ invval:
     return gcry_error(GPG_ERR_INV_VALUE);
 }
 
-/* Accept an OTR Data Message in datamsg.  Decrypt it and put the
- * plaintext into *plaintextp, and any TLVs into tlvsp.  Put any
- * received flags into *flagsp (if non-NULL).  Put the current extra
- * symmetric key into extrakey (if non-NULL). */
-gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
-	ConnContext *context, const char *datamsg, unsigned char *flagsp,
-	unsigned char *extrakey)
+/* Verify and decrypt in place the decoded Data Message of length rawlen
+ * in rawmsg.  On success, *plaintextp points to the NUL-terminated
+ * plaintext inside rawmsg, and *plainlenp is its length not including
+ * any TLVs. */
+static gcry_error_t accept_data_raw(char **plaintextp, size_t *plainlenp,
+	OtrlTLV **tlvsp, ConnContext *context, unsigned char *rawmsg,
+	size_t rawlen, unsigned char *flagsp, unsigned char *extrakey)
 {
-    char *otrtag, *endtag;
     gcry_error_t err;
-    unsigned char *rawmsg = NULL;
-    size_t msglen, rawlen, lenp;
+    size_t lenp;
     unsigned char *macstart, *macend;
     unsigned char *bufp;
     unsigned int sender_keyid, recipient_keyid;
@@ -728,33 +803,6 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
     DH_sesskeys *sess;
     unsigned char version;
 
-    *plaintextp = NULL;
-    *tlvsp = NULL;
-    if (flagsp) *flagsp = 0;
-    otrtag = strstr(datamsg, "?OTR:");
-    if (!otrtag) {
-	goto invval;
-    }
-    endtag = strchr(otrtag, '.');
-    if (endtag) {
-	msglen = endtag-otrtag;
-    } else {
-	msglen = strlen(otrtag);
-    }
-
-    /* Skip over the "?OTR:" */
-    otrtag += 5;
-    msglen -= 5;
-
-    /* Base64-decode the message */
-    rawlen = OTRL_B64_MAX_DECODED_SIZE(msglen);   /* maximum possible */
-    rawmsg = malloc(rawlen);
-    if (!rawmsg && rawlen > 0) {
-	err = gcry_error(GPG_ERR_ENOMEM);
-	goto err;
-    }
-    rawlen = otrl_base64_decode(rawmsg, otrtag, msglen);  /* actual size */
-
     bufp = rawmsg;
     lenp = rawlen;
 
@@ -783,13 +831,8 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
     bufp += 8; lenp -= 8;
     read_int(datalen);
     require_len(datalen);
-    data = malloc(datalen+1);
-    if (!data) {
-	err = gcry_error(GPG_ERR_ENOMEM);
-	goto err;
-    }
-    memmove(data, bufp, datalen);
-    data[datalen] = '\0';
+    /* The ciphertext is decrypted where it lies, rather than copied out */
+    data = bufp;
     bufp += datalen; lenp -= datalen;
     macend = bufp;
     require_len(20);
@@ -826,6 +869,11 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
 	    [context->context_priv->our_keyid - recipient_keyid]
 	    [context->context_priv->their_keyid - sender_keyid]);
 
+    /* Derive them, if this is their first use */
+    err = otrl_dh_session_derive(sess, context->context_priv->us ?
+	    context->context_priv->us->dhhandles : NULL);
+    if (err) goto err;
+
     gcry_md_reset(sess->rcvmac);
     gcry_md_write(sess->rcvmac, macstart, macend-macstart);
     if (otrl_mem_differ(givenmac, gcry_md_read(sess->rcvmac, GCRY_MD_SHA1),
@@ -870,16 +918,20 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
     }
 
     gcry_mpi_release(sender_next_y);
-    *plaintextp = (char *)data;
 
     /* See if there are TLVs */
     nul = data;
     while (nul < data+datalen && *nul) ++nul;
+    *plainlenp = nul - data;
     /* If we stopped before the end, skip the NUL we stopped at */
     if (nul < data+datalen) ++nul;
     *tlvsp = otrl_tlv_parse(nul, (data+datalen)-nul);
 
-    free(rawmsg);
+    /* The MAC we have already checked follows the data, so there is
+     * room to terminate the plaintext. */
+    data[*plainlenp] = '\0';
+    *plaintextp = (char *)data;
+
     return gcry_error(GPG_ERR_NO_ERROR);
 
 invval:
@@ -890,11 +942,82 @@ conflict:
     goto err;
 err:
     gcry_mpi_release(sender_next_y);
-    free(data);
-    free(rawmsg);
     return err;
 }
 
+/* Accept an OTR Data Message in datamsg.  Decrypt it and put the
+ * plaintext into *plaintextp, and any TLVs into tlvsp.  Put any
+ * received flags into *flagsp (if non-NULL).  Put the current extra
+ * symmetric key into extrakey (if non-NULL). */
+gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
+	ConnContext *context, const char *datamsg, unsigned char *flagsp,
+	unsigned char *extrakey)
+{
+    const char *otrtag;
+    gcry_error_t err;
+    unsigned char *rawmsg;
+    size_t msglen, rawlen, plainlen;
+    char *plaintext;
+
+    *plaintextp = NULL;
+    *tlvsp = NULL;
+    if (flagsp) *flagsp = 0;
+    err = data_body(datamsg, &otrtag, &msglen);
+    if (err) return err;
+
+    /* The message is decoded and decrypted within this one buffer, which
+     * then becomes the plaintext we return. */
+    rawlen = OTRL_B64_MAX_DECODED_SIZE(msglen);   /* maximum possible */
+    rawmsg = malloc(rawlen + 1);
+    if (!rawmsg) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    err = data_decode(rawmsg, rawlen, &rawlen, otrtag, msglen);
+    if (!err) {
+	err = accept_data_raw(&plaintext, &plainlen, tlvsp, context, rawmsg,
+		rawlen, flagsp, extrakey);
+    }
+    if (err) {
+	free(rawmsg);
+	return err;
+    }
+
+    memmove(rawmsg, plaintext, plainlen + 1);
+    *plaintextp = (char *)rawmsg;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Accept an OTR Data Message in datamsg, as otrl_proto_accept_data
+ * does, but without allocating memory for the decoded message.  The
+ * message is decoded and decrypted within the scratch buffer, which
+ * needs at most OTRL_B64_MAX_DECODED_SIZE(strlen(datamsg)) bytes, and
+ * *plaintextp is left pointing into it; do not free it, and copy
+ * it out before reusing the buffer.  If there are TLVs, *tlvsp is
+ * still allocated and must be freed with otrl_tlv_free.  Returns
+ * GPG_ERR_BUFFER_TOO_SHORT if the scratch buffer is too small. */
+gcry_error_t otrl_proto_accept_data_scratch(char **plaintextp,
+	OtrlTLV **tlvsp, ConnContext *context, const char *datamsg,
+	unsigned char *flagsp, unsigned char *extrakey,
+	unsigned char *scratch, size_t scratchlen)
+{
+    const char *otrtag;
+    gcry_error_t err;
+    size_t msglen, rawlen, plainlen;
+
+    *plaintextp = NULL;
+    *tlvsp = NULL;
+    if (flagsp) *flagsp = 0;
+    err = data_body(datamsg, &otrtag, &msglen);
+    if (err) return err;
+
+    err = data_decode(scratch, scratchlen, &rawlen, otrtag, msglen);
+    if (err) return err;
+
+    return accept_data_raw(plaintextp, &plainlen, tlvsp, context, scratch,
+	    rawlen, flagsp, extrakey);
+}
+
 /* Accumulate a potential fragment into the current context. */
 OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
 	ConnContext *context, const char *msg)
@@ -902,105 +1025,99 @@ OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
     OtrlFragmentResult res = OTRL_FRAGMENT_INCOMPLETE;
     const char *tag;
     unsigned short n = 0, k = 0;
+    unsigned int sender = 0;
     int start = 0, end = 0;
+    time_t now;
 
     tag = strstr(msg, "?OTR|");
     if (tag) {
-	sscanf(tag, "?OTR|%*x|%*x,%hu,%hu,%n%*[^,],%n", &k, &n, &start, &end);
+	sscanf(tag, "?OTR|%x|%*x,%hu,%hu,%n%*[^,],%n", &sender, &k, &n,
+		&start, &end);
     } else if ((tag = strstr(msg, "?OTR,")) != NULL) {
 	sscanf(tag, "?OTR,%hu,%hu,%n%*[^,],%n", &k, &n, &start, &end);
     } else {
-	/* Unfragmented message, so discard any fragment we may have */
-	free(context->context_priv->fragment);
-	context->context_priv->fragment = NULL;
-	context->context_priv->fragment_len = 0;
-	context->context_priv->fragment_n = 0;
-	context->context_priv->fragment_k = 0;
+	/* Unfragmented message.  Keep any fragments we have, since the
+	 * rest of their messages may still be on the way. */
 	res = OTRL_FRAGMENT_UNFRAGMENTED;
 	return res;
     }
 
+    now = time(NULL);
+    otrl_fragment_expire(context->context_priv, now - OTRL_FRAGMENT_EXPIRY);
+
     if (k > 0 && n > 0 && k <= n && start > 0 && end > 0 && start < end) {
-	if (k == 1) {
-	    int fraglen = end - start - 1;
-	    size_t newsize = fraglen + 1;
-	    free(context->context_priv->fragment);
-	    context->context_priv->fragment = NULL;
-	    if (newsize >= 1) {  /* Check for overflow */
-		context->context_priv->fragment = malloc(newsize);
-	    }
-	    if (context->context_priv->fragment) {
-		memmove(context->context_priv->fragment, tag + start, fraglen);
-		context->context_priv->fragment_len = fraglen;
-		context->context_priv->fragment[
-			context->context_priv->fragment_len] = '\0';
-		context->context_priv->fragment_n = n;
-		context->context_priv->fragment_k = k;
-	    } else {
-		context->context_priv->fragment_len = 0;
-		context->context_priv->fragment_n = 0;
-		context->context_priv->fragment_k = 0;
-	    }
-	} else if (n == context->context_priv->fragment_n &&
-		k == context->context_priv->fragment_k + 1) {
-	    int fraglen = end - start - 1;
-	    char *newfrag = NULL;
-	    size_t newsize = context->context_priv->fragment_len + fraglen + 1;
-	    /* Check for overflow */
-	    if (newsize > context->context_priv->fragment_len) {
-		newfrag = realloc(context->context_priv->fragment, newsize);
-	    }
-	    if (newfrag) {
-		context->context_priv->fragment = newfrag;
-		memmove(context->context_priv->fragment +
-			context->context_priv->fragment_len,
-			tag + start, fraglen);
-		context->context_priv->fragment_len += fraglen;
-		context->context_priv->fragment[
-			context->context_priv->fragment_len] = '\0';
-		context->context_priv->fragment_k = k;
-	    } else {
-		free(context->context_priv->fragment);
-		context->context_priv->fragment = NULL;
-		context->context_priv->fragment_len = 0;
-		context->context_priv->fragment_n = 0;
-		context->context_priv->fragment_k = 0;
-	    }
-	} else {
-	    free(context->context_priv->fragment);
-	    context->context_priv->fragment = NULL;
-	    context->context_priv->fragment_len = 0;
-	    context->context_priv->fragment_n = 0;
-	    context->context_priv->fragment_k = 0;
-	}
+	res = otrl_fragment_add(context->context_priv, sender, k, n,
+		tag + start, end - start - 1, now, unfragmessagep);
     }
 
-    if (context->context_priv->fragment_n > 0 &&
-	    context->context_priv->fragment_n ==
-	    context->context_priv->fragment_k) {
-	/* We've got a complete message */
-	*unfragmessagep = context->context_priv->fragment;
-	context->context_priv->fragment = NULL;
-	context->context_priv->fragment_len = 0;
-	context->context_priv->fragment_n = 0;
-	context->context_priv->fragment_k = 0;
-	res = OTRL_FRAGMENT_COMPLETE;
+    return res;
+}
+
+/* The longest fragment header, "?OTR|%08x|%08x,%05hu,%05hu,", plus a
+ * NUL */
+#define FRAGMENT_HEADER_MAX 36
+
+/* Format the fragment header for fragment 1 of n into hdr, which has
+ * room for FRAGMENT_HEADER_MAX bytes, and return its length.  The
+ * fragment number is the five digits starting 12 bytes from the end. */
+static size_t fragment_header(char *hdr, ConnContext *context,
+	int fragment_count)
+{
+    if (context->auth.protocol_version != 3) {
+	return snprintf(hdr, FRAGMENT_HEADER_MAX, "?OTR,%05hu,%05hu,",
+		(unsigned short)1, (unsigned short)fragment_count);
+    } else {
+	/* V3 messages require instance tags in the header */
+	return snprintf(hdr, FRAGMENT_HEADER_MAX,
+		"?OTR|%08x|%08x,%05hu,%05hu,",
+		context->our_instance, context->their_instance,
+		(unsigned short)1, (unsigned short)fragment_count);
     }
+}
 
-    return res;
+/* Write fragment curfrag, with fragdatalen bytes of data from message,
+ * to out, using the header made by fragment_header.  headerlen is the
+ * allowance for the header (and the terminating NUL) that the caller
+ * made when splitting up the message; the fragment is cut short if the
+ * header turned out to be longer than that.  Return the length of the
+ * fragment, which is NUL-terminated. */
+static size_t fragment_write(char *out, const char *hdr, size_t hdrlen,
+	int curfrag, const char *message, size_t fragdatalen,
+	size_t headerlen)
+{
+    size_t fraglen = hdrlen + fragdatalen + 1;
+    unsigned short k = (unsigned short)curfrag;
+    char *kp;
+
+    memmove(out, hdr, hdrlen);
+    kp = out + hdrlen - 7;
+    *--kp = '0' + k % 10; k /= 10;
+    *--kp = '0' + k % 10; k /= 10;
+    *--kp = '0' + k % 10; k /= 10;
+    *--kp = '0' + k % 10; k /= 10;
+    *--kp = '0' + k;
+    memmove(out + hdrlen, message, fragdatalen);
+    out[hdrlen + fragdatalen] = ',';
+
+    if (fraglen > fragdatalen + headerlen - 1) {
+	fraglen = fragdatalen + headerlen - 1;
+    }
+    out[fraglen] = '\0';
+    return fraglen;
 }
 
 /* Create a fragmented message. */
 gcry_error_t otrl_proto_fragment_create(int mms, int fragment_count,
 	char ***fragments, ConnContext *context, const char *message)
 {
-    char *fragdata;
     int fragdatalen = 0;
     int curfrag = 0;
     int index = 0;
     int msglen = strlen(message);
     /* Should vary by number of msgs */
     int headerlen = context->protocol_version == 3 ? 37 : 19;
+    char hdr[FRAGMENT_HEADER_MAX];
+    size_t hdrlen;
 
     char **fragmentarray;
 
@@ -1011,6 +1128,8 @@ gcry_error_t otrl_proto_fragment_create(int mms, int fragment_count,
     fragmentarray = malloc(fragment_count * sizeof(char*));
     if(!fragmentarray) return gcry_error(GPG_ERR_ENOMEM);
 
+    hdrlen = fragment_header(hdr, context, fragment_count);
+
     /*
      * Find the next message fragment and store it in the array.
      */
@@ -1024,43 +1143,21 @@ gcry_error_t otrl_proto_fragment_create(int mms, int fragment_count,
 	    fragdatalen = mms - headerlen;
 	}
 
-	fragdata = malloc(fragdatalen + 1);
-	if(!fragdata) {
-		for (i=0; i<curfrag-1; free(fragmentarray[i++])) {}
-		free(fragmentarray);
-		return gcry_error(GPG_ERR_ENOMEM);
-	}
-	strncpy(fragdata, message, fragdatalen);
-	fragdata[fragdatalen] = 0;
-
-	fragmentmsg = malloc(fragdatalen+headerlen+1);
+	fragmentmsg = malloc(hdrlen + fragdatalen + 2);
 	if(!fragmentmsg) {
 	    for (i=0; i<curfrag-1; free(fragmentarray[i++])) {}
 	    free(fragmentarray);
-	    free(fragdata);
 	    return gcry_error(GPG_ERR_ENOMEM);
 	}
 
 	/*
 	 * Create the actual fragment and store it in the array
 	 */
-	if (context->auth.protocol_version != 3) {
-	    snprintf(fragmentmsg, fragdatalen + headerlen,
-		    "?OTR,%05hu,%05hu,%s,", (unsigned short)curfrag,
-			    (unsigned short)fragment_count, fragdata);
-	} else {
-	    /* V3 messages require instance tags in the header */
-	    snprintf(fragmentmsg, fragdatalen + headerlen,
-		    "?OTR|%08x|%08x,%05hu,%05hu,%s,",
-		    context->our_instance, context->their_instance,
-		    (unsigned short)curfrag, (unsigned short)fragment_count,
-		    fragdata);
-	}
-	fragmentmsg[fragdatalen + headerlen] = 0;
+	fragment_write(fragmentmsg, hdr, hdrlen, curfrag, message,
+		fragdatalen, headerlen);
 
 	fragmentarray[curfrag-1] = fragmentmsg;
 
-	free(fragdata);
 	index += fragdatalen;
 	message += fragdatalen;
     }
@@ -1069,6 +1166,62 @@ gcry_error_t otrl_proto_fragment_create(int mms, int fragment_count,
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* Create a fragmented message, as otrl_proto_fragment_create does, but
+ * put the array of fragments and all of their text into a single
+ * allocation, which the caller should free() when done.  The text of
+ * each fragment is NUL-terminated, and laid out one after the other in
+ * order. */
+gcry_error_t otrl_proto_fragment_create_contiguous(int mms,
+	int fragment_count, OtrlFragment **fragmentsp, ConnContext *context,
+	const char *message)
+{
+    int fragdatalen = 0;
+    int curfrag = 0;
+    int index = 0;
+    int msglen = strlen(message);
+    /* Should vary by number of msgs */
+    int headerlen = context->protocol_version == 3 ? 37 : 19;
+    char hdr[FRAGMENT_HEADER_MAX];
+    size_t hdrlen;
+    OtrlFragment *fragmentarray;
+    char *out;
+
+    *fragmentsp = NULL;
+    if (fragment_count < 1 || fragment_count > 65535) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    hdrlen = fragment_header(hdr, context, fragment_count);
+
+    /* Each fragment is at most the header, its data, a ',' and a NUL */
+    fragmentarray = malloc(fragment_count * sizeof(OtrlFragment) +
+	    fragment_count * (hdrlen + 2) + msglen);
+    if(!fragmentarray) return gcry_error(GPG_ERR_ENOMEM);
+    out = (char *)(fragmentarray + fragment_count);
+
+    for(curfrag = 1; curfrag <= fragment_count; curfrag++) {
+	size_t fraglen;
+
+	if (msglen - index < mms - headerlen) {
+	    fragdatalen = msglen - index;
+	} else {
+	    fragdatalen = mms - headerlen;
+	}
+
+	fraglen = fragment_write(out, hdr, hdrlen, curfrag, message,
+		fragdatalen, headerlen);
+	fragmentarray[curfrag-1].text = out;
+	fragmentarray[curfrag-1].len = fraglen;
+
+	out += fraglen + 1;
+	index += fragdatalen;
+	message += fragdatalen;
+    }
+
+    *fragmentsp = fragmentarray;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
 /* Free a string array containing fragment messages. */
 void otrl_proto_fragment_free(char ***fragments, unsigned short arraylen)
 {
@@ -100,6 +100,13 @@ typedef enum {
     OTRL_FRAGMENT_SEND_ALL_BUT_LAST
 } OtrlFragmentPolicy;
 
+/* One fragment of a message.  The text is NUL-terminated; len does not
+ * include the NUL. */
+typedef struct s_OtrlFragment {
+    const char *text;
+    size_t len;
+} OtrlFragment;
+
 /* Initialize the OTR library.  Pass the version of the API you are
  * using. */
 gcry_error_t otrl_init(unsigned int ver_major, unsigned int ver_minor,
@@ -163,6 +170,19 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
 	ConnContext *context, const char *datamsg, unsigned char *flagsp,
 	unsigned char *extrakey);
 
+/* Accept an OTR Data Message in datamsg, as otrl_proto_accept_data
+ * does, but without allocating memory for the decoded message.  The
+ * message is decoded and decrypted within the scratch buffer, which
+ * needs at most OTRL_B64_MAX_DECODED_SIZE(strlen(datamsg)) bytes, and
+ * *plaintextp is left pointing into it; do not free it, and copy it
+ * out before reusing the buffer.  If there are TLVs, *tlvsp is still
+ * allocated and must be freed with otrl_tlv_free.  Returns
+ * GPG_ERR_BUFFER_TOO_SHORT if the scratch buffer is too small. */
+gcry_error_t otrl_proto_accept_data_scratch(char **plaintextp,
+	OtrlTLV **tlvsp, ConnContext *context, const char *datamsg,
+	unsigned char *flagsp, unsigned char *extrakey,
+	unsigned char *scratch, size_t scratchlen);
+
 /* Accumulate a potential fragment into the current context. */
 OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
 	ConnContext *context, const char *msg);
@@ -170,5 +190,14 @@ OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
 gcry_error_t otrl_proto_fragment_create(int mms, int fragment_count,
 	char ***fragments, ConnContext *context, const char *message);
 
+/* Create a fragmented message, as otrl_proto_fragment_create does, but
+ * put the array of fragments and all of their text into a single
+ * allocation, which the caller should free() when done.  The text of
+ * each fragment is NUL-terminated, and laid out one after the other in
+ * order. */
+gcry_error_t otrl_proto_fragment_create_contiguous(int mms,
+	int fragment_count, OtrlFragment **fragmentsp, ConnContext *context,
+	const char *message);
+
 void otrl_proto_fragment_free(char ***fragments, unsigned short arraylen);
 #endif
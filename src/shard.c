@@ -0,0 +1,211 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "shard.h"
+#include "fpstore.h"
+#include "privkey.h"
+#include "hash.h"
+
+struct s_OtrlShards {
+    OtrlUserState base;          /* Where the keys and instance tags are */
+    OtrlUserState *shards;
+    unsigned int nshards;
+};
+
+/* Create nshards (at least 1) new OtrlUserStates sharing the private
+ * keys and instance tags of base.  Any keys read from a file and not
+ * yet parsed are parsed now, so that the shards can look them up
+ * without changing anything.  The base's limit on the memory held by
+ * partly received fragmented messages is divided among the shards.
+ * The base itself must outlive the shards. */
+gcry_error_t otrl_shards_create(OtrlUserState base, unsigned int nshards,
+	OtrlShards *shardsp)
+{
+    OtrlShards shards;
+    OtrlPrivKey *p;
+    unsigned int i;
+
+    *shardsp = NULL;
+    if (!base || nshards == 0) return gcry_error(GPG_ERR_INV_VALUE);
+
+    /* Looking a key up parses it if need be */
+    for (p = base->privkey_root; p; p = p->next) {
+	otrl_privkey_find(base, p->accountname, p->protocol);
+    }
+
+    shards = malloc(sizeof(*shards));
+    if (!shards) return gcry_error(GPG_ERR_ENOMEM);
+    shards->base = base;
+    shards->nshards = 0;
+    shards->shards = calloc(nshards, sizeof(OtrlUserState));
+    if (!shards->shards) {
+	free(shards);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    for (i = 0; i < nshards; ++i) {
+	OtrlUserState us = otrl_userstate_create();
+	if (!us) {
+	    otrl_shards_free(shards);
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	us->keystate = base;
+	us->fragment_limit = base->fragment_limit / nshards;
+	us->fragment_context_limit = base->fragment_context_limit;
+	if (us->fragment_context_limit > us->fragment_limit) {
+	    us->fragment_context_limit = us->fragment_limit;
+	}
+	shards->shards[i] = us;
+	shards->nshards++;
+    }
+
+    *shardsp = shards;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Free the given set of shards and all their contexts.  The base
+ * OtrlUserState is left alone. */
+void otrl_shards_free(OtrlShards shards)
+{
+    unsigned int i;
+
+    if (!shards) return;
+
+    for (i = 0; i < shards->nshards; ++i) {
+	otrl_userstate_free(shards->shards[i]);
+    }
+    free(shards->shards);
+    free(shards);
+}
+
+/* Return the number of shards in the given set. */
+unsigned int otrl_shards_count(OtrlShards shards)
+{
+    return shards->nshards;
+}
+
+/* Return the i'th shard of the given set. */
+OtrlUserState otrl_shards_get(OtrlShards shards, unsigned int i)
+{
+    return i < shards->nshards ? shards->shards[i] : NULL;
+}
+
+/* Return the index of the shard that owns the contexts for the given
+ * username, accountname and protocol.  This depends only on those
+ * strings and the number of shards, so it may be computed from any
+ * thread, and stays the same from run to run. */
+unsigned int otrl_shards_route(OtrlShards shards, const char *username,
+	const char *accountname, const char *protocol)
+{
+    unsigned int hash = OTRL_HASH_INIT;
+
+    hash = otrl_hash_string(hash, username);
+    hash = otrl_hash_string(hash, accountname);
+    hash = otrl_hash_string(hash, protocol);
+    return hash % shards->nshards;
+}
+
+/* Return the shard that owns the contexts for the given username,
+ * accountname and protocol. */
+OtrlUserState otrl_shards_find(OtrlShards shards, const char *username,
+	const char *accountname, const char *protocol)
+{
+    return shards->shards[otrl_shards_route(shards, username, accountname,
+	    protocol)];
+}
+
+/* Read the fingerprint store from a file on disk, putting each
+ * correspondent's context and fingerprints into the shard that owns
+ * them.  Use add_app_data to add application data to each ConnContext
+ * so created. */
+gcry_error_t otrl_shards_read_fingerprints(OtrlShards shards,
+	const char *filename,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void *data)
+{
+    OtrlUserState tmp;
+    ConnContext *context;
+    gcry_error_t err;
+
+    /* Read the store as usual, and then hand out what we read */
+    tmp = otrl_userstate_create();
+    if (!tmp) return gcry_error(GPG_ERR_ENOMEM);
+    err = otrl_privkey_read_fingerprints(tmp, filename, NULL, NULL);
+    if (err) {
+	otrl_userstate_free(tmp);
+	return err;
+    }
+
+    for (context = tmp->context_root; context; context = context->next) {
+	OtrlUserState us;
+	ConnContext *shardctx;
+	Fingerprint *fprint;
+
+	if (context->their_instance != OTRL_INSTAG_MASTER) continue;
+
+	us = otrl_shards_find(shards, context->username,
+		context->accountname, context->protocol);
+	shardctx = otrl_context_find(us, context->username,
+		context->accountname, context->protocol, OTRL_INSTAG_MASTER,
+		1, NULL, add_app_data, data);
+	for (fprint = context->fingerprint_root.next; fprint;
+		fprint = fprint->next) {
+	    Fingerprint *fng = otrl_context_find_fingerprint(shardctx,
+		    fprint->fingerprint, 1, NULL);
+	    otrl_context_set_trust(fng, fprint->trust);
+	}
+    }
+
+    otrl_userstate_free(tmp);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Write the fingerprints of all the shards to one fingerprint store
+ * file on disk, in the format read by otrl_privkey_read_fingerprints
+ * and otrl_shards_read_fingerprints.  As with otrl_fpstore_write, the
+ * file is replaced only once the whole new one is safely on disk. */
+gcry_error_t otrl_shards_write_fingerprints(OtrlShards shards,
+	const char *filename)
+{
+    gcry_error_t err;
+    FILE *storef;
+    char *tmpname;
+    unsigned int i;
+
+    err = otrl_fpstore_replace_begin(filename, &storef, &tmpname);
+    if (err) return err;
+
+    for (i = 0; i < shards->nshards && !err; ++i) {
+	err = otrl_privkey_write_fingerprints_FILEp(shards->shards[i],
+		storef);
+    }
+
+    return otrl_fpstore_replace_end(filename, storef, tmpname, err);
+}
@@ -0,0 +1,102 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <gcrypt.h>
+
+#include "context.h"
+#include "userstate.h"
+
+/* A set of OtrlUserStates that between them hold the contexts of one
+ * user, each correspondent's contexts living in exactly one of them,
+ * chosen by a hash of (username, accountname, protocol).  The shards
+ * all use the private keys and instance tags of one base OtrlUserState,
+ * without copying them, so an application can give each shard to its
+ * own thread, route every message to the shard that owns its
+ * correspondent with otrl_shards_route, and handle messages on
+ * different shards without any locking between them.
+ *
+ * The shards only ever read the base's private keys and instance tags,
+ * holding the base's shared lock if it has one.  Read or generate them
+ * all in the base before creating the shards, and don't change them
+ * while the shards are in use.  A shard never calls your create_privkey
+ * or create_instag callbacks, which would have to change the base while
+ * other shards read it: a message that needs a private key the base
+ * doesn't have gets an OTRL_MSGEVENT_SETUP_ERROR with
+ * gcry_error(GPG_ERR_NO_SECKEY), and an account without an instance
+ * tag gets a random one, as it would with no create_instag callback.
+ * Everything else a userstate has (contexts and their
+ * fingerprints, the timer, fragment memory, DH and AKE pools) belongs
+ * to each shard separately: call otrl_message_poll for each shard, and
+ * enable any pools on each shard that should have one. */
+
+typedef struct s_OtrlShards *OtrlShards;
+
+/* Create nshards (at least 1) new OtrlUserStates sharing the private
+ * keys and instance tags of base.  Any keys read from a file and not
+ * yet parsed are parsed now, so that the shards can look them up
+ * without changing anything.  The base's limit on the memory held by
+ * partly received fragmented messages is divided among the shards.
+ * The base itself must outlive the shards. */
+gcry_error_t otrl_shards_create(OtrlUserState base, unsigned int nshards,
+	OtrlShards *shardsp);
+
+/* Free the given set of shards and all their contexts.  The base
+ * OtrlUserState is left alone. */
+void otrl_shards_free(OtrlShards shards);
+
+/* Return the number of shards in the given set. */
+unsigned int otrl_shards_count(OtrlShards shards);
+
+/* Return the i'th shard of the given set. */
+OtrlUserState otrl_shards_get(OtrlShards shards, unsigned int i);
+
+/* Return the index of the shard that owns the contexts for the given
+ * username, accountname and protocol.  This depends only on those
+ * strings and the number of shards, so it may be computed from any
+ * thread, and stays the same from run to run. */
+unsigned int otrl_shards_route(OtrlShards shards, const char *username,
+	const char *accountname, const char *protocol);
+
+/* Return the shard that owns the contexts for the given username,
+ * accountname and protocol. */
+OtrlUserState otrl_shards_find(OtrlShards shards, const char *username,
+	const char *accountname, const char *protocol);
+
+/* Read the fingerprint store from a file on disk, putting each
+ * correspondent's context and fingerprints into the shard that owns
+ * them.  Use add_app_data to add application data to each ConnContext
+ * so created. */
+gcry_error_t otrl_shards_read_fingerprints(OtrlShards shards,
+	const char *filename,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void *data);
+
+/* Write the fingerprints of all the shards to one fingerprint store
+ * file on disk, in the format read by otrl_privkey_read_fingerprints
+ * and otrl_shards_read_fingerprints.  As with otrl_fpstore_write, the
+ * file is replaced only once the whole new one is safely on disk. */
+gcry_error_t otrl_shards_write_fingerprints(OtrlShards shards,
+	const char *filename);
+
+#endif
@@ -25,6 +25,11 @@
 #include "context.h"
 #include "privkey.h"
 #include "userstate.h"
+#include "dhpool.h"
+#include "akepool.h"
+#include "uslock.h"
+#include "deadline.h"
+#include "fragment.h"
 
 /* Create a new OtrlUserState.  Most clients will only need one of
  * these.  A OtrlUserState encapsulates the list of known fingerprints
@@ -42,14 +47,40 @@ OtrlUserState otrl_userstate_create(void)
     us->instag_root = NULL;
     us->pending_root = NULL;
     us->timer_running = 0;
+    us->timer_busy = 0;
+    us->timer_recheck = 0;
+    us->context_index = NULL;
+    us->fpstore = NULL;
+    us->fpjournal = NULL;
+    us->fpwriter = NULL;
+    us->privkey_index = NULL;
+    us->privkey_lazy = 0;
+    us->instag_index = NULL;
+    us->dhpool = NULL;
+    us->dhhandles = NULL;
+    us->akepool = NULL;
+    us->uslock = NULL;
+    us->keystate = NULL;
+    us->deadlines = NULL;
+    us->fragment_bytes = 0;
+    us->fragment_limit = OTRL_FRAGMENT_MAX_BYTES;
+    us->fragment_context_limit = OTRL_FRAGMENT_MAX_CONTEXT_BYTES;
     return us;
 }
 
 /* Free a OtrlUserState.  If you have a timer running for this userstate,
-stop it before freeing the userstate. */
+stop it before freeing the userstate.  This waits for any fingerprint
+writes still being done for it by otrl_privkey_write_fingerprints_async. */
 void otrl_userstate_free(OtrlUserState us)
 {
+    otrl_privkey_write_fingerprints_free(us);
+    otrl_dhpool_disable(us);
+    otrl_akepool_disable(us);
+    otrl_uslock_disable(us);
     otrl_context_forget_all(us);
+    otrl_context_index_disable(us);
+    otrl_deadline_free(us);
+    otrl_dh_handlepool_free(us->dhhandles);
     otrl_privkey_forget_all(us);
     otrl_privkey_pending_forget_all(us);
     otrl_instag_forget_all(us);
@@ -33,6 +33,45 @@ struct s_OtrlUserState {
     OtrlInsTag *instag_root;
     OtrlPendingPrivKey *pending_root;
     int timer_running;
+    int timer_busy;                  /* Set while a thread is calling
+					ops->timer_control */
+    int timer_recheck;               /* Set if the deadlines changed
+					meanwhile */
+    struct s_OtrlContextIndex *context_index;  /* Hash index over
+						   context_root, or NULL
+						   if not enabled */
+    struct s_OtrlFPStore *fpstore;   /* Attached binary fingerprint
+					store, or NULL */
+    struct s_OtrlFPJournal *fpjournal;  /* Open fingerprint journal, or
+					   NULL */
+    struct s_OtrlFPWriter *fpwriter;  /* Queue and thread of
+					 otrl_privkey_write_fingerprints_async,
+					 or NULL */
+    struct s_OtrlPrivKeyIndex *privkey_index;  /* Hash index over
+						   privkey_root, or NULL */
+    int privkey_lazy;                /* Parse keys read from a file only
+					when they are first needed */
+    struct s_OtrlInsTagIndex *instag_index;  /* Hash index over
+						 instag_root, or NULL */
+    struct s_OtrlDHPool *dhpool;     /* Pool of pre-generated DH keypairs,
+					or NULL */
+    OtrlDHHandlePool *dhhandles;     /* Pool of cipher and MAC handles
+					for session keys, or NULL */
+    struct s_OtrlAKEPool *akepool;   /* Threads doing the public-key
+					operations of AKEs, or NULL */
+    struct s_OtrlUSLock *uslock;     /* Locks for using this userstate
+					from several threads, or NULL */
+    struct s_OtrlDeadlines *deadlines;  /* When contexts next need
+					   polling, or NULL */
+    struct s_OtrlUserState *keystate;  /* The userstate whose private
+					  keys and instance tags this one
+					  uses (see shard.h), or NULL to
+					  use its own */
+    size_t fragment_bytes;           /* Memory held by partly received
+					fragmented messages */
+    size_t fragment_limit;           /* The most fragment_bytes may be */
+    size_t fragment_context_limit;   /* The most any one context may
+					hold */
 };
 
 /* Create a new OtrlUserState.  Most clients will only need one of
@@ -45,7 +84,8 @@ struct s_OtrlUserState {
 OtrlUserState otrl_userstate_create(void);
 
 /* Free a OtrlUserState.  If you have a timer running for this userstate,
-stop it before freeing the userstate. */
+stop it before freeing the userstate.  This waits for any fingerprint
+writes still being done for it by otrl_privkey_write_fingerprints_async. */
 void otrl_userstate_free(OtrlUserState us);
 
 #endif
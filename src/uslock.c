@@ -0,0 +1,254 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdlib.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "context_priv.h"
+#include "uslock.h"
+
+#ifdef HAVE_PTHREAD_H
+
+struct s_OtrlUSLock {
+    pthread_rwlock_t contexts;   /* Over the list and index of contexts */
+    pthread_mutex_t shared;      /* Over everything else that isn't in a
+				    context */
+};
+
+struct s_OtrlUSLockContext {
+    pthread_mutex_t mutex;
+};
+
+static void init_recursive(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Make the given OtrlUserState safe to use from several threads, as
+ * described in uslock.h.  This also turns on the context index.  Call
+ * it before starting the other threads.  Returns
+ * gcry_error(GPG_ERR_NOT_SUPPORTED) if libotr was built without thread
+ * support. */
+gcry_error_t otrl_uslock_enable(OtrlUserState us)
+{
+    OtrlUSLock *lock;
+    ConnContext *context;
+    gcry_error_t err;
+
+    if (us->uslock) return gcry_error(GPG_ERR_EEXIST);
+
+    err = otrl_context_index_enable(us);
+    if (err) return err;
+
+    lock = malloc(sizeof(*lock));
+    if (!lock) return gcry_error(GPG_ERR_ENOMEM);
+    pthread_rwlock_init(&lock->contexts, NULL);
+    init_recursive(&lock->shared);
+    us->uslock = lock;
+
+    for (context = us->context_root; context; context = context->next) {
+	if (context->m_context == context) {
+	    err = otrl_uslock_context_new(context);
+	    if (err) {
+		otrl_uslock_disable(us);
+		return err;
+	    }
+	}
+    }
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Free the locks of the given OtrlUserState, once no other threads are
+ * using it.  otrl_userstate_free does this for you. */
+void otrl_uslock_disable(OtrlUserState us)
+{
+    OtrlUSLock *lock = us->uslock;
+    ConnContext *context;
+
+    if (!lock) return;
+
+    for (context = us->context_root; context; context = context->next) {
+	otrl_uslock_context_free(context);
+    }
+    pthread_mutex_destroy(&lock->shared);
+    pthread_rwlock_destroy(&lock->contexts);
+    free(lock);
+    us->uslock = NULL;
+}
+
+/* Lock and unlock the master context of the given context.  These do
+ * nothing if its userstate isn't locked. */
+void otrl_uslock_context_lock(ConnContext *context)
+{
+    OtrlUSLockContext *lock = context->m_context->context_priv->lock;
+
+    if (lock) pthread_mutex_lock(&lock->mutex);
+}
+
+void otrl_uslock_context_unlock(ConnContext *context)
+{
+    OtrlUSLockContext *lock = context->m_context->context_priv->lock;
+
+    if (lock) pthread_mutex_unlock(&lock->mutex);
+}
+
+/* Try to lock the master context of the given context, without
+ * waiting.  Returns 1 if it was locked (or its userstate isn't
+ * locked), and 0 if another thread holds it. */
+int otrl_uslock_context_trylock(ConnContext *context)
+{
+    OtrlUSLockContext *lock = context->m_context->context_priv->lock;
+
+    return !lock || pthread_mutex_trylock(&lock->mutex) == 0;
+}
+
+/* Give a new master context its lock, if its userstate is locked. */
+gcry_error_t otrl_uslock_context_new(ConnContext *context)
+{
+    OtrlUSLockContext *lock;
+
+    if (!context->context_priv->us || !context->context_priv->us->uslock) {
+	return gcry_error(GPG_ERR_NO_ERROR);
+    }
+
+    lock = malloc(sizeof(*lock));
+    if (!lock) return gcry_error(GPG_ERR_ENOMEM);
+    init_recursive(&lock->mutex);
+    context->context_priv->lock = lock;
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Free the lock of a master context that is being forgotten. */
+void otrl_uslock_context_free(ConnContext *context)
+{
+    OtrlUSLockContext *lock = context->context_priv->lock;
+
+    if (!lock) return;
+
+    pthread_mutex_destroy(&lock->mutex);
+    free(lock);
+    context->context_priv->lock = NULL;
+}
+
+/* Take the lock over the given OtrlUserState's list of contexts, for
+ * reading or for writing, and release it.  These do nothing if it isn't
+ * locked. */
+void otrl_uslock_contexts_read(OtrlUserState us)
+{
+    if (us->uslock) pthread_rwlock_rdlock(&us->uslock->contexts);
+}
+
+void otrl_uslock_contexts_write(OtrlUserState us)
+{
+    if (us->uslock) pthread_rwlock_wrlock(&us->uslock->contexts);
+}
+
+void otrl_uslock_contexts_done(OtrlUserState us)
+{
+    if (us->uslock) pthread_rwlock_unlock(&us->uslock->contexts);
+}
+
+/* Lock and unlock the rest of the given OtrlUserState.  These do
+ * nothing if it isn't locked. */
+void otrl_uslock_shared_lock(OtrlUserState us)
+{
+    if (us->uslock) pthread_mutex_lock(&us->uslock->shared);
+}
+
+void otrl_uslock_shared_unlock(OtrlUserState us)
+{
+    if (us->uslock) pthread_mutex_unlock(&us->uslock->shared);
+}
+
+#else  /* HAVE_PTHREAD_H */
+
+/* Without threads, a userstate is never locked. */
+
+gcry_error_t otrl_uslock_enable(OtrlUserState us)
+{
+    return gcry_error(GPG_ERR_NOT_SUPPORTED);
+}
+
+void otrl_uslock_disable(OtrlUserState us)
+{
+}
+
+void otrl_uslock_context_lock(ConnContext *context)
+{
+}
+
+void otrl_uslock_context_unlock(ConnContext *context)
+{
+}
+
+int otrl_uslock_context_trylock(ConnContext *context)
+{
+    return 1;
+}
+
+gcry_error_t otrl_uslock_context_new(ConnContext *context)
+{
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+void otrl_uslock_context_free(ConnContext *context)
+{
+}
+
+void otrl_uslock_contexts_read(OtrlUserState us)
+{
+}
+
+void otrl_uslock_contexts_write(OtrlUserState us)
+{
+}
+
+void otrl_uslock_contexts_done(OtrlUserState us)
+{
+}
+
+void otrl_uslock_shared_lock(OtrlUserState us)
+{
+}
+
+void otrl_uslock_shared_unlock(OtrlUserState us)
+{
+}
+
+#endif  /* HAVE_PTHREAD_H */
@@ -0,0 +1,109 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __USLOCK_H__
+#define __USLOCK_H__
+
+#include <gcrypt.h>
+
+#include "context.h"
+#include "userstate.h"
+
+/* Locking for using one OtrlUserState from several threads at once.
+ * Once otrl_uslock_enable has been called, otrl_message_sending,
+ * otrl_message_receiving (and their batch versions),
+ * otrl_message_ake_poll, otrl_message_poll and the otrl_message_disconnect
+ * functions may be called from any thread, for the same or different
+ * correspondents.
+ *
+ * Three kinds of lock are used:
+ *
+ * - A read-write lock over the list and index of contexts.  Looking up
+ *   a context takes it for reading; only adding or forgetting one takes
+ *   it for writing.
+ *
+ * - A mutex for each master context, held while handling a message to
+ *   or from that correspondent, which covers the master, its child
+ *   instances, and their fingerprints.  If you call any other function
+ *   that takes a ConnContext (to start SMP, set trust, and so on) from
+ *   a thread, hold that context's lock with otrl_uslock_context_lock
+ *   around it.
+ *
+ * - A mutex for the rest of the userstate (private keys, instance tags,
+ *   the fingerprint journal, the fragment memory totals and the timer),
+ *   held only briefly.
+ *
+ * Both mutexes are recursive, so the callbacks in your
+ * OtrlMessageAppOps may call back into libotr for the same
+ * correspondent.  They may be called from any of your threads,
+ * possibly at the same time for different correspondents.
+ * ops->create_privkey and ops->create_instag are called with no lock
+ * held, so they may be called for the same account from two threads
+ * at once; otrl_privkey_generate_start returns GPG_ERR_EEXIST for the
+ * second.  Reading,
+ * writing or forgetting private keys, instance tags, fingerprints or
+ * contexts as a whole (otrl_privkey_read, otrl_context_forget_all and
+ * so on) must still not be done while other threads are handling
+ * messages. */
+
+typedef struct s_OtrlUSLock OtrlUSLock;
+typedef struct s_OtrlUSLockContext OtrlUSLockContext;
+
+/* Make the given OtrlUserState safe to use from several threads, as
+ * described above.  This also turns on the context index.  Call it
+ * before starting the other threads.  Returns
+ * gcry_error(GPG_ERR_NOT_SUPPORTED) if libotr was built without thread
+ * support. */
+gcry_error_t otrl_uslock_enable(OtrlUserState us);
+
+/* Free the locks of the given OtrlUserState, once no other threads are
+ * using it.  otrl_userstate_free does this for you. */
+void otrl_uslock_disable(OtrlUserState us);
+
+/* Lock and unlock the master context of the given context.  These do
+ * nothing if its userstate isn't locked. */
+void otrl_uslock_context_lock(ConnContext *context);
+void otrl_uslock_context_unlock(ConnContext *context);
+
+/* Try to lock the master context of the given context, without
+ * waiting.  Returns 1 if it was locked (or its userstate isn't
+ * locked), and 0 if another thread holds it. */
+int otrl_uslock_context_trylock(ConnContext *context);
+
+/* Give a new master context its lock, if its userstate is locked. */
+gcry_error_t otrl_uslock_context_new(ConnContext *context);
+
+/* Free the lock of a master context that is being forgotten. */
+void otrl_uslock_context_free(ConnContext *context);
+
+/* Take the lock over the given OtrlUserState's list of contexts, for
+ * reading or for writing, and release it.  These do nothing if it isn't
+ * locked. */
+void otrl_uslock_contexts_read(OtrlUserState us);
+void otrl_uslock_contexts_write(OtrlUserState us);
+void otrl_uslock_contexts_done(OtrlUserState us);
+
+/* Lock and unlock the rest of the given OtrlUserState.  These do
+ * nothing if it isn't locked. */
+void otrl_uslock_shared_lock(OtrlUserState us);
+void otrl_uslock_shared_unlock(OtrlUserState us);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Time base64 encoding with otrl_base64_encode, and decoding of an OTR
+ * message body with otrl_base64_otr_body_decode, from 64 bytes to 1
+ * MiB, first with the scalar code (which is all there is before
+ * otrl_base64_init is called) and then with the kernels it chooses. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "b64.h"
+
+#include "testutil.h"
+
+#define MIN_SIZE 64
+#define MAX_SIZE (1024 * 1024)
+
+/* Encode or decode about this many bytes for each timing */
+#define BYTES_PER_TIMING (64 * 1024 * 1024)
+
+#define NUM_SIZES 8   /* MIN_SIZE to MAX_SIZE, by fours */
+
+/* Return the throughput in MB/s of encoding (or, if decoding is set,
+ * decoding) len bytes of data */
+static double time_size(const unsigned char *data, size_t len,
+	int decoding)
+{
+    size_t base64len = ((len + 2) / 3) * 4;
+    char *enc = malloc(base64len + 1);
+    unsigned char *dec = malloc(len);
+    unsigned long n, iterations = BYTES_PER_TIMING / len;
+    double start, elapsed;
+    size_t declen;
+
+    otrl_base64_encode(enc, data, len);
+    enc[base64len] = '.';
+
+    start = test_now();
+    for (n = 0; n < iterations; ++n) {
+	if (decoding) {
+	    if (otrl_base64_otr_body_decode(dec, len, &declen, enc,
+			base64len + 1, 0) || declen != len) {
+		fprintf(stderr, "decoding failed\n");
+		exit(1);
+	    }
+	} else {
+	    otrl_base64_encode(enc, data, len);
+	}
+    }
+    elapsed = test_now() - start;
+
+    free(enc);
+    free(dec);
+    return (double)len * iterations / elapsed / 1e6;
+}
+
+static void time_all(const unsigned char *data, double *enc, double *dec)
+{
+    size_t len;
+    int i;
+
+    for (i = 0, len = MIN_SIZE; len <= MAX_SIZE; ++i, len *= 4) {
+	enc[i] = time_size(data, len, 0);
+	dec[i] = time_size(data, len, 1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    double scalar_enc[NUM_SIZES], scalar_dec[NUM_SIZES];
+    double simd_enc[NUM_SIZES], simd_dec[NUM_SIZES];
+    unsigned char *data = malloc(MAX_SIZE);
+    size_t len;
+    int i;
+
+    for (len = 0; len < MAX_SIZE; ++len) {
+	data[len] = random() & 0xff;
+    }
+
+    /* The scalar code alone, then whatever kernels this CPU has */
+    time_all(data, scalar_enc, scalar_dec);
+    OTRL_INIT;
+    time_all(data, simd_enc, simd_dec);
+
+    printf("%10s %24s %24s\n", "", "encode (MB/s)", "decode (MB/s)");
+    printf("%10s %12s %11s %12s %11s\n", "bytes", "scalar", "kernels",
+	    "scalar", "kernels");
+    for (i = 0, len = MIN_SIZE; len <= MAX_SIZE; ++i, len *= 4) {
+	printf("%10lu %12.0f %11.0f %12.0f %11.0f\n", (unsigned long)len,
+		scalar_enc[i], simd_enc[i], scalar_dec[i], simd_dec[i]);
+    }
+
+    free(data);
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Count the heap allocations made by otrl_proto_create_data for each
+ * Data Message, and time it, for plaintexts of several sizes.  This is
+ * linked with --wrap for malloc, calloc, realloc and strdup (see the
+ * Makefile), so every allocation libotr makes is counted, including
+ * libgcrypt's, which libotr routes through its own allocator. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+#include "context.h"
+
+#include "testconv.h"
+
+#define ITERATIONS 20000
+
+static int counting = 0;
+static unsigned long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size)
+{
+    if (counting) allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    if (counting) allocations++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if (counting) allocations++;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+    if (counting) allocations++;
+    return __real_strdup(s);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 16, 256, 4096, 65536, 0 };
+    char peer[32];
+    OtrlUserState us;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    ConnContext *context;
+    int i;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    test_net_init(&net);
+    test_peer_name(peer, sizeof(peer), 0);
+    if (test_setup_accounts(us, 1) ||
+	    !test_start_otr(us, &ops, &net, TEST_ME, peer)) {
+	fprintf(stderr, "couldn't set up an OTR conversation\n");
+	return 1;
+    }
+    context = test_context(us, TEST_ME, peer);
+
+    printf("%10s %14s %14s\n", "bytes", "allocs/msg", "usecs/msg");
+    for (i = 0; sizes[i]; ++i) {
+	char *msg = malloc(sizes[i] + 1);
+	double start, elapsed;
+	unsigned long n;
+
+	memset(msg, 'a', sizes[i]);
+	msg[sizes[i]] = '\0';
+
+	/* The first message may still derive the session keys, or grow
+	 * the buffer kept for retransmission */
+	for (n = 0; n < 2; ++n) {
+	    char *encmsg;
+	    otrl_proto_create_data(&encmsg, context, msg, NULL, 0, NULL);
+	    free(encmsg);
+	}
+
+	allocations = 0;
+	start = test_now();
+	for (n = 0; n < ITERATIONS; ++n) {
+	    char *encmsg = NULL;
+
+	    counting = 1;
+	    if (otrl_proto_create_data(&encmsg, context, msg, NULL, 0,
+			NULL)) {
+		fprintf(stderr, "otrl_proto_create_data failed\n");
+		return 1;
+	    }
+	    counting = 0;
+	    free(encmsg);
+	}
+	elapsed = test_now() - start;
+
+	printf("%10lu %14.2f %14.2f\n", (unsigned long)sizes[i],
+		(double)allocations / ITERATIONS, elapsed * 1e6 / ITERATIONS);
+	free(msg);
+    }
+
+    otrl_userstate_free(us);
+    return 0;
+}
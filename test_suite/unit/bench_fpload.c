@@ -0,0 +1,150 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Time loading fingerprint stores of increasing size with the
+ * original line-at-a-time reader, with and without the context index,
+ * and with the bulk reader.  The line-at-a-time reader with the index
+ * is also timed on a store in sorted order, as libotr writes it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "privkey.h"
+#include "context.h"
+#include "userstate.h"
+
+#include "testutil.h"
+
+/* Beyond this many contexts, the line-at-a-time reader takes too long
+ * to be worth waiting for on an unsorted store: with or without the
+ * index, it walks the sorted context list to find where each new
+ * context goes. */
+#define MAX_LINEWISE 20000
+
+static void write_store(const char *filename, unsigned int n, int sorted)
+{
+    FILE *f = fopen(filename, "w");
+    unsigned int i, j;
+
+    if (!f) {
+	perror(filename);
+	exit(1);
+    }
+    /* Unless sorted is set, in no particular order, as a store written
+     * by an older libotr that has been appended to may be */
+    for (i = 0; i < n; ++i) {
+	fprintf(f, "buddy%08u\totrtest1\t%s\t",
+		sorted ? i : (unsigned int)((i * 7919ULL) % n), TEST_PROTOCOL);
+	for (j = 0; j < 20; ++j) {
+	    fprintf(f, "%02x", (unsigned int)random() & 0xff);
+	}
+	fprintf(f, "\t%s\n", i % 3 ? "" : "verified");
+    }
+    fclose(f);
+}
+
+static unsigned int count_masters(OtrlUserState us)
+{
+    ConnContext *context;
+    unsigned int n = 0;
+
+    for (context = us->context_root; context; context = context->next) {
+	n++;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int sizes[] = { 1000, 10000, 100000, 1000000,
+	0 };
+    char filename[1024];
+    int i;
+
+    OTRL_INIT;
+    test_tmpname(filename, sizeof(filename), "fingerprints");
+
+    printf("%10s %14s %14s %14s %14s\n", "contexts", "plain (s)",
+	    "indexed (s)", "idx+sorted (s)", "bulk (s)");
+    for (i = 0; sizes[i]; ++i) {
+	unsigned int n = sizes[i];
+	OtrlUserState us;
+	OtrlFingerprintLoadStats stats;
+	double start, plain = -1, indexed = -1, sorted, bulk;
+
+	write_store(filename, n, 1);
+	us = otrl_userstate_create();
+	otrl_context_index_enable(us);
+	start = test_now();
+	otrl_privkey_read_fingerprints(us, filename, NULL, NULL);
+	sorted = test_now() - start;
+	if (count_masters(us) != n) {
+	    fprintf(stderr, "indexed reader lost contexts\n");
+	    return 1;
+	}
+	otrl_userstate_free(us);
+
+	write_store(filename, n, 0);
+
+	if (n <= MAX_LINEWISE) {
+	    us = otrl_userstate_create();
+	    start = test_now();
+	    otrl_privkey_read_fingerprints(us, filename, NULL, NULL);
+	    plain = test_now() - start;
+	    if (count_masters(us) != n) {
+		fprintf(stderr, "plain reader lost contexts\n");
+		return 1;
+	    }
+	    otrl_userstate_free(us);
+
+	    us = otrl_userstate_create();
+	    otrl_context_index_enable(us);
+	    start = test_now();
+	    otrl_privkey_read_fingerprints(us, filename, NULL, NULL);
+	    indexed = test_now() - start;
+	    otrl_userstate_free(us);
+	}
+
+	us = otrl_userstate_create();
+	start = test_now();
+	otrl_privkey_read_fingerprints_bulk(us, filename, NULL, NULL, &stats);
+	bulk = test_now() - start;
+	if (count_masters(us) != n || stats.fingerprints != n) {
+	    fprintf(stderr, "bulk reader lost contexts\n");
+	    return 1;
+	}
+	otrl_userstate_free(us);
+
+	if (plain >= 0 && indexed >= 0) {
+	    printf("%10u %14.3f %14.3f %14.3f %14.3f\n", n, plain, indexed,
+		    sorted, bulk);
+	} else {
+	    printf("%10u %14s %14s %14.3f %14.3f\n", n, "-", "-", sorted,
+		    bulk);
+	}
+	printf("%10s bulk: read %.3f, sort %.3f, build %.3f\n", "",
+		stats.read_usecs / 1e6, stats.sort_usecs / 1e6,
+		stats.build_usecs / 1e6);
+    }
+
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Time receiving a mixed batch of messages with
+ * otrl_message_receiving_batch, and with otrl_message_receiving called
+ * on each in turn.  Each batch comes from some number of correspondents
+ * in an encrypted conversation with TEST_ME, interleaved, and one
+ * message in four is plaintext.  Data Messages can't be received twice,
+ * so each timing gets a freshly sent batch. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testconv.h"
+
+#define BATCH_SIZE 256
+#define ROUNDS 40
+
+/* The most correspondents in a batch */
+#define MAX_PEERS 64
+
+/* Have the first numpeers correspondents send TEST_ME a batch of
+ * BATCH_SIZE messages, and fill in items with them */
+static void make_batch(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, unsigned int numpeers, OtrlMessageReceived *items,
+	TestMsg **msgs)
+{
+    char peer[32], text[64];
+    unsigned int i;
+
+    for (i = 0; i < BATCH_SIZE; ++i) {
+	test_peer_name(peer, sizeof(peer), i % numpeers);
+	snprintf(text, sizeof(text), "message %u of the batch", i);
+	if (i % 4 == 3) {
+	    test_net_push(net, peer, TEST_ME, text);
+	} else if (test_send(us, ops, net, peer, TEST_ME, text)) {
+	    fprintf(stderr, "couldn't send from %s\n", peer);
+	    exit(1);
+	}
+	msgs[i] = test_net_pop(net);
+	memset(&items[i], 0, sizeof(items[i]));
+	items[i].accountname = msgs[i]->to;
+	items[i].protocol = TEST_PROTOCOL;
+	items[i].sender = msgs[i]->from;
+	items[i].message = msgs[i]->msg;
+    }
+}
+
+/* Check that every message in the batch came out as it went in, and
+ * free it.  Also drop anything TEST_ME sent back, such as heartbeats. */
+static void finish_batch(TestNet *net, OtrlMessageReceived *items,
+	TestMsg **msgs)
+{
+    char text[64];
+    TestMsg *m;
+    unsigned int i;
+
+    for (i = 0; i < BATCH_SIZE; ++i) {
+	const char *got = items[i].newmessage ? items[i].newmessage :
+	    items[i].message;
+
+	snprintf(text, sizeof(text), "message %u of the batch", i);
+	if (items[i].ignore || strcmp(got, text)) {
+	    fprintf(stderr, "message %u was not received\n", i);
+	    exit(1);
+	}
+	otrl_message_free(items[i].newmessage);
+	otrl_tlv_free(items[i].tlvs);
+	test_msg_free(msgs[i]);
+    }
+    while ((m = test_net_pop(net)) != NULL) {
+	test_msg_free(m);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int numpeers[] = { 1, 8, 64, 0 };
+    OtrlMessageReceived items[BATCH_SIZE];
+    TestMsg *msgs[BATCH_SIZE];
+    OtrlUserState us;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    char peer[32];
+    unsigned int i, p, round;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    test_net_init(&net);
+    if (test_setup_accounts(us, MAX_PEERS)) {
+	fprintf(stderr, "couldn't set up the accounts\n");
+	return 1;
+    }
+    for (p = 0; p < MAX_PEERS; ++p) {
+	test_peer_name(peer, sizeof(peer), p);
+	if (!test_start_otr(us, &ops, &net, TEST_ME, peer)) {
+	    fprintf(stderr, "couldn't start OTR with %s\n", peer);
+	    return 1;
+	}
+    }
+
+    printf("%10s %14s %14s\n", "", "loop", "batch");
+    printf("%10s %14s %14s\n", "peers", "(usecs/msg)", "(usecs/msg)");
+    for (i = 0; numpeers[i]; ++i) {
+	double looptime = 0, batchtime = 0, start;
+
+	for (round = 0; round < ROUNDS; ++round) {
+	    unsigned int j;
+
+	    make_batch(us, &ops, &net, numpeers[i], items, msgs);
+	    start = test_now();
+	    for (j = 0; j < BATCH_SIZE; ++j) {
+		items[j].ignore = otrl_message_receiving(us, &ops, &net,
+			items[j].accountname, items[j].protocol,
+			items[j].sender, items[j].message,
+			&items[j].newmessage, &items[j].tlvs,
+			&items[j].context, NULL, NULL);
+	    }
+	    looptime += test_now() - start;
+	    finish_batch(&net, items, msgs);
+
+	    make_batch(us, &ops, &net, numpeers[i], items, msgs);
+	    start = test_now();
+	    otrl_message_receiving_batch(us, &ops, &net, items, BATCH_SIZE,
+		    NULL, NULL);
+	    batchtime += test_now() - start;
+	    finish_batch(&net, items, msgs);
+	}
+
+	printf("%10u %14.2f %14.2f\n", numpeers[i],
+		looptime * 1e6 / (ROUNDS * BATCH_SIZE),
+		batchtime * 1e6 / (ROUNDS * BATCH_SIZE));
+    }
+
+    otrl_userstate_free(us);
+    return 0;
+}
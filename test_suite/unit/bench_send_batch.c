@@ -0,0 +1,163 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Time sending a batch of messages with otrl_message_sending_batch,
+ * and with otrl_message_sending called on each in turn: one message
+ * to each of many correspondents, as an announcement would be, and
+ * many messages to one.  Each is timed with and without the userstate
+ * lock.  The messages are not fragmented or injected; after each
+ * timing they are all received and checked, untimed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uslock.h"
+
+#include "testconv.h"
+
+#define BATCH_SIZE 64
+#define ROUNDS 200
+
+/* The correspondents each message of the batch goes to */
+typedef enum { TO_EACH, TO_ONE } Recipients;
+
+static void make_batch(OtrlMessageToSend *items, char names[][32],
+	char texts[][64], Recipients to)
+{
+    unsigned int i;
+
+    for (i = 0; i < BATCH_SIZE; ++i) {
+	memset(&items[i], 0, sizeof(items[i]));
+	items[i].accountname = TEST_ME;
+	items[i].protocol = TEST_PROTOCOL;
+	items[i].recipient = names[to == TO_EACH ? i : 0];
+	items[i].instag = OTRL_INSTAG_BEST;
+	items[i].message = texts[i];
+    }
+}
+
+/* Receive each message of the batch, check it, and free it */
+static void finish_batch(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, OtrlMessageToSend *items)
+{
+    TestMsg m;
+    char *text;
+    TestMsg *reply;
+    unsigned int i;
+
+    for (i = 0; i < BATCH_SIZE; ++i) {
+	if (items[i].err || !items[i].newmessage) {
+	    fprintf(stderr, "message %u was not sent\n", i);
+	    exit(1);
+	}
+	m.from = (char *)items[i].accountname;
+	m.to = (char *)items[i].recipient;
+	m.msg = items[i].newmessage;
+	if (!test_receive(us, ops, net, &m, &text) ||
+		strcmp(text, items[i].message)) {
+	    fprintf(stderr, "message %u was not received\n", i);
+	    exit(1);
+	}
+	free(text);
+	otrl_message_free(items[i].newmessage);
+    }
+    /* Drop any heartbeats sent back */
+    while ((reply = test_net_pop(net)) != NULL) {
+	test_msg_free(reply);
+    }
+}
+
+static void time_batches(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, char names[][32], char texts[][64], Recipients to,
+	const char *label)
+{
+    OtrlMessageToSend items[BATCH_SIZE];
+    double looptime = 0, batchtime = 0, start;
+    unsigned int i, round;
+
+    /* The first round derives the session keys, so isn't timed */
+    for (round = 0; round <= ROUNDS; ++round) {
+	if (round == 1) looptime = batchtime = 0;
+	make_batch(items, names, texts, to);
+	start = test_now();
+	for (i = 0; i < BATCH_SIZE; ++i) {
+	    items[i].err = otrl_message_sending(us, ops, net,
+		    items[i].accountname, items[i].protocol,
+		    items[i].recipient, items[i].instag, items[i].message,
+		    items[i].tlvs, &items[i].newmessage,
+		    OTRL_FRAGMENT_SEND_SKIP, &items[i].context, NULL, NULL);
+	}
+	looptime += test_now() - start;
+	finish_batch(us, ops, net, items);
+
+	make_batch(items, names, texts, to);
+	start = test_now();
+	otrl_message_sending_batch(us, ops, net, items, BATCH_SIZE,
+		OTRL_FRAGMENT_SEND_SKIP, NULL, NULL);
+	batchtime += test_now() - start;
+	finish_batch(us, ops, net, items);
+    }
+
+    printf("%-24s %14.2f %14.2f\n", label,
+	    looptime * 1e6 / (ROUNDS * BATCH_SIZE),
+	    batchtime * 1e6 / (ROUNDS * BATCH_SIZE));
+}
+
+int main(int argc, char **argv)
+{
+    static char names[BATCH_SIZE][32], texts[BATCH_SIZE][64];
+    OtrlUserState us;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    unsigned int i;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    test_net_init(&net);
+    /* Locking the userstate turns the context index on, so have it
+     * from the start, to compare like with like */
+    otrl_context_index_enable(us);
+    if (test_setup_accounts(us, BATCH_SIZE)) {
+	fprintf(stderr, "couldn't set up the accounts\n");
+	return 1;
+    }
+    for (i = 0; i < BATCH_SIZE; ++i) {
+	test_peer_name(names[i], sizeof(names[i]), i);
+	snprintf(texts[i], sizeof(texts[i]), "message %u of the batch", i);
+	if (!test_start_otr(us, &ops, &net, TEST_ME, names[i])) {
+	    fprintf(stderr, "couldn't start OTR with %s\n", names[i]);
+	    return 1;
+	}
+    }
+
+    printf("%-24s %14s %14s\n", "", "loop", "batch");
+    printf("%-24s %14s %14s\n", "recipients", "(usecs/msg)", "(usecs/msg)");
+    time_batches(us, &ops, &net, names, texts, TO_EACH, "each");
+    time_batches(us, &ops, &net, names, texts, TO_ONE, "one");
+    if (otrl_uslock_enable(us) == 0) {
+	time_batches(us, &ops, &net, names, texts, TO_EACH, "each, locked");
+	time_batches(us, &ops, &net, names, texts, TO_ONE, "one, locked");
+    }
+
+    otrl_userstate_free(us);
+    return 0;
+}
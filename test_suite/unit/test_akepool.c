@@ -0,0 +1,163 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Run AKEs through the AKE pool: one to the end, one whose context is
+ * forgotten while its D-H Key Message is in the pool, and one whose
+ * private key is forgotten meanwhile, which the job must still be able
+ * to sign with. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "akepool.h"
+#include "auth.h"
+#include "context.h"
+
+#include "testconv.h"
+
+/* Finish the AKE pool's work on the given master's AKE, handing back
+ * the messages held behind it */
+static void wait_for_pool(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, ConnContext *master)
+{
+    OtrlMessageReceived *held;
+    size_t numheld;
+
+    while (master->context_priv->ake_job) {
+	otrl_message_ake_poll(us, ops, net, &held, &numheld);
+	otrl_message_ake_held_free(held, numheld);
+	if (master->context_priv->ake_job) usleep(1000);
+    }
+}
+
+/* Deliver messages until one of them is handed to the pool, and
+ * return the master context whose job it is, or NULL if the network
+ * emptied first. */
+static ConnContext *deliver_until_pooled(OtrlUserState us,
+	const OtrlMessageAppOps *ops, TestNet *net)
+{
+    TestMsg *m;
+
+    while ((m = test_net_pop(net)) != NULL) {
+	ConnContext *master;
+
+	test_receive(us, ops, net, m, NULL);
+	master = otrl_context_find(us, m->from, m->to, TEST_PROTOCOL,
+		OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+	test_msg_free(m);
+	if (master && master->context_priv->ake_job) return master;
+    }
+    return NULL;
+}
+
+/* Count the messages on the network, and point *lastp at the newest */
+static unsigned int net_count(TestNet *net, TestMsg **lastp)
+{
+    TestMsg *m;
+    unsigned int n = 0;
+
+    if (lastp) *lastp = NULL;
+    for (m = net->head; m; m = m->next) {
+	if (lastp) *lastp = m;
+	n++;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    ConnContext *master;
+    TestMsg *m;
+    char peer[32];
+    unsigned int before;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    test_net_init(&net);
+    if (test_setup_accounts(us, 3) ||
+	    otrl_akepool_enable(us, 2, NULL, NULL)) {
+	fprintf(stderr, "Can't set up the userstate\n");
+	return 1;
+    }
+    CHECK(otrl_akepool_enable(us, 1, NULL, NULL) ==
+	    gcry_error(GPG_ERR_EEXIST));
+    alarm(60);
+
+    /* A whole AKE, every expensive step of it in the pool */
+    test_peer_name(peer, sizeof(peer), 0);
+    test_net_push(&net, TEST_ME, peer, "?OTRv3?");
+    while ((master = deliver_until_pooled(us, &ops, &net)) != NULL) {
+	wait_for_pool(us, &ops, &net, master);
+    }
+    CHECK(test_encrypted(us, TEST_ME, peer));
+
+    /* The correspondent is forgotten while its AKE is in the pool; the
+     * job is dropped, and nothing more is sent */
+    test_peer_name(peer, sizeof(peer), 1);
+    test_net_push(&net, TEST_ME, peer, "?OTRv3?");
+    master = deliver_until_pooled(us, &ops, &net);
+    CHECK(master != NULL);
+    if (master) {
+	OtrlMessageReceived *held;
+	size_t numheld;
+	unsigned int i;
+
+	before = net_count(&net, NULL);
+	otrl_context_force_plaintext(master);
+	CHECK(otrl_context_forget(master) == 0);
+	for (i = 0; i < 100; ++i) {
+	    otrl_message_ake_poll(us, &ops, &net, &held, &numheld);
+	    CHECK(numheld == 0);
+	    otrl_message_ake_held_free(held, numheld);
+	    usleep(1000);
+	}
+	CHECK(net_count(&net, NULL) == before);
+    }
+    while ((m = test_net_pop(&net)) != NULL) test_msg_free(m);
+
+    /* The private keys are forgotten while a job that signs is in the
+     * pool; it has its own copy, so it still sends its Reveal Signature
+     * Message */
+    test_peer_name(peer, sizeof(peer), 2);
+    test_net_push(&net, TEST_ME, peer, "?OTRv3?");
+    master = deliver_until_pooled(us, &ops, &net);
+    CHECK(master != NULL);
+    if (master) {
+	CHECK(master->context_priv->ake_job->msgtype ==
+		OTRL_MSGTYPE_DH_KEY);
+	before = net_count(&net, NULL);
+	otrl_privkey_forget_all(us);
+	wait_for_pool(us, &ops, &net, master);
+	CHECK(net_count(&net, &m) == before + 1);
+	CHECK(m && !strncmp(m->msg, "?OTR:AAMR", 9));
+    }
+    while ((m = test_net_pop(&net)) != NULL) test_msg_free(m);
+
+    otrl_akepool_disable(us);
+    otrl_akepool_disable(us);
+    otrl_userstate_free(us);
+    return test_done();
+}
@@ -0,0 +1,263 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that the SIMD base64 kernels otrl_base64_init chooses give
+ * exactly the results of the scalar code.  Until otrl_base64_init is
+ * called, only the scalar code is used, so every case is run once
+ * before OTRL_INIT, recording its results, and once after, comparing
+ * them.  The cases are random data, their encodings with characters
+ * changed or broken into lines, and encoding in place as
+ * otrl_proto_create_data does.  On a CPU with no SIMD kernels, both
+ * runs are of the scalar code. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "b64.h"
+
+#include "testutil.h"
+
+#define NUM_CASES 3000
+#define MAX_CASE_LEN 700
+
+/* A few cases are this long, to run the kernels for a while */
+static const size_t long_lens[] = { 4095, 4096, 65536, 65537, 0 };
+
+/* Characters to corrupt encodings with: padding, the OTR terminator,
+ * whitespace, and characters just outside the base64 alphabet */
+static const char corruptions[] = "==..  \n\t$*,-:;@[]^_`{|}~\x80\xff";
+
+typedef struct {
+    long ret;
+    size_t len;
+    unsigned long long hash;
+} Result;
+
+static Result *results = NULL;
+static size_t numresults = 0, resultssize = 0, nextresult = 0;
+static int comparing = 0;
+
+/* The same sequence of pseudo-random numbers in each run */
+static unsigned long long rnd_state;
+
+static unsigned int rnd(void)
+{
+    rnd_state = rnd_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)(rnd_state >> 33);
+}
+
+static unsigned long long fnv(const unsigned char *data, size_t len)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+	h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Record a result in the first run, and compare it in the second */
+static void result(const char *what, unsigned int casenum, long ret,
+	const void *out, size_t len)
+{
+    Result r;
+
+    r.ret = ret;
+    r.len = len;
+    r.hash = fnv(out, len);
+    if (!comparing) {
+	if (numresults == resultssize) {
+	    resultssize = resultssize ? 2 * resultssize : 1024;
+	    results = realloc(results, resultssize * sizeof(Result));
+	}
+	results[numresults++] = r;
+	return;
+    }
+    if (nextresult >= numresults) {
+	fprintf(stderr, "case %u: %s: more results than before\n",
+		casenum, what);
+	test_failures++;
+	return;
+    }
+    if (results[nextresult].ret != r.ret || results[nextresult].len != r.len
+	    || results[nextresult].hash != r.hash) {
+	fprintf(stderr, "case %u: %s differs from the scalar code "
+		"(returned %ld, %lu bytes; was %ld, %lu bytes)\n", casenum,
+		what, r.ret, (unsigned long)r.len, results[nextresult].ret,
+		(unsigned long)results[nextresult].len);
+	test_failures++;
+    }
+    nextresult++;
+}
+
+/* Known answers from RFC 4648 */
+static void run_vectors(void)
+{
+    static const char *plain[] = { "", "f", "fo", "foo", "foob", "fooba",
+	"foobar", NULL };
+    static const char *encoded[] = { "", "Zg==", "Zm8=", "Zm9v",
+	"Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy", NULL };
+    static const char *spaced[] = { "Zm9v\r\nYg=\n= .", " Zm9v\tYmE=\r\n",
+	"Zm9v,Yg==." };
+    char enc[16];
+    unsigned char dec[16];
+    size_t len;
+    int i;
+
+    for (i = 0; plain[i]; ++i) {
+	len = otrl_base64_encode(enc, (const unsigned char *)plain[i],
+		strlen(plain[i]));
+	CHECK(len == strlen(encoded[i]) && !memcmp(enc, encoded[i], len));
+	len = otrl_base64_decode(dec, encoded[i], strlen(encoded[i]));
+	CHECK(len == strlen(plain[i]) && !memcmp(dec, plain[i], len));
+    }
+
+    /* Whitespace is skipped anywhere in an OTR message body, even in
+     * its padding, but nothing else is */
+    CHECK(otrl_base64_otr_body_decode(dec, sizeof(dec), &len, spaced[0],
+		strlen(spaced[0]), 0) == 0);
+    CHECK(len == 4 && !memcmp(dec, "foob", 4));
+    CHECK(otrl_base64_otr_body_decode(dec, sizeof(dec), &len, spaced[1],
+		strlen(spaced[1]), 1) == 0);
+    CHECK(len == 5 && !memcmp(dec, "fooba", 5));
+    CHECK(otrl_base64_otr_body_decode(dec, sizeof(dec), &len, spaced[2],
+		strlen(spaced[2]), 0) == -2);
+}
+
+static void run_case(unsigned int casenum, size_t len)
+{
+    size_t base64len = ((len + 2) / 3) * 4;
+    size_t maxdecoded = OTRL_B64_MAX_DECODED_SIZE(base64len + 1);
+    unsigned int offset = rnd() % 16;
+    unsigned char *data = malloc(len + 16);
+    char *enc = malloc(base64len + 1 + 16);
+    char *bad = malloc(base64len + 1);
+    unsigned char *dec = malloc(maxdecoded + 1);
+    unsigned char *inplace;
+    char *wrapped;
+    size_t i, outlen, declen, datasize, linelen;
+    unsigned int changes;
+    int ret;
+
+    for (i = 0; i < len; ++i) {
+	data[offset + i] = rnd() & 0xff;
+    }
+
+    /* Encode, from and to unaligned buffers */
+    outlen = otrl_base64_encode(enc + offset, data + offset, len);
+    CHECK(outlen == base64len);
+    result("encode", casenum, 0, enc + offset, outlen);
+    memmove(enc, enc + offset, base64len);
+    enc[base64len] = '.';
+
+    /* Encode in place, as otrl_proto_create_data lays out its buffer:
+     * "?OTR:", the encoding, "." and NUL, with the binary message
+     * right at the end */
+    outlen = 5 + base64len + 1 + 1;
+    inplace = malloc(outlen);
+    memmove(inplace + outlen - len, data + offset, len);
+    otrl_base64_encode((char *)inplace + 5, inplace + outlen - len, len);
+    CHECK(!memcmp(inplace + 5, enc, base64len));
+    free(inplace);
+
+    /* Decode it again, both ways */
+    declen = otrl_base64_decode(dec, enc, base64len);
+    CHECK(declen == len && !memcmp(dec, data + offset, len));
+    ret = otrl_base64_otr_body_decode(dec, maxdecoded, &declen, enc,
+	    base64len + 1, 0);
+    CHECK(ret == 0 && declen == len && !memcmp(dec, data + offset, len));
+
+    /* Break it into lines, as some networks do, and decode that */
+    linelen = 1 + rnd() % 80;
+    wrapped = malloc(base64len + 2 * (base64len / linelen) + 1);
+    for (i = 0, outlen = 0; i <= base64len; ++i) {
+	if (i > 0 && i % linelen == 0) {
+	    wrapped[outlen++] = '\r';
+	    wrapped[outlen++] = '\n';
+	}
+	wrapped[outlen++] = enc[i];
+    }
+    ret = otrl_base64_otr_body_decode(dec, maxdecoded, &declen, wrapped,
+	    outlen, 0);
+    CHECK(ret == 0 && declen == len && !memcmp(dec, data + offset, len));
+    result("wrapped body decode", casenum, ret, dec, ret == 0 ? declen : 0);
+    free(wrapped);
+
+    /* Now change a few characters, or cut it short, and decode that */
+    memmove(bad, enc, base64len + 1);
+    changes = rnd() % 4;
+    for (i = 0; i < changes && base64len > 0; ++i) {
+	size_t pos = rnd() % base64len;
+	bad[pos] = rnd() % 2 ? corruptions[rnd() % (sizeof(corruptions) - 1)]
+	    : (char)(rnd() & 0xff);
+    }
+    outlen = base64len + 1;
+    if (rnd() % 4 == 0) outlen = rnd() % (base64len + 2);
+
+    declen = otrl_base64_decode(dec, bad, outlen);
+    result("decode", casenum, 0, dec, declen);
+
+    ret = otrl_base64_otr_body_decode(dec, maxdecoded, &declen, bad,
+	    outlen, rnd() % 2);
+    result("body decode", casenum, ret, dec, ret == 0 ? declen : 0);
+
+    /* And into a buffer which may be too small */
+    datasize = rnd() % (maxdecoded + 1);
+    ret = otrl_base64_otr_body_decode(dec, datasize, &declen, bad, outlen,
+	    1);
+    CHECK(ret != 0 || declen <= datasize);
+    result("short body decode", casenum, ret, dec, ret == 0 ? declen : 0);
+
+    free(data);
+    free(enc);
+    free(bad);
+    free(dec);
+}
+
+static void run_cases(void)
+{
+    unsigned int i;
+
+    rnd_state = 1;
+    run_vectors();
+    for (i = 0; i < NUM_CASES; ++i) {
+	run_case(i, i < MAX_CASE_LEN ? i : rnd() % MAX_CASE_LEN);
+    }
+    for (i = 0; long_lens[i]; ++i) {
+	run_case(NUM_CASES + i, long_lens[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    /* The scalar code alone */
+    run_cases();
+
+    /* And with whatever kernels this CPU has */
+    OTRL_INIT;
+    comparing = 1;
+    run_cases();
+    CHECK(nextresult == numresults);
+
+    free(results);
+    return test_done();
+}
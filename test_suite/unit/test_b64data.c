@@ -0,0 +1,194 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Send Data Messages of every length up to a few of the kernels' blocks
+ * long, and of lengths around the size of the receive scratch buffer,
+ * through otrl_proto_create_data and otrl_proto_accept_data with each
+ * set of base64 kernels this CPU has, and check that they arrive as
+ * they were sent, also when the network breaks them into lines.  Then
+ * check that each kernel's Data Messages are the same as the scalar
+ * code's, for the same keys and counter. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "b64.h"
+#include "context_priv.h"
+
+#include "testconv.h"
+
+#define MAX_SHORT_LEN 300
+#define LONG_SLACK 100
+#define LINE_LEN 60
+
+static const struct {
+    OtrlBase64Kernels kernels;
+    const char *name;
+} kernels[] = {
+    { OTRL_B64_KERNELS_SCALAR, "scalar" },
+    { OTRL_B64_KERNELS_SSSE3, "SSSE3" },
+    { OTRL_B64_KERNELS_AVX2, "AVX2" },
+    { OTRL_B64_KERNELS_NEON, "NEON" },
+};
+
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/* The name of the kernels being tried, for reporting failures */
+static const char *kernels_name;
+
+/* Break the message into lines of LINE_LEN characters, with "\r\n" */
+static void wrap(TestMsg *m)
+{
+    size_t len = strlen(m->msg), i, j;
+    char *wrapped = malloc(len + 2 * (len / LINE_LEN) + 1);
+
+    if (!wrapped) return;
+    for (i = 0, j = 0; i < len; ++i) {
+	if (i > 0 && i % LINE_LEN == 0) {
+	    wrapped[j++] = '\r';
+	    wrapped[j++] = '\n';
+	}
+	wrapped[j++] = m->msg[i];
+    }
+    wrapped[j] = '\0';
+    free(m->msg);
+    m->msg = wrapped;
+}
+
+/* Send a message of the given length from a to b, and check it comes
+ * out the same, broken into lines on the way if wrapped is set */
+static void round_trip(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, const char *a, const char *b, size_t len,
+	int wrapped)
+{
+    char *msg = malloc(len + 1), *text = NULL;
+    TestMsg *m;
+    size_t i;
+
+    if (!msg) return;
+    for (i = 0; i < len; ++i) {
+	msg[i] = 'a' + (i % 26);
+    }
+    msg[len] = '\0';
+
+    CHECK(test_send(us, ops, net, a, b, msg) == 0);
+    m = test_net_pop(net);
+    CHECK(m != NULL);
+    if (m) {
+	CHECK(!strncmp(m->msg, "?OTR:", 5));
+	if (wrapped) wrap(m);
+	CHECK(test_receive(us, ops, net, m, &text));
+	CHECK(text && !strcmp(text, msg));
+	if (!text || strcmp(text, msg)) {
+	    fprintf(stderr, "  %s kernels, length %lu\n", kernels_name,
+		    (unsigned long)len);
+	}
+	free(text);
+	test_msg_free(m);
+    }
+    free(msg);
+}
+
+/* Make a Data Message of the given length with the context's current
+ * keys and counter, leaving the counter as it was */
+static char *make_data(ConnContext *context, size_t len)
+{
+    unsigned char ctr[8];
+    char *msg = malloc(len + 1), *encoded = NULL;
+
+    if (!msg) return NULL;
+    memset(msg, 'x', len);
+    msg[len] = '\0';
+    memmove(ctr, context->context_priv->sesskeys[1][0].sendctr, 8);
+    CHECK(otrl_proto_create_data(&encoded, context, msg, NULL, 0,
+		NULL) == 0);
+    memmove(context->context_priv->sesskeys[1][0].sendctr, ctr, 8);
+    free(msg);
+    return encoded;
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    ConnContext *mine;
+    char peer[32];
+    char *scalar[2];
+    unsigned int k, tried = 0;
+    size_t len;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    test_net_init(&net);
+    test_peer_name(peer, sizeof(peer), 0);
+    if (test_setup_accounts(us, 1) ||
+	    !test_start_otr(us, &ops, &net, TEST_ME, peer)) {
+	fprintf(stderr, "Can't start the conversation\n");
+	return 1;
+    }
+
+    for (k = 0; k < NUM_KERNELS; ++k) {
+	if (otrl_base64_use_kernels(kernels[k].kernels)) continue;
+	tried++;
+	kernels_name = kernels[k].name;
+	for (len = 1; len <= MAX_SHORT_LEN; ++len) {
+	    round_trip(us, &ops, &net, TEST_ME, peer, len, 0);
+	    round_trip(us, &ops, &net, peer, TEST_ME, len, len % 2);
+	}
+	for (len = OTRL_RECV_SCRATCH_BYTES - LONG_SLACK;
+		len <= OTRL_RECV_SCRATCH_BYTES + LONG_SLACK; ++len) {
+	    round_trip(us, &ops, &net, TEST_ME, peer, len, len % 2);
+	}
+    }
+    CHECK(tried > 0);
+
+    /* The kernels encode exactly as the scalar code does */
+    mine = test_context(us, TEST_ME, peer);
+    CHECK(mine != NULL);
+    if (mine) {
+	otrl_base64_use_kernels(OTRL_B64_KERNELS_SCALAR);
+	scalar[0] = make_data(mine, MAX_SHORT_LEN);
+	scalar[1] = make_data(mine, OTRL_RECV_SCRATCH_BYTES);
+	for (k = 1; k < NUM_KERNELS; ++k) {
+	    char *short_msg, *long_msg;
+	    int same;
+
+	    if (otrl_base64_use_kernels(kernels[k].kernels)) continue;
+	    kernels_name = kernels[k].name;
+	    short_msg = make_data(mine, MAX_SHORT_LEN);
+	    long_msg = make_data(mine, OTRL_RECV_SCRATCH_BYTES);
+	    same = scalar[0] && short_msg && !strcmp(scalar[0], short_msg) &&
+		scalar[1] && long_msg && !strcmp(scalar[1], long_msg);
+	    CHECK(same);
+	    if (!same) fprintf(stderr, "  %s kernels\n", kernels_name);
+	    free(short_msg);
+	    free(long_msg);
+	}
+	free(scalar[0]);
+	free(scalar[1]);
+    }
+
+    otrl_base64_init();
+    otrl_userstate_free(us);
+    return test_done();
+}
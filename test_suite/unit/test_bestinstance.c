@@ -0,0 +1,140 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that the cached answer to OTRL_INSTAG_BEST lookups follows
+ * changes to the msgstate, trust and time of last received message of
+ * each instance. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "context.h"
+#include "userstate.h"
+
+#include "testutil.h"
+
+#define NUM_INSTANCES 3
+
+static ConnContext *find(OtrlUserState us, otrl_instag_t instag)
+{
+    return otrl_context_find(us, "buddy", "otrtest1", TEST_PROTOCOL,
+	    instag, 1, NULL, NULL, NULL);
+}
+
+/* Receive a message on the given instance at the given time, as
+ * otrl_message_receiving records it */
+static void receive(ConnContext *context, time_t when)
+{
+    context->context_priv->lastrecv = when;
+    otrl_context_best_instance_changed(context);
+}
+
+static void set_msgstate(ConnContext *context, OtrlMessageState msgstate)
+{
+    context->msgstate = msgstate;
+    otrl_context_best_instance_changed(context);
+}
+
+/* The best instance as a lookup with nothing cached finds it */
+static ConnContext *rescan(ConnContext *master)
+{
+    master->context_priv->best_instance = NULL;
+    return otrl_context_find_recent_secure_instance(master);
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    ConnContext *master, *inst[NUM_INSTANCES];
+    unsigned char fp[20];
+    Fingerprint *fprint;
+    int i;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    master = find(us, OTRL_INSTAG_MASTER);
+    for (i = 0; i < NUM_INSTANCES; ++i) {
+	inst[i] = find(us, OTRL_MIN_VALID_INSTAG + i);
+	inst[i]->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	inst[i]->context_priv->lastrecv = 100;
+    }
+
+    /* Ties go to the last instance */
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[2]);
+
+    /* The most recently heard from of the encrypted instances wins */
+    receive(inst[0], 200);
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[0]);
+    receive(inst[1], 300);
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[1]);
+
+    /* A plaintext instance doesn't, however recent */
+    receive(master, 400);
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[1]);
+
+    /* Once the best one finishes, the next most recent takes over */
+    set_msgstate(inst[1], OTRL_MSGSTATE_FINISHED);
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[0]);
+    receive(inst[1], 500);
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[0]);
+
+    /* Trusting the fingerprint of one instance makes it the best */
+    memset(fp, 0, sizeof(fp));
+    fprint = otrl_context_find_fingerprint(master, fp, 1, NULL);
+    inst[2]->active_fingerprint = fprint;
+    inst[1]->active_fingerprint = fprint;
+    otrl_context_set_trust(fprint, "verified");
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[2]);
+    set_msgstate(inst[1], OTRL_MSGSTATE_ENCRYPTED);
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[1]);
+
+    /* And distrusting it undoes that */
+    otrl_context_set_trust(fprint, NULL);
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[1]);
+    receive(inst[0], 600);
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[0]);
+
+    /* Going back to plaintext is worse than finishing */
+    set_msgstate(inst[1], OTRL_MSGSTATE_FINISHED);
+    set_msgstate(inst[0], OTRL_MSGSTATE_PLAINTEXT);
+    set_msgstate(inst[2], OTRL_MSGSTATE_PLAINTEXT);
+    CHECK(find(us, OTRL_INSTAG_BEST) == inst[1]);
+
+    /* An instance which can't beat the cached one may still be the best:
+     * the instances are compared in turn, so it only has to beat the
+     * one before it */
+    master = otrl_context_find(us, "buddy2", "otrtest1", TEST_PROTOCOL,
+	    OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+    for (i = 0; i < 2; ++i) {
+	inst[i] = otrl_context_find(us, "buddy2", "otrtest1", TEST_PROTOCOL,
+		OTRL_MIN_VALID_INSTAG + i, 1, NULL, NULL, NULL);
+    }
+    fprint = otrl_context_find_fingerprint(master, fp, 1, NULL);
+    otrl_context_set_trust(fprint, "verified");
+    inst[1]->active_fingerprint = fprint;
+    CHECK(otrl_context_find_recent_secure_instance(master) == inst[1]);
+    set_msgstate(inst[0], OTRL_MSGSTATE_ENCRYPTED);
+    CHECK(otrl_context_find_recent_secure_instance(master) == inst[0]);
+    CHECK(rescan(master) == inst[0]);
+
+    otrl_userstate_free(us);
+    return test_done();
+}
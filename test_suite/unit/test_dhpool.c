@@ -0,0 +1,158 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that a DH pool fills up to its high watermark and no further,
+ * is refilled only once it drops to its low watermark, generates
+ * keypairs inline once it is empty, and can be disabled while its
+ * threads are busy.  Then run a conversation with the pool on, so
+ * that its keypairs are used by the AKE and by key rotation. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dhpool.h"
+
+#include "testconv.h"
+
+#define LOW 2
+#define HIGH 6
+#define NUM_TAKES 50
+#define NUM_MESSAGES 10
+
+/* Wait until the pool has the given number of keypairs ready */
+static void wait_for(OtrlUserState us, unsigned int available)
+{
+    OtrlDHPoolStats stats;
+
+    do {
+	usleep(1000);
+	otrl_dhpool_stats(us, &stats);
+	CHECK(stats.available <= HIGH);
+    } while (stats.available != available);
+}
+
+/* Take a keypair, and check it is a whole one */
+static void take(OtrlUserState us, DH_keypair *kp)
+{
+    otrl_dh_keypair_init(kp);
+    CHECK(otrl_dhpool_gen_keypair(us, kp) == 0);
+    CHECK(kp->groupid == DH1536_GROUP_ID && kp->priv && kp->pub);
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    OtrlDHPoolStats stats;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    DH_keypair keys[NUM_TAKES];
+    char peer[32];
+    unsigned int i;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    alarm(60);
+
+    /* With no pool, keypairs are just generated */
+    take(us, &keys[0]);
+    otrl_dh_keypair_free(&keys[0]);
+    otrl_dhpool_stats(us, &stats);
+    CHECK(stats.hits == 0 && stats.misses == 0 && stats.available == 0);
+
+    /* The pool fills up to its high watermark, and stays there */
+    CHECK(otrl_dhpool_enable(us, LOW, HIGH, 2) == 0);
+    CHECK(otrl_dhpool_enable(us, LOW, HIGH, 2) ==
+	    gcry_error(GPG_ERR_EEXIST));
+    wait_for(us, HIGH);
+    usleep(50000);
+    otrl_dhpool_stats(us, &stats);
+    CHECK(stats.available == HIGH);
+
+    /* Taking keypairs down to just above the low watermark doesn't
+     * start a refill... */
+    for (i = 0; i < HIGH - LOW - 1; ++i) {
+	take(us, &keys[i]);
+    }
+    usleep(50000);
+    otrl_dhpool_stats(us, &stats);
+    CHECK(stats.available == LOW + 1);
+    CHECK(stats.hits == HIGH - LOW - 1 && stats.misses == 0);
+
+    /* ...but reaching it does, all the way back up */
+    take(us, &keys[i++]);
+    wait_for(us, HIGH);
+    while (i > 0) otrl_dh_keypair_free(&keys[--i]);
+
+    /* Once it is empty, keypairs are generated inline, and they are all
+     * different */
+    for (i = 0; i < NUM_TAKES; ++i) {
+	take(us, &keys[i]);
+    }
+    otrl_dhpool_stats(us, &stats);
+    CHECK(stats.misses > 0);
+    CHECK(stats.hits + stats.misses == NUM_TAKES + HIGH - LOW);
+    for (i = 1; i < NUM_TAKES; ++i) {
+	CHECK(gcry_mpi_cmp(keys[i].pub, keys[i-1].pub) != 0);
+    }
+    for (i = 0; i < NUM_TAKES; ++i) {
+	otrl_dh_keypair_free(&keys[i]);
+    }
+
+    /* It can be disabled while its threads are generating keypairs */
+    otrl_dhpool_disable(us);
+    CHECK(us->dhpool == NULL);
+    CHECK(otrl_dhpool_enable(us, LOW, HIGH, 4) == 0);
+    otrl_dhpool_disable(us);
+    CHECK(us->dhpool == NULL);
+    otrl_dhpool_disable(us);
+
+    /* Conversations use it, both for the AKE and for rotating keys */
+    CHECK(otrl_dhpool_enable(us, LOW, HIGH, 1) == 0);
+    test_ops_init(&ops);
+    test_net_init(&net);
+    test_peer_name(peer, sizeof(peer), 0);
+    if (test_setup_accounts(us, 1)) {
+	fprintf(stderr, "Can't set up the userstate\n");
+	return 1;
+    }
+    wait_for(us, HIGH);
+    CHECK(test_start_otr(us, &ops, &net, TEST_ME, peer));
+    for (i = 0; i < NUM_MESSAGES; ++i) {
+	TestMsg *m;
+	char *text = NULL;
+
+	CHECK(test_send(us, &ops, &net, i % 2 ? peer : TEST_ME,
+		    i % 2 ? TEST_ME : peer, "hello") == 0);
+	m = test_net_pop(&net);
+	CHECK(m != NULL);
+	if (!m) continue;
+	CHECK(test_receive(us, &ops, &net, m, &text));
+	CHECK(text && !strcmp(text, "hello"));
+	free(text);
+	test_msg_free(m);
+    }
+    otrl_dhpool_stats(us, &stats);
+    CHECK(stats.hits > 0);
+
+    otrl_userstate_free(us);
+    return test_done();
+}
@@ -0,0 +1,159 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that a master context with a few fingerprints finds them by
+ * walking its list, and that once it has enough of them it keeps a
+ * hash table of them too, which grows as they are added, stays in step
+ * with the list as they are forgotten, and is used when looking them up
+ * through one of its instances. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "context_priv.h"
+
+#include "testutil.h"
+
+#define NUM_FEW 8
+#define NUM_MANY 3000
+
+/* Make up the given fingerprint, differing from the others in both its
+ * first and last bytes */
+static void make_fingerprint(unsigned char fp[20], unsigned int n)
+{
+    memset(fp, 0xaa, 20);
+    fp[0] = n & 0xff;
+    fp[1] = (n >> 8) & 0xff;
+    fp[18] = (n * 7) & 0xff;
+    fp[19] = 1;
+}
+
+/* Return 1 if each of the fingerprints in the list is in the table
+ * exactly once, and the table has nothing else in it */
+static int table_matches_list(ConnContext *context)
+{
+    ConnContextPriv *priv = context->context_priv;
+    Fingerprint *f;
+    unsigned int i, inlist = 0, intable = 0;
+
+    for (f = context->fingerprint_root.next; f; f = f->next) {
+	unsigned int found = 0;
+
+	inlist++;
+	for (i = 0; i < priv->fingerprint_table_size; ++i) {
+	    if (priv->fingerprint_table[i] == f) found++;
+	}
+	if (found != 1) return 0;
+    }
+    for (i = 0; i < priv->fingerprint_table_size; ++i) {
+	if (priv->fingerprint_table[i]) intable++;
+    }
+    return inlist == intable && inlist == priv->num_fingerprints;
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    ConnContext *master, *child;
+    Fingerprint *fprints[NUM_MANY];
+    unsigned char fp[20];
+    unsigned int i, size;
+    int added;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    master = otrl_context_find(us, "buddy0", "otrtest1", TEST_PROTOCOL,
+	    OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+    CHECK(master != NULL);
+    if (!master) return test_done();
+
+    /* A few fingerprints are only kept in the list */
+    for (i = 0; i < NUM_FEW; ++i) {
+	make_fingerprint(fp, i);
+	fprints[i] = otrl_context_find_fingerprint(master, fp, 1, &added);
+	CHECK(fprints[i] != NULL && added);
+    }
+    CHECK(master->context_priv->fingerprint_table == NULL);
+    CHECK(master->context_priv->num_fingerprints == NUM_FEW);
+    for (i = 0; i < NUM_FEW; ++i) {
+	make_fingerprint(fp, i);
+	CHECK(otrl_context_find_fingerprint(master, fp, 0, NULL) ==
+		fprints[i]);
+    }
+    make_fingerprint(fp, NUM_MANY);
+    CHECK(otrl_context_find_fingerprint(master, fp, 0, NULL) == NULL);
+
+    /* Many go into a table as well, which is never more than half
+     * full */
+    size = 0;
+    for (i = NUM_FEW; i < NUM_MANY; ++i) {
+	make_fingerprint(fp, i);
+	fprints[i] = otrl_context_find_fingerprint(master, fp, 1, &added);
+	CHECK(fprints[i] != NULL && added);
+	if (master->context_priv->fingerprint_table_size != size) {
+	    size = master->context_priv->fingerprint_table_size;
+	    CHECK(master->context_priv->fingerprint_table != NULL);
+	    CHECK((size & (size - 1)) == 0);
+	}
+	CHECK(size == 0 || 2 * (i + 1) <= size);
+    }
+    CHECK(size > 0);
+    CHECK(table_matches_list(master));
+
+    /* Finding them again adds nothing, also through an instance */
+    child = otrl_context_find(us, "buddy0", "otrtest1", TEST_PROTOCOL,
+	    0x1234, 1, NULL, NULL, NULL);
+    CHECK(child != NULL && child != master);
+    for (i = 0; i < NUM_MANY; ++i) {
+	make_fingerprint(fp, i);
+	CHECK(otrl_context_find_fingerprint(master, fp, 1, &added) ==
+		fprints[i] && !added);
+	CHECK(otrl_context_find_fingerprint(child, fp, 0, NULL) ==
+		fprints[i]);
+    }
+    make_fingerprint(fp, NUM_MANY);
+    CHECK(otrl_context_find_fingerprint(child, fp, 0, NULL) == NULL);
+    CHECK(master->context_priv->num_fingerprints == NUM_MANY);
+
+    /* Forgetting every third one leaves the rest reachable */
+    for (i = 0; i < NUM_MANY; i += 3) {
+	otrl_context_forget_fingerprint(fprints[i], 0);
+	fprints[i] = NULL;
+    }
+    CHECK(table_matches_list(master));
+    for (i = 0; i < NUM_MANY; ++i) {
+	make_fingerprint(fp, i);
+	CHECK(otrl_context_find_fingerprint(master, fp, 0, NULL) ==
+		fprints[i]);
+    }
+
+    /* And they can be added back */
+    for (i = 0; i < NUM_MANY; i += 3) {
+	make_fingerprint(fp, i);
+	fprints[i] = otrl_context_find_fingerprint(master, fp, 1, &added);
+	CHECK(fprints[i] != NULL && added);
+    }
+    CHECK(table_matches_list(master));
+    CHECK(master->context_priv->num_fingerprints == NUM_MANY);
+
+    otrl_userstate_free(us);
+    return test_done();
+}
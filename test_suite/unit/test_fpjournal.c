@@ -0,0 +1,170 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that a fingerprint journal which grows past its threshold is
+ * compacted into the store by itself, without losing anything or
+ * leaving temporary files behind, both with and without the userstate
+ * lock.  Then check that forgetting fingerprints or contexts is
+ * journaled, but letting go of all the contexts is not. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "privkey.h"
+#include "context.h"
+#include "userstate.h"
+#include "uslock.h"
+#include "fpjournal.h"
+
+#include "testutil.h"
+
+#define NUM_BUDDIES 200
+#define THRESHOLD 1024
+
+static void add_fingerprint(OtrlUserState us, int buddy)
+{
+    test_add_fingerprint(us, buddy, 1, buddy % 2 ? "verified" : "");
+}
+
+/* Return 1 if the given buddy's fingerprint is in the given
+ * OtrlUserState, with the right trust */
+static int has_fingerprint(OtrlUserState us, int buddy)
+{
+    Fingerprint *fprint = test_find_fingerprint(us, buddy, 1);
+
+    return fprint && otrl_context_is_fingerprint_trusted(fprint) ==
+	(buddy % 2);
+}
+
+static off_t file_size(const char *filename)
+{
+    struct stat st;
+
+    return stat(filename, &st) ? -1 : st.st_size;
+}
+
+/* Read the store and its journal into a new OtrlUserState */
+static OtrlUserState reopen(const char *filename, OtrlFPJournal **journalp)
+{
+    OtrlUserState us = otrl_userstate_create();
+
+    CHECK(otrl_fpjournal_open(journalp, us, filename, THRESHOLD,
+		NULL, NULL) == 0);
+    return us;
+}
+
+static void run(const char *filename, int locked)
+{
+    char journalname[1100];
+    OtrlUserState us;
+    OtrlFPJournal *journal;
+    ConnContext *context;
+    off_t storelen;
+    int i;
+
+    snprintf(journalname, sizeof(journalname), "%s.journal", filename);
+    remove(filename);
+    remove(journalname);
+
+    /* Write well past the threshold.  The first compaction starts
+     * partway through, and we keep writing while it runs. */
+    us = otrl_userstate_create();
+    if (locked) CHECK(otrl_uslock_enable(us) == 0);
+    CHECK(otrl_fpjournal_open(&journal, us, filename, THRESHOLD,
+		NULL, NULL) == 0);
+    for (i = 0; i < NUM_BUDDIES - 1; ++i) {
+	add_fingerprint(us, i);
+    }
+    otrl_fpjournal_close(journal);
+    otrl_userstate_free(us);
+    CHECK(file_size(filename) > 0);
+
+    /* Unless the compactions kept up, the journal is still past its
+     * threshold, so one more change compacts all of it into the
+     * store.  Either way, it ends up below the threshold. */
+    us = otrl_userstate_create();
+    if (locked) CHECK(otrl_uslock_enable(us) == 0);
+    CHECK(otrl_fpjournal_open(&journal, us, filename, THRESHOLD,
+		NULL, NULL) == 0);
+    add_fingerprint(us, NUM_BUDDIES - 1);
+    otrl_fpjournal_close(journal);
+    otrl_userstate_free(us);
+
+    storelen = file_size(filename);
+    CHECK(file_size(journalname) < THRESHOLD);
+    CHECK(file_size(journalname) < storelen);
+
+    /* And nothing is lost reading it back */
+    us = reopen(filename, &journal);
+    for (i = 0; i < NUM_BUDDIES; ++i) {
+	CHECK(has_fingerprint(us, i));
+    }
+    CHECK(test_count_tmpfiles(filename) == 0);
+
+    /* Letting go of all the contexts forgets nothing on disk... */
+    otrl_context_forget_all(us);
+    CHECK(us->context_root == NULL);
+    otrl_fpjournal_close(journal);
+    otrl_userstate_free(us);
+    us = reopen(filename, &journal);
+    for (i = 0; i < NUM_BUDDIES; ++i) {
+	CHECK(has_fingerprint(us, i));
+    }
+
+    /* ...but forgetting a fingerprint, or a whole context, does */
+    context = otrl_context_find(us, "buddy0", "otrtest1", TEST_PROTOCOL,
+	    OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+    CHECK(context != NULL);
+    if (context) CHECK(otrl_context_forget(context) == 0);
+    context = otrl_context_find(us, "buddy1", "otrtest1", TEST_PROTOCOL,
+	    OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+    CHECK(context && context->fingerprint_root.next);
+    if (context && context->fingerprint_root.next) {
+	otrl_context_forget_fingerprint(context->fingerprint_root.next, 0);
+    }
+    otrl_fpjournal_close(journal);
+    otrl_userstate_free(us);
+    us = reopen(filename, &journal);
+    CHECK(!has_fingerprint(us, 0));
+    CHECK(!has_fingerprint(us, 1));
+    for (i = 2; i < NUM_BUDDIES; ++i) {
+	CHECK(has_fingerprint(us, i));
+    }
+    otrl_fpjournal_close(journal);
+    otrl_userstate_free(us);
+
+    remove(filename);
+    remove(journalname);
+}
+
+int main(int argc, char **argv)
+{
+    char filename[1024];
+
+    OTRL_INIT;
+    test_tmpname(filename, sizeof(filename), "fpjournal.txt");
+
+    run(filename, 0);
+    run(filename, 1);
+
+    return test_done();
+}
@@ -0,0 +1,163 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that fingerprints still sitting unloaded in an attached binary
+ * fingerprint store are not lost when the store is written back out,
+ * in either format, and that the asynchronous text writer writes the
+ * same thing as the synchronous one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "privkey.h"
+#include "context.h"
+#include "userstate.h"
+#include "fpstore.h"
+
+#include "testutil.h"
+
+#define NUM_BUDDIES 5
+#define NUM_ASYNC 4
+
+/* Return 1 if the two files have the same contents */
+static int same_contents(const char *file1, const char *file2)
+{
+    FILE *f1 = fopen(file1, "rb"), *f2 = fopen(file2, "rb");
+    int c1 = EOF, c2 = EOF;
+
+    if (f1 && f2) {
+	do {
+	    c1 = getc(f1);
+	    c2 = getc(f2);
+	} while (c1 == c2 && c1 != EOF);
+    }
+    if (f1) fclose(f1);
+    if (f2) fclose(f2);
+    return f1 && f2 && c1 == c2;
+}
+
+static void write_done(void *data, gcry_error_t err)
+{
+    *(gcry_error_t *)data = err;
+}
+
+/* Count the completed writes whose done callbacks get the given
+ * counter */
+static void count_done(void *data, gcry_error_t err)
+{
+    CHECK(err == 0);
+    (*(unsigned int *)data)++;
+}
+
+/* Load the given text store and check it has everything */
+static void check_text_store(const char *filename)
+{
+    OtrlUserState us = otrl_userstate_create();
+    int i;
+
+    CHECK(otrl_privkey_read_fingerprints(us, filename, NULL, NULL) == 0);
+    for (i = 0; i < NUM_BUDDIES; ++i) {
+	CHECK(test_find_fingerprint(us, i, 1) != NULL);
+    }
+    CHECK(test_find_fingerprint(us, 2, 2) != NULL);
+    otrl_userstate_free(us);
+}
+
+int main(int argc, char **argv)
+{
+    char binfile[1024], textfile[1024], snapfile[1024], asyncfile[1024];
+    gcry_error_t async_err = gcry_error(GPG_ERR_GENERAL);
+    unsigned int async_done = 0;
+    OtrlUserState us;
+    OtrlFPStore *store;
+    char *buf;
+    size_t len;
+    FILE *f;
+    int i;
+
+    OTRL_INIT;
+    test_tmpname(binfile, sizeof(binfile), "fpstore.bin");
+    test_tmpname(textfile, sizeof(textfile), "fpstore.txt");
+    test_tmpname(snapfile, sizeof(snapfile), "fpstore.snap");
+    test_tmpname(asyncfile, sizeof(asyncfile), "fpstore.async");
+
+    /* Make a binary store with one fingerprint per buddy */
+    us = otrl_userstate_create();
+    for (i = 0; i < NUM_BUDDIES; ++i) {
+	test_add_fingerprint(us, i, 1, i % 2 ? "verified" : NULL);
+    }
+    CHECK(otrl_fpstore_write(us, binfile) == 0);
+    otrl_userstate_free(us);
+
+    /* Attach it to a fresh userstate, and touch just one buddy */
+    CHECK(otrl_fpstore_open(&store, binfile) == 0);
+    us = otrl_userstate_create();
+    otrl_fpstore_attach(us, store);
+    test_add_fingerprint(us, 2, 2, "verified");
+
+    /* The text writer and the snapshot include the other buddies */
+    CHECK(otrl_privkey_write_fingerprints(us, textfile) == 0);
+    check_text_store(textfile);
+
+    CHECK(otrl_privkey_snapshot_fingerprints(us, &buf, &len) == 0);
+    f = fopen(snapfile, "wb");
+    CHECK(f && fwrite(buf, len, 1, f) == 1);
+    if (f) fclose(f);
+    free(buf);
+    check_text_store(snapfile);
+
+    CHECK(otrl_privkey_write_fingerprints_async(us, asyncfile, write_done,
+		&async_err) == 0);
+    otrl_privkey_write_fingerprints_wait(us);
+    CHECK(async_err == 0);
+    CHECK(same_contents(asyncfile, textfile));
+    CHECK(test_count_tmpfiles(asyncfile) == 0);
+
+    /* And so does writing the binary store back over itself */
+    CHECK(otrl_fpstore_write(us, binfile) == 0);
+    otrl_fpstore_attach(us, NULL);
+    otrl_userstate_free(us);
+    otrl_fpstore_close(store);
+
+    CHECK(otrl_fpstore_convert_to_text(binfile, textfile) == 0);
+    check_text_store(textfile);
+
+    /* Freeing a userstate finishes its writes first */
+    us = otrl_userstate_create();
+    for (i = 0; i < NUM_BUDDIES; ++i) {
+	test_add_fingerprint(us, i, 1, i % 2 ? "verified" : NULL);
+    }
+    test_add_fingerprint(us, 2, 2, "verified");
+    for (i = 0; i < NUM_ASYNC; ++i) {
+	CHECK(otrl_privkey_write_fingerprints_async(us, asyncfile,
+		    count_done, &async_done) == 0);
+    }
+    otrl_userstate_free(us);
+    CHECK(async_done == NUM_ASYNC);
+    check_text_store(asyncfile);
+    CHECK(test_count_tmpfiles(asyncfile) == 0);
+
+    remove(binfile);
+    remove(textfile);
+    remove(snapfile);
+    remove(asyncfile);
+    return test_done();
+}
@@ -0,0 +1,123 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check the limits on the memory partly received messages may take up,
+ * in each context and in the userstate as a whole: that a fragment
+ * which would go over either is dropped, and that once the limits are
+ * lowered below what is already held, every new fragment is. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "context.h"
+#include "fragment.h"
+#include "userstate.h"
+
+#include "testutil.h"
+
+#define PIECE_LEN 100
+
+static char piece[PIECE_LEN];
+
+static ConnContext *find(OtrlUserState us, const char *username)
+{
+    return otrl_context_find(us, username, "otrtest1", TEST_PROTOCOL,
+	    OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+}
+
+/* Add fragment k of n from sender, and return whether it was kept (or
+ * completed its message, which is freed) */
+static int add(ConnContext *context, unsigned int sender, unsigned short k,
+	unsigned short n)
+{
+    ConnContextPriv *priv = context->context_priv;
+    size_t before = priv->fragment_bytes;
+    char *message = NULL;
+
+    if (otrl_fragment_add(priv, sender, k, n, piece, PIECE_LEN, 0,
+		&message) == OTRL_FRAGMENT_COMPLETE) {
+	CHECK(message && strlen(message) == (size_t)n * PIECE_LEN);
+	free(message);
+	return 1;
+    }
+    return priv->fragment_bytes > before;
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    ConnContext *alice, *bob;
+    size_t held;
+
+    OTRL_INIT;
+    memset(piece, 'x', sizeof(piece));
+    us = otrl_userstate_create();
+    alice = find(us, "alice");
+    bob = find(us, "bob");
+
+    /* A message too big for the context's limit is dropped */
+    otrl_fragment_set_limits(us, PIECE_LEN, 0);
+    CHECK(!add(alice, 0, 1, 3));
+    CHECK(alice->context_priv->fragment_bytes == 0);
+    CHECK(us->fragment_bytes == 0);
+
+    /* With room for it, it is kept, and completes */
+    otrl_fragment_set_limits(us, 0, 0);
+    CHECK(add(alice, 0, 1, 2));
+    CHECK(alice->context_priv->fragment_bytes > 0);
+    CHECK(us->fragment_bytes == alice->context_priv->fragment_bytes);
+    CHECK(add(alice, 0, 2, 2));
+    CHECK(alice->context_priv->fragment_bytes == 0);
+    CHECK(us->fragment_bytes == 0);
+
+    /* Lower the context's limit below what it already holds: what it
+     * has is kept, but no new message is */
+    CHECK(add(alice, 0, 1, 2));
+    held = alice->context_priv->fragment_bytes;
+    otrl_fragment_set_limits(us, held / 2, 0);
+    CHECK(!add(alice, 0, 1, 3));
+    CHECK(!add(alice, 1000, 1, 2));
+    CHECK(alice->context_priv->fragment_bytes == held);
+    CHECK(us->fragment_bytes == held);
+
+    /* Raising it again makes room */
+    otrl_fragment_set_limits(us, 0, 0);
+    CHECK(add(bob, 0, 1, 2));
+    CHECK(us->fragment_bytes > held);
+
+    /* Likewise lowering the userstate's limit below what all of them
+     * hold */
+    otrl_fragment_set_limits(us, 0, us->fragment_bytes - 1);
+    held = us->fragment_bytes;
+    CHECK(!add(alice, 0, 1, 3));
+    CHECK(!add(bob, 0, 1, 3));
+    CHECK(us->fragment_bytes == held);
+
+    /* The messages already held can still be finished, and once they
+     * are, there is room again */
+    CHECK(add(alice, 0, 2, 2));
+    CHECK(add(bob, 0, 2, 2));
+    CHECK(us->fragment_bytes == 0);
+    CHECK(add(alice, 0, 1, 3));
+
+    otrl_userstate_free(us);
+    return test_done();
+}
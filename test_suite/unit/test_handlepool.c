@@ -0,0 +1,132 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that a userstate keeps no cipher and MAC handles until its
+ * caps are set, and that once they are, a conversation that rotates
+ * its keys reuses the handles of the session keys it frees, never
+ * keeping more than the caps, and that its messages still arrive
+ * intact.  Then lower the caps, and check that the handles over them
+ * are closed and no more are kept. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dhpool.h"
+
+#include "testconv.h"
+
+#define MAX_CIPHERS 4
+#define MAX_MACS 3
+#define NUM_MESSAGES 40
+
+/* Send messages back and forth, so that the keys are rotated, and
+ * check that they arrive and that the pool stays within the caps */
+static void chat(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, const char *peer, unsigned int maxciphers,
+	unsigned int maxmacs)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_MESSAGES; ++i) {
+	OtrlDHHandleStats stats;
+	TestMsg *m;
+	char *text = NULL;
+
+	CHECK(test_send(us, ops, net, i % 2 ? peer : TEST_ME,
+		    i % 2 ? TEST_ME : peer, "hello") == 0);
+	m = test_net_pop(net);
+	CHECK(m != NULL);
+	if (!m) continue;
+	CHECK(test_receive(us, ops, net, m, &text));
+	CHECK(text && !strcmp(text, "hello"));
+	free(text);
+	test_msg_free(m);
+
+	otrl_dhpool_handle_stats(us, &stats);
+	CHECK(stats.ciphers_pooled <= maxciphers);
+	CHECK(stats.macs_pooled <= maxmacs);
+	CHECK(stats.cipher_opens + stats.cipher_reuses ==
+		stats.mac_opens + stats.mac_reuses);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    OtrlDHHandleStats stats, before;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    char peer[32];
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    test_net_init(&net);
+    test_peer_name(peer, sizeof(peer), 0);
+    if (test_setup_accounts(us, 1)) {
+	fprintf(stderr, "Can't set up the userstate\n");
+	return 1;
+    }
+
+    /* No handles are kept by default, and caps of 0 don't change
+     * that */
+    CHECK(otrl_dhpool_set_handle_caps(us, 0, 0) == 0);
+    CHECK(us->dhhandles == NULL);
+    otrl_dhpool_handle_stats(us, &stats);
+    CHECK(stats.cipher_opens == 0 && stats.mac_opens == 0 &&
+	    stats.ciphers_pooled == 0 && stats.macs_pooled == 0);
+
+    /* With caps, rotating keys reuses the handles of freed session
+     * keys */
+    CHECK(otrl_dhpool_set_handle_caps(us, MAX_CIPHERS, MAX_MACS) == 0);
+    CHECK(us->dhhandles != NULL);
+    if (!test_start_otr(us, &ops, &net, TEST_ME, peer)) {
+	fprintf(stderr, "Can't start the conversation\n");
+	return 1;
+    }
+    chat(us, &ops, &net, peer, MAX_CIPHERS, MAX_MACS);
+    otrl_dhpool_handle_stats(us, &stats);
+    CHECK(stats.cipher_opens > 0 && stats.mac_opens > 0);
+    CHECK(stats.cipher_reuses > 0 && stats.mac_reuses > 0);
+    CHECK(stats.ciphers_pooled > 0 && stats.macs_pooled > 0);
+
+    /* Lowering the caps closes the handles over them at once... */
+    CHECK(otrl_dhpool_set_handle_caps(us, 1, 0) == 0);
+    otrl_dhpool_handle_stats(us, &stats);
+    CHECK(stats.ciphers_pooled <= 1 && stats.macs_pooled == 0);
+
+    /* ...and keeps no more afterwards, so every MAC handle, and at
+     * least one of the two cipher handles of each session, is newly
+     * opened */
+    before = stats;
+    chat(us, &ops, &net, peer, 1, 0);
+    otrl_dhpool_handle_stats(us, &stats);
+    CHECK(stats.mac_reuses == before.mac_reuses);
+    CHECK(stats.mac_opens > before.mac_opens);
+    CHECK(stats.cipher_opens - before.cipher_opens >=
+	    (stats.mac_opens - before.mac_opens) / 2);
+
+    /* The pool goes with the userstate, handles and all */
+    CHECK(otrl_dhpool_set_handle_caps(us, MAX_CIPHERS, MAX_MACS) == 0);
+    chat(us, &ops, &net, peer, MAX_CIPHERS, MAX_MACS);
+    otrl_userstate_free(us);
+    return test_done();
+}
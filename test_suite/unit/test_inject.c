@@ -0,0 +1,214 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that otrl_proto_fragment_create_contiguous makes the same
+ * fragments as otrl_proto_fragment_create, laid out one after the
+ * other.  Then send a message too big for the network, and check that
+ * its fragments go to inject_fragments in a single call when it is
+ * set, less the one returned by each fragment policy, and to
+ * inject_message one at a time when it isn't, and that they are put
+ * back together at the other end.  A message that fits is still sent
+ * with inject_message. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+
+#include "testconv.h"
+
+#define MMS 400
+#define MSG_LEN 3000
+
+static unsigned int fragment_calls, fragments_sent, messages_sent;
+
+static int max_message_size(void *opdata, ConnContext *context)
+{
+    return MMS;
+}
+
+static void inject_message(void *opdata, const char *accountname,
+	const char *protocol, const char *recipient, const char *message)
+{
+    messages_sent++;
+    CHECK(strlen(message) <= MMS);
+    test_net_push(opdata, accountname, recipient, message);
+}
+
+static void inject_fragments(void *opdata, const char *accountname,
+	const char *protocol, const char *recipient,
+	const OtrlFragment *fragments, unsigned int fragment_count)
+{
+    unsigned int i;
+
+    fragment_calls++;
+    fragments_sent += fragment_count;
+    for (i = 0; i < fragment_count; ++i) {
+	CHECK(strlen(fragments[i].text) == fragments[i].len);
+	CHECK(fragments[i].len <= MMS);
+	CHECK(!strncmp(fragments[i].text, "?OTR|", 5));
+	if (i > 0) {
+	    CHECK(fragments[i].text ==
+		    fragments[i-1].text + fragments[i-1].len + 1);
+	}
+	test_net_push(opdata, accountname, recipient, fragments[i].text);
+    }
+}
+
+/* Send msg from TEST_ME to peer with the given fragment policy, and
+ * return what otrl_message_sending left in its place */
+static char *send_msg(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, const char *peer, const char *msg,
+	OtrlFragmentPolicy policy)
+{
+    char *newmsg = NULL;
+
+    fragment_calls = fragments_sent = messages_sent = 0;
+    CHECK(otrl_message_sending(us, ops, net, TEST_ME, TEST_PROTOCOL, peer,
+		OTRL_INSTAG_BEST, msg, NULL, &newmsg, policy, NULL, NULL,
+		NULL) == 0);
+    return newmsg;
+}
+
+/* Deliver everything on the network to peer, with the given extra
+ * fragments before and after it, and return 1 if only the last message
+ * shows peer msg */
+static int receive_msg(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, const char *peer, const char *msg, const char *before,
+	const char *after)
+{
+    TestNet ordered;
+    TestMsg *m;
+    int shown = 0, last = 0;
+
+    test_net_init(&ordered);
+    if (before) test_net_push(&ordered, TEST_ME, peer, before);
+    while ((m = test_net_pop(net)) != NULL) {
+	test_net_push(&ordered, m->from, m->to, m->msg);
+	test_msg_free(m);
+    }
+    if (after) test_net_push(&ordered, TEST_ME, peer, after);
+
+    while ((m = test_net_pop(&ordered)) != NULL) {
+	char *text = NULL;
+
+	shown += test_receive(us, ops, net, m, &text);
+	last = text && !strcmp(text, msg);
+	free(text);
+	test_msg_free(m);
+    }
+    return shown == 1 && last;
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    ConnContext *mine;
+    OtrlFragment *contiguous;
+    char **separate;
+    char *msg, *newmsg;
+    char peer[32];
+    int i, count;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    test_net_init(&net);
+    test_peer_name(peer, sizeof(peer), 0);
+    if (test_setup_accounts(us, 1) ||
+	    !test_start_otr(us, &ops, &net, TEST_ME, peer)) {
+	fprintf(stderr, "Can't start the conversation\n");
+	return 1;
+    }
+    mine = test_context(us, TEST_ME, peer);
+    CHECK(mine != NULL);
+    if (!mine) return test_done();
+
+    msg = malloc(MSG_LEN + 1);
+    if (!msg) return test_done();
+    for (i = 0; i < MSG_LEN; ++i) {
+	msg[i] = 'a' + (i % 26);
+    }
+    msg[MSG_LEN] = '\0';
+
+    /* The contiguous fragments are the same as the separate ones */
+    count = (MSG_LEN - 1) / (MMS - 37) + 1;
+    CHECK(otrl_proto_fragment_create_contiguous(MMS, count, &contiguous,
+		mine, msg) == 0);
+    CHECK(otrl_proto_fragment_create(MMS, count, &separate, mine, msg)
+	    == 0);
+    for (i = 0; i < count; ++i) {
+	CHECK(!strcmp(contiguous[i].text, separate[i]));
+	CHECK(contiguous[i].len == strlen(separate[i]));
+	if (i > 0) {
+	    CHECK(contiguous[i].text ==
+		    contiguous[i-1].text + contiguous[i-1].len + 1);
+	}
+    }
+    free(contiguous);
+    otrl_proto_fragment_free(&separate, count);
+
+    /* Without inject_fragments, the fragments go to inject_message */
+    ops.inject_message = inject_message;
+    ops.max_message_size = max_message_size;
+    newmsg = send_msg(us, &ops, &net, peer, msg, OTRL_FRAGMENT_SEND_ALL);
+    CHECK(fragment_calls == 0 && messages_sent > 1);
+    CHECK(receive_msg(us, &ops, &net, peer, msg, NULL, NULL));
+    otrl_message_free(newmsg);
+    count = messages_sent;
+
+    /* With it, they all go there in one call... */
+    ops.inject_fragments = inject_fragments;
+    newmsg = send_msg(us, &ops, &net, peer, msg, OTRL_FRAGMENT_SEND_ALL);
+    CHECK(fragment_calls == 1 && fragments_sent == count);
+    CHECK(messages_sent == 0);
+    CHECK(receive_msg(us, &ops, &net, peer, msg, NULL, NULL));
+    otrl_message_free(newmsg);
+
+    /* ...except the one the fragment policy returns */
+    newmsg = send_msg(us, &ops, &net, peer, msg,
+	    OTRL_FRAGMENT_SEND_ALL_BUT_FIRST);
+    CHECK(fragment_calls == 1 && fragments_sent == count - 1);
+    CHECK(newmsg && !strncmp(newmsg, "?OTR|", 5));
+    CHECK(newmsg && strstr(newmsg, ",00001,") != NULL);
+    CHECK(receive_msg(us, &ops, &net, peer, msg, newmsg, NULL));
+    otrl_message_free(newmsg);
+
+    newmsg = send_msg(us, &ops, &net, peer, msg,
+	    OTRL_FRAGMENT_SEND_ALL_BUT_LAST);
+    CHECK(fragment_calls == 1 && fragments_sent == count - 1);
+    CHECK(newmsg && !strncmp(newmsg, "?OTR|", 5));
+    CHECK(receive_msg(us, &ops, &net, peer, msg, NULL, newmsg));
+    otrl_message_free(newmsg);
+
+    /* A message that fits still goes to inject_message */
+    newmsg = send_msg(us, &ops, &net, peer, "hello",
+	    OTRL_FRAGMENT_SEND_ALL);
+    CHECK(fragment_calls == 0 && messages_sent == 1);
+    CHECK(receive_msg(us, &ops, &net, peer, "hello", NULL, NULL));
+    otrl_message_free(newmsg);
+
+    free(msg);
+    otrl_userstate_free(us);
+    return test_done();
+}
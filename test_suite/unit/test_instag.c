@@ -0,0 +1,186 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Read an instance tag file with many accounts, and some lines that
+ * aren't instance tags, and check that otrl_instag_find finds each
+ * account's tag through the index, and the same one a walk of the list
+ * would when an account appears twice.  Then check that forgetting,
+ * generating and writing tags out and reading them back in keep the
+ * index in step with the list. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "instag.h"
+
+#include "testutil.h"
+
+#define NUM_ACCOUNTS 5000
+#define OTHER_PROTOCOL "prpl-jabber"
+
+/* The made-up instance tag of the given account */
+static otrl_instag_t account_instag(unsigned int n)
+{
+    return OTRL_MIN_VALID_INSTAG + 3 * n;
+}
+
+/* The instance tag a walk of the list finds for the given account */
+static OtrlInsTag *walk_find(OtrlUserState us, const char *accountname,
+	const char *protocol)
+{
+    OtrlInsTag *p;
+
+    for (p = us->instag_root; p; p = p->next) {
+	if (!strcmp(p->accountname, accountname) &&
+		!strcmp(p->protocol, protocol)) {
+	    return p;
+	}
+    }
+    return NULL;
+}
+
+/* Return 1 if every account has its own tag, found through the index */
+static int all_found(OtrlUserState us)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_ACCOUNTS; ++i) {
+	char name[32];
+	OtrlInsTag *p;
+
+	snprintf(name, sizeof(name), "account%u", i);
+	p = otrl_instag_find(us, name, TEST_PROTOCOL);
+	if (!p || p->instag != account_instag(i) ||
+		p != walk_find(us, name, TEST_PROTOCOL)) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us, reread;
+    OtrlInsTag *p;
+    FILE *f;
+    unsigned int i;
+    otrl_instag_t dup;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+
+    /* Many accounts, with a comment, lines that are too short or
+     * reserved, a CRLF line ending, one account on two protocols, and
+     * one account twice */
+    f = tmpfile();
+    CHECK(f != NULL);
+    if (!f) return test_done();
+    fprintf(f, "# A comment, with no tabs\n");
+    fprintf(f, "short\t%s\t1234\n", TEST_PROTOCOL);
+    fprintf(f, "reserved\t%s\t%08x\n", TEST_PROTOCOL,
+	    OTRL_MIN_VALID_INSTAG - 1);
+    fprintf(f, "account0\t%s\t%08x\n", OTHER_PROTOCOL, 0x12345678);
+    fprintf(f, "account1\t%s\t%08x\n", TEST_PROTOCOL, 0x87654321);
+    for (i = 0; i < NUM_ACCOUNTS; ++i) {
+	fprintf(f, "account%u\t%s\t%08x%s\n", i, TEST_PROTOCOL,
+		account_instag(i), i == 7 ? "\r" : "");
+    }
+    fprintf(f, "unterminated\t%s\t%08x", TEST_PROTOCOL, 0x11111111);
+    rewind(f);
+    CHECK(otrl_instag_read_FILEp(us, f) == 0);
+    fclose(f);
+    CHECK(us->instag_index != NULL);
+
+    CHECK(all_found(us));
+    CHECK(otrl_instag_find(us, "short", TEST_PROTOCOL) == NULL);
+    CHECK(otrl_instag_find(us, "reserved", TEST_PROTOCOL) == NULL);
+    CHECK(otrl_instag_find(us, "unterminated", TEST_PROTOCOL) == NULL);
+    CHECK(otrl_instag_find(us, "account", TEST_PROTOCOL) == NULL);
+    p = otrl_instag_find(us, "account0", OTHER_PROTOCOL);
+    CHECK(p && p->instag == 0x12345678);
+
+    /* Forgetting an account's newer tag finds its older one again */
+    p = otrl_instag_find(us, "account1", TEST_PROTOCOL);
+    otrl_instag_forget(p);
+    p = otrl_instag_find(us, "account1", TEST_PROTOCOL);
+    CHECK(p && p->instag == 0x87654321);
+    CHECK(p == walk_find(us, "account1", TEST_PROTOCOL));
+    otrl_instag_forget(p);
+    CHECK(otrl_instag_find(us, "account1", TEST_PROTOCOL) == NULL);
+
+    /* A new tag is found, and its file has all the others in it */
+    f = tmpfile();
+    CHECK(f != NULL);
+    if (!f) return test_done();
+    CHECK(otrl_instag_generate_FILEp(us, f, "account1", TEST_PROTOCOL)
+	    == 0);
+    p = otrl_instag_find(us, "account1", TEST_PROTOCOL);
+    CHECK(p && p->instag >= OTRL_MIN_VALID_INSTAG);
+    if (!p) return test_done();
+    dup = p->instag;
+    rewind(f);
+    reread = otrl_userstate_create();
+    CHECK(otrl_instag_read_FILEp(reread, f) == 0);
+    fclose(f);
+    p = otrl_instag_find(reread, "account1", TEST_PROTOCOL);
+    CHECK(p && p->instag == dup);
+    p = otrl_instag_find(reread, "account0", OTHER_PROTOCOL);
+    CHECK(p && p->instag == 0x12345678);
+    otrl_instag_forget(otrl_instag_find(us, "account1", TEST_PROTOCOL));
+    otrl_instag_forget(otrl_instag_find(reread, "account1", TEST_PROTOCOL));
+    for (i = 0; i < NUM_ACCOUNTS; ++i) {
+	char name[32];
+
+	snprintf(name, sizeof(name), "account%u", i);
+	if (i == 1) continue;
+	p = otrl_instag_find(reread, name, TEST_PROTOCOL);
+	CHECK(p && p->instag == account_instag(i));
+    }
+
+    /* Forgetting them all empties the index, which then starts again */
+    otrl_instag_forget_all(reread);
+    CHECK(reread->instag_index == NULL);
+    CHECK(otrl_instag_find(reread, "account0", TEST_PROTOCOL) == NULL);
+    f = tmpfile();
+    CHECK(f != NULL);
+    if (!f) return test_done();
+    fprintf(f, "account1\t%s\t%08x\n", TEST_PROTOCOL, account_instag(1));
+    rewind(f);
+    CHECK(otrl_instag_read_FILEp(reread, f) == 0);
+    fclose(f);
+    CHECK(reread->instag_index != NULL);
+    p = otrl_instag_find(reread, "account1", TEST_PROTOCOL);
+    CHECK(p && p->instag == account_instag(1));
+
+    /* Put account1 back in us, and everything is still found */
+    f = tmpfile();
+    CHECK(f != NULL);
+    if (!f) return test_done();
+    CHECK(otrl_instag_write_FILEp(reread, f) == 0);
+    rewind(f);
+    CHECK(otrl_instag_read_FILEp(us, f) == 0);
+    fclose(f);
+    CHECK(all_found(us));
+
+    otrl_userstate_free(reread);
+    otrl_userstate_free(us);
+    return test_done();
+}
@@ -0,0 +1,143 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that otrl_message_poll leaves alone a DH Commit that has waited
+ * too long while the AKE it started is in the AKE pool, and comes back
+ * to it, through the deadline heap, once otrl_message_ake_poll has
+ * finished that AKE.  A poll that keeps finding the same context due
+ * never returns, so the test gives up after a while. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "akepool.h"
+#include "auth.h"
+#include "context.h"
+#include "deadline.h"
+
+#include "testconv.h"
+
+/* As in message.c */
+#define MAX_AKE_WAIT_TIME 60
+
+/* Deliver the oldest message on the network, and check it was from
+ * from to to. */
+static void deliver_one(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, const char *from, const char *to)
+{
+    TestMsg *m = test_net_pop(net);
+
+    CHECK(m != NULL);
+    if (!m) return;
+    CHECK(!strcmp(m->from, from) && !strcmp(m->to, to));
+    test_receive(us, ops, net, m, NULL);
+    test_msg_free(m);
+}
+
+/* Finish the AKE pool's work on the given master's AKE */
+static void wait_for_pool(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, ConnContext *master)
+{
+    OtrlMessageReceived *held;
+    size_t numheld;
+
+    while (master->context_priv->ake_job) {
+	otrl_message_ake_poll(us, ops, net, &held, &numheld);
+	otrl_message_ake_held_free(held, numheld);
+	if (master->context_priv->ake_job) usleep(1000);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    ConnContext *master;
+    TestMsg *m;
+    char peer[32];
+    time_t now, sent;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    test_net_init(&net);
+    test_peer_name(peer, sizeof(peer), 0);
+    if (test_setup_accounts(us, 1) ||
+	    otrl_akepool_enable(us, 1, NULL, NULL)) {
+	fprintf(stderr, "Can't set up the userstate\n");
+	return 1;
+    }
+    alarm(30);
+
+    /* The peer answers the Query with a DH Commit, from its master */
+    test_net_push(&net, TEST_ME, peer, "?OTRv3?");
+    deliver_one(us, &ops, &net, TEST_ME, peer);
+    master = otrl_context_find(us, TEST_ME, peer, TEST_PROTOCOL,
+	    OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+    CHECK(master != NULL);
+    if (!master) return test_done();
+    CHECK(master->auth.authstate == OTRL_AUTHSTATE_AWAITING_DHKEY);
+    CHECK(master->auth.protocol_version == 3);
+    sent = master->auth.commit_sent_time;
+    CHECK(sent > 0);
+    CHECK(otrl_message_poll_next_deadline(us) ==
+	    sent + MAX_AKE_WAIT_TIME + 1);
+
+    /* Its DH Key Message goes to the pool */
+    deliver_one(us, &ops, &net, peer, TEST_ME);
+    deliver_one(us, &ops, &net, TEST_ME, peer);
+    CHECK(master->context_priv->ake_job != NULL);
+
+    /* Have the DH Commit wait too long, and the master come due */
+    master->auth.commit_sent_time -= MAX_AKE_WAIT_TIME + 10;
+    now = time(NULL);
+    otrl_deadline_schedule(master, now);
+    otrl_message_poll(us, &ops, &net);
+    CHECK(master->auth.authstate == OTRL_AUTHSTATE_AWAITING_DHKEY);
+    CHECK(otrl_message_poll_next_deadline(us) == 0 ||
+	    otrl_message_poll_next_deadline(us) > now);
+
+    /* Once the pool is done, the DH Commit is due again, and dropped */
+    wait_for_pool(us, &ops, &net, master);
+    CHECK(otrl_message_poll_next_deadline(us) ==
+	    master->auth.commit_sent_time + MAX_AKE_WAIT_TIME + 1);
+    otrl_message_poll(us, &ops, &net);
+    CHECK(master->auth.authstate == OTRL_AUTHSTATE_NONE);
+    CHECK(otrl_message_poll_next_deadline(us) == 0);
+
+    /* The instance that took over the AKE finishes it regardless */
+    while ((m = test_net_pop(&net)) != NULL) {
+	ConnContext *mine = otrl_context_find(us, peer, TEST_ME,
+		TEST_PROTOCOL, OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+
+	test_receive(us, &ops, &net, m, NULL);
+	test_msg_free(m);
+	wait_for_pool(us, &ops, &net, mine);
+	wait_for_pool(us, &ops, &net, master);
+    }
+    CHECK(test_encrypted(us, TEST_ME, peer));
+
+    otrl_akepool_disable(us);
+    otrl_userstate_free(us);
+    return test_done();
+}
@@ -0,0 +1,141 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that private keys are parsed as they are read, unless lazy
+ * reading is enabled, in which case each is parsed by the first
+ * otrl_privkey_find or otrl_privkey_sign that needs it, and gives the
+ * same key as reading it normally.  Then generate a new key into a
+ * userstate whose other keys haven't all been parsed, and check that
+ * they are all written out with it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+#include "privkey.h"
+
+#include "testutil.h"
+
+#define NUM_KEYS 3
+
+static const char *accounts[NUM_KEYS] = {
+    "otrtest1", "otrtest2", "otrtest3"
+};
+
+/* Find the given account's key without parsing it */
+static OtrlPrivKey *find_unparsed(OtrlUserState us, const char *accountname)
+{
+    OtrlPrivKey *p;
+
+    for (p = us->privkey_root; p; p = p->next) {
+	if (!strcmp(p->accountname, accountname) &&
+		!strcmp(p->protocol, TEST_PROTOCOL)) {
+	    return p;
+	}
+    }
+    return NULL;
+}
+
+/* Return 1 if the given account's key is the same in both userstates */
+static int same_key(OtrlUserState a, OtrlUserState b,
+	const char *accountname)
+{
+    unsigned char fa[20], fb[20];
+
+    return otrl_privkey_fingerprint_raw(a, fa, accountname,
+		TEST_PROTOCOL) != NULL &&
+	otrl_privkey_fingerprint_raw(b, fb, accountname,
+		TEST_PROTOCOL) != NULL &&
+	!memcmp(fa, fb, 20);
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState eager, lazy, reread;
+    OtrlPrivKey *p;
+    unsigned char *sig;
+    size_t siglen;
+    void *newkey;
+    FILE *f;
+    unsigned int i;
+
+    OTRL_INIT;
+
+    /* By default, every key is parsed as it is read */
+    eager = otrl_userstate_create();
+    CHECK(otrl_privkey_read(eager, TEST_KEYFILE) == 0);
+    for (i = 0; i < NUM_KEYS; ++i) {
+	p = find_unparsed(eager, accounts[i]);
+	CHECK(p && p->privkey && p->pubkey_data && !p->sexp);
+    }
+
+    /* Read lazily, none is parsed until it is found... */
+    lazy = otrl_userstate_create();
+    otrl_privkey_lazy_enable(lazy);
+    CHECK(otrl_privkey_read(lazy, TEST_KEYFILE) == 0);
+    for (i = 0; i < NUM_KEYS; ++i) {
+	p = find_unparsed(lazy, accounts[i]);
+	CHECK(p && !p->privkey && !p->pubkey_data && p->sexp);
+    }
+    p = otrl_privkey_find(lazy, accounts[0], TEST_PROTOCOL);
+    CHECK(p && p->privkey && p->pubkey_data && !p->sexp);
+    CHECK(same_key(eager, lazy, accounts[0]));
+    p = find_unparsed(lazy, accounts[1]);
+    CHECK(p && !p->privkey && p->sexp);
+
+    /* ...or used to sign */
+    p = find_unparsed(lazy, accounts[2]);
+    CHECK(p && !p->privkey);
+    if (p) {
+	CHECK(otrl_privkey_sign(&sig, &siglen, p,
+		    (const unsigned char *)"01234567890123456789", 20) == 0);
+	CHECK(siglen == 40);
+	CHECK(p->privkey && p->pubkey_data && !p->sexp);
+	free(sig);
+    }
+    CHECK(same_key(eager, lazy, accounts[2]));
+
+    /* A new key is written out with the others, parsed or not */
+    p = find_unparsed(lazy, accounts[1]);
+    CHECK(p && !p->privkey);
+    CHECK(otrl_privkey_generate_start(lazy, "newaccount", TEST_PROTOCOL,
+		&newkey) == 0);
+    CHECK(otrl_privkey_generate_calculate(newkey) == 0);
+    f = tmpfile();
+    CHECK(f != NULL);
+    if (!f) return test_done();
+    CHECK(otrl_privkey_generate_finish_FILEp(lazy, newkey, f) == 0);
+    CHECK(otrl_privkey_find(lazy, "newaccount", TEST_PROTOCOL) != NULL);
+    rewind(f);
+    reread = otrl_userstate_create();
+    CHECK(otrl_privkey_read_FILEp(reread, f) == 0);
+    fclose(f);
+    for (i = 0; i < NUM_KEYS; ++i) {
+	CHECK(same_key(eager, reread, accounts[i]));
+	CHECK(same_key(eager, lazy, accounts[i]));
+    }
+    CHECK(same_key(lazy, reread, "newaccount"));
+
+    otrl_userstate_free(reread);
+    otrl_userstate_free(lazy);
+    otrl_userstate_free(eager);
+    return test_done();
+}
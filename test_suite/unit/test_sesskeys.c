@@ -0,0 +1,220 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that otrl_dh_session opens no handles, and that
+ * otrl_dh_session_derive gives the two ends matching keys, only once.
+ * Make it fail part way through, with handles already taken from a
+ * pool, and check that it gives them back and leaves the session as it
+ * was, so that it can be derived again.  Then check that a conversation
+ * only derives the session keys its messages use. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "context_priv.h"
+
+#include "testconv.h"
+
+/* gcry_cipher_open and gcry_md_open are wrapped (see the Makefile), to
+ * count the handles opened, and to make them fail on demand */
+static unsigned int opens;
+static int fail_opens;
+
+gcry_error_t __real_gcry_cipher_open(gcry_cipher_hd_t *hd, int algo,
+	int mode, unsigned int flags);
+gcry_error_t __real_gcry_md_open(gcry_md_hd_t *hd, int algo,
+	unsigned int flags);
+
+gcry_error_t __wrap_gcry_cipher_open(gcry_cipher_hd_t *hd, int algo,
+	int mode, unsigned int flags)
+{
+    if (fail_opens) return gcry_error(GPG_ERR_ENOMEM);
+    opens++;
+    return __real_gcry_cipher_open(hd, algo, mode, flags);
+}
+
+gcry_error_t __wrap_gcry_md_open(gcry_md_hd_t *hd, int algo,
+	unsigned int flags)
+{
+    if (fail_opens) return gcry_error(GPG_ERR_ENOMEM);
+    opens++;
+    return __real_gcry_md_open(hd, algo, flags);
+}
+
+/* Return 1 if what a sends with its keys, b can read with its own */
+static int keys_match(DH_sesskeys *a, DH_sesskeys *b)
+{
+    static const unsigned char plain[32] = "Some text to encrypt with CTR";
+    unsigned char buf[32], ctr[16];
+
+    if (memcmp(a->sendmackey, b->rcvmackey, 20) ||
+	    memcmp(a->rcvmackey, b->sendmackey, 20) ||
+	    memcmp(a->extrakey, b->extrakey, OTRL_EXTRAKEY_BYTES)) {
+	return 0;
+    }
+    memset(ctr, 0, 16);
+    ctr[0] = 1;
+    if (gcry_cipher_reset(a->sendenc) ||
+	    gcry_cipher_setctr(a->sendenc, ctr, 16) ||
+	    gcry_cipher_encrypt(a->sendenc, buf, 32, plain, 32) ||
+	    gcry_cipher_reset(b->rcvenc) ||
+	    gcry_cipher_setctr(b->rcvenc, ctr, 16) ||
+	    gcry_cipher_decrypt(b->rcvenc, buf, 32, NULL, 0)) {
+	return 0;
+    }
+    return !memcmp(buf, plain, 32);
+}
+
+/* Count a context's session keys that have been derived */
+static unsigned int count_derived(ConnContext *context)
+{
+    unsigned int i, j, n = 0;
+
+    for (i = 0; i < 2; ++i) {
+	for (j = 0; j < 2; ++j) {
+	    if (context->context_priv->sesskeys[i][j].sendenc) n++;
+	}
+    }
+    return n;
+}
+
+/* Send a message from a to b, and check that it arrives */
+static void deliver(OtrlUserState us, const OtrlMessageAppOps *ops,
+	TestNet *net, const char *a, const char *b)
+{
+    TestMsg *m;
+    char *text = NULL;
+
+    CHECK(test_send(us, ops, net, a, b, "hello") == 0);
+    m = test_net_pop(net);
+    CHECK(m != NULL);
+    if (!m) return;
+    CHECK(test_receive(us, ops, net, m, &text));
+    CHECK(text && !strcmp(text, "hello"));
+    free(text);
+    test_msg_free(m);
+}
+
+int main(int argc, char **argv)
+{
+    DH_keypair a, b;
+    DH_sesskeys sa, sb, sc;
+    OtrlDHHandlePool *pool;
+    OtrlDHHandleStats stats;
+    OtrlUserState us;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    ConnContext *mine, *theirs;
+    char peer[32];
+
+    OTRL_INIT;
+    otrl_dh_keypair_init(&a);
+    otrl_dh_keypair_init(&b);
+    CHECK(otrl_dh_gen_keypair(DH1536_GROUP_ID, &a) == 0);
+    CHECK(otrl_dh_gen_keypair(DH1536_GROUP_ID, &b) == 0);
+
+    /* Setting up a session opens nothing... */
+    opens = 0;
+    CHECK(otrl_dh_session(&sa, &a, b.pub) == 0);
+    CHECK(otrl_dh_session(&sb, &b, a.pub) == 0);
+    CHECK(opens == 0);
+    CHECK(sa.pending_priv && sa.pending_y && !sa.sendenc && !sa.rcvmac);
+    CHECK(sa.sendbyte != sb.sendbyte);
+
+    /* ...deriving its keys opens two of each handle, which match the
+     * other end's... */
+    CHECK(otrl_dh_session_derive(&sa, NULL) == 0);
+    CHECK(otrl_dh_session_derive(&sb, NULL) == 0);
+    CHECK(opens == 8);
+    CHECK(!sa.pending_priv && !sa.pending_y);
+    CHECK(keys_match(&sa, &sb));
+    CHECK(keys_match(&sb, &sa));
+
+    /* ...and deriving them again does nothing */
+    CHECK(otrl_dh_session_derive(&sa, NULL) == 0);
+    CHECK(opens == 8);
+
+    /* A derivation that fails part way through gives back the handles
+     * it took from the pool, and can be tried again */
+    pool = otrl_dh_handlepool_new();
+    CHECK(pool != NULL);
+    if (!pool) return test_done();
+    CHECK(otrl_dh_handlepool_set_caps(pool, 2, 2) == 0);
+    CHECK(otrl_dh_session(&sc, &a, b.pub) == 0);
+    CHECK(otrl_dh_session_derive(&sc, pool) == 0);
+    CHECK(otrl_dh_handlepool_set_caps(pool, 2, 1) == 0);
+    otrl_dh_session_free(&sc);
+    otrl_dh_handlepool_stats(pool, &stats);
+    CHECK(stats.ciphers_pooled == 2 && stats.macs_pooled == 1);
+
+    CHECK(otrl_dh_session(&sc, &a, b.pub) == 0);
+    fail_opens = 1;
+    CHECK(otrl_dh_session_derive(&sc, pool) != 0);
+    fail_opens = 0;
+    otrl_dh_handlepool_stats(pool, &stats);
+    CHECK(stats.ciphers_pooled == 2 && stats.macs_pooled == 1);
+    CHECK(stats.cipher_reuses == 2 && stats.mac_reuses == 1);
+    CHECK(sc.pending_priv && sc.pending_y);
+    CHECK(!sc.sendenc && !sc.rcvenc && !sc.sendmac && !sc.rcvmac);
+    CHECK(sc.handlepool == NULL);
+
+    CHECK(otrl_dh_session_derive(&sc, pool) == 0);
+    CHECK(sc.handlepool == pool);
+    CHECK(keys_match(&sc, &sb));
+    CHECK(keys_match(&sb, &sc));
+    otrl_dh_handlepool_stats(pool, &stats);
+    CHECK(stats.ciphers_pooled == 0 && stats.macs_pooled == 0);
+
+    otrl_dh_session_free(&sc);
+    otrl_dh_session_free(&sa);
+    otrl_dh_session_free(&sb);
+    otrl_dh_handlepool_free(pool);
+    otrl_dh_keypair_free(&a);
+    otrl_dh_keypair_free(&b);
+
+    /* A conversation derives nothing until it sends a message, and
+     * then only the keys the message uses, at each end */
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    test_net_init(&net);
+    test_peer_name(peer, sizeof(peer), 0);
+    if (test_setup_accounts(us, 1) ||
+	    !test_start_otr(us, &ops, &net, TEST_ME, peer)) {
+	fprintf(stderr, "Can't start the conversation\n");
+	return 1;
+    }
+    mine = test_context(us, TEST_ME, peer);
+    theirs = test_context(us, peer, TEST_ME);
+    CHECK(mine && theirs);
+    if (!mine || !theirs) return test_done();
+    CHECK(count_derived(mine) == 0 && count_derived(theirs) == 0);
+    deliver(us, &ops, &net, TEST_ME, peer);
+    CHECK(count_derived(mine) == 1 && count_derived(theirs) == 1);
+    deliver(us, &ops, &net, TEST_ME, peer);
+    CHECK(count_derived(mine) == 1 && count_derived(theirs) == 1);
+    deliver(us, &ops, &net, peer, TEST_ME);
+    deliver(us, &ops, &net, TEST_ME, peer);
+    deliver(us, &ops, &net, peer, TEST_ME);
+    CHECK(count_derived(mine) < 4 && count_derived(theirs) < 4);
+
+    otrl_userstate_free(us);
+    return test_done();
+}
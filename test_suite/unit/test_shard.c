@@ -0,0 +1,275 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check that otrl_shards_route depends only on its strings and the
+ * number of shards, and that the shards find the base userstate's own
+ * private keys and instance tags.  Then run the AKE between TEST_ME
+ * and correspondents whose two ends live in different shards, handing
+ * each message to the shard that owns its recipient's context, and
+ * with an account that has no key, which the shards must not ask the
+ * application to make. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shard.h"
+
+#include "testconv.h"
+
+#define NUM_SHARDS 4
+#define NUM_PEERS 8
+#define NUM_NAMES 1000
+
+/* Routes computed once, which must never change: an application may
+ * have put its shards' state on disk by them */
+static const struct {
+    const char *username;
+    const char *accountname;
+    unsigned int nshards;
+    unsigned int shard;
+} known_routes[] = {
+    { "alice@example.com", "otrtest1", 2, 0 },
+    { "bob", "otrtest2", 4, 1 },
+    { "carol@jabber.org", "me@example.net", 7, 0 },
+    { "dave", "otrtest3", 16, 11 },
+};
+
+static unsigned int created;
+static unsigned int no_seckey;
+
+static void create_privkey(void *opdata, const char *accountname,
+	const char *protocol)
+{
+    created++;
+}
+
+static void create_instag(void *opdata, const char *accountname,
+	const char *protocol)
+{
+    created++;
+}
+
+static void handle_msg_event(void *opdata, OtrlMessageEvent msg_event,
+	ConnContext *context, const char *message, gcry_error_t err)
+{
+    if (msg_event == OTRL_MSGEVENT_SETUP_ERROR &&
+	    gcry_err_code(err) == GPG_ERR_NO_SECKEY) {
+	no_seckey++;
+    }
+}
+
+/* Count the fingerprints in all the shards of a set */
+static unsigned int count_fingerprints(OtrlShards shards)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < otrl_shards_count(shards); ++i) {
+	ConnContext *context;
+
+	for (context = otrl_shards_get(shards, i)->context_root; context;
+		context = context->next) {
+	    Fingerprint *fprint;
+
+	    if (context->m_context != context) continue;
+	    for (fprint = context->fingerprint_root.next; fprint;
+		    fprint = fprint->next) {
+		n++;
+	    }
+	}
+    }
+    return n;
+}
+
+/* Deliver everything on the network, each message to the shard that
+ * owns its recipient's context with its sender */
+static void deliver_all(OtrlShards shards, const OtrlMessageAppOps *ops,
+	TestNet *net)
+{
+    TestMsg *m;
+
+    while ((m = test_net_pop(net)) != NULL) {
+	OtrlUserState us = otrl_shards_find(shards, m->from, m->to,
+		TEST_PROTOCOL);
+	test_receive(us, ops, net, m, NULL);
+	test_msg_free(m);
+    }
+}
+
+/* The context the given account uses to talk to the given
+ * correspondent, in the shard that owns it */
+static ConnContext *find(OtrlShards shards, const char *from,
+	const char *to)
+{
+    return test_context(otrl_shards_find(shards, to, from, TEST_PROTOCOL),
+	    from, to);
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState base, other;
+    OtrlShards shards, shards2;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    unsigned int counts[NUM_SHARDS];
+    unsigned int i, j, split = 0;
+    char storename[256];
+
+    OTRL_INIT;
+    base = otrl_userstate_create();
+    other = otrl_userstate_create();
+    if (test_setup_accounts(base, NUM_PEERS) ||
+	    otrl_shards_create(base, NUM_SHARDS, &shards) ||
+	    otrl_shards_create(other, NUM_SHARDS, &shards2)) {
+	fprintf(stderr, "Can't set up the shards\n");
+	return 1;
+    }
+    CHECK(otrl_shards_count(shards) == NUM_SHARDS);
+    CHECK(otrl_shards_get(shards, NUM_SHARDS) == NULL);
+
+    /* The same strings go to the same shard, whatever the set */
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < NUM_NAMES; ++i) {
+	char name[32];
+	unsigned int r;
+
+	snprintf(name, sizeof(name), "buddy%u@example.com", i);
+	r = otrl_shards_route(shards, name, TEST_ME, TEST_PROTOCOL);
+	CHECK(r < NUM_SHARDS);
+	if (r >= NUM_SHARDS) continue;
+	counts[r]++;
+	CHECK(otrl_shards_route(shards, name, TEST_ME, TEST_PROTOCOL)
+		== r);
+	CHECK(otrl_shards_route(shards2, name, TEST_ME, TEST_PROTOCOL)
+		== r);
+	CHECK(otrl_shards_find(shards, name, TEST_ME, TEST_PROTOCOL) ==
+		otrl_shards_get(shards, r));
+    }
+    /* And they are spread over all of them */
+    for (i = 0; i < NUM_SHARDS; ++i) {
+	CHECK(counts[i] > NUM_NAMES / NUM_SHARDS / 2);
+    }
+    for (i = 0; i < sizeof(known_routes) / sizeof(known_routes[0]); ++i) {
+	OtrlShards s;
+
+	if (otrl_shards_create(other, known_routes[i].nshards, &s)) {
+	    CHECK(0);
+	    continue;
+	}
+	CHECK(otrl_shards_route(s, known_routes[i].username,
+		    known_routes[i].accountname, TEST_PROTOCOL) ==
+		known_routes[i].shard);
+	otrl_shards_free(s);
+    }
+
+    /* Every shard finds the base's own keys and instance tags */
+    for (i = 0; i < NUM_SHARDS; ++i) {
+	OtrlUserState us = otrl_shards_get(shards, i);
+
+	for (j = 0; j <= NUM_PEERS; ++j) {
+	    char name[32];
+
+	    if (j == NUM_PEERS) {
+		strcpy(name, TEST_ME);
+	    } else {
+		test_peer_name(name, sizeof(name), j);
+	    }
+	    CHECK(otrl_privkey_find(us, name, TEST_PROTOCOL) != NULL);
+	    CHECK(otrl_privkey_find(us, name, TEST_PROTOCOL) ==
+		    otrl_privkey_find(base, name, TEST_PROTOCOL));
+	    CHECK(otrl_instag_find(us, name, TEST_PROTOCOL) != NULL);
+	    CHECK(otrl_instag_find(us, name, TEST_PROTOCOL) ==
+		    otrl_instag_find(base, name, TEST_PROTOCOL));
+	}
+	CHECK(us->privkey_root == NULL);
+	CHECK(us->instag_root == NULL);
+    }
+
+    /* Conversations work across shards, and never ask for a key or an
+     * instance tag to be made */
+    test_ops_init(&ops);
+    ops.create_privkey = create_privkey;
+    ops.create_instag = create_instag;
+    ops.handle_msg_event = handle_msg_event;
+    test_net_init(&net);
+    for (j = 0; j < NUM_PEERS; ++j) {
+	char peer[32];
+	ConnContext *mine, *theirs;
+
+	test_peer_name(peer, sizeof(peer), j);
+	if (otrl_shards_route(shards, peer, TEST_ME, TEST_PROTOCOL) !=
+		otrl_shards_route(shards, TEST_ME, peer, TEST_PROTOCOL)) {
+	    split++;
+	}
+	test_net_push(&net, TEST_ME, peer, "?OTRv3?");
+	deliver_all(shards, &ops, &net);
+	mine = find(shards, TEST_ME, peer);
+	theirs = find(shards, peer, TEST_ME);
+	CHECK(mine && mine->msgstate == OTRL_MSGSTATE_ENCRYPTED);
+	CHECK(theirs && theirs->msgstate == OTRL_MSGSTATE_ENCRYPTED);
+	if (!mine || !theirs) continue;
+	CHECK(mine->our_instance ==
+		otrl_instag_find(base, TEST_ME, TEST_PROTOCOL)->instag);
+	CHECK(theirs->our_instance ==
+		otrl_instag_find(base, peer, TEST_PROTOCOL)->instag);
+    }
+    CHECK(split > 0);
+    CHECK(base->context_root == NULL);
+    CHECK(created == 0);
+    CHECK(no_seckey == 0);
+
+    /* An account the base has no key for can't sign its part of the
+     * AKE, and says so, still without asking for a key */
+    test_net_push(&net, TEST_ME, "nokey", "?OTRv3?");
+    deliver_all(shards, &ops, &net);
+    CHECK(created == 0);
+    CHECK(no_seckey == 1);
+    CHECK(find(shards, "nokey", TEST_ME)->msgstate ==
+	    OTRL_MSGSTATE_PLAINTEXT);
+    CHECK(otrl_context_find(otrl_shards_find(shards, TEST_ME, "nokey",
+		    TEST_PROTOCOL), TEST_ME, "nokey", TEST_PROTOCOL,
+		OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL)->our_instance >=
+	    OTRL_MIN_VALID_INSTAG);
+    CHECK(otrl_privkey_find(base, "nokey", TEST_PROTOCOL) == NULL);
+    CHECK(otrl_instag_find(base, "nokey", TEST_PROTOCOL) == NULL);
+
+    /* The fingerprints of all the shards go to one store, which only
+     * replaces the old one once it has all been written */
+    test_tmpname(storename, sizeof(storename), "shards.fp");
+    CHECK(count_fingerprints(shards) == 2 * NUM_PEERS);
+    CHECK(otrl_shards_write_fingerprints(shards, storename) == 0);
+    CHECK(test_count_tmpfiles(storename) == 0);
+    CHECK(otrl_shards_read_fingerprints(shards2, storename, NULL, NULL)
+	    == 0);
+    CHECK(count_fingerprints(shards2) == 2 * NUM_PEERS);
+    remove(storename);
+    CHECK(mkdir(storename, 0700) == 0);
+    CHECK(otrl_shards_write_fingerprints(shards, storename) != 0);
+    CHECK(test_count_tmpfiles(storename) == 0);
+    rmdir(storename);
+
+    otrl_shards_free(shards);
+    otrl_shards_free(shards2);
+    otrl_userstate_free(other);
+    otrl_userstate_free(base);
+    return test_done();
+}
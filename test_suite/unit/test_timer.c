@@ -0,0 +1,140 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check when a locked userstate calls timer_control, for a DH Commit
+ * and for a partly received message, and that it doesn't hold the
+ * userstate's lock while doing so: the callback here
+ * has another thread look at the userstate's deadlines, which would
+ * never return if it did, so the test gives up after a while. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "auth.h"
+#include "deadline.h"
+#include "fragment.h"
+#include "instag.h"
+#include "uslock.h"
+
+#include "testconv.h"
+
+/* As in message.c */
+#define MAX_AKE_WAIT_TIME 60
+
+static OtrlUserState us;
+static unsigned int calls;
+static unsigned int interval;
+
+static void *look_at_deadlines(void *data)
+{
+    otrl_message_poll_next_deadline(us);
+    return NULL;
+}
+
+static void timer_control(void *opdata, unsigned int newinterval)
+{
+    pthread_t thread;
+
+    calls++;
+    interval = newinterval;
+    if (!pthread_create(&thread, NULL, look_at_deadlines, NULL)) {
+	pthread_join(thread, NULL);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    OtrlMessageAppOps ops;
+    TestNet net;
+    TestMsg *m;
+    ConnContext *master;
+    char peer[32];
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    test_ops_init(&ops);
+    ops.timer_control = timer_control;
+    test_net_init(&net);
+    test_peer_name(peer, sizeof(peer), 0);
+    if (test_setup_accounts(us, 1) || otrl_uslock_enable(us)) {
+	fprintf(stderr, "Can't set up the userstate\n");
+	return 1;
+    }
+    alarm(30);
+
+    /* Sending a DH Commit starts the timer */
+    test_net_push(&net, TEST_ME, peer, "?OTRv3?");
+    m = test_net_pop(&net);
+    test_receive(us, &ops, &net, m, NULL);
+    test_msg_free(m);
+    CHECK(calls == 1);
+    CHECK(interval == otrl_message_poll_get_default_interval(us));
+    CHECK(otrl_message_poll_next_deadline(us) != 0);
+
+    /* Polling while it still has to wait leaves the timer alone... */
+    otrl_message_poll(us, &ops, &net);
+    CHECK(calls == 1);
+
+    /* ...and once the DH Commit has waited too long, stops it */
+    master = otrl_context_find(us, TEST_ME, peer, TEST_PROTOCOL,
+	    OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+    CHECK(master != NULL);
+    if (master) {
+	master->auth.commit_sent_time -= MAX_AKE_WAIT_TIME + 10;
+	otrl_deadline_schedule(master, time(NULL));
+	otrl_message_poll(us, &ops, &net);
+	CHECK(master->auth.authstate == OTRL_AUTHSTATE_NONE);
+	CHECK(calls == 2);
+	CHECK(interval == 0);
+	CHECK(otrl_message_poll_next_deadline(us) == 0);
+    }
+
+    /* The first fragment of a message starts it again, until the rest
+     * of the message is too late */
+    while ((m = test_net_pop(&net)) != NULL) test_msg_free(m);
+    if (master) {
+	OtrlInsTag *sender = otrl_instag_find(us, TEST_ME, TEST_PROTOCOL);
+	char frag[64];
+	time_t before = time(NULL), after;
+
+	CHECK(sender != NULL);
+	snprintf(frag, sizeof(frag), "?OTR|%08x|%08x,00001,00002,?OTR:AAMD,",
+		sender ? sender->instag : 0, master->our_instance);
+	test_net_push(&net, TEST_ME, peer, frag);
+	m = test_net_pop(&net);
+	test_receive(us, &ops, &net, m, NULL);
+	test_msg_free(m);
+	after = time(NULL);
+	CHECK(calls == 3);
+	CHECK(interval == otrl_message_poll_get_default_interval(us));
+	CHECK(otrl_message_poll_next_deadline(us) >=
+		before + OTRL_FRAGMENT_EXPIRY + 1);
+	CHECK(otrl_message_poll_next_deadline(us) <=
+		after + OTRL_FRAGMENT_EXPIRY + 1);
+    }
+
+    while ((m = test_net_pop(&net)) != NULL) test_msg_free(m);
+    otrl_uslock_disable(us);
+    otrl_userstate_free(us);
+    return test_done();
+}
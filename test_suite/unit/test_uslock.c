@@ -0,0 +1,260 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Hold OTR conversations from several threads at once in one locked
+ * userstate, and check that every one of them goes as it would in a
+ * single thread.  Each thread has correspondents of its own, who all
+ * talk to TEST_ME: with each in turn, it runs the AKE, exchanges
+ * messages both ways (some of them in batches, to a given instance),
+ * and disconnects, several times over.  Meanwhile another thread keeps
+ * calling otrl_message_poll. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "uslock.h"
+
+#include "testconv.h"
+
+#define NUM_THREADS 4
+#define PEERS_PER_THREAD 3
+#define CONVERSATIONS 3
+#define MESSAGES 16
+
+typedef struct {
+    OtrlUserState us;
+    unsigned int num;
+    unsigned int failures;
+} Worker;
+
+/* CHECK, for use in a worker thread */
+#define WCHECK(w, cond) do { \
+    if (!(cond)) { \
+	fprintf(stderr, "%s:%d: thread %u: check failed: %s\n", __FILE__, \
+		__LINE__, (w)->num, #cond); \
+	(w)->failures++; \
+    } \
+} while (0)
+
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int done = 0;
+
+/* The msgstate of the given account's conversation with the given
+ * correspondent, read under its lock, or -1 if there is none */
+static int msgstate(OtrlUserState us, const char *from, const char *to)
+{
+    ConnContext *context = test_context(us, from, to);
+    int state;
+
+    if (!context) return -1;
+    otrl_uslock_context_lock(context);
+    state = context->msgstate;
+    otrl_uslock_context_unlock(context);
+    return state;
+}
+
+/* Send a message, deliver everything, and check that it (and only it)
+ * arrived */
+static void exchange(Worker *w, const OtrlMessageAppOps *ops, TestNet *net,
+	const char *from, const char *to, const char *text)
+{
+    TestMsg *m;
+    char *got;
+    int shown = 0;
+
+    WCHECK(w, test_send(w->us, ops, net, from, to, text) == 0);
+    while ((m = test_net_pop(net)) != NULL) {
+	if (test_receive(w->us, ops, net, m, &got)) {
+	    WCHECK(w, !strcmp(m->to, to) && !strcmp(got, text));
+	    shown++;
+	    free(got);
+	}
+	test_msg_free(m);
+    }
+    WCHECK(w, shown == 1);
+}
+
+/* Send TEST_ME's half of the messages to the given instance of peer in
+ * one batch, and receive peer's replies in another */
+static void exchange_batches(Worker *w, const OtrlMessageAppOps *ops,
+	TestNet *net, const char *peer, unsigned int conv)
+{
+    OtrlMessageToSend out[MESSAGES];
+    OtrlMessageReceived in[MESSAGES];
+    TestMsg *msgs[MESSAGES];
+    char texts[MESSAGES][64];
+    ConnContext *context = test_context(w->us, TEST_ME, peer);
+    otrl_instag_t instag;
+    char *got;
+    unsigned int i;
+
+    otrl_uslock_context_lock(context);
+    instag = context->their_instance;
+    otrl_uslock_context_unlock(context);
+    WCHECK(w, instag >= OTRL_MIN_VALID_INSTAG);
+
+    for (i = 0; i < MESSAGES; ++i) {
+	snprintf(texts[i], sizeof(texts[i]), "batch %u/%u to %s", conv, i,
+		peer);
+	memset(&out[i], 0, sizeof(out[i]));
+	out[i].accountname = TEST_ME;
+	out[i].protocol = TEST_PROTOCOL;
+	out[i].recipient = peer;
+	out[i].instag = instag;
+	out[i].message = texts[i];
+    }
+    otrl_message_sending_batch(w->us, ops, net, out, MESSAGES,
+	    OTRL_FRAGMENT_SEND_SKIP, NULL, NULL);
+    for (i = 0; i < MESSAGES; ++i) {
+	TestMsg m;
+
+	WCHECK(w, out[i].err == 0 && out[i].newmessage != NULL);
+	if (out[i].err || !out[i].newmessage) continue;
+	m.from = TEST_ME;
+	m.to = (char *)peer;
+	m.msg = out[i].newmessage;
+	WCHECK(w, test_receive(w->us, ops, net, &m, &got) &&
+		!strcmp(got, texts[i]));
+	free(got);
+	otrl_message_free(out[i].newmessage);
+    }
+    test_deliver_all(w->us, ops, net);
+
+    for (i = 0; i < MESSAGES; ++i) {
+	snprintf(texts[i], sizeof(texts[i]), "batch %u/%u from %s", conv, i,
+		peer);
+	WCHECK(w, test_send(w->us, ops, net, peer, TEST_ME, texts[i]) == 0);
+	msgs[i] = test_net_pop(net);
+	memset(&in[i], 0, sizeof(in[i]));
+	in[i].accountname = msgs[i]->to;
+	in[i].protocol = TEST_PROTOCOL;
+	in[i].sender = msgs[i]->from;
+	in[i].message = msgs[i]->msg;
+    }
+    otrl_message_receiving_batch(w->us, ops, net, in, MESSAGES, NULL, NULL);
+    for (i = 0; i < MESSAGES; ++i) {
+	WCHECK(w, !in[i].ignore && in[i].newmessage &&
+		!strcmp(in[i].newmessage, texts[i]));
+	otrl_message_free(in[i].newmessage);
+	otrl_tlv_free(in[i].tlvs);
+	test_msg_free(msgs[i]);
+    }
+    test_deliver_all(w->us, ops, net);
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *w = arg;
+    OtrlMessageAppOps ops;
+    TestNet net;
+    char peer[32], text[64];
+    unsigned int conv, p, i;
+
+    test_ops_init(&ops);
+    test_net_init(&net);
+
+    for (conv = 0; conv < CONVERSATIONS; ++conv) {
+	for (p = 0; p < PEERS_PER_THREAD; ++p) {
+	    test_peer_name(peer, sizeof(peer),
+		    w->num * PEERS_PER_THREAD + p);
+
+	    WCHECK(w, test_start_otr(w->us, &ops, &net, TEST_ME, peer));
+
+	    for (i = 0; i < MESSAGES; ++i) {
+		snprintf(text, sizeof(text), "message %u/%u to %s", conv, i,
+			peer);
+		exchange(w, &ops, &net, TEST_ME, peer, text);
+		snprintf(text, sizeof(text), "message %u/%u from %s", conv,
+			i, peer);
+		exchange(w, &ops, &net, peer, TEST_ME, text);
+	    }
+	    exchange_batches(w, &ops, &net, peer, conv);
+
+	    /* TEST_ME hangs up, and the correspondent is told */
+	    otrl_message_disconnect_all_instances(w->us, &ops, &net,
+		    TEST_ME, TEST_PROTOCOL, peer);
+	    test_deliver_all(w->us, &ops, &net);
+	    WCHECK(w, msgstate(w->us, TEST_ME, peer) ==
+		    OTRL_MSGSTATE_PLAINTEXT);
+	    WCHECK(w, msgstate(w->us, peer, TEST_ME) ==
+		    OTRL_MSGSTATE_FINISHED);
+	    otrl_message_disconnect_all_instances(w->us, &ops, &net, peer,
+		    TEST_PROTOCOL, TEST_ME);
+	    WCHECK(w, msgstate(w->us, peer, TEST_ME) ==
+		    OTRL_MSGSTATE_PLAINTEXT);
+	    WCHECK(w, net.head == NULL);
+	}
+    }
+    return NULL;
+}
+
+static void *poll_thread(void *arg)
+{
+    OtrlUserState us = arg;
+    OtrlMessageAppOps ops;
+    int stop;
+
+    test_ops_init(&ops);
+    do {
+	otrl_message_poll(us, &ops, NULL);
+	pthread_mutex_lock(&done_mutex);
+	stop = done;
+	pthread_mutex_unlock(&done_mutex);
+    } while (!stop);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    OtrlUserState us;
+    Worker workers[NUM_THREADS];
+    pthread_t threads[NUM_THREADS], poller;
+    unsigned int i;
+
+    OTRL_INIT;
+    us = otrl_userstate_create();
+    CHECK(test_setup_accounts(us, NUM_THREADS * PEERS_PER_THREAD) == 0);
+    if (otrl_uslock_enable(us)) {
+	printf("libotr was built without thread support; ");
+	otrl_userstate_free(us);
+	return test_done();
+    }
+
+    pthread_create(&poller, NULL, poll_thread, us);
+    for (i = 0; i < NUM_THREADS; ++i) {
+	workers[i].us = us;
+	workers[i].num = i;
+	workers[i].failures = 0;
+	pthread_create(&threads[i], NULL, worker_thread, &workers[i]);
+    }
+    for (i = 0; i < NUM_THREADS; ++i) {
+	pthread_join(threads[i], NULL);
+	test_failures += workers[i].failures;
+    }
+    pthread_mutex_lock(&done_mutex);
+    done = 1;
+    pthread_mutex_unlock(&done_mutex);
+    pthread_join(poller, NULL);
+
+    otrl_userstate_free(us);
+    return test_done();
+}
@@ -0,0 +1,286 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Helpers for the tests and benchmarks in this directory that hold
+ * OTR conversations.  Both ends of each conversation are accounts in
+ * the same OtrlUserState, and the network is a queue in memory. */
+
+#ifndef __TESTCONV_H__
+#define __TESTCONV_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gcrypt.h>
+
+#include "proto.h"
+#include "privkey.h"
+#include "instag.h"
+#include "message.h"
+#include "userstate.h"
+
+#include "testutil.h"
+
+/* The account every correspondent talks to, and the prefix of the
+ * correspondents' own account names */
+#define TEST_ME "otrtest1"
+#define TEST_PEER_PREFIX "peer"
+
+/* A message on its way from one account to another */
+typedef struct s_TestMsg {
+    struct s_TestMsg *next;
+    char *from, *to, *msg;
+} TestMsg;
+
+/* The messages sent but not yet delivered, oldest first.  The inject
+ * callback of test_ops adds to the TestNet passed as its opdata. */
+typedef struct {
+    TestMsg *head;
+    TestMsg **tail;
+} TestNet;
+
+static inline void test_net_init(TestNet *net)
+{
+    net->head = NULL;
+    net->tail = &(net->head);
+}
+
+static inline void test_net_push(TestNet *net, const char *from,
+	const char *to, const char *msg)
+{
+    TestMsg *m = malloc(sizeof(TestMsg));
+
+    m->next = NULL;
+    m->from = strdup(from);
+    m->to = strdup(to);
+    m->msg = strdup(msg);
+    *(net->tail) = m;
+    net->tail = &(m->next);
+}
+
+/* Take the oldest message off the queue, or return NULL */
+static inline TestMsg *test_net_pop(TestNet *net)
+{
+    TestMsg *m = net->head;
+
+    if (m) {
+	net->head = m->next;
+	if (!net->head) net->tail = &(net->head);
+    }
+    return m;
+}
+
+static inline void test_msg_free(TestMsg *m)
+{
+    free(m->from);
+    free(m->to);
+    free(m->msg);
+    free(m);
+}
+
+static OtrlPolicy test_op_policy(void *opdata, ConnContext *context)
+{
+    return OTRL_POLICY_DEFAULT;
+}
+
+static int test_op_is_logged_in(void *opdata, const char *accountname,
+	const char *protocol, const char *recipient)
+{
+    return 1;
+}
+
+static void test_op_inject(void *opdata, const char *accountname,
+	const char *protocol, const char *recipient, const char *message)
+{
+    test_net_push(opdata, accountname, recipient, message);
+}
+
+/* Fill in the callbacks used by conversations here.  Everything else is
+ * left NULL. */
+static inline void test_ops_init(OtrlMessageAppOps *ops)
+{
+    memset(ops, 0, sizeof(*ops));
+    ops->policy = test_op_policy;
+    ops->is_logged_in = test_op_is_logged_in;
+    ops->inject_message = test_op_inject;
+}
+
+/* Fill in buf with the account name of the given correspondent */
+static inline void test_peer_name(char *buf, size_t size, unsigned int i)
+{
+    snprintf(buf, size, TEST_PEER_PREFIX "%u", i);
+}
+
+/* Give the given OtrlUserState a private key and instance tag for
+ * TEST_ME and for numpeers correspondents.  Generating that many keys
+ * would take too long, so the correspondents all share the key of
+ * otrtest2 from TEST_KEYFILE.  Return 0 on success. */
+static inline int test_setup_accounts(OtrlUserState us, unsigned int numpeers)
+{
+    OtrlUserState keys = otrl_userstate_create();
+    OtrlPrivKey *mykey, *peerkey;
+    char *mytext = NULL, *peertext = NULL;
+    size_t len;
+    FILE *f;
+    unsigned int i;
+    int ret = -1;
+
+    if (otrl_privkey_read(keys, TEST_KEYFILE)) goto done;
+    mykey = otrl_privkey_find(keys, TEST_ME, TEST_PROTOCOL);
+    peerkey = otrl_privkey_find(keys, "otrtest2", TEST_PROTOCOL);
+    if (!mykey || !peerkey) goto done;
+
+    len = gcry_sexp_sprint(mykey->privkey, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+    mytext = malloc(len);
+    gcry_sexp_sprint(mykey->privkey, GCRYSEXP_FMT_ADVANCED, mytext, len);
+    len = gcry_sexp_sprint(peerkey->privkey, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+    peertext = malloc(len);
+    gcry_sexp_sprint(peerkey->privkey, GCRYSEXP_FMT_ADVANCED, peertext, len);
+
+    /* Write out a key file with all of the accounts in it */
+    f = tmpfile();
+    if (!f) goto done;
+    fprintf(f, "(privkeys\n (account\n(name %s)\n(protocol %s)\n%s)\n",
+	    TEST_ME, TEST_PROTOCOL, mytext);
+    for (i = 0; i < numpeers; ++i) {
+	char name[32];
+
+	test_peer_name(name, sizeof(name), i);
+	fprintf(f, " (account\n(name %s)\n(protocol %s)\n%s)\n", name,
+		TEST_PROTOCOL, peertext);
+    }
+    fprintf(f, ")\n");
+    rewind(f);
+    if (otrl_privkey_read_FILEp(us, f)) {
+	fclose(f);
+	goto done;
+    }
+    fclose(f);
+
+    /* And an instance tag for each of them */
+    f = tmpfile();
+    if (!f) goto done;
+    fprintf(f, "%s\t%s\t%08x\n", TEST_ME, TEST_PROTOCOL,
+	    (unsigned int)OTRL_MIN_VALID_INSTAG);
+    for (i = 0; i < numpeers; ++i) {
+	char name[32];
+
+	test_peer_name(name, sizeof(name), i);
+	fprintf(f, "%s\t%s\t%08x\n", name, TEST_PROTOCOL,
+		(unsigned int)OTRL_MIN_VALID_INSTAG + 1 + i);
+    }
+    rewind(f);
+    if (!otrl_instag_read_FILEp(us, f)) ret = 0;
+    fclose(f);
+
+done:
+    free(mytext);
+    free(peertext);
+    otrl_userstate_free(keys);
+    return ret;
+}
+
+/* Pass a message about to be sent from one account to another through
+ * otrl_message_sending, and put the result on the network. */
+static inline gcry_error_t test_send(OtrlUserState us,
+	const OtrlMessageAppOps *ops, TestNet *net, const char *from,
+	const char *to, const char *msg)
+{
+    char *newmsg = NULL;
+    gcry_error_t err;
+
+    err = otrl_message_sending(us, ops, net, from, TEST_PROTOCOL, to,
+	    OTRL_INSTAG_BEST, msg, NULL, &newmsg, OTRL_FRAGMENT_SEND_SKIP,
+	    NULL, NULL, NULL);
+    if (!err) {
+	test_net_push(net, from, to, newmsg ? newmsg : msg);
+    }
+    otrl_message_free(newmsg);
+    return err;
+}
+
+/* Pass a message which has arrived through otrl_message_receiving.  If
+ * it is to be shown to the user, and textp is not NULL, set *textp to
+ * a newly allocated copy of what would be shown; otherwise set it to
+ * NULL.  Return 1 if the message was to be shown. */
+static inline int test_receive(OtrlUserState us,
+	const OtrlMessageAppOps *ops, TestNet *net, const TestMsg *m,
+	char **textp)
+{
+    char *newmsg = NULL;
+    OtrlTLV *tlvs = NULL;
+    int ignore;
+
+    ignore = otrl_message_receiving(us, ops, net, m->to, TEST_PROTOCOL,
+	    m->from, m->msg, &newmsg, &tlvs, NULL, NULL, NULL);
+    if (textp) {
+	*textp = ignore ? NULL : strdup(newmsg ? newmsg : m->msg);
+    }
+    otrl_message_free(newmsg);
+    otrl_tlv_free(tlvs);
+    return !ignore;
+}
+
+/* Deliver everything on the network, including whatever is sent in
+ * reply, until it is empty. */
+static inline void test_deliver_all(OtrlUserState us,
+	const OtrlMessageAppOps *ops, TestNet *net)
+{
+    TestMsg *m;
+
+    while ((m = test_net_pop(net)) != NULL) {
+	test_receive(us, ops, net, m, NULL);
+	test_msg_free(m);
+    }
+}
+
+/* Return the context the given account uses to talk to the given
+ * correspondent, or NULL if there is none. */
+static inline ConnContext *test_context(OtrlUserState us, const char *from,
+	const char *to)
+{
+    return otrl_context_find(us, to, from, TEST_PROTOCOL, OTRL_INSTAG_BEST,
+	    0, NULL, NULL, NULL);
+}
+
+/* Return 1 if both ends of the conversation between a and b are
+ * encrypted */
+static inline int test_encrypted(OtrlUserState us, const char *a,
+	const char *b)
+{
+    ConnContext *ca = test_context(us, a, b), *cb = test_context(us, b, a);
+
+    return ca && cb && ca->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
+	cb->msgstate == OTRL_MSGSTATE_ENCRYPTED;
+}
+
+/* Have a start an OTR conversation with b, and run the AKE to the end.
+ * Return 1 if both ends are then encrypted. */
+static inline int test_start_otr(OtrlUserState us,
+	const OtrlMessageAppOps *ops, TestNet *net, const char *a,
+	const char *b)
+{
+    test_net_push(net, a, b, "?OTRv3?");
+    test_deliver_all(us, ops, net);
+    return test_encrypted(us, a, b);
+}
+
+#endif
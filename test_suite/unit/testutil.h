@@ -0,0 +1,160 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Rob Smits, Chris Alexander,
+ *  			      Willy Lew, Lisa Du, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Helpers shared by the tests and benchmarks in this directory */
+
+#ifndef __TESTUTIL_H__
+#define __TESTUTIL_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+
+#include <gcrypt.h>
+
+#include "proto.h"
+#include "context.h"
+
+/* The keys and instance tags shipped with the test suite, for the
+ * accounts otrtest1, otrtest2 and otrtest3 on TEST_PROTOCOL */
+#define TEST_KEYFILE "../otr.private_key"
+#define TEST_INSTAGFILE "../instance_tags0.txt"
+#define TEST_PROTOCOL "prpl-aim"
+
+static int test_failures = 0;
+
+/* Note a failed check, and carry on */
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		#cond); \
+	test_failures++; \
+    } \
+} while (0)
+
+/* Print the result of a test, and return its exit status */
+static inline int test_done(void)
+{
+    if (test_failures) {
+	printf("FAIL (%d checks)\n", test_failures);
+	return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
+
+/* Fill in buf with the name of a scratch file called name */
+static inline void test_tmpname(char *buf, size_t size, const char *name)
+{
+    const char *dir = getenv("TMPDIR");
+
+    snprintf(buf, size, "%s/libotr-test-%ld-%s", dir ? dir : "/tmp",
+	    (long)getpid(), name);
+}
+
+/* Fill in fp with the made-up fingerprint number which of the given
+ * buddy */
+static inline void test_buddy_fingerprint(unsigned char fp[20], int buddy,
+	int which)
+{
+    memset(fp, 0, 20);
+    fp[0] = buddy;
+    fp[19] = which;
+}
+
+/* Add fingerprint number which of "buddy<buddy>", talking to otrtest1,
+ * to the given OtrlUserState, with the given trust */
+static inline void test_add_fingerprint(OtrlUserState us, int buddy,
+	int which, const char *trust)
+{
+    char username[32];
+    unsigned char fp[20];
+    ConnContext *context;
+    Fingerprint *fprint;
+
+    snprintf(username, sizeof(username), "buddy%d", buddy);
+    context = otrl_context_find(us, username, "otrtest1", TEST_PROTOCOL,
+	    OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+    test_buddy_fingerprint(fp, buddy, which);
+    fprint = otrl_context_find_fingerprint(context, fp, 1, NULL);
+    otrl_context_set_trust(fprint, trust);
+}
+
+/* Return the given OtrlUserState's fingerprint number which of
+ * "buddy<buddy>", or NULL if it doesn't have it */
+static inline Fingerprint *test_find_fingerprint(OtrlUserState us,
+	int buddy, int which)
+{
+    char username[32];
+    unsigned char fp[20];
+    ConnContext *context;
+
+    snprintf(username, sizeof(username), "buddy%d", buddy);
+    context = otrl_context_find(us, username, "otrtest1", TEST_PROTOCOL,
+	    OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+    if (!context) return NULL;
+    test_buddy_fingerprint(fp, buddy, which);
+    return otrl_context_find_fingerprint(context, fp, 0, NULL);
+}
+
+/* Count the temporary files left behind next to the given file by
+ * writes that replace it: those named after it with ".tmp" or a
+ * mkstemp suffix added */
+static inline unsigned int test_count_tmpfiles(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    char dirname[1024];
+    size_t baselen;
+    unsigned int n = 0;
+    struct dirent *ent;
+    DIR *dir;
+
+    if (!base) return 0;
+    snprintf(dirname, sizeof(dirname), "%.*s", (int)(base - filename),
+	    filename);
+    base++;
+    baselen = strlen(base);
+    dir = opendir(dirname);
+    if (!dir) return 0;
+    while ((ent = readdir(dir)) != NULL) {
+	const char *suffix = ent->d_name + baselen;
+
+	if (strncmp(ent->d_name, base, baselen) || suffix[0] != '.') {
+	    continue;
+	}
+	if (!strcmp(suffix, ".tmp") || strlen(suffix) == 7) n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+/* The number of seconds since some fixed point, for timing */
+static inline double test_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2014  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "proto.h"
+#include "fpstore.h"
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s -b textstore binstore\n"
+"       %s -t binstore textstore\n"
+"Convert a fingerprint store to (-b) or from (-t) the binary format.\n",
+	progname, progname);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    gcry_error_t err;
+
+    if (argc != 4) {
+	usage(argv[0]);
+    }
+
+    OTRL_INIT;
+
+    if (!strcmp(argv[1], "-b")) {
+	err = otrl_fpstore_convert_from_text(argv[2], argv[3]);
+    } else if (!strcmp(argv[1], "-t")) {
+	err = otrl_fpstore_convert_to_text(argv[2], argv[3]);
+    } else {
+	usage(argv[0]);
+	return 1;
+    }
+
+    if (err) {
+	fprintf(stderr, "%s: %s\n", argv[0], gcry_strerror(err));
+	return 1;
+    }
+    return 0;
+}